@@ -0,0 +1,339 @@
+/*
+ * accesslog.c - Asynchronous access log with per-thread rings
+ *
+ * See accesslog.h for the interface.  Each ring has exactly one
+ * producer, the thread that owns it, and one consumer, the writer, so
+ * two counters are all the synchronization it needs: the producer
+ * copies an entry in and then publishes it by advancing "head"; the
+ * writer writes out everything up to "head" and then frees the space
+ * by advancing "tail".  Since entries are plain text, the writer can
+ * pass the bytes between the two counters straight to writev, as one
+ * piece or, if they wrap around the end of the ring, two.
+ *
+ * Rings are never freed.  When a thread exits its ring is released,
+ * and the next thread that logs takes it over, so the number of rings
+ * only grows with the number of threads logging at the same time.
+ */
+
+#define _GNU_SOURCE
+#include <sys/uio.h>
+#include "csapp.h"
+#include "accesslog.h"
+
+#define ALOG_MAX_IOV 64         /* Pieces handed to one writev */
+
+typedef struct ring {
+    struct ring *next;          /* Next ring in the list of all rings */
+    int owned;                  /* Nonzero while a thread is using the ring */
+    unsigned long head __attribute__((aligned(64)));  /* Bytes ever added */
+    unsigned long tail __attribute__((aligned(64)));  /* Bytes ever written */
+    char data[ALOG_RING_BYTES];
+} ring_t;
+
+static ring_t *rings;           /* Every ring, newest first */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread ring_t *my_ring;
+
+static int log_fd;
+static const char *log_path;
+static int flush_interval;
+static alog_policy_t full_policy;
+static unsigned long dropped;
+
+/* The writer sleeps on "wake"; blocked producers sleep on "space" */
+static pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space = PTHREAD_COND_INITIALIZER;
+
+/* Set by the signal handlers, acted on by the writer */
+static volatile sig_atomic_t reopen_requested;
+static volatile sig_atomic_t exit_requested;
+
+static ring_t *claim_ring(void);
+static void release_ring(void *vargp);
+static void *alog_writer(void *vargp);
+static void flush_rings(void);
+static void write_all(struct iovec *iov, int iovcnt);
+static void open_log(void);
+static void handle_signal(int sig);
+
+/*
+ * alog_init - Open the log and start the writer.
+ */
+void alog_init(const char *path, int flush_ms, alog_policy_t policy)
+{
+    struct sigaction action;
+    pthread_t tid;
+    int rc;
+
+    log_path = path;
+    flush_interval = flush_ms > 0 ? flush_ms : ALOG_FLUSH_MS;
+    full_policy = policy;
+    log_fd = -1;
+    open_log();
+    if (log_fd < 0)
+        unix_error("alog_init: open error");
+    if ((rc = pthread_key_create(&ring_key, release_ring)) != 0)
+        posix_error(rc, "alog_init: pthread_key_create error");
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    Pthread_create(&tid, NULL, alog_writer, NULL);
+}
+
+/*
+ * alog_write - Copy an entry into the calling thread's ring.
+ */
+void alog_write(const char *entry, int len)
+{
+    ring_t *r = my_ring != NULL ? my_ring : claim_ring();
+    unsigned long head = r->head;
+    unsigned long tail;
+    struct timespec deadline;
+    int off, first;
+
+    if (len > ALOG_RING_BYTES)
+        len = ALOG_RING_BYTES;
+    while (ALOG_RING_BYTES - (head - (tail = __atomic_load_n(&r->tail,
+      __ATOMIC_ACQUIRE))) < len) {
+        if (full_policy == ALOG_DROP) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        /* Hurry the writer along and wait for it to make room */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&wait_lock);
+        pthread_cond_signal(&wake);
+        pthread_cond_timedwait(&space, &wait_lock, &deadline);
+        pthread_mutex_unlock(&wait_lock);
+    }
+
+    off = head % ALOG_RING_BYTES;
+    first = ALOG_RING_BYTES - off < len ? ALOG_RING_BYTES - off : len;
+    memcpy(r->data + off, entry, first);
+    memcpy(r->data, entry + first, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+    /* Don't wait for the timer if the ring is getting full */
+    if (head + len - tail > ALOG_RING_BYTES / 2)
+        pthread_cond_signal(&wake);
+}
+
+/*
+ * alog_timestamp - Return the time for a log entry, reformatting it
+ * at most once a second.
+ */
+const char *alog_timestamp(void)
+{
+    static __thread time_t last;
+    static __thread char str[64];
+    struct tm tm;
+    time_t now = time(NULL);
+
+    if (now != last) {
+        localtime_r(&now, &tm);
+        strftime(str, sizeof(str), "%a %d %b %Y %H:%M:%S %Z", &tm);
+        last = now;
+    }
+    return str;
+}
+
+/*
+ * alog_dropped - Number of entries lost to ALOG_DROP.
+ */
+unsigned long alog_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * claim_ring - Give the calling thread a ring: one released by a
+ * thread that has exited, or failing that a new one.
+ */
+static ring_t *claim_ring(void)
+{
+    ring_t *r;
+
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL; r = r->next) {
+        if (!__atomic_load_n(&r->owned, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (r == NULL) {
+        r = Calloc(1, sizeof(ring_t));
+        r->next = rings;
+        __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&r->owned, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rings_lock);
+
+    my_ring = r;
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+/*
+ * release_ring - Key destructor run when a thread that has logged
+ * exits.  Entries still in the ring are written out as usual.
+ */
+static void release_ring(void *vargp)
+{
+    ring_t *r = (ring_t *)vargp;
+
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * alog_writer - Thread routine that drains the rings.
+ */
+static void *alog_writer(void *vargp)
+{
+    struct timespec deadline;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval / 1000;
+        deadline.tv_nsec += (flush_interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&wait_lock);
+        pthread_cond_timedwait(&wake, &wait_lock, &deadline);
+        pthread_mutex_unlock(&wait_lock);
+
+        if (reopen_requested) {
+            reopen_requested = 0;
+            open_log();
+        }
+        flush_rings();
+
+        pthread_mutex_lock(&wait_lock);
+        pthread_cond_broadcast(&space);
+        pthread_mutex_unlock(&wait_lock);
+
+        if (exit_requested)
+            exit(0);
+    }
+    return NULL;
+}
+
+/*
+ * flush_rings - Write out everything the rings hold right now.
+ */
+static void flush_rings(void)
+{
+    struct iovec iov[ALOG_MAX_IOV];
+    ring_t *pending[ALOG_MAX_IOV];
+    unsigned long heads[ALOG_MAX_IOV];
+    unsigned long head, tail;
+    int iovcnt = 0;
+    int npending = 0;
+    int off, len, i;
+    ring_t *r;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        if (head == tail)
+            continue;
+
+        if (iovcnt + 2 > ALOG_MAX_IOV) {
+            write_all(iov, iovcnt);
+            for (i = 0; i < npending; i++)
+                __atomic_store_n(&pending[i]->tail, heads[i], __ATOMIC_RELEASE);
+            iovcnt = npending = 0;
+        }
+
+        off = tail % ALOG_RING_BYTES;
+        len = head - tail;
+        if (off + len > ALOG_RING_BYTES) {
+            iov[iovcnt].iov_base = r->data + off;
+            iov[iovcnt++].iov_len = ALOG_RING_BYTES - off;
+            len -= ALOG_RING_BYTES - off;
+            off = 0;
+        }
+        iov[iovcnt].iov_base = r->data + off;
+        iov[iovcnt++].iov_len = len;
+        pending[npending] = r;
+        heads[npending++] = head;
+    }
+
+    if (iovcnt > 0)
+        write_all(iov, iovcnt);
+    for (i = 0; i < npending; i++)
+        __atomic_store_n(&pending[i]->tail, heads[i], __ATOMIC_RELEASE);
+}
+
+/*
+ * write_all - writev that carries on after short writes.  Entries that
+ * can't be written at all are reported and discarded, so a full disk
+ * doesn't stall the proxy.
+ */
+static void write_all(struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        if ((n = writev(log_fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Warning: writing %s failed; error = %s\n",
+              log_path, strerror(errno));
+            return;
+        }
+        while (iovcnt > 0  &&  n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/*
+ * open_log - (Re)open the log file.  If it can't be opened, logging
+ * carries on to the old file, if there is one.
+ */
+static void open_log(void)
+{
+    int fd;
+
+    fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: opening %s failed; error = %s\n",
+          log_path, strerror(errno));
+        return;
+    }
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = fd;
+}
+
+/*
+ * handle_signal - Note a request to reopen the log or to exit; the
+ * writer acts on it within one flush interval.
+ */
+static void handle_signal(int sig)
+{
+    if (sig == SIGHUP)
+        reopen_requested = 1;
+    else
+        exit_requested = 1;
+}
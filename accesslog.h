@@ -0,0 +1,48 @@
+#ifndef _ACCESSLOG_H
+#define _ACCESSLOG_H
+
+/*
+ * Asynchronous access log.
+ *
+ * Threads append finished log entries to a ring buffer of their own,
+ * without taking any lock, and a dedicated writer thread collects the
+ * entries from all the rings and writes them to the log file in
+ * batches with writev.  The file stays open; it is reopened when the
+ * process receives SIGHUP, so it can be rotated by renaming it and
+ * sending the signal.  SIGINT and SIGTERM make the writer flush what
+ * is buffered before the process exits.
+ *
+ * When a thread's ring is full, because the writer has fallen behind,
+ * the thread either waits for room (ALOG_BLOCK) or drops the entry
+ * (ALOG_DROP) and the drop is counted.
+ */
+
+#define ALOG_RING_BYTES 65536   /* Size of each thread's ring */
+#define ALOG_FLUSH_MS   100     /* Default time between writes */
+
+typedef enum {
+    ALOG_BLOCK,                 /* Wait for room in the ring */
+    ALOG_DROP                   /* Discard the entry */
+} alog_policy_t;
+
+/*
+ * Open "path" for appending and start the writer thread, which writes
+ * whatever has been logged every "flush_ms" milliseconds, or sooner if
+ * a ring is filling up.
+ */
+extern void alog_init(const char *path, int flush_ms, alog_policy_t policy);
+
+/* Append one entry of "len" bytes, which should end in a newline */
+extern void alog_write(const char *entry, int len);
+
+/*
+ * The current local time, formatted for a log entry.  The string is
+ * only rebuilt when the second changes, and belongs to the calling
+ * thread.
+ */
+extern const char *alog_timestamp(void);
+
+/* How many entries have been dropped so far */
+extern unsigned long alog_dropped(void);
+
+#endif /* _ACCESSLOG_H */
@@ -0,0 +1,185 @@
+/*
+ * admit.c - TinyLFU admission: a count-min sketch with periodic
+ * halving, behind a doorkeeper bloom filter
+ *
+ * See admit.h for the interface.  The counters are packed sixteen to a
+ * 64-bit word, and a row's counter for a key is picked by multiplying
+ * the key's hash by a constant of the row's own and taking high bits,
+ * so one hash gives ADMIT_DEPTH independent-enough indexes.  The
+ * doorkeeper takes two of its bits the same way.
+ *
+ * Counters only ever change by compare-and-swap on their whole word,
+ * so a count is never lost to a neighbour's; counting up stops at 15.
+ */
+
+#include "csapp.h"
+#include "admit.h"
+
+#define COUNTERS_PER_WORD 16
+#define HALF_MASK 0x7777777777777777UL  /* Clears what shifts in from a neighbour */
+
+static unsigned long *table;    /* ADMIT_DEPTH rows of counters */
+static int width_bits;          /* Each row has 1 << width_bits counters */
+static unsigned long *door;     /* The doorkeeper */
+static int door_bits;           /* It has 1 << door_bits bits */
+static unsigned long sample;    /* Requests per period */
+static unsigned long recorded;  /* Requests recorded so far */
+
+static const unsigned long seeds[ADMIT_DEPTH] = {
+    0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+    0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL
+};
+
+static unsigned long spread(unsigned int hash, int i, int bits);
+static unsigned long *counter(unsigned int hash, int i, int *shift);
+static int door_has(unsigned int hash);
+static int door_add(unsigned int hash);
+static void halve(void);
+
+/*
+ * admit_init - Give each row a counter per entry, rounded up to a
+ * power of two, and the doorkeeper enough bits to stay sparse over a
+ * whole period.  A small cache still gets ADMIT_MIN_WIDTH counters,
+ * and a period to match, since its entries may be far smaller than
+ * guessed.
+ */
+void admit_init(size_t entries)
+{
+    for (width_bits = 4; (1UL << width_bits) < entries
+      ||  (1UL << width_bits) < ADMIT_MIN_WIDTH; width_bits++)
+        ;
+    sample = ADMIT_SAMPLE_FACTOR << width_bits;
+    for (door_bits = 6; (1UL << door_bits) < sample * ADMIT_DOOR_BITS; door_bits++)
+        ;
+    door = Calloc((1UL << door_bits) / 64, sizeof(unsigned long));
+    __atomic_store_n(&table,
+      Calloc(ADMIT_DEPTH * ((1UL << width_bits) / COUNTERS_PER_WORD),
+        sizeof(unsigned long)), __ATOMIC_RELEASE);
+}
+
+/*
+ * admit_record - Let the doorkeeper have a key's first request of a
+ * period, and count the rest, conservatively, in the sketch.
+ */
+void admit_record(unsigned int hash)
+{
+    unsigned long *words[ADMIT_DEPTH];
+    int shifts[ADMIT_DEPTH];
+    unsigned long old;
+    int i, min = 15;
+
+    if (__atomic_load_n(&table, __ATOMIC_ACQUIRE) == NULL)
+        return;
+    if (door_add(hash)) {
+        for (i = 0; i < ADMIT_DEPTH; i++) {
+            words[i] = counter(hash, i, &shifts[i]);
+            old = (__atomic_load_n(words[i], __ATOMIC_RELAXED) >> shifts[i]) & 0xf;
+            if (old < min)
+                min = old;
+        }
+        for (i = 0; i < ADMIT_DEPTH  &&  min < 15; i++) {
+            old = __atomic_load_n(words[i], __ATOMIC_RELAXED);
+            while (((old >> shifts[i]) & 0xf) == min
+              &&  !__atomic_compare_exchange_n(words[i], &old,
+                old + (1UL << shifts[i]), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+        }
+    }
+    if (__atomic_add_fetch(&recorded, 1, __ATOMIC_RELAXED) % sample == 0)
+        halve();
+}
+
+/*
+ * admit_estimate - The smallest of the key's counters, plus one if the
+ * doorkeeper has seen it.
+ */
+int admit_estimate(unsigned int hash)
+{
+    unsigned long n;
+    int i, shift, min = 15;
+
+    if (__atomic_load_n(&table, __ATOMIC_ACQUIRE) == NULL)
+        return 0;
+    for (i = 0; i < ADMIT_DEPTH; i++) {
+        n = (__atomic_load_n(counter(hash, i, &shift), __ATOMIC_RELAXED) >> shift) & 0xf;
+        if (n < min)
+            min = n;
+    }
+    return min + door_has(hash);
+}
+
+/*
+ * admit_allow - Ties go to the victim, which has proved itself already.
+ */
+int admit_allow(unsigned int candidate, unsigned int victim)
+{
+    if (__atomic_load_n(&table, __ATOMIC_ACQUIRE) == NULL)
+        return 1;
+    return admit_estimate(candidate) > admit_estimate(victim);
+}
+
+/*
+ * spread - Make a "bits"-bit index from a hash, a different one for
+ * each "i".
+ */
+static unsigned long spread(unsigned int hash, int i, int bits)
+{
+    return ((hash + 1UL) * seeds[i]) >> (64 - bits);
+}
+
+/*
+ * counter - The word holding a key's counter in row "i", and where in
+ * the word the counter is.
+ */
+static unsigned long *counter(unsigned int hash, int i, int *shift)
+{
+    unsigned long index = spread(hash, i, width_bits);
+
+    *shift = (index % COUNTERS_PER_WORD) * 4;
+    return &table[(i << width_bits) / COUNTERS_PER_WORD + index / COUNTERS_PER_WORD];
+}
+
+/*
+ * door_has - Has the doorkeeper seen a key this period?
+ */
+static int door_has(unsigned int hash)
+{
+    unsigned long a = spread(hash, 0, door_bits);
+    unsigned long b = spread(hash, 1, door_bits);
+
+    return (__atomic_load_n(&door[a / 64], __ATOMIC_RELAXED) >> (a % 64) & 1)
+      &&  (__atomic_load_n(&door[b / 64], __ATOMIC_RELAXED) >> (b % 64) & 1);
+}
+
+/*
+ * door_add - Show a key to the doorkeeper.  Returns whether it had
+ * seen it already.
+ */
+static int door_add(unsigned int hash)
+{
+    unsigned long a = spread(hash, 0, door_bits);
+    unsigned long b = spread(hash, 1, door_bits);
+    unsigned long had_a, had_b;
+
+    had_a = __atomic_fetch_or(&door[a / 64], 1UL << (a % 64), __ATOMIC_RELAXED);
+    had_b = __atomic_fetch_or(&door[b / 64], 1UL << (b % 64), __ATOMIC_RELAXED);
+    return (had_a >> (a % 64) & 1)  &&  (had_b >> (b % 64) & 1);
+}
+
+/*
+ * halve - End a period: halve every counter and clear the doorkeeper.
+ */
+static void halve(void)
+{
+    unsigned long nwords = ADMIT_DEPTH * ((1UL << width_bits) / COUNTERS_PER_WORD);
+    unsigned long i, old;
+
+    for (i = 0; i < nwords; i++) {
+        old = __atomic_load_n(&table[i], __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&table[i], &old,
+          (old >> 1) & HALF_MASK, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+    for (i = 0; i < (1UL << door_bits) / 64; i++)
+        __atomic_store_n(&door[i], 0, __ATOMIC_RELAXED);
+}
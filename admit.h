@@ -0,0 +1,56 @@
+#ifndef _ADMIT_H
+#define _ADMIT_H
+
+#include <stddef.h>
+
+/*
+ * TinyLFU admission for the response cache.
+ *
+ * Most URLs are fetched only once, and a cache that keeps every
+ * response lets them push out the ones asked for again and again.
+ * Instead, a new response that needs room is only kept if its URL has
+ * lately been asked for more often than that of the object it would
+ * evict.
+ *
+ * How often is estimated with a count-min sketch: ADMIT_DEPTH rows of
+ * 4-bit counters, a key counting in one counter of each row and its
+ * estimate being the smallest of them.  Only the smallest are counted
+ * up, which keeps collisions from inflating the others.  A row has a
+ * counter per cache entry, and so that it is recent requests that
+ * count, every counter is halved each time ADMIT_SAMPLE_FACTOR
+ * requests per counter have been recorded.  In front of the sketch
+ * sits the doorkeeper, a bloom filter cleared along with the halving:
+ * a key's first request in each period only sets its doorkeeper bits,
+ * so keys seen just once never reach the sketch at all.
+ *
+ * Recording and estimating take no locks; the counters are updated
+ * with atomic operations.  The halving is done by whichever thread
+ * records the request that ends a period, while the others carry on
+ * recording, so a request recorded meanwhile may be halved at once.
+ */
+
+#define ADMIT_DEPTH          4      /* Counters per key */
+#define ADMIT_SAMPLE_FACTOR  10     /* Requests per entry between halvings */
+#define ADMIT_MIN_WIDTH      1024   /* Fewest counters in a row */
+#define ADMIT_DOOR_BITS      8      /* Doorkeeper bits per request in a period */
+
+/*
+ * Size the sketch for a cache of about "entries" objects.  Until this
+ * is called, every object is admitted.
+ */
+extern void admit_init(size_t entries);
+
+/* Record a request for the key whose hash is "hash" */
+extern void admit_record(unsigned int hash);
+
+/* How many times the key has been requested lately, roughly */
+extern int admit_estimate(unsigned int hash);
+
+/*
+ * Should a new object, whose key's hash is "candidate", displace the
+ * object whose key's hash is "victim"?  Only if it has been requested
+ * more often.
+ */
+extern int admit_allow(unsigned int candidate, unsigned int victim);
+
+#endif /* _ADMIT_H */
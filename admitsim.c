@@ -0,0 +1,334 @@
+/*
+ * admitsim.c - Trace-driven simulation of the cache's admission filter
+ *
+ * Replays the URLs and response sizes recorded in access logs in
+ * proxy.log's format through two models of the proxy's memory cache,
+ * and reports on standard output, as one JSON object, the hit ratio
+ * each achieves.  Both models are byte-bounded and split into
+ * CACHE_SHARDS shards with CLOCK eviction, like cache.c; the first
+ * keeps every response that fits, and the second asks the TinyLFU
+ * filter in admit.c first, just as cache.c does.
+ *
+ * A request is a hit if its URL is in the model cache; otherwise the
+ * logged response is offered to the cache.  Every logged response is
+ * taken to be one the proxy may keep, and its logged size, header
+ * included, to be what it would be charged.  The trace can be replayed
+ * several times over, to see how the two settle once the cache has
+ * warmed up.
+ *
+ * usage: admitsim [-C cache bytes] [-O object bytes] [-r repeats]
+ *                 <log file>...
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "admit.h"
+
+#define SIM_BUCKETS  65536      /* Hash buckets for interning URLs */
+#define SIM_MAX_URL  2048       /* Longest URL taken from a log */
+
+/* A URL seen in the logs, and where it stands in a model */
+typedef struct entry {
+    unsigned int hash;          /* As cache.c hashes keys */
+    long size;                  /* Charged while cached, else 0 */
+    int referenced;             /* Hit since the hand last passed it? */
+    struct entry *prev;         /* Shard's ring, if cached */
+    struct entry *next;
+} entry_t;
+
+/* One replayed request */
+typedef struct {
+    long url;                   /* Index of its URL */
+    long size;                  /* Logged response size */
+} request_t;
+
+/* A model cache */
+typedef struct {
+    const char *name;
+    int admit;                  /* Ask the admission filter? */
+    entry_t *entries;           /* One per URL */
+    entry_t *hand[CACHE_SHARDS]; /* Clock hands, NULL while empty */
+    long bytes[CACHE_SHARDS];
+    long hits;
+    long hit_bytes;
+    long rejects;
+    long evictions;
+} model_t;
+
+/* A URL being interned */
+typedef struct url {
+    char *text;
+    long index;
+    struct url *next;
+} url_t;
+
+static url_t *buckets[SIM_BUCKETS];
+static unsigned int *hashes;    /* Per URL */
+static long nurls;
+static request_t *trace;
+static long ntrace;
+static long total_bytes;
+static long shard_capacity;
+static long object_capacity;
+
+static void load_log(const char *path);
+static long intern(const char *url);
+static void simulate(model_t *m, int repeats);
+static int make_room(model_t *m, int shard, entry_t *e, long size);
+static void ring_insert(entry_t **hand, entry_t *e);
+static void ring_remove(entry_t **hand, entry_t *e);
+static void report(model_t *m, long requests, long bytes, int last);
+static unsigned int hash_key(const char *key);
+
+int main(int argc, char **argv)
+{
+    model_t plain, tinylfu;
+    long max_cache = MAX_CACHE_SIZE;
+    long max_object = MAX_OBJECT_SIZE;
+    int repeats = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "C:O:r:")) != -1) {
+        switch (opt) {
+        case 'C':
+            max_cache = atol(optarg);
+            break;
+        case 'O':
+            max_object = atol(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind < 1  ||  max_cache < CACHE_SHARDS  ||  repeats < 1) {
+        fprintf(stderr, "Usage: %s [-C cache bytes] [-O object bytes] "
+          "[-r repeats]\n       <log file>...\n", argv[0]);
+        exit(1);
+    }
+    for (; optind < argc; optind++)
+        load_log(argv[optind]);
+
+    /* The same budgets cache_init works out */
+    shard_capacity = max_cache / CACHE_SHARDS;
+    object_capacity = max_object < shard_capacity ? max_object : shard_capacity;
+
+    memset(&plain, 0, sizeof(plain));
+    plain.name = "clock";
+    simulate(&plain, repeats);
+    memset(&tinylfu, 0, sizeof(tinylfu));
+    tinylfu.name = "tinylfu";
+    tinylfu.admit = 1;
+    admit_init(max_cache / CACHE_MEAN_OBJECT);
+    simulate(&tinylfu, repeats);
+
+    printf("{\n");
+    printf("  \"requests\": %ld,\n", ntrace * repeats);
+    printf("  \"urls\": %ld,\n", nurls);
+    printf("  \"bytes\": %ld,\n", total_bytes * repeats);
+    printf("  \"cache_bytes\": %ld,\n", max_cache);
+    printf("  \"object_bytes\": %ld,\n", object_capacity);
+    report(&plain, ntrace * repeats, total_bytes * repeats, 0);
+    report(&tinylfu, ntrace * repeats, total_bytes * repeats, 1);
+    printf("}\n");
+    exit(0);
+}
+
+/*
+ * load_log - Add every logged request with a URL and a size to the
+ * trace.
+ */
+static void load_log(const char *path)
+{
+    static long max_trace;
+    FILE *fp;
+    char line[MAXLINE];
+    char url[SIM_MAX_URL];
+    char *p, *end;
+    long size;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        unix_error((char *)path);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strstr(line, "http://")) == NULL)
+            continue;
+        end = p + strcspn(p, " \t\r\n");
+        if (end - p >= sizeof(url))
+            continue;
+        memcpy(url, p, end - p);
+        url[end - p] = '\0';
+        size = strtol(end, &p, 10);
+        if (p == end  ||  size < 0)
+            continue;
+
+        if (ntrace == max_trace) {
+            max_trace = max_trace ? max_trace * 2 : 4096;
+            trace = Realloc(trace, max_trace * sizeof(request_t));
+        }
+        trace[ntrace].url = intern(url);
+        trace[ntrace].size = size;
+        ntrace++;
+        total_bytes += size;
+    }
+    fclose(fp);
+}
+
+/*
+ * intern - The index of a URL, numbering it if it is new.
+ */
+static long intern(const char *url)
+{
+    static long max_urls;
+    unsigned int hash = hash_key(url);
+    url_t **bucket = &buckets[hash % SIM_BUCKETS];
+    url_t *u;
+
+    for (u = *bucket; u != NULL; u = u->next) {
+        if (strcmp(u->text, url) == 0)
+            return u->index;
+    }
+    if (nurls == max_urls) {
+        max_urls = max_urls ? max_urls * 2 : 4096;
+        hashes = Realloc(hashes, max_urls * sizeof(unsigned int));
+    }
+    u = Malloc(sizeof(url_t));
+    u->text = Malloc(strlen(url) + 1);
+    strcpy(u->text, url);
+    u->index = nurls;
+    u->next = *bucket;
+    *bucket = u;
+    hashes[nurls] = hash;
+    return nurls++;
+}
+
+/*
+ * simulate - Replay the trace through a model, "repeats" times.
+ */
+static void simulate(model_t *m, int repeats)
+{
+    request_t *r;
+    entry_t *e;
+    int i, shard;
+
+    m->entries = Calloc(nurls, sizeof(entry_t));
+    for (i = 0; i < nurls; i++)
+        m->entries[i].hash = hashes[i];
+
+    for (i = 0; i < repeats; i++) {
+        for (r = trace; r < trace + ntrace; r++) {
+            e = &m->entries[r->url];
+            shard = e->hash % CACHE_SHARDS;
+            if (m->admit)
+                admit_record(e->hash);
+            if (e->size > 0) {
+                m->hits++;
+                m->hit_bytes += r->size;
+                e->referenced = 1;
+            }
+            else if (r->size > 0  &&  r->size <= object_capacity
+              &&  make_room(m, shard, e, r->size)) {
+                e->size = r->size;
+                m->bytes[shard] += r->size;
+                ring_insert(&m->hand[shard], e);
+            }
+        }
+    }
+}
+
+/*
+ * make_room - Evict from a shard, as the clock picks, until "size"
+ * more bytes fit, if the model lets "e" displace the first object to
+ * go, as cache.c's make_room does.  Returns 0 if "e" is not to be
+ * kept.
+ */
+static int make_room(model_t *m, int shard, entry_t *e, long size)
+{
+    entry_t **hand = &m->hand[shard];
+    entry_t *victim;
+    int first = 1;
+
+    while (m->bytes[shard] + size > shard_capacity) {
+        if (*hand == NULL)
+            return 0;
+        while ((*hand)->referenced) {
+            (*hand)->referenced = 0;
+            *hand = (*hand)->next;
+        }
+        victim = *hand;
+        *hand = victim->next;
+        if (first  &&  m->admit  &&  !admit_allow(e->hash, victim->hash)) {
+            m->rejects++;
+            return 0;
+        }
+        first = 0;
+        ring_remove(hand, victim);
+        m->bytes[shard] -= victim->size;
+        victim->size = 0;
+        m->evictions++;
+    }
+    return 1;
+}
+
+/*
+ * ring_insert - Put an entry in a shard's ring just behind the hand,
+ * unreferenced, as cache.c's charge does.
+ */
+static void ring_insert(entry_t **hand, entry_t *e)
+{
+    e->referenced = 0;
+    if (*hand == NULL) {
+        e->prev = e->next = e;
+        *hand = e;
+        return;
+    }
+    e->next = *hand;
+    e->prev = (*hand)->prev;
+    e->prev->next = e;
+    (*hand)->prev = e;
+}
+
+/*
+ * ring_remove - Take an entry out of a shard's ring.
+ */
+static void ring_remove(entry_t **hand, entry_t *e)
+{
+    if (e->next == e) {
+        *hand = NULL;
+        return;
+    }
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    if (*hand == e)
+        *hand = e->next;
+}
+
+/*
+ * report - Print a model's results as a member of the JSON object.
+ */
+static void report(model_t *m, long requests, long bytes, int last)
+{
+    printf("  \"%s\": {\"hits\": %ld, \"hit_ratio\": %.4f, "
+      "\"byte_hit_ratio\": %.4f, \"evictions\": %ld", m->name, m->hits,
+      requests > 0 ? (double)m->hits / requests : 0.0,
+      bytes > 0 ? (double)m->hit_bytes / bytes : 0.0, m->evictions);
+    if (m->admit)
+        printf(", \"rejects\": %ld", m->rejects);
+    printf("}%s\n", last ? "" : ",");
+}
+
+/*
+ * hash_key - FNV-1a hash of a key, as in cache.c.
+ */
+static unsigned int hash_key(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*key != '\0') {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,195 @@
+/*
+ * arena.c - Per-connection bump allocator with a global free list
+ *
+ * See arena.h for the interface.  An arena is a header followed, in
+ * the same block, by its first chunk.  Larger needs are met by further
+ * chunks, linked after the first; a reset arena goes back to its mark
+ * but keeps those chunks for its next requests, and only an arena put
+ * back on the free list gives them up.
+ */
+
+#include "csapp.h"
+#include "arena.h"
+
+#define ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+typedef struct chunk {
+    struct chunk *next;         /* Next chunk, if more were needed */
+    size_t size;                /* Bytes of data */
+    char data[] __attribute__((aligned(16)));
+} chunk_t;
+
+struct arena {
+    struct arena *next;         /* Next arena on the free list */
+    chunk_t *chunk;             /* Chunk being allocated from */
+    char *ptr;                  /* Next free byte in it */
+    char *end;                  /* End of it */
+    chunk_t *mark_chunk;        /* Where arena_reset goes back to */
+    char *mark_ptr;
+    unsigned long requests;     /* Counts not yet added to the totals */
+    unsigned long allocs;
+    unsigned long heap_calls;
+    int busy;                   /* Anything allocated since the last reset? */
+    chunk_t *first;
+};
+
+static arena_t *free_list;
+static int free_count;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_stats_t totals;
+
+static void rewind_to(arena_t *a, chunk_t *chunk, char *ptr);
+
+/*
+ * arena_get - Take an arena from the free list, or allocate one.
+ */
+arena_t *arena_get(void)
+{
+    arena_t *a;
+
+    pthread_mutex_lock(&free_lock);
+    if ((a = free_list) != NULL) {
+        free_list = a->next;
+        free_count--;
+    }
+    pthread_mutex_unlock(&free_lock);
+    if (a != NULL)
+        return a;
+
+    a = Malloc(ALIGN(sizeof(arena_t)) + sizeof(chunk_t) + ARENA_CHUNK);
+    memset(a, 0, sizeof(arena_t));
+    a->first = (chunk_t *)((char *)a + ALIGN(sizeof(arena_t)));
+    a->first->next = NULL;
+    a->first->size = ARENA_CHUNK;
+    a->heap_calls = 1;
+    rewind_to(a, a->first, a->first->data);
+    arena_mark(a);
+    return a;
+}
+
+/*
+ * arena_alloc - Bump-allocate from the current chunk, moving on to
+ * the next chunk (or a new one) when it is used up.
+ */
+void *arena_alloc(arena_t *a, size_t size)
+{
+    chunk_t *chunk;
+    size_t want;
+    char *p;
+
+    size = ALIGN(size);
+    a->allocs++;
+    a->busy = 1;
+    while ((size_t)(a->end - a->ptr) < size) {
+        chunk = a->chunk->next;
+        if (chunk == NULL  ||  chunk->size < size) {
+            /* Chunks double in size, so few are ever needed */
+            want = a->chunk->size * 2 > size ? a->chunk->size * 2 : size;
+            chunk = Malloc(sizeof(chunk_t) + want);
+            chunk->size = want;
+            chunk->next = a->chunk->next;
+            a->chunk->next = chunk;
+            a->heap_calls++;
+        }
+        rewind_to(a, chunk, chunk->data);
+    }
+    p = a->ptr;
+    a->ptr += size;
+    return p;
+}
+
+/*
+ * arena_realloc - Grow an allocation, in place when it is the last.
+ */
+void *arena_realloc(arena_t *a, void *ptr, size_t old, size_t size)
+{
+    char *p = ptr;
+    void *q;
+
+    if (p + ALIGN(old) == a->ptr  &&  p + ALIGN(size) <= a->end) {
+        a->allocs++;
+        a->busy = 1;
+        a->ptr = p + ALIGN(size);
+        return p;
+    }
+    q = arena_alloc(a, size);
+    memcpy(q, p, old);
+    return q;
+}
+
+/*
+ * arena_mark - Remember where the allocations to keep end.
+ */
+void arena_mark(arena_t *a)
+{
+    a->mark_chunk = a->chunk;
+    a->mark_ptr = a->ptr;
+}
+
+/*
+ * arena_reset - Go back to the mark, counting one request.
+ */
+void arena_reset(arena_t *a)
+{
+    a->requests++;
+    a->busy = 0;
+    rewind_to(a, a->mark_chunk, a->mark_ptr);
+}
+
+/*
+ * arena_put - Add an arena's counts to the totals, trim it to its
+ * first chunk, and put it on the free list if there is room.
+ */
+void arena_put(arena_t *a)
+{
+    chunk_t *chunk;
+
+    while ((chunk = a->first->next) != NULL) {
+        a->first->next = chunk->next;
+        Free(chunk);
+        a->heap_calls++;
+    }
+    if (a->busy)
+        a->requests++;
+    __atomic_add_fetch(&totals.requests, a->requests, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals.allocs, a->allocs, __ATOMIC_RELAXED);
+    a->requests = a->allocs = a->busy = 0;
+
+    pthread_mutex_lock(&free_lock);
+    if (free_count < ARENA_FREE_MAX) {
+        __atomic_add_fetch(&totals.heap_calls, a->heap_calls, __ATOMIC_RELAXED);
+        a->heap_calls = 0;
+        rewind_to(a, a->first, a->first->data);
+        arena_mark(a);
+        a->next = free_list;
+        free_list = a;
+        free_count++;
+        a = NULL;
+    }
+    pthread_mutex_unlock(&free_lock);
+    if (a != NULL) {
+        __atomic_add_fetch(&totals.heap_calls, a->heap_calls + 1,
+          __ATOMIC_RELAXED);
+        Free(a);
+    }
+}
+
+/*
+ * arena_stats - Read the totals.
+ */
+void arena_stats(arena_stats_t *stats)
+{
+    stats->requests = __atomic_load_n(&totals.requests, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&totals.allocs, __ATOMIC_RELAXED);
+    stats->heap_calls = __atomic_load_n(&totals.heap_calls, __ATOMIC_RELAXED);
+}
+
+/*
+ * rewind_to - Make "ptr" in "chunk" the next free byte.
+ */
+static void rewind_to(arena_t *a, chunk_t *chunk, char *ptr)
+{
+    a->chunk = chunk;
+    a->ptr = ptr;
+    a->end = chunk->data + chunk->size;
+}
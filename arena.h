@@ -0,0 +1,60 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Per-connection memory arenas.
+ *
+ * Everything a connection allocates for itself comes from its arena,
+ * by bumping a pointer through a chunk of memory, and is never freed
+ * on its own.  Allocations made before arena_mark outlive requests;
+ * everything after it is dropped at once by arena_reset between two
+ * requests on a keep-alive connection.  When the connection closes,
+ * the arena goes back on a global free list, trimmed to its first
+ * chunk, for the next connection to take, so in the steady state
+ * serving a request takes no calls into the heap at all.
+ *
+ * An arena is used by one thread at a time.  Its allocation counts are
+ * kept in the arena itself and only added to the global totals when
+ * it is put back.
+ */
+
+#define ARENA_CHUNK     32768   /* Bytes in an arena's first chunk */
+#define ARENA_FREE_MAX  256     /* Most arenas kept on the free list */
+
+typedef struct arena arena_t;
+
+/* Totals over all arenas put back so far */
+typedef struct {
+    unsigned long requests;     /* Requests served from arenas */
+    unsigned long allocs;       /* arena_alloc calls */
+    unsigned long heap_calls;   /* Chunks and arenas taken from the heap */
+} arena_stats_t;
+
+/* Take an empty arena from the free list, or make one */
+extern arena_t *arena_get(void);
+
+/* Return "size" bytes, aligned for any type, and uninitialized */
+extern void *arena_alloc(arena_t *a, size_t size);
+
+/*
+ * Grow the allocation at "ptr" from "old" to "size" bytes, in place if
+ * it is the most recent one and there is room, else by copying it.  An
+ * allocation made before the mark must be marked again afterwards.
+ */
+extern void *arena_realloc(arena_t *a, void *ptr, size_t old, size_t size);
+
+/* Keep everything allocated so far across arena_reset */
+extern void arena_mark(arena_t *a);
+
+/* Drop everything allocated since the mark; ends one request */
+extern void arena_reset(arena_t *a);
+
+/* Put an arena back; nothing allocated from it may be used afterwards */
+extern void arena_put(arena_t *a);
+
+/* Fill in the totals */
+extern void arena_stats(arena_stats_t *stats);
+
+#endif /* _ARENA_H */
@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# bench.sh - Benchmark the proxy against the stub origin ("make bench")
+#
+# Starts stuborigin and the proxy on local ports, replays the URL mix
+# in proxy.log through the proxy with loadgen, and writes loadgen's JSON
+# report to bench.json as well as standard output, so runs of different
+# builds can be compared: keep one build's report, and give it as the
+# baseline when running the other.  The proxy runs in a scratch
+# directory, which keeps its log and debugging output out of the tree.
+# Settings come from the environment:
+#
+#   BENCH_THREADS   event-mode worker threads for the proxy; empty runs
+#                   it with its fixed pool of workers (default)
+#   BENCH_PROXY     extra proxy options, e.g. "-d"
+#   BENCH_CONNS     concurrent client connections (default 16)
+#   BENCH_SECS      length of the run in seconds (default 10, or the
+#                   whole mix once with BENCH_SPEEDUP)
+#   BENCH_MIX       URL mix to replay (default proxy.log)
+#   BENCH_SPEEDUP   replay the mix on its logged timing, this many times
+#                   faster; empty sends requests as fast as they are
+#                   answered (default)
+#   BENCH_BASELINE  report of an earlier run, e.g. of another build, to
+#                   compare throughput and latency with
+#   BENCH_LOADGEN   extra loadgen options, e.g. "-k -u"
+#   BENCH_ORIGIN    extra stuborigin options, e.g. "-d 5"
+#   BENCH_PORT      proxy port; the origin uses the next one (default 15300)
+#   BENCH_OUT       report file (default bench.json)
+
+here=$(cd "$(dirname "$0")" && pwd)
+port=${BENCH_PORT:-15300}
+origin_port=$((port + 1))
+out=${BENCH_OUT:-bench.json}
+scratch=$(mktemp -d)
+
+cleanup() {
+    kill $proxy_pid $origin_pid 2>/dev/null
+    wait $proxy_pid $origin_pid 2>/dev/null
+    rm -rf "$scratch"
+}
+trap cleanup EXIT
+
+# wait_for port - Wait up to five seconds for something to listen on port
+wait_for() {
+    for i in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "bench.sh: nothing listening on port $1" >&2
+    exit 1
+}
+
+"$here/stuborigin" $BENCH_ORIGIN $origin_port &
+origin_pid=$!
+(cd "$scratch" && exec "$here/proxy" $BENCH_PROXY $port $BENCH_THREADS \
+    > proxy.out 2>&1) &
+proxy_pid=$!
+wait_for $origin_port
+wait_for $port
+
+label=$(cd "$here" && git rev-parse --short HEAD 2>/dev/null)
+if [ -n "$BENCH_SPEEDUP" ]; then
+    timing="-s $BENCH_SPEEDUP ${BENCH_SECS:+-t $BENCH_SECS}"
+else
+    timing="-t ${BENCH_SECS:-10}"
+fi
+"$here/loadgen" -c ${BENCH_CONNS:-16} $timing \
+    -f "${BENCH_MIX:-$here/proxy.log}" -o 127.0.0.1:$origin_port \
+    -P $proxy_pid -l "$label" ${BENCH_BASELINE:+-b "$BENCH_BASELINE"} \
+    $BENCH_LOADGEN 127.0.0.1 $port > "$out"
+status=$?
+cat "$out"
+exit $status
@@ -0,0 +1,870 @@
+/*
+ * cache.c - Sharded, byte-bounded CLOCK store of GET responses,
+ * readable while they are being filled
+ *
+ * See cache.h for the interface.  Each shard keeps its kept objects in
+ * a ring, newest just behind the clock hand.  A hit only sets the
+ * object's referenced bit, with an atomic store so that hits can run
+ * under the shard's read lock.  When the shard needs room, the hand
+ * sweeps on from where it stopped, clearing the bits it passes, and
+ * evicts the first object whose bit was already clear; so choosing a
+ * victim takes constant time on average, however many objects the
+ * shard holds.  Every lookup is recorded with the admission filter,
+ * which takes no locks of its own, so hits stay under the read lock
+ * alone.
+ *
+ * The hash buckets are allocated once, enough for each to hold one
+ * object of CACHE_MEAN_OBJECT bytes when the cache is full.
+ *
+ * Readers and the writer share an object without locking.  The
+ * writer fills a segment and only then publishes the new length, and
+ * links the next segment only once the current one is full; readers
+ * load a segment's "next" before its "len", so a reader that sees a
+ * following segment also sees every byte of the current one.  Bytes
+ * below a published length never change.  The object's mutex is only
+ * taken to sleep until the writer has appended more, and by the writer
+ * to wake the sleepers.
+ *
+ * Each segment holds a reference on the one after it, the index holds
+ * one on an object's first segment, the writer holds one on the
+ * segment it is filling, and every reader holds one on the segment it
+ * is reading.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "cache.h"
+#include "fresh.h"
+#include "admit.h"
+#include "httpparse.h"
+#include "stats.h"
+
+#define CACHE_MIN_BUCKETS 16   /* Fewest hash buckets per shard */
+
+/* What state an object is in */
+#define FILLING 0           /* Still being written */
+#define DONE    1           /* Complete; clients may persist */
+#define CLOSING 2           /* Ended; clients must close */
+
+typedef struct {
+    pthread_rwlock_t lock;
+    cache_obj_t **buckets;  /* bucket_mask + 1 of them */
+    cache_obj_t *hand;      /* Next kept object for the clock, or NULL */
+    size_t bytes;           /* Bytes charged to kept objects */
+} shard_t;
+
+static shard_t shards[CACHE_SHARDS];
+static size_t shard_capacity;      /* Byte budget of each shard */
+static size_t object_capacity;     /* Largest object we will keep */
+static unsigned int bucket_mask;   /* Buckets per shard, less one */
+
+static cache_obj_t **bucket(shard_t *shard, unsigned int hash);
+static cache_obj_t *find(shard_t *shard, unsigned int hash, const char *key);
+static int may_follow(cache_obj_t *obj, int req_flags);
+static void attach(cache_obj_t *obj, cache_reader_t *reader);
+static cache_obj_t *obj_new(const char *key, unsigned int hash);
+static int advance(cache_reader_t *reader, char **buf);
+static void charge(shard_t *shard, cache_obj_t *obj, long size);
+static void unlist(shard_t *shard, cache_obj_t *obj);
+static int make_room(shard_t *shard, unsigned int hash, long size);
+static cache_obj_t *clock_victim(shard_t *shard);
+static unsigned int hash_key(const char *key);
+static int stale(cache_obj_t *obj);
+static int check_header(const char *data, long len, int req_flags,
+  long *length, int *flags);
+static int cacheable(char *data, int *size, int req_flags);
+static cache_seg_t *seg_new(int size, int refcnt);
+static void seg_put(cache_seg_t *seg);
+static void obj_put(cache_obj_t *obj);
+
+/*
+ * cache_init - Set up the shards, their budgets and their buckets,
+ * a power of two of them.
+ */
+void cache_init(size_t max_cache, size_t max_object)
+{
+    size_t nbuckets;
+    int i, rc;
+
+    shard_capacity = max_cache / CACHE_SHARDS;
+    object_capacity = max_object;
+    if (object_capacity > shard_capacity)
+        object_capacity = shard_capacity;
+    for (nbuckets = CACHE_MIN_BUCKETS;
+         nbuckets * CACHE_MEAN_OBJECT < shard_capacity; nbuckets *= 2)
+        ;
+    bucket_mask = nbuckets - 1;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        if ((rc = pthread_rwlock_init(&shards[i].lock, NULL)) != 0)
+            posix_error(rc, "cache_init: pthread_rwlock_init error");
+        shards[i].buckets = Calloc(nbuckets, sizeof(cache_obj_t *));
+    }
+    admit_init(max_cache / CACHE_MEAN_OBJECT);
+}
+
+/*
+ * cache_max_object - Return the largest response worth keeping.
+ */
+size_t cache_max_object(void)
+{
+    return object_capacity;
+}
+
+/*
+ * cache_key - Build a normalized cache key for a URL.
+ */
+int cache_key(char *key, size_t size, char *hostname, int port, char *pathname)
+{
+    int n;
+    char *p;
+
+    n = snprintf(key, size, "%s:%d/%s", hostname, port, pathname);
+    if (n < 0  ||  n >= size)
+        return -1;
+    for (p = key; *p != ':'; p++)
+        *p = tolower((unsigned char)*p);
+    return 0;
+}
+
+/*
+ * cache_open - Attach to the object for a key, or start filling one.
+ * A stale object is replaced by the new one, so requests from now on
+ * follow the new one's writer while it revalidates the old.  An object
+ * the request may not follow is left alone, and the request gets
+ * neither.
+ */
+cache_obj_t *cache_open(const char *key, int req_flags, cache_reader_t *reader)
+{
+    unsigned int hash = hash_key(key);
+    shard_t *shard = &shards[hash % CACHE_SHARDS];
+    cache_obj_t *obj;
+    cache_obj_t *fresh;
+
+    admit_record(hash);
+    reader->obj = NULL;
+    pthread_rwlock_rdlock(&shard->lock);
+    if ((obj = find(shard, hash, key)) != NULL  &&  !stale(obj)) {
+        if (may_follow(obj, req_flags))
+            attach(obj, reader);
+    }
+    else
+        obj = NULL;
+    pthread_rwlock_unlock(&shard->lock);
+    if (obj != NULL)
+        return NULL;
+
+    /* Build the object before taking the write lock; it may go unused */
+    fresh = obj_new(key, hash);
+    fresh->req_flags = req_flags;
+    pthread_rwlock_wrlock(&shard->lock);
+    if ((obj = find(shard, hash, key)) != NULL  &&  !stale(obj)) {
+        if (may_follow(obj, req_flags))
+            attach(obj, reader);
+        pthread_rwlock_unlock(&shard->lock);
+        seg_put(fresh->first);
+        seg_put(fresh->tail);
+        fresh->refcnt = 1;
+        obj_put(fresh);
+        return NULL;
+    }
+    if (obj != NULL) {
+        attach(obj, reader);
+        unlist(shard, obj);
+    }
+    fresh->next = *bucket(shard, hash);
+    *bucket(shard, hash) = fresh;
+    pthread_rwlock_unlock(&shard->lock);
+    return fresh;
+}
+
+/*
+ * cache_lookup - Attach to a complete object, if there is one.
+ */
+int cache_lookup(const char *key, cache_reader_t *reader)
+{
+    unsigned int hash = hash_key(key);
+    shard_t *shard = &shards[hash % CACHE_SHARDS];
+    cache_obj_t *obj;
+
+    admit_record(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    obj = find(shard, hash, key);
+    if (obj != NULL  &&  __atomic_load_n(&obj->state, __ATOMIC_ACQUIRE) == DONE
+      &&  !stale(obj))
+        attach(obj, reader);
+    else
+        obj = NULL;
+    pthread_rwlock_unlock(&shard->lock);
+    return obj != NULL ? 0 : -1;
+}
+
+/*
+ * cache_append - Copy bytes into the tail segment, adding segments as
+ * they fill, and wake the readers.
+ */
+void cache_append(cache_obj_t *obj, const char *buf, int n)
+{
+    cache_seg_t *seg;
+    cache_seg_t *next;
+    int m;
+
+    obj->size += n;
+    if (obj->disk != NULL)
+        disk_write(obj->disk, buf, n);
+    if (obj->disk_only)
+        return;
+
+    while (n > 0) {
+        seg = obj->tail;
+        if (seg->len == seg->size) {
+            /* One reference for the link, one for us */
+            next = seg_new(CACHE_SEGMENT, 2);
+            __atomic_store_n(&seg->next, next, __ATOMIC_RELEASE);
+            obj->tail = next;
+            seg_put(seg);
+            continue;
+        }
+        m = seg->size - seg->len < n ? seg->size - seg->len : n;
+        memcpy(seg->data + seg->len, buf, m);
+        __atomic_store_n(&seg->len, seg->len + m, __ATOMIC_RELEASE);
+        buf += m;
+        n -= m;
+    }
+
+    pthread_mutex_lock(&obj->lock);
+    pthread_cond_broadcast(&obj->grew);
+    pthread_mutex_unlock(&obj->lock);
+}
+
+/*
+ * cache_header - Note where the header ends, and keep the object if
+ * the header allows it and room can be made.
+ */
+int cache_header(cache_obj_t *obj, long head_len, int closing)
+{
+    shard_t *shard = &shards[obj->hash % CACHE_SHARDS];
+    cache_seg_t *seg;
+    char buf[MAXBUF];
+    char *head;
+    long length = -1;
+    long total = 0;
+    long got;
+    int flags = closing ? CACHE_HEAD_CLOSE : 0;
+    int shared = 0;
+    int keep = 0;
+    int spill = 0;
+
+    /* Gather what has been appended, the blank line included */
+    if (obj->first != NULL  &&  head_len < obj->size) {
+        head = obj->size < sizeof(buf) ? buf : Malloc(obj->size + 1);
+        for (seg = obj->first, got = 0; seg != NULL; seg = seg->next) {
+            memcpy(head + got, seg->data, seg->len);
+            got += seg->len;
+        }
+        head[got] = '\0';
+        shared = check_header(head, head_len, obj->req_flags, &length, &flags);
+        keep = shared > 0  &&  !closing;
+        total = head_len + (head[head_len] == '\r' ? 2 : 1);
+        obj->expires = fresh_expires(head, total, time(NULL));
+        total += length;
+        spill = keep  &&  total > object_capacity;
+        keep = keep  &&  total <= object_capacity;
+        if (spill)
+            obj->disk = disk_reserve(obj->key, total, head_len, obj->expires);
+        if (obj->disk != NULL)
+            disk_write(obj->disk, head, got);
+        if (head != buf)
+            Free(head);
+    }
+
+    /*
+     * Settle whether the object stays in the index before telling the
+     * readers about the header, so a reader that gives up on it can't
+     * find it again.  Readers of a response that isn't to be shared are
+     * turned away, to fetch it for themselves.
+     */
+    pthread_rwlock_wrlock(&shard->lock);
+    if (keep  &&  obj->listed)
+        keep = make_room(shard, obj->hash, total);
+    if (keep  &&  obj->listed)
+        charge(shard, obj, total);
+    else
+        unlist(shard, obj);
+    keep = obj->listed  ||  (shared >= 0
+      &&  __atomic_load_n(&obj->readers, __ATOMIC_ACQUIRE) > 0);
+    pthread_rwlock_unlock(&shard->lock);
+    if (obj->disk != NULL) {
+        obj->disk_only = !keep;
+        keep = 1;
+    }
+
+    pthread_mutex_lock(&obj->lock);
+    obj->head_len = head_len;
+    obj->head_flags = flags;
+    obj->unshared = shared < 0;
+    pthread_cond_broadcast(&obj->grew);
+    pthread_mutex_unlock(&obj->lock);
+    return keep;
+}
+
+/*
+ * cache_finish - Complete the object, or discard it, and wake the
+ * readers for the last time.
+ */
+void cache_finish(cache_obj_t *obj, int persist)
+{
+    shard_t *shard = &shards[obj->hash % CACHE_SHARDS];
+    cache_seg_t *chain = NULL;
+    cache_seg_t *whole = NULL;
+    cache_seg_t *seg;
+
+    /*
+     * A kept object spread over several segments is copied into one,
+     * so that hits go out in a single write; readers already attached
+     * carry on through the segments they hold
+     */
+    pthread_rwlock_rdlock(&shard->lock);
+    if (persist  &&  obj->listed  &&  obj->charged == obj->size
+      &&  obj->first->next != NULL) {
+        chain = obj->first;
+        __atomic_add_fetch(&chain->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (chain != NULL) {
+        whole = seg_new(obj->size, 1);
+        for (seg = chain; seg != NULL; seg = seg->next) {
+            memcpy(whole->data + whole->len, seg->data, seg->len);
+            whole->len += seg->len;
+        }
+        seg_put(chain);
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+    if (obj->listed  &&  (!persist  ||  obj->charged == 0
+      ||  obj->charged != obj->size))
+        unlist(shard, obj);
+    if (obj->listed  &&  whole != NULL) {
+        chain = obj->first;
+        obj->first = whole;
+        whole = NULL;
+        seg_put(chain);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    seg_put(whole);
+    if (obj->disk != NULL)
+        disk_commit(obj->disk, persist);
+
+    seg_put(obj->tail);
+    obj->tail = NULL;
+    pthread_mutex_lock(&obj->lock);
+    __atomic_store_n(&obj->state, persist ? DONE : CLOSING, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&obj->grew);
+    pthread_mutex_unlock(&obj->lock);
+    obj_put(obj);
+}
+
+/*
+ * cache_wait_header - Sleep until the header is complete or the
+ * object has ended.  A header that may not be shared counts as none.
+ */
+long cache_wait_header(cache_reader_t *reader, int *flags)
+{
+    cache_obj_t *obj = reader->obj;
+    long head_len;
+
+    pthread_mutex_lock(&obj->lock);
+    while (obj->head_len < 0  &&  obj->state == FILLING)
+        pthread_cond_wait(&obj->grew, &obj->lock);
+    head_len = obj->unshared ? -1 : obj->head_len;
+    *flags = obj->head_flags;
+    pthread_mutex_unlock(&obj->lock);
+    return head_len;
+}
+
+/*
+ * cache_read - Return the next run of unread bytes, waiting for the
+ * writer if the reader has caught up with it.
+ */
+int cache_read(cache_reader_t *reader, char **buf)
+{
+    cache_obj_t *obj = reader->obj;
+    int locked = 0;
+    int state;
+    int n;
+
+    while ((n = advance(reader, buf)) == 0) {
+        state = __atomic_load_n(&obj->state, __ATOMIC_ACQUIRE);
+        if (state != FILLING) {
+            /* Bytes appended before the end may have just appeared */
+            if ((n = advance(reader, buf)) == 0)
+                n = state == DONE ? 0 : -1;
+            break;
+        }
+        /* Look again under the lock, so no wakeup can be missed */
+        if (locked)
+            pthread_cond_wait(&obj->grew, &obj->lock);
+        else
+            pthread_mutex_lock(&obj->lock);
+        locked = 1;
+    }
+    if (locked)
+        pthread_mutex_unlock(&obj->lock);
+    return n;
+}
+
+/*
+ * cache_close - Drop a reader's references.
+ */
+void cache_close(cache_reader_t *reader)
+{
+    seg_put(reader->seg);
+    __atomic_sub_fetch(&reader->obj->readers, 1, __ATOMIC_RELEASE);
+    obj_put(reader->obj);
+    reader->obj = NULL;
+}
+
+/*
+ * cache_insert - Store a complete response, evicting objects not used
+ * lately from its shard until it fits, if it is let in.
+ */
+int cache_insert(const char *key, char *data, int size, int req_flags)
+{
+    unsigned int hash;
+    shard_t *shard;
+    cache_obj_t *obj;
+    cache_obj_t *old;
+    int head_len;
+
+    if (size <= 0  ||  size > object_capacity
+      ||  (head_len = cacheable(data, &size, req_flags)) < 0) {
+        free(data);
+        return -1;
+    }
+
+    hash = hash_key(key);
+    shard = &shards[hash % CACHE_SHARDS];
+
+    obj = obj_new(key, hash);
+    seg_put(obj->tail);
+    obj->tail = NULL;
+    obj->first = seg_new(size, 1);
+    memcpy(obj->first->data, data, size);
+    obj->first->len = size;
+    free(data);
+    obj->size = size;
+    obj->head_len = head_len;
+    obj->expires = fresh_expires(obj->first->data, head_len + 2, time(NULL));
+    obj->state = DONE;
+    obj->refcnt = 1;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    if ((old = find(shard, hash, key)) != NULL  &&  !stale(old)) {
+        /* Another thread fetched the same URL first */
+        pthread_rwlock_unlock(&shard->lock);
+        seg_put(obj->first);
+        obj_put(obj);
+        return -1;
+    }
+    if (old != NULL)
+        unlist(shard, old);
+    if (!make_room(shard, hash, size)) {
+        pthread_rwlock_unlock(&shard->lock);
+        seg_put(obj->first);
+        obj_put(obj);
+        return -1;
+    }
+    obj->next = *bucket(shard, hash);
+    *bucket(shard, hash) = obj;
+    charge(shard, obj, size);
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+/*
+ * bucket - The hash bucket of a shard that a key's hash falls in.
+ */
+static cache_obj_t **bucket(shard_t *shard, unsigned int hash)
+{
+    return &shard->buckets[(hash / CACHE_SHARDS) & bucket_mask];
+}
+
+/*
+ * find - Look a key up in a shard, marking the object as referenced.
+ * The bit is only written if it is clear, so hits on a popular object
+ * don't keep dirtying its cache line.  The caller must hold the
+ * shard's lock.
+ */
+static cache_obj_t *find(shard_t *shard, unsigned int hash, const char *key)
+{
+    cache_obj_t *obj;
+
+    for (obj = *bucket(shard, hash); obj != NULL; obj = obj->next) {
+        if (obj->hash == hash  &&  strcmp(obj->key, key) == 0) {
+            if (!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED))
+                __atomic_store_n(&obj->referenced, 1, __ATOMIC_RELAXED);
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * may_follow - May a request described by "req_flags" attach to an
+ * object?  A kept one has been judged fit for anyone.  One still
+ * waiting for its header, or not kept, is only fit for a request like
+ * its writer's, and never when either carries credentials, since the
+ * origin may answer them differently.  The caller must hold the
+ * shard's lock, under which "charged" is set.
+ */
+static int may_follow(cache_obj_t *obj, int req_flags)
+{
+    return obj->charged > 0  ||  (req_flags == obj->req_flags
+      &&  !(req_flags & CACHE_REQ_AUTHORIZED));
+}
+
+/*
+ * attach - Make "reader" a reader of a listed object, at its start.
+ * The caller must hold the shard's lock, which keeps obj->first from
+ * going away.
+ */
+static void attach(cache_obj_t *obj, cache_reader_t *reader)
+{
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&obj->readers, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&obj->first->refcnt, 1, __ATOMIC_RELAXED);
+    reader->obj = obj;
+    reader->seg = obj->first;
+    reader->off = 0;
+}
+
+/*
+ * obj_new - Create a listed, filling object with one empty segment.
+ * It holds references for the index and for its writer.
+ */
+static cache_obj_t *obj_new(const char *key, unsigned int hash)
+{
+    cache_obj_t *obj = Calloc(1, sizeof(cache_obj_t));
+
+    obj->key = Malloc(strlen(key) + 1);
+    strcpy(obj->key, key);
+    obj->hash = hash;
+    obj->listed = 1;
+    obj->head_len = -1;
+    obj->state = FILLING;
+    obj->first = obj->tail = seg_new(CACHE_SEGMENT, 2);
+    pthread_mutex_init(&obj->lock, NULL);
+    pthread_cond_init(&obj->grew, NULL);
+    obj->refcnt = 2;
+    return obj;
+}
+
+/*
+ * advance - Take whatever the writer has published beyond the reader's
+ * position, moving to the next segment when this one is used up.
+ * Returns the number of bytes, or 0 if there are none yet.
+ */
+static int advance(cache_reader_t *reader, char **buf)
+{
+    cache_seg_t *seg;
+    cache_seg_t *next;
+    int len;
+
+    while (1) {
+        seg = reader->seg;
+        next = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE);
+        len = __atomic_load_n(&seg->len, __ATOMIC_ACQUIRE);
+        if (reader->off < len) {
+            *buf = seg->data + reader->off;
+            reader->off = len;
+            return len - (*buf - seg->data);
+        }
+        if (next == NULL)
+            return 0;
+        __atomic_add_fetch(&next->refcnt, 1, __ATOMIC_RELAXED);
+        reader->seg = next;
+        reader->off = 0;
+        seg_put(seg);
+    }
+}
+
+/*
+ * charge - Charge a listed object to its shard, and put it in the ring
+ * just behind the hand, so that it is the last the hand comes to.
+ * The caller must hold the shard's write lock.
+ */
+static void charge(shard_t *shard, cache_obj_t *obj, long size)
+{
+    obj->charged = size;
+    shard->bytes += size;
+    obj->referenced = 0;
+    if (shard->hand == NULL) {
+        obj->ring_prev = obj->ring_next = obj;
+        shard->hand = obj;
+        return;
+    }
+    obj->ring_next = shard->hand;
+    obj->ring_prev = shard->hand->ring_prev;
+    obj->ring_prev->ring_next = obj;
+    shard->hand->ring_prev = obj;
+}
+
+/*
+ * unlist - Take an object out of the index, uncharge it and let go of
+ * the index's references.  The caller must hold the shard's write lock.
+ */
+static void unlist(shard_t *shard, cache_obj_t *obj)
+{
+    cache_obj_t **link;
+
+    if (!obj->listed)
+        return;
+    for (link = bucket(shard, obj->hash); *link != obj; link = &(*link)->next)
+        ;
+    *link = obj->next;
+    obj->listed = 0;
+    if (obj->charged > 0) {
+        /* Only kept objects are in the ring */
+        if (obj->ring_next == obj)
+            shard->hand = NULL;
+        else {
+            obj->ring_prev->ring_next = obj->ring_next;
+            obj->ring_next->ring_prev = obj->ring_prev;
+            if (shard->hand == obj)
+                shard->hand = obj->ring_next;
+        }
+    }
+    shard->bytes -= obj->charged;
+    obj->charged = 0;
+    seg_put(obj->first);
+    obj->first = NULL;
+    obj_put(obj);
+}
+
+/*
+ * make_room - Evict the objects the clock picks until "size" more
+ * bytes fit in a shard, if the admission filter lets the object that
+ * needs them, whose key's hash is "hash", displace the first of them.
+ * Returns 0 if the object is not to be kept.  The caller must hold the
+ * shard's write lock.
+ */
+static int make_room(shard_t *shard, unsigned int hash, long size)
+{
+    cache_obj_t *victim;
+    int first = 1;
+
+    while (shard->bytes + size > shard_capacity) {
+        if ((victim = clock_victim(shard)) == NULL)
+            return 0;
+        if (first  &&  !admit_allow(hash, victim->hash)) {
+            stats_add(STAT_CACHE_REJECTS, 1);
+            return 0;
+        }
+        first = 0;
+        unlist(shard, victim);
+    }
+    return 1;
+}
+
+/*
+ * clock_victim - Move the hand on past the kept objects of a shard
+ * that were hit since it last passed them, clearing their bits, and
+ * return the first that wasn't, or NULL if the shard keeps nothing.
+ * The hand is left on the object after it.  The caller must hold the
+ * shard's write lock.
+ */
+static cache_obj_t *clock_victim(shard_t *shard)
+{
+    cache_obj_t *obj;
+
+    while ((obj = shard->hand) != NULL) {
+        shard->hand = obj->ring_next;
+        if (!obj->referenced)
+            return obj;
+        obj->referenced = 0;
+    }
+    return NULL;
+}
+
+/*
+ * hash_key - FNV-1a hash of a key.
+ */
+static unsigned int hash_key(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*key != '\0') {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * stale - Is a complete object past its freshness lifetime?  One still
+ * filling has none yet.
+ */
+static int stale(cache_obj_t *obj)
+{
+    return __atomic_load_n(&obj->state, __ATOMIC_ACQUIRE) == DONE
+      &&  obj->expires <= time(NULL);
+}
+
+/*
+ * check_header - Decide from the "len" bytes of a response header, up
+ * to its blank line, whether the response may be kept and served to
+ * other clients.  It may be shared at all only if its origin didn't
+ * forbid shared caching with "Cache-Control: no-store" or "private",
+ * and it doesn't vary with the request, except with the
+ * Accept-Encoding a CACHE_REQ_ENCODING key stands for; and if the
+ * request was CACHE_REQ_AUTHORIZED, only if the origin allowed it with
+ * "public", "s-maxage" or "must-revalidate".  It may be kept only if
+ * it is also a "200" response with a Content-Length, so a copy can be
+ * sent on a connection that stays open.  Returns 1 if it may be kept,
+ * 0 if it may only be shared, and -1 if not even that.  Sets *length
+ * to the Content-Length, or -1, and adds CACHE_HEAD_CHUNKED to *flags
+ * if the body is chunked.  The header must be followed by at least one
+ * more byte.
+ */
+static int check_header(const char *data, long len, int req_flags,
+  long *length, int *flags)
+{
+    const char *end = data + len;
+    const char *line;
+    const char *eol;
+    const char *value;
+    const char *last;
+    http_span_t cc;
+    int shared = 0;
+    int unshared = 0;
+    int ok;
+
+    ok = len >= 12  &&  strncmp(data, "HTTP/1.", 7) == 0
+      &&  strncmp(data + 8, " 200", 4) == 0;
+    *length = -1;
+    for (line = data; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            if (memmem(line, eol - line, "chunked", 7) != NULL)
+                *flags |= CACHE_HEAD_CHUNKED;
+            ok = 0;
+        }
+        else if (strncasecmp(line, "Content-Length:", 15) == 0)
+            *length = strtol(line + 15, NULL, 10);
+        else if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+            last = eol;
+            while (last > line + 14  &&  isspace((unsigned char)last[-1]))
+                last--;
+            cc.off = line + 14 - data;
+            cc.len = last - (line + 14);
+            if (http_list_find(data, cc, "no-store") >= 0
+              ||  http_list_find(data, cc, "private") >= 0)
+                unshared = 1;
+            if (http_list_find(data, cc, "public") >= 0
+              ||  http_list_find(data, cc, "s-maxage") >= 0
+              ||  http_list_find(data, cc, "must-revalidate") >= 0)
+                shared = 1;
+        }
+        else if (strncasecmp(line, "Vary:", 5) == 0) {
+            value = line + 5;
+            last = eol;
+            while (value < last  &&  isspace((unsigned char)*value))
+                value++;
+            while (last > value  &&  isspace((unsigned char)last[-1]))
+                last--;
+            if (last > value  &&  !((req_flags & CACHE_REQ_ENCODING)
+              &&  last - value == 15
+              &&  strncasecmp(value, "Accept-Encoding", 15) == 0))
+                unshared = 1;
+        }
+    }
+    if (unshared  ||  ((req_flags & CACHE_REQ_AUTHORIZED)  &&  !shared))
+        return -1;
+    return ok  &&  *length >= 0;
+}
+
+/*
+ * cacheable - Decide whether a complete response may be kept; see
+ * check_header.  The data must hold all of the body.
+ *
+ * If the response is cacheable, its hop-by-hop headers are removed in
+ * place, *size is updated, and the offset of the blank line ending the
+ * header is returned.  Otherwise returns -1.
+ */
+static int cacheable(char *data, int *size, int req_flags)
+{
+    char *end;
+    char *line;
+    char *eol;
+    char *out;
+    long length;
+    int flags = 0;
+    int head_len;
+
+    if ((end = memmem(data, *size, "\r\n\r\n", 4)) == NULL)
+        return -1;
+    end += 2;
+    if (check_header(data, end - data, req_flags, &length, &flags) <= 0
+      ||  end + 2 - data + length != *size)
+        return -1;
+
+    /* Squeeze out the hop-by-hop headers */
+    out = data;
+    for (line = data; line < end; line = eol + 2) {
+        eol = memmem(line, end - line, "\r\n", 2);
+        if (strncasecmp(line, "Connection:", 11) == 0
+          ||  strncasecmp(line, "Keep-Alive:", 11) == 0
+          ||  strncasecmp(line, "Proxy-Connection:", 17) == 0)
+            continue;
+        memmove(out, line, eol + 2 - line);
+        out += eol + 2 - line;
+    }
+    head_len = out - data;
+    memmove(out, end, data + *size - end);
+    *size -= end - out;
+    return head_len;
+}
+
+/*
+ * seg_new - Allocate an empty segment with room for "size" bytes.
+ */
+static cache_seg_t *seg_new(int size, int refcnt)
+{
+    cache_seg_t *seg = Malloc(sizeof(cache_seg_t) + size);
+
+    seg->next = NULL;
+    seg->len = 0;
+    seg->size = size;
+    seg->refcnt = refcnt;
+    return seg;
+}
+
+/*
+ * seg_put - Drop a reference on a segment, freeing it and, in turn,
+ * any segments after it that nothing else refers to.
+ */
+static void seg_put(cache_seg_t *seg)
+{
+    cache_seg_t *next;
+
+    while (seg != NULL
+      &&  __atomic_sub_fetch(&seg->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        next = seg->next;
+        Free(seg);
+        seg = next;
+    }
+}
+
+/*
+ * obj_put - Drop one reference to an object, freeing it with the last.
+ * By then the index and the writer have let go of its segments.
+ */
+static void obj_put(cache_obj_t *obj)
+{
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&obj->lock);
+        pthread_cond_destroy(&obj->grew);
+        Free(obj->key);
+        Free(obj);
+    }
+}
@@ -0,0 +1,221 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include "diskcache.h"
+
+/*
+ * Shared in-memory store of responses to GET requests, readable while
+ * they are still being downloaded.
+ *
+ * An object's bytes live in an append-only list of segments.  When a
+ * request misses, the thread serving it creates an object in the
+ * "filling" state and appends the response to it as it relays it.
+ * Requests for the same URL that arrive meanwhile, and that the
+ * writer's response can answer too (see cache_open), attach to the
+ * object as readers and follow the writer's progress through the
+ * segments, so they get their first bytes as soon as the writer does
+ * (and the origin is asked only once); requests that arrive later find
+ * the complete object.  Readers never copy: each call to cache_read
+ * hands back a run of bytes inside a segment, which the reader can
+ * write straight to its client.
+ *
+ * When the response header is complete, the cache decides whether the
+ * object is to be kept: only "200" responses framed by a Content-Length
+ * that fits in the cache, and that may be shared (see check_header in
+ * cache.c), are.  A kept object is charged to its shard right away,
+ * since its final size is known, and becomes a complete entry when the
+ * last byte is appended; it is discarded if the response is cut short.
+ * An object that is not kept leaves the index, so no new readers find
+ * it, but is still delivered to the readers already attached, unless
+ * it may not be shared at all; then they are told to fetch it for
+ * themselves.  A response that would be kept but for its size is
+ * copied to the disk tier instead, if there is one (see diskcache.h).
+ *
+ * A complete object is only served while it is fresh (see fresh.h).
+ * A request that finds it stale gets to revalidate it: cache_open puts
+ * a new object in its place, for the request to fill and for later
+ * requests to follow, and hands the request the stale one as well, so
+ * that it can ask the origin whether the stale copy still holds and,
+ * if it does, fill the new object from it.
+ *
+ * The cache is split into CACHE_SHARDS independent shards, picked by
+ * hashing the key, each protected by its own reader-writer lock and
+ * with an equal slice of the total byte budget.  A hit only takes the
+ * read lock long enough to find the object and take a reference on
+ * it.  Reading a complete object takes no lock at all; only readers
+ * keeping up with a writer wait on the object's own mutex.  A shard
+ * evicts objects not used lately when a new one won't fit, picking
+ * them with the CLOCK approximation of least recently used, but only
+ * if the admission filter (see admit.h) finds the new one more
+ * popular than the first it would evict; if not, the new one is
+ * treated as one the cache doesn't keep.
+ *
+ * Segments are reference counted, and an object that has left the
+ * index, by eviction or because it wasn't kept, frees each segment as
+ * soon as its last reader has moved past it.
+ */
+
+/* Default budgets, as suggested by the CS:APP proxy lab */
+#define MAX_CACHE_SIZE  1049000
+#define MAX_OBJECT_SIZE 102400
+
+#define CACHE_SHARDS    16
+#define CACHE_SEGMENT   16384   /* Bytes of response per segment */
+#define CACHE_MEAN_OBJECT 8192  /* Object size the index and filter are sized for */
+
+/* Flags describing a response header; see cache_wait_header */
+#define CACHE_HEAD_CLOSE    1   /* Says "Connection: close" */
+#define CACHE_HEAD_CHUNKED  2   /* Body has chunked transfer coding */
+
+/*
+ * Flags describing the request a response is stored for; see
+ * cache_open.  A response to a request with credentials is only shared
+ * if it says it may be, and one that varies with request headers only
+ * if it varies with nothing but Accept-Encoding and the key was made
+ * for one Accept-Encoding (a compressed variant's is).
+ */
+#define CACHE_REQ_AUTHORIZED 1  /* Request had an Authorization field */
+#define CACHE_REQ_ENCODING   2  /* Key stands for its Accept-Encoding */
+
+typedef struct cache_seg {
+    struct cache_seg *next;   /* Next segment, set once this one is full */
+    int len;                  /* Bytes of data filled so far */
+    int size;                 /* Bytes of data allocated */
+    int refcnt;
+    char data[];
+} cache_seg_t;
+
+typedef struct cache_obj {
+    struct cache_obj *next;   /* Next object in the same hash bucket */
+    char *key;                /* Normalized URL; see cache_key */
+    unsigned int hash;        /* Hash of key */
+    int listed;               /* Still in the index? */
+    long charged;             /* Bytes charged to the shard, if kept */
+    long size;                /* Bytes appended so far */
+    long head_len;            /* Offset of the blank line ending the header, or -1 */
+    int head_flags;           /* CACHE_HEAD_* */
+    int req_flags;            /* CACHE_REQ_* of the writer's request */
+    int unshared;             /* Header forbids giving it to readers? */
+    time_t expires;           /* When it goes stale, once the header is in */
+    int state;                /* Filling, or how it ended */
+    cache_seg_t *first;       /* First segment, while listed */
+    cache_seg_t *tail;        /* Segment being filled */
+    disk_fill_t *disk;        /* Copy going to the disk tier, or NULL */
+    int disk_only;            /* Nobody else wants the rest? */
+    int readers;
+    pthread_mutex_t lock;     /* Guards the fill in progress */
+    pthread_cond_t grew;      /* More bytes, the header, or the end */
+    struct cache_obj *ring_prev; /* Shard's ring of kept objects */
+    struct cache_obj *ring_next;
+    int referenced;           /* Hit since the clock hand last passed it? */
+    int refcnt;               /* Index, writer and readers */
+} cache_obj_t;
+
+/* A reader's position in an object */
+typedef struct {
+    cache_obj_t *obj;
+    cache_seg_t *seg;         /* Segment being read */
+    int off;                  /* Bytes of it already read */
+} cache_reader_t;
+
+/*
+ * Set up an empty cache holding at most "max_cache" bytes in all, none
+ * of them in objects larger than "max_object".  Must be called once
+ * before any other cache function.
+ */
+extern void cache_init(size_t max_cache, size_t max_object);
+
+/* The largest response the cache will keep */
+extern size_t cache_max_object(void);
+
+/*
+ * Build the cache key for a URL from its host, port and path (the
+ * part after the path's leading '/'; see httpparse.h):
+ * "host:port/path" with the host name in lower case, so equivalent
+ * spellings of the same URL share one entry.  Returns -1 if the key
+ * wouldn't fit in "size" bytes.
+ */
+extern int cache_key(char *key, size_t size, char *hostname, int port,
+  char *pathname);
+
+/*
+ * Look up "key".  If the index has an object for it, still filling or
+ * complete and fresh, attach "reader" to it, at its first byte, and
+ * return NULL.  Otherwise create an object and return it: the caller
+ * is its writer, and must append the response with cache_append and
+ * end with cache_finish.  "req_flags" describes the request with
+ * CACHE_REQ_* flags, for cache_header to judge the response by.  If
+ * the object found was stale, "reader" is attached to it, for the
+ * writer to revalidate; if not, reader->obj is NULL.
+ *
+ * A request only follows an object whose header is still to be judged
+ * if it has the same flags as the writer's and neither has
+ * CACHE_REQ_AUTHORIZED.  Otherwise NULL is returned with reader->obj
+ * NULL, and the caller must fetch the response for itself, without
+ * caching it.
+ */
+extern cache_obj_t *cache_open(const char *key, int req_flags,
+  cache_reader_t *reader);
+
+/*
+ * Look up "key" and, only if a complete, fresh object is found, attach
+ * "reader" to it and return 0; cache_read then never waits.  Returns
+ * -1 otherwise.
+ */
+extern int cache_lookup(const char *key, cache_reader_t *reader);
+
+/* Writer: add the next "n" bytes of the response */
+extern void cache_append(cache_obj_t *obj, const char *buf, int n);
+
+/*
+ * Writer: the response header has been appended, with its final blank
+ * line at offset "head_len"; "closing" is nonzero if it says
+ * "Connection: close".  Decides whether to keep the object, or to
+ * store it on disk.  Returns zero if nobody needs the rest of the
+ * response, in which case the writer should cache_finish the object
+ * and stop appending.
+ */
+extern int cache_header(cache_obj_t *obj, long head_len, int closing);
+
+/*
+ * Writer: the response is over.  "persist" is zero if it was cut short
+ * or ended by the origin closing the connection; then client
+ * connections following it must be closed, and the object is not
+ * kept.  The writer must not use the object afterwards.
+ */
+extern void cache_finish(cache_obj_t *obj, int persist);
+
+/*
+ * Reader: wait for the response header.  Returns the offset of its
+ * final blank line, with *flags set to its CACHE_HEAD_* flags, or -1
+ * if the response ended without one or may not be shared; then the
+ * reader must fetch the response for itself.
+ */
+extern long cache_wait_header(cache_reader_t *reader, int *flags);
+
+/*
+ * Reader: wait for bytes not yet read.  Returns how many there are,
+ * pointing *buf at them; they stay valid until the next call.  At the
+ * end of the response, returns 0 if the client connection may stay
+ * open and -1 if it must be closed.
+ */
+extern int cache_read(cache_reader_t *reader, char **buf);
+
+/* Reader: detach from the object */
+extern void cache_close(cache_reader_t *reader);
+
+/*
+ * Store a complete response of "size" bytes in one go, for a request
+ * described by "req_flags" as in cache_open.  "data" must be
+ * malloc'ed; the cache frees it either way.  Hop-by-hop headers are
+ * removed from the stored copy, so it can be sent on any client
+ * connection.  A stale object already stored under "key" is
+ * replaced.  Returns 0 if the object was stored.
+ */
+extern int cache_insert(const char *key, char *data, int size,
+  int req_flags);
+
+#endif /* _CACHE_H */
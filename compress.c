@@ -0,0 +1,659 @@
+/*
+ * compress.c - gzip and brotli compression of responses on a small
+ * pool of threads
+ *
+ * See compress.h for the interface.  A stream has two input blocks
+ * and two output buffers, used in pairs.  While the relaying thread
+ * fills one input block, a compression thread may be working on the
+ * other; when the block being filled is full, the relaying thread
+ * waits for the other to be done, hands over the full one, sends on
+ * the output of the one just done, and starts filling that one's
+ * input block again.  So the relaying thread waits only when it gets
+ * a whole block ahead of the compressor, and each block's output is
+ * sent in order, by the thread that owns the client.
+ *
+ * The threads take work from two queues under one lock: blocks of
+ * streams in progress, which a client is waiting on and so always go
+ * first, and variants to be made for the cache, which nobody waits on.
+ */
+
+#define _GNU_SOURCE
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "csapp.h"
+#include "compress.h"
+#include "cache.h"
+
+/* Something for a compression thread to do */
+typedef struct job {
+    struct job *next;
+    void (*run)(struct job *job);
+} job_t;
+
+struct compress_stream {
+    job_t job;                  /* Must come first; the block in the pool */
+    compress_enc_t enc;
+    z_stream z;
+    BrotliEncoderState *br;
+    compress_out_t out;
+    void *arg;
+    char *in[2];                /* Input blocks */
+    char *outbuf[2];            /* Output of each block */
+    int out_len[2];
+    int out_size[2];
+    int fill;                   /* Input block being filled */
+    int in_len;                 /* Bytes in it */
+    int job_block;              /* Block handed to the pool */
+    int job_len;                /* Bytes in it */
+    int job_finish;             /* Is it the last? */
+    int busy;                   /* Is the pool still working on it? */
+    int pending;                /* Block whose output is still to send, or -1 */
+    int error;                  /* Did the encoder fail? */
+    int gave_up;                /* Did "out" give up? */
+    pthread_cond_t done;        /* The pool has finished a block */
+};
+
+/* A variant to be made for the cache */
+typedef struct {
+    job_t job;                  /* Must come first */
+    char *key;                  /* The original's key */
+    compress_enc_t enc;
+} variant_t;
+
+static int enabled;
+static int level = COMPRESS_LEVEL;
+static long min_size = COMPRESS_MIN_SIZE;
+static int open_streams;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static job_t *blocks_head, *blocks_tail;
+static job_t *variants_head, *variants_tail;
+static int nvariants;
+
+static void *compress_thread(void *vargp);
+static compress_stream_t *stream_new(compress_enc_t enc);
+static void stream_free(compress_stream_t *s);
+static int encode(compress_stream_t *s, int i, const char *buf, int n,
+  int finish);
+static void grow(compress_stream_t *s, int i);
+static int hand_over(compress_stream_t *s, int finish);
+static int wait_block(compress_stream_t *s);
+static int send_block(compress_stream_t *s, int i);
+static void run_block(job_t *job);
+static void run_variant(job_t *job);
+static void make_variant(variant_t *v, cache_reader_t *reader);
+static int text_type(const char *buf, http_span_t type);
+static int put(char **p, char *end, const char *buf, int n);
+
+/*
+ * compress_init - Set the level and threshold, and start the threads.
+ */
+void compress_init(int lvl, long min)
+{
+    pthread_t tid;
+    int i;
+
+    level = lvl < 1 ? 1 : lvl > 9 ? 9 : lvl;
+    min_size = min > 0 ? min : 0;
+    for (i = 0; i < COMPRESS_THREADS; i++)
+        Pthread_create(&tid, NULL, compress_thread, NULL);
+    enabled = 1;
+}
+
+/*
+ * compress_enabled - Has compress_init been called?
+ */
+int compress_enabled(void)
+{
+    return enabled;
+}
+
+/*
+ * compress_accepted - Weigh the codings in an Accept-Encoding value.
+ * A coding not listed gets the weight of "*", if that is; a weight of
+ * 0 rules it out.
+ */
+compress_enc_t compress_accepted(const char *buf, http_span_t value)
+{
+    const char *p = buf + value.off;
+    const char *end = p + value.len;
+    const char *name, *name_end, *q;
+    double gzip = -1, br = -1, any = -1, weight;
+    char num[16];
+    int len;
+
+    while (p < end) {
+        while (p < end  &&  (*p == ' '  ||  *p == '\t'  ||  *p == ','))
+            p++;
+        name = p;
+        while (p < end  &&  *p != ','  &&  *p != ';'  &&  *p != ' '
+          &&  *p != '\t')
+            p++;
+        name_end = p;
+        weight = 1;
+        while (p < end  &&  *p != ',') {
+            /* Parameters; only q matters */
+            if (*p == ';') {
+                for (q = p + 1; q < end  &&  (*q == ' '  ||  *q == '\t'); q++)
+                    ;
+                if (end - q > 2  &&  (*q == 'q'  ||  *q == 'Q')  &&  q[1] == '=') {
+                    q += 2;
+                    for (len = 0; q + len < end  &&  len < sizeof(num) - 1
+                      &&  q[len] != ','  &&  q[len] != ';'; len++)
+                        num[len] = q[len];
+                    num[len] = '\0';
+                    weight = strtod(num, NULL);
+                }
+            }
+            p++;
+        }
+
+        len = name_end - name;
+        if ((len == 4  &&  strncasecmp(name, "gzip", 4) == 0)
+          ||  (len == 6  &&  strncasecmp(name, "x-gzip", 6) == 0))
+            gzip = weight;
+        else if (len == 2  &&  strncasecmp(name, "br", 2) == 0)
+            br = weight;
+        else if (len == 1  &&  *name == '*')
+            any = weight;
+    }
+
+    if (gzip < 0)
+        gzip = any;
+    if (br < 0)
+        br = any;
+    if (br > 0  &&  br >= gzip)
+        return COMPRESS_BR;
+    if (gzip > 0)
+        return COMPRESS_GZIP;
+    return COMPRESS_NONE;
+}
+
+/*
+ * compress_name - The coding's token.
+ */
+const char *compress_name(compress_enc_t enc)
+{
+    switch (enc) {
+    case COMPRESS_GZIP:
+        return "gzip";
+    case COMPRESS_BR:
+        return "br";
+    default:
+        return "identity";
+    }
+}
+
+/*
+ * compress_variant_key - The original's key and the coding's name;
+ * keys never contain spaces, so this can't clash with another key.
+ */
+int compress_variant_key(char *dst, int size, const char *key,
+  compress_enc_t enc)
+{
+    int n = snprintf(dst, size, "%s %s", key, compress_name(enc));
+
+    return n < 0  ||  n >= size ? -1 : 0;
+}
+
+/*
+ * compress_header - Check the response, then copy its header with the
+ * changes the coding calls for.  The ETag is weakened because the
+ * compressed body isn't byte-for-byte the one it names.
+ */
+int compress_header(const char *head, int len, compress_enc_t enc,
+  long length, char *out, int size, long *body_len)
+{
+    http_response_t resp;
+    const http_header_t *h;
+    const char *eol;
+    char *p = out;
+    char *end = out + size;
+    char line[64];
+    int i, n;
+
+    http_response_init(&resp);
+    if (enc == COMPRESS_NONE  ||  http_parse_response(head, len, &resp) != len
+      ||  resp.status != 200)
+        return -1;
+    if ((h = http_find_response_header(head, &resp, "Content-Length")) == NULL
+      ||  (*body_len = strtol(head + h->value.off, NULL, 10)) < min_size)
+        return -1;
+    if (http_find_response_header(head, &resp, "Content-Encoding") != NULL
+      ||  http_find_response_header(head, &resp, "Transfer-Encoding") != NULL
+      ||  http_find_response_header(head, &resp, "Content-Range") != NULL)
+        return -1;
+    if ((h = http_find_response_header(head, &resp, "Cache-Control")) != NULL
+      &&  http_list_find(head, h->value, "no-transform") >= 0)
+        return -1;
+    if ((h = http_find_response_header(head, &resp, "Content-Type")) == NULL
+      ||  !text_type(head, h->value))
+        return -1;
+
+    /* The status line as it was, then the fields */
+    eol = memchr(head, '\n', len);
+    if (put(&p, end, head, eol + 1 - head) < 0)
+        return -1;
+    for (i = 0; i < resp.nheaders; i++) {
+        h = &resp.headers[i];
+        if (http_span_equals(head, h->name, "Content-Length")
+          ||  http_span_equals(head, h->name, "Accept-Ranges"))
+            continue;
+        if (put(&p, end, head + h->name.off, h->name.len) < 0
+          ||  put(&p, end, ": ", 2) < 0)
+            return -1;
+        if (http_span_equals(head, h->name, "ETag")
+          &&  strncmp(head + h->value.off, "W/", 2) != 0
+          &&  put(&p, end, "W/", 2) < 0)
+            return -1;
+        if (put(&p, end, head + h->value.off, h->value.len) < 0
+          ||  put(&p, end, "\r\n", 2) < 0)
+            return -1;
+    }
+
+    n = snprintf(line, sizeof(line), "Content-Encoding: %s\r\n",
+      compress_name(enc));
+    if (put(&p, end, line, n) < 0
+      ||  put(&p, end, "Vary: Accept-Encoding\r\n", 23) < 0)
+        return -1;
+    if (length >= 0)
+        n = snprintf(line, sizeof(line), "Content-Length: %ld\r\n", length);
+    else if (length == COMPRESS_CHUNKED)
+        n = snprintf(line, sizeof(line), "Transfer-Encoding: chunked\r\n");
+    else
+        n = 0;
+    if (put(&p, end, line, n) < 0  ||  put(&p, end, "\r\n", 2) < 0)
+        return -1;
+    return p - out;
+}
+
+/*
+ * compress_open - Set up a stream, unless too many are open.
+ */
+compress_stream_t *compress_open(compress_enc_t enc, compress_out_t out,
+  void *arg)
+{
+    compress_stream_t *s;
+
+    if (__sync_add_and_fetch(&open_streams, 1) > COMPRESS_STREAMS) {
+        __sync_sub_and_fetch(&open_streams, 1);
+        return NULL;
+    }
+    s = stream_new(enc);
+    s->out = out;
+    s->arg = arg;
+    s->in[0] = Malloc(COMPRESS_BLOCK);
+    s->in[1] = Malloc(COMPRESS_BLOCK);
+    s->job.run = run_block;
+    pthread_cond_init(&s->done, NULL);
+    return s;
+}
+
+/*
+ * compress_write - Fill the current block, handing it over when full.
+ */
+int compress_write(compress_stream_t *s, const char *buf, int n)
+{
+    int m;
+
+    while (n > 0) {
+        if (s->gave_up)
+            return -1;
+        m = COMPRESS_BLOCK - s->in_len;
+        if (m > n)
+            m = n;
+        memcpy(s->in[s->fill] + s->in_len, buf, m);
+        s->in_len += m;
+        buf += m;
+        n -= m;
+        if (s->in_len == COMPRESS_BLOCK  &&  hand_over(s, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * compress_close - Hand over the last block, however short, and send
+ * the output of both blocks still outstanding.
+ */
+int compress_close(compress_stream_t *s)
+{
+    int rc = -1;
+
+    if (!s->gave_up  &&  !s->error  &&  hand_over(s, 1) == 0
+      &&  send_block(s, wait_block(s)) == 0)
+        rc = 0;
+    else
+        wait_block(s);
+    pthread_cond_destroy(&s->done);
+    Free(s->in[0]);
+    Free(s->in[1]);
+    stream_free(s);
+    __sync_sub_and_fetch(&open_streams, 1);
+    return rc;
+}
+
+/*
+ * compress_variant - Queue a variant, unless it's queued already.
+ */
+void compress_variant(const char *key, compress_enc_t enc)
+{
+    variant_t *v;
+    job_t *job;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!enabled  ||  nvariants >= COMPRESS_QUEUE) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    for (job = variants_head; job != NULL; job = job->next) {
+        v = (variant_t *)job;
+        if (v->enc == enc  &&  strcmp(v->key, key) == 0) {
+            pthread_mutex_unlock(&queue_lock);
+            return;
+        }
+    }
+    v = Malloc(sizeof(variant_t));
+    v->job.next = NULL;
+    v->job.run = run_variant;
+    v->key = strdup(key);
+    v->enc = enc;
+    if (variants_tail != NULL)
+        variants_tail->next = &v->job;
+    else
+        variants_head = &v->job;
+    variants_tail = &v->job;
+    nvariants++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * compress_thread - Thread routine: run jobs, blocks before variants.
+ */
+static void *compress_thread(void *vargp)
+{
+    job_t *job;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (blocks_head == NULL  &&  variants_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if ((job = blocks_head) != NULL) {
+            if ((blocks_head = job->next) == NULL)
+                blocks_tail = NULL;
+        }
+        else {
+            job = variants_head;
+            if ((variants_head = job->next) == NULL)
+                variants_tail = NULL;
+            nvariants--;
+        }
+        pthread_mutex_unlock(&queue_lock);
+        job->run(job);
+    }
+    return NULL;
+}
+
+/*
+ * stream_new - Set up an encoder, with no buffers yet.
+ */
+static compress_stream_t *stream_new(compress_enc_t enc)
+{
+    compress_stream_t *s = Calloc(1, sizeof(compress_stream_t));
+
+    s->enc = enc;
+    s->pending = -1;
+    if (enc == COMPRESS_GZIP) {
+        /* 16 more window bits ask for a gzip wrapper */
+        if (deflateInit2(&s->z, level, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+            app_error("stream_new: deflateInit2 failed");
+    }
+    else {
+        if ((s->br = BrotliEncoderCreateInstance(NULL, NULL, NULL)) == NULL)
+            app_error("stream_new: BrotliEncoderCreateInstance failed");
+        BrotliEncoderSetParameter(s->br, BROTLI_PARAM_QUALITY, level);
+        BrotliEncoderSetParameter(s->br, BROTLI_PARAM_MODE,
+          BROTLI_MODE_TEXT);
+    }
+    return s;
+}
+
+/*
+ * stream_free - Release the encoder and the output buffers.
+ */
+static void stream_free(compress_stream_t *s)
+{
+    if (s->enc == COMPRESS_GZIP)
+        deflateEnd(&s->z);
+    else
+        BrotliEncoderDestroyInstance(s->br);
+    Free(s->outbuf[0]);
+    Free(s->outbuf[1]);
+    Free(s);
+}
+
+/*
+ * encode - Compress "n" bytes into output buffer "i", replacing what
+ * it held, and end the stream if "finish" is set.  Returns -1 if the
+ * encoder fails.
+ */
+static int encode(compress_stream_t *s, int i, const char *buf, int n,
+  int finish)
+{
+    const uint8_t *next_in = (const uint8_t *)buf;
+    uint8_t *next_out;
+    size_t avail_in = n;
+    size_t avail_out;
+    int rc;
+
+    s->out_len[i] = 0;
+    if (s->enc == COMPRESS_GZIP) {
+        s->z.next_in = (Bytef *)buf;
+        s->z.avail_in = n;
+        do {
+            if (s->out_len[i] == s->out_size[i])
+                grow(s, i);
+            s->z.next_out = (Bytef *)s->outbuf[i] + s->out_len[i];
+            s->z.avail_out = s->out_size[i] - s->out_len[i];
+            rc = deflate(&s->z, finish ? Z_FINISH : Z_NO_FLUSH);
+            if (rc == Z_STREAM_ERROR)
+                return -1;
+            s->out_len[i] = s->out_size[i] - s->z.avail_out;
+        } while (s->z.avail_out == 0  ||  (finish  &&  rc != Z_STREAM_END));
+        return 0;
+    }
+
+    do {
+        if (s->out_len[i] == s->out_size[i])
+            grow(s, i);
+        next_out = (uint8_t *)s->outbuf[i] + s->out_len[i];
+        avail_out = s->out_size[i] - s->out_len[i];
+        if (!BrotliEncoderCompressStream(s->br, finish
+            ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+            &avail_in, &next_in, &avail_out, &next_out, NULL))
+            return -1;
+        s->out_len[i] = (char *)next_out - s->outbuf[i];
+    } while (avail_in > 0  ||  BrotliEncoderHasMoreOutput(s->br)
+      ||  (finish  &&  !BrotliEncoderIsFinished(s->br)));
+    return 0;
+}
+
+/*
+ * grow - Make room for more output in buffer "i".
+ */
+static void grow(compress_stream_t *s, int i)
+{
+    s->out_size[i] = s->out_size[i] > 0 ? 2 * s->out_size[i] : COMPRESS_BLOCK / 2;
+    s->outbuf[i] = Realloc(s->outbuf[i], s->out_size[i]);
+}
+
+/*
+ * hand_over - Give the block being filled to the pool, once it is done
+ * with the other, then send the other's output and fill it next.
+ */
+static int hand_over(compress_stream_t *s, int finish)
+{
+    int prev = wait_block(s);
+
+    s->job_block = s->fill;
+    s->job_len = s->in_len;
+    s->job_finish = finish;
+    s->job.next = NULL;
+    s->busy = 1;
+    s->pending = s->fill;
+    pthread_mutex_lock(&queue_lock);
+    if (blocks_tail != NULL)
+        blocks_tail->next = &s->job;
+    else
+        blocks_head = &s->job;
+    blocks_tail = &s->job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    s->fill = 1 - s->fill;
+    s->in_len = 0;
+    return send_block(s, prev);
+}
+
+/*
+ * wait_block - Wait for the pool to finish the block it has, if any.
+ * Returns the block whose output is waiting to be sent, or -1.
+ */
+static int wait_block(compress_stream_t *s)
+{
+    int i;
+
+    pthread_mutex_lock(&queue_lock);
+    while (s->busy)
+        pthread_cond_wait(&s->done, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+    i = s->pending;
+    s->pending = -1;
+    return i;
+}
+
+/*
+ * send_block - Pass block "i"'s output to "out"; -1 means none.
+ */
+static int send_block(compress_stream_t *s, int i)
+{
+    if (s->error  ||  s->gave_up)
+        return -1;
+    if (i >= 0  &&  s->out_len[i] > 0
+      &&  s->out(s->arg, s->outbuf[i], s->out_len[i]) < 0)
+        s->gave_up = 1;
+    return s->gave_up ? -1 : 0;
+}
+
+/*
+ * run_block - Job: compress the block handed over.
+ */
+static void run_block(job_t *job)
+{
+    compress_stream_t *s = (compress_stream_t *)job;
+    int i = s->job_block;
+
+    if (encode(s, i, s->in[i], s->job_len, s->job_finish) < 0)
+        s->error = 1;
+    pthread_mutex_lock(&queue_lock);
+    s->busy = 0;
+    pthread_cond_signal(&s->done);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * run_variant - Job: make a variant, if the original is still cached.
+ */
+static void run_variant(job_t *job)
+{
+    variant_t *v = (variant_t *)job;
+    cache_reader_t reader;
+
+    if (cache_lookup(v->key, &reader) == 0) {
+        make_variant(v, &reader);
+        cache_close(&reader);
+    }
+    Free(v->key);
+    Free(v);
+}
+
+/*
+ * make_variant - Compress a complete cached response in one go, and
+ * cache the result if it came out smaller.
+ */
+static void make_variant(variant_t *v, cache_reader_t *reader)
+{
+    char key[MAXLINE];
+    char head[MAXBUF];
+    compress_stream_t *s;
+    char *data, *buf;
+    long head_len, body_len, size;
+    int flags, len, n;
+
+    if ((head_len = cache_wait_header(reader, &flags)) < 0
+      ||  compress_variant_key(key, sizeof(key), v->key, v->enc) < 0)
+        return;
+    head_len += 2;
+    size = reader->obj->size;
+    data = Malloc(size);
+    for (len = 0; len < size  &&  (n = cache_read(reader, &buf)) > 0; len += n)
+        memcpy(data + len, buf, n);
+    if (len != size  ||  head_len > size
+      ||  compress_header(data, head_len, v->enc, 0, head, sizeof(head),
+        &body_len) < 0  ||  head_len + body_len != size) {
+        Free(data);
+        return;
+    }
+
+    s = stream_new(v->enc);
+    if (encode(s, 0, data + head_len, body_len, 1) == 0
+      &&  s->out_len[0] < body_len
+      &&  (len = compress_header(data, head_len, v->enc, s->out_len[0],
+        head, sizeof(head), &body_len)) >= 0) {
+        buf = Malloc(len + s->out_len[0]);
+        memcpy(buf, head, len);
+        memcpy(buf + len, s->outbuf[0], s->out_len[0]);
+        cache_insert(key, buf, len + s->out_len[0], CACHE_REQ_ENCODING);
+    }
+    stream_free(s);
+    Free(data);
+}
+
+/*
+ * text_type - Is this a Content-Type that compresses well?  Anything
+ * textual does; images, audio, video and archives are compressed
+ * already.
+ */
+static int text_type(const char *buf, http_span_t type)
+{
+    static const char *kinds[] = {
+        "javascript", "ecmascript", "json", "xml", "svg"
+    };
+    const char *p = buf + type.off;
+    const char *end = memchr(p, ';', type.len);
+    int len = end != NULL ? end - p : type.len;
+    int i;
+
+    if (len >= 5  &&  strncasecmp(p, "text/", 5) == 0)
+        return 1;
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+        if (memmem(p, len, kinds[i], strlen(kinds[i])) != NULL)
+            return 1;
+    return 0;
+}
+
+/*
+ * put - Append "n" bytes at *p, if they fit before "end".
+ */
+static int put(char **p, char *end, const char *buf, int n)
+{
+    if (end - *p < n)
+        return -1;
+    memcpy(*p, buf, n);
+    *p += n;
+    return 0;
+}
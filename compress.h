@@ -0,0 +1,125 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include "httpparse.h"
+
+/*
+ * Transparent gzip and brotli compression of text responses.
+ *
+ * When a client says in Accept-Encoding that it takes gzip or br, and
+ * the origin sends a text response that isn't compressed already, the
+ * body can be compressed on its way to the client.  compress_header
+ * decides from the response header whether that is worth doing, and
+ * rewrites the header to match; a compress_stream_t then compresses
+ * the body as it arrives.
+ *
+ * The compressing itself is done by a small, fixed set of compression
+ * threads, never by the thread relaying the response.  The body is
+ * handed over a block at a time; while one block is being compressed,
+ * the relaying thread reads the next from the origin, and it gets the
+ * compressed output back to send on itself, so a compression thread
+ * never waits on a socket.  At most COMPRESS_STREAMS responses are
+ * compressed at once; beyond that compress_open refuses, and the
+ * response simply goes out as it is, rather than waiting its turn.
+ *
+ * A compressed copy of a response is kept in the cache as a variant
+ * of the original, under the key compress_variant_key makes, so that
+ * repeat requests cost no compressing at all.  Copies are made as
+ * responses are compressed on their way to a client, and, for
+ * responses served from the cache, by compress_variant in the
+ * background.
+ */
+
+#define COMPRESS_LEVEL     6        /* Default level, 1 to 9 */
+#define COMPRESS_MIN_SIZE  1024     /* Default smallest body worth compressing */
+#define COMPRESS_THREADS   2        /* Threads doing the compressing */
+#define COMPRESS_STREAMS   32       /* Most responses compressed at once */
+#define COMPRESS_QUEUE     64       /* Most variants waiting to be made */
+#define COMPRESS_BLOCK     32768    /* Bytes handed over at a time */
+
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_BR
+} compress_enc_t;
+
+/* How compress_header frames the compressed body, if not by a length */
+#define COMPRESS_CHUNKED  -1    /* Chunked transfer coding */
+#define COMPRESS_CLOSE    -2    /* Until the connection closes */
+
+/* Where a stream's compressed output goes; returns -1 to give up */
+typedef int (*compress_out_t)(void *arg, const char *buf, int n);
+
+typedef struct compress_stream compress_stream_t;
+
+/*
+ * Turn compression on at "level" (brotli's quality is the same number)
+ * for bodies of at least "min_size" bytes, and start the compression
+ * threads.  Until this is called compression stays off.
+ */
+extern void compress_init(int level, long min_size);
+
+/* Is compression on? */
+extern int compress_enabled(void);
+
+/*
+ * The encoding to use for a client that sent "value" (a span of "buf")
+ * as its Accept-Encoding: the one it rates highest, brotli on a tie,
+ * or COMPRESS_NONE.
+ */
+extern compress_enc_t compress_accepted(const char *buf, http_span_t value);
+
+/* The encoding's name, as in Content-Encoding */
+extern const char *compress_name(compress_enc_t enc);
+
+/*
+ * Make the cache key of the "enc" variant of the response cached under
+ * "key".  Returns -1 if it doesn't fit in "size" bytes.
+ */
+extern int compress_variant_key(char *dst, int size, const char *key,
+  compress_enc_t enc);
+
+/*
+ * Decide whether to compress the body of the response whose header is
+ * the "len" bytes at "head", up to and including the blank line: a 200
+ * with a Content-Length of at least the minimum size, a text content
+ * type, no Content-Encoding and no "Cache-Control: no-transform".  If
+ * so, write the header for the body compressed with "enc" into "out":
+ * without Content-Length and Accept-Ranges, with a weak ETag, with
+ * Content-Encoding and "Vary: Accept-Encoding" added, and framed by
+ * "length" (a byte count, COMPRESS_CHUNKED or COMPRESS_CLOSE).
+ * Returns its length, or -1 if the body isn't to be compressed or the
+ * header doesn't fit in "size" bytes.  "*body_len" is set to the
+ * original body's length.
+ */
+extern int compress_header(const char *head, int len, compress_enc_t enc,
+  long length, char *out, int size, long *body_len);
+
+/*
+ * Start compressing a body with "enc", passing the output to "out".
+ * Returns NULL if as many bodies as allowed are being compressed
+ * already.
+ */
+extern compress_stream_t *compress_open(compress_enc_t enc, compress_out_t out,
+  void *arg);
+
+/*
+ * Add "n" bytes of body.  Only waits, and only passes output on, when
+ * a full block is handed over.  Returns -1 once "out" has given up.
+ */
+extern int compress_write(compress_stream_t *s, const char *buf, int n);
+
+/*
+ * Finish the body, wait for the rest of the output and pass it on, and
+ * free the stream.  Returns -1 if "out" gave up along the way.
+ */
+extern int compress_close(compress_stream_t *s);
+
+/*
+ * Queue the making of the "enc" variant of the response cached under
+ * "key", unless it is queued already or too much is queued.  Never
+ * waits.  Responses that aren't worth compressing are left alone.
+ */
+extern void compress_variant(const char *key, compress_enc_t enc);
+
+#endif /* _COMPRESS_H */
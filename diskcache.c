@@ -0,0 +1,592 @@
+/*
+ * diskcache.c - Log-structured on-disk cache tier in mapped slab files
+ *
+ * See diskcache.h for the interface.  Three locks are involved:
+ *
+ *   fill_lock    the head: which slab is being filled and how far,
+ *                and moving it on, which includes reclaiming a slab;
+ *   index_lock   the digest index, the list of objects being written,
+ *                and each slab's generation;
+ *   users_lock   only for sleeping until a slab is no longer in use.
+ *
+ * Each slab counts its users: hits being sent and objects being
+ * written into it.  A slab is only overwritten after the head has
+ * moved into it, which first waits for the count to drop to zero; and
+ * nobody new can use a slab by then, since reclaiming it removed its
+ * objects from the index and set its generation to zero, which makes
+ * objects still being written into it fail to commit.
+ *
+ * The index is an open-addressing hash table of 64-bit key digests
+ * with linear probing.  An entry only says where the record is; the
+ * key stored in the record is compared on lookup, so a digest
+ * collision just costs a miss.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <sys/mman.h>
+#include "csapp.h"
+#include "diskcache.h"
+
+#define SLAB_MAGIC      0x4c534251u     /* Slab header, of this record layout */
+#define REC_PENDING     0x50524250u     /* Record being written */
+#define REC_STORED      0x53524250u     /* Complete record */
+#define REC_DEAD        0x44524250u     /* Abandoned record */
+#define REC_ALIGN       64              /* Records start on this boundary */
+
+#define INDEX_INITIAL   1024            /* Initial index slots */
+#define ENTRY_HIT       0x80000000u     /* Hit since written or moved */
+
+/* Header at the start of each slab, padded to REC_ALIGN */
+typedef struct {
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t gen;           /* Generation, counting up from 1 */
+    uint64_t size;          /* Slab size, so a changed size is noticed */
+} slab_header_t;
+
+/* Header of each record; the key and then the response follow */
+typedef struct {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t gen;           /* Generation of the slab when written */
+    uint64_t digest;
+    uint64_t size;          /* Bytes of response */
+    uint64_t head_len;
+    int64_t expires;        /* When it stops being fresh */
+} record_t;
+
+typedef struct {
+    int fd;
+    char *map;
+    uint64_t gen;           /* Current generation, or 0 if free */
+    long used;              /* Bytes filled so far */
+    int users;              /* Hits and fills in progress */
+} slab_t;
+
+typedef struct {
+    uint64_t digest;        /* 0 if the slot is empty */
+    uint32_t slab;          /* Slab number, plus ENTRY_HIT */
+    uint32_t unit;          /* Offset of the record / REC_ALIGN */
+} entry_t;
+
+struct disk_fill {
+    struct disk_fill *next; /* Next object being written */
+    uint64_t digest;
+    int slab;
+    uint64_t gen;           /* Generation of the slab at reserve time */
+    record_t *rec;
+    char *data;             /* Where the response goes */
+    long size;              /* Bytes reserved */
+    long written;           /* Bytes written, or size + 1 on overflow */
+};
+
+static slab_t *slabs;               /* NULL while disabled */
+static int nslabs;
+static long slab_size;
+static long max_object;
+static int head;                    /* Slab being filled */
+static uint64_t next_gen = 1;
+static disk_fill_t *fills;          /* Objects being written */
+
+static entry_t *table;
+static size_t table_size;           /* A power of two */
+static size_t table_count;
+
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t users_idle = PTHREAD_COND_INITIALIZER;
+
+static void open_slab(const char *dir, int n);
+static long scan_slab(int n);
+static void advance(void);
+static void start_slab(int n);
+static void reclaim(int n);
+static record_t *record_at(int slab, long off);
+static long record_span(long key_len, long size);
+static void slab_put(int n);
+static uint64_t digest_key(const char *key);
+static entry_t *index_find(uint64_t digest);
+static void index_put(uint64_t digest, int slab, long off);
+static void index_remove(entry_t *e);
+static void index_grow(void);
+
+/*
+ * disk_init - Map the slabs and rebuild the index from their headers.
+ */
+void disk_init(const char *dir, int n, size_t size)
+{
+    uint64_t newest = 0;
+    long count = 0;
+    int i;
+
+    if (n < 3)
+        app_error("disk_init: at least 3 slabs are needed");
+    if (mkdir(dir, 0755) < 0  &&  errno != EEXIST)
+        unix_error("disk_init: mkdir error");
+    nslabs = n;
+    slab_size = size;
+    max_object = slab_size - REC_ALIGN - record_span(MAXLINE, 0);
+    slabs = Calloc(nslabs, sizeof(slab_t));
+    table_size = INDEX_INITIAL;
+    table = Calloc(table_size, sizeof(entry_t));
+
+    for (i = 0; i < nslabs; i++) {
+        open_slab(dir, i);
+        count += scan_slab(i);
+        if (slabs[i].gen > newest) {
+            newest = slabs[i].gen;
+            head = i;
+        }
+    }
+    next_gen = newest + 1;
+
+    /* Keep the slab after the head free, as advance does */
+    if (slabs[head].gen == 0)
+        start_slab(head);
+    if (slabs[(head + 1) % nslabs].gen != 0)
+        reclaim((head + 1) % nslabs);
+    printf("Disk cache: %ld objects found in %d slabs\n", count, nslabs);
+}
+
+/*
+ * disk_max_object - Return the largest response worth storing.
+ */
+long disk_max_object(void)
+{
+    return slabs != NULL ? max_object : 0;
+}
+
+/*
+ * disk_lookup - Find a stored response that is still fresh, and pin
+ * its slab.  A stale one is left where it is, to be replaced by the
+ * next copy fetched.
+ */
+int disk_lookup(const char *key, disk_hit_t *hit)
+{
+    uint64_t digest;
+    entry_t *e;
+    record_t *rec;
+    int slab;
+
+    if (slabs == NULL)
+        return -1;
+    digest = digest_key(key);
+    pthread_rwlock_rdlock(&index_lock);
+    if ((e = index_find(digest)) == NULL) {
+        pthread_rwlock_unlock(&index_lock);
+        return -1;
+    }
+    slab = e->slab & ~ENTRY_HIT;
+    rec = record_at(slab, (long)e->unit * REC_ALIGN);
+    if (rec->key_len != strlen(key)
+      ||  memcmp((char *)(rec + 1), key, rec->key_len) != 0
+      ||  rec->expires <= time(NULL)) {
+        pthread_rwlock_unlock(&index_lock);
+        return -1;
+    }
+    __atomic_or_fetch(&e->slab, ENTRY_HIT, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slabs[slab].users, 1, __ATOMIC_RELAXED);
+    hit->fd = slabs[slab].fd;
+    hit->off = (char *)(rec + 1) + rec->key_len - slabs[slab].map;
+    hit->size = rec->size;
+    hit->head_len = rec->head_len;
+    hit->slab = slab;
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+}
+
+/*
+ * disk_release - Unpin the slab of a hit.
+ */
+void disk_release(disk_hit_t *hit)
+{
+    slab_put(hit->slab);
+}
+
+/*
+ * disk_reserve - Claim room at the head for a new record.
+ */
+disk_fill_t *disk_reserve(const char *key, long size, long head_len,
+                          time_t expires)
+{
+    uint64_t digest;
+    disk_fill_t *fill;
+    long key_len = strlen(key);
+    long span;
+    long off;
+
+    if (slabs == NULL  ||  size > max_object  ||  key_len >= MAXLINE)
+        return NULL;
+    digest = digest_key(key);
+
+    /* One writer per key is enough */
+    pthread_rwlock_wrlock(&index_lock);
+    for (fill = fills; fill != NULL; fill = fill->next) {
+        if (fill->digest == digest)
+            break;
+    }
+    if (fill != NULL) {
+        pthread_rwlock_unlock(&index_lock);
+        return NULL;
+    }
+    fill = Calloc(1, sizeof(disk_fill_t));
+    fill->digest = digest;
+    fill->next = fills;
+    fills = fill;
+    pthread_rwlock_unlock(&index_lock);
+
+    span = record_span(key_len, size);
+    pthread_mutex_lock(&fill_lock);
+    while (slabs[head].used + span > slab_size)
+        advance();
+    off = slabs[head].used;
+    slabs[head].used += span;
+    fill->slab = head;
+    fill->gen = slabs[head].gen;
+    __atomic_add_fetch(&slabs[head].users, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fill_lock);
+
+    fill->rec = record_at(fill->slab, off);
+    fill->rec->magic = REC_PENDING;
+    fill->rec->key_len = key_len;
+    fill->rec->gen = fill->gen;
+    fill->rec->digest = digest;
+    fill->rec->size = size;
+    fill->rec->head_len = head_len;
+    fill->rec->expires = expires;
+    memcpy(fill->rec + 1, key, key_len);
+    fill->data = (char *)(fill->rec + 1) + key_len;
+    fill->size = size;
+    return fill;
+}
+
+/*
+ * disk_write - Copy the next piece of the response into the slab.
+ */
+void disk_write(disk_fill_t *fill, const char *buf, int n)
+{
+    if (fill->written + n > fill->size) {
+        fill->written = fill->size + 1;
+        return;
+    }
+    memcpy(fill->data + fill->written, buf, n);
+    fill->written += n;
+}
+
+/*
+ * disk_commit - Publish a finished record, or abandon it.
+ */
+void disk_commit(disk_fill_t *fill, int complete)
+{
+    disk_fill_t **link;
+    uint32_t magic = REC_DEAD;
+
+    pthread_rwlock_wrlock(&index_lock);
+    for (link = &fills; *link != fill; link = &(*link)->next)
+        ;
+    *link = fill->next;
+    if (complete  &&  fill->written == fill->size
+      &&  slabs[fill->slab].gen == fill->gen) {
+        index_put(fill->digest, fill->slab,
+          (char *)fill->rec - slabs[fill->slab].map);
+        magic = REC_STORED;
+    }
+    __atomic_store_n(&fill->rec->magic, magic, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&index_lock);
+
+    slab_put(fill->slab);
+    Free(fill);
+}
+
+/*
+ * open_slab - Open slab file "n", creating it at full size if need be,
+ * and map it.
+ */
+static void open_slab(const char *dir, int n)
+{
+    char path[MAXLINE];
+    struct stat st;
+    int rc;
+
+    snprintf(path, sizeof(path), "%s/slab.%03d", dir, n);
+    if ((slabs[n].fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        unix_error("disk_init: open error");
+    if (fstat(slabs[n].fd, &st) < 0)
+        unix_error("disk_init: fstat error");
+    if (st.st_size != slab_size) {
+        /* Whatever it held was laid out for another size */
+        if (ftruncate(slabs[n].fd, 0) < 0)
+            unix_error("disk_init: ftruncate error");
+        if ((rc = posix_fallocate(slabs[n].fd, 0, slab_size)) != 0)
+            posix_error(rc, "disk_init: posix_fallocate error");
+    }
+    slabs[n].map = mmap(NULL, slab_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      slabs[n].fd, 0);
+    if (slabs[n].map == MAP_FAILED)
+        unix_error("disk_init: mmap error");
+}
+
+/*
+ * scan_slab - Index the complete records of slab "n", from its header
+ * up to the first record that isn't of its generation.  Returns how
+ * many records were indexed.
+ */
+static long scan_slab(int n)
+{
+    slab_header_t *hdr = (slab_header_t *)slabs[n].map;
+    record_t *rec;
+    entry_t *e;
+    long off = REC_ALIGN;
+    long span;
+    long count = 0;
+
+    if (hdr->magic != SLAB_MAGIC  ||  hdr->size != slab_size)
+        return 0;
+    slabs[n].gen = hdr->gen;
+    while (off + (long)sizeof(record_t) <= slab_size) {
+        rec = record_at(n, off);
+        if (rec->gen != hdr->gen  ||  rec->key_len >= MAXLINE
+          ||  (rec->magic != REC_PENDING  &&  rec->magic != REC_STORED
+            &&  rec->magic != REC_DEAD))
+            break;
+        span = record_span(rec->key_len, rec->size);
+        if (off + span > slab_size)
+            break;
+        if (rec->magic == REC_STORED) {
+            /* A copy in a newer slab wins */
+            e = index_find(rec->digest);
+            if (e == NULL  ||  slabs[e->slab].gen < hdr->gen) {
+                index_put(rec->digest, n, off);
+                count++;
+            }
+        }
+        off += span;
+    }
+    slabs[n].used = off;
+    return count;
+}
+
+/*
+ * advance - Move the head on to the next slab, which is free, and
+ * reclaim the one after it.  Called with fill_lock held.
+ */
+static void advance(void)
+{
+    head = (head + 1) % nslabs;
+    start_slab(head);
+    reclaim((head + 1) % nslabs);
+}
+
+/*
+ * start_slab - Begin a new generation in slab "n", once the hits and
+ * fills still using its previous contents are over.
+ */
+static void start_slab(int n)
+{
+    slab_header_t *hdr = (slab_header_t *)slabs[n].map;
+
+    pthread_mutex_lock(&users_lock);
+    while (__atomic_load_n(&slabs[n].users, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&users_idle, &users_lock);
+    pthread_mutex_unlock(&users_lock);
+
+    pthread_rwlock_wrlock(&index_lock);
+    slabs[n].gen = next_gen++;
+    pthread_rwlock_unlock(&index_lock);
+    slabs[n].used = REC_ALIGN;
+    hdr->gen = slabs[n].gen;
+    hdr->size = slab_size;
+    hdr->magic = SLAB_MAGIC;
+}
+
+/*
+ * reclaim - Empty slab "n": copy the records hit since they were
+ * written to the head, while there is room, and drop the rest.
+ * Called with fill_lock held.
+ */
+static void reclaim(int n)
+{
+    slab_header_t *hdr = (slab_header_t *)slabs[n].map;
+    uint64_t gen = slabs[n].gen;
+    record_t *rec;
+    entry_t *e;
+    long off;
+    long span;
+    long to;
+    int hot;
+
+    pthread_rwlock_wrlock(&index_lock);
+    slabs[n].gen = 0;
+    pthread_rwlock_unlock(&index_lock);
+    hdr->magic = 0;
+
+    for (off = REC_ALIGN; off < slabs[n].used; off += span) {
+        rec = record_at(n, off);
+        span = record_span(rec->key_len, rec->size);
+        if (rec->magic != REC_STORED  ||  rec->gen != gen)
+            continue;
+
+        pthread_rwlock_wrlock(&index_lock);
+        e = index_find(rec->digest);
+        if (e == NULL  ||  (e->slab & ~ENTRY_HIT) != n
+          ||  (long)e->unit * REC_ALIGN != off) {
+            /* Since replaced by a newer copy */
+            pthread_rwlock_unlock(&index_lock);
+            continue;
+        }
+        hot = (e->slab & ENTRY_HIT)  &&  slabs[head].used + span <= slab_size;
+        if (!hot)
+            index_remove(e);
+        pthread_rwlock_unlock(&index_lock);
+        if (!hot)
+            continue;
+
+        /* The old copy stays valid until this slab is started again */
+        to = slabs[head].used;
+        slabs[head].used += span;
+        memcpy(record_at(head, to), rec, span);
+        record_at(head, to)->gen = slabs[head].gen;
+        pthread_rwlock_wrlock(&index_lock);
+        if ((e = index_find(rec->digest)) != NULL
+          &&  (e->slab & ~ENTRY_HIT) == n  &&  (long)e->unit * REC_ALIGN == off)
+            index_put(rec->digest, head, to);
+        else
+            record_at(head, to)->magic = REC_DEAD;
+        pthread_rwlock_unlock(&index_lock);
+    }
+    slabs[n].used = 0;
+}
+
+/*
+ * record_at - Return the record at offset "off" of a slab.
+ */
+static record_t *record_at(int slab, long off)
+{
+    return (record_t *)(slabs[slab].map + off);
+}
+
+/*
+ * record_span - Bytes taken by a record, header and padding included.
+ */
+static long record_span(long key_len, long size)
+{
+    long span = sizeof(record_t) + key_len + size;
+
+    return (span + REC_ALIGN - 1) / REC_ALIGN * REC_ALIGN;
+}
+
+/*
+ * slab_put - Drop a use of a slab, waking anyone waiting to reuse it.
+ */
+static void slab_put(int n)
+{
+    if (__atomic_sub_fetch(&slabs[n].users, 1, __ATOMIC_RELEASE) == 0) {
+        pthread_mutex_lock(&users_lock);
+        pthread_cond_broadcast(&users_idle);
+        pthread_mutex_unlock(&users_lock);
+    }
+}
+
+/*
+ * digest_key - 64-bit FNV-1a hash of a key, never 0.
+ */
+static uint64_t digest_key(const char *key)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    while (*key != '\0') {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ull;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+/*
+ * index_find - Return the index entry for a digest, or NULL.
+ */
+static entry_t *index_find(uint64_t digest)
+{
+    size_t mask = table_size - 1;
+    size_t i;
+
+    for (i = digest & mask; table[i].digest != 0; i = (i + 1) & mask) {
+        if (table[i].digest == digest)
+            return &table[i];
+    }
+    return NULL;
+}
+
+/*
+ * index_put - Point the entry for a digest at a record, adding the
+ * entry if there is none.  The hit flag starts out clear.
+ */
+static void index_put(uint64_t digest, int slab, long off)
+{
+    size_t mask;
+    size_t i;
+
+    if ((table_count + 1) * 2 > table_size)
+        index_grow();
+    mask = table_size - 1;
+    for (i = digest & mask; table[i].digest != 0; i = (i + 1) & mask) {
+        if (table[i].digest == digest)
+            break;
+    }
+    if (table[i].digest == 0)
+        table_count++;
+    table[i].digest = digest;
+    table[i].slab = slab;
+    table[i].unit = off / REC_ALIGN;
+}
+
+/*
+ * index_remove - Empty an entry, moving later entries of its probe
+ * sequence back so that they can still be found.
+ */
+static void index_remove(entry_t *e)
+{
+    size_t mask = table_size - 1;
+    size_t i = e - table;
+    size_t j = i;
+    size_t k;
+
+    table[i].digest = 0;
+    while (1) {
+        j = (j + 1) & mask;
+        if (table[j].digest == 0)
+            break;
+        /* Leave the entry alone if its home slot lies in (i, j] */
+        k = table[j].digest & mask;
+        if (i <= j ? (i < k  &&  k <= j) : (i < k  ||  k <= j))
+            continue;
+        table[i] = table[j];
+        table[j].digest = 0;
+        i = j;
+    }
+    table_count--;
+}
+
+/*
+ * index_grow - Double the size of the index.
+ */
+static void index_grow(void)
+{
+    entry_t *old = table;
+    size_t old_size = table_size;
+    size_t mask;
+    size_t i, j;
+
+    table_size *= 2;
+    table = Calloc(table_size, sizeof(entry_t));
+    mask = table_size - 1;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].digest == 0)
+            continue;
+        for (j = old[i].digest & mask; table[j].digest != 0; j = (j + 1) & mask)
+            ;
+        table[j] = old[i];
+    }
+    Free(old);
+}
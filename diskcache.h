@@ -0,0 +1,84 @@
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+#include <sys/types.h>
+
+/*
+ * Second cache tier, on disk, for responses too large to keep in
+ * memory.
+ *
+ * Objects are stored in a ring of large slab files, preallocated and
+ * mapped into memory, that are filled like a log: each new object is
+ * written at the head of the current slab, and when the slab is full
+ * the head moves on to the next one.  Before a slab is reused, the
+ * objects in it that were hit since they were written are copied to
+ * the head, and the rest are dropped (FIFO with reinsertion).  One
+ * slab is always kept empty, so there is somewhere to copy them to.
+ *
+ * Every slab begins with a header carrying its generation, and every
+ * object with a record header carrying the digest of its key, its
+ * sizes, when it stops being fresh, and the slab's generation when it
+ * was written.  The index of digests in memory is compact (no keys),
+ * and is rebuilt at startup by reading just those headers: a scan of
+ * each slab stops at the first record that doesn't belong to the
+ * slab's current generation.
+ *
+ * A hit is a file descriptor and an offset, meant for sendfile; the
+ * slab it lives in is not reused until the hit is released.
+ */
+
+#define DISK_SLAB_SIZE  (64 << 20)  /* Bytes per slab file */
+#define DISK_SLABS      16          /* Default number of slabs */
+
+/* An object being written; see disk_reserve */
+typedef struct disk_fill disk_fill_t;
+
+/* Where a stored response is */
+typedef struct {
+    int fd;                 /* Slab file */
+    off_t off;              /* Offset of the response in it */
+    long size;              /* Bytes of response */
+    long head_len;          /* Offset of the blank line ending the header */
+    int slab;               /* Slab index, for disk_release */
+} disk_hit_t;
+
+/*
+ * Open or create "nslabs" slab files of "slab_size" bytes in "dir",
+ * and rebuild the index from what they hold.  Until this is called,
+ * the disk tier is disabled: lookups miss and nothing is stored.
+ */
+extern void disk_init(const char *dir, int nslabs, size_t slab_size);
+
+/* The largest response the disk tier will keep, or 0 if disabled */
+extern long disk_max_object(void);
+
+/*
+ * Look up "key".  On a hit, fill in "hit" and return 0; the caller
+ * must disk_release it when done.  Returns -1 on a miss, which is
+ * also what a stored response that is no longer fresh gets.
+ */
+extern int disk_lookup(const char *key, disk_hit_t *hit);
+
+/* Let the slab holding a hit be reused */
+extern void disk_release(disk_hit_t *hit);
+
+/*
+ * Make room for a response of "size" bytes whose header ends (with
+ * its blank line) at "head_len", to be stored under "key" and served
+ * until "expires".  Returns NULL if it can't be stored, including when
+ * the same key is already being written.
+ */
+extern disk_fill_t *disk_reserve(const char *key, long size, long head_len,
+                                 time_t expires);
+
+/* Add the next "n" bytes of the response */
+extern void disk_write(disk_fill_t *fill, const char *buf, int n);
+
+/*
+ * The response is over.  It is added to the index if "complete" is
+ * nonzero and exactly the reserved number of bytes was written, and
+ * discarded otherwise.
+ */
+extern void disk_commit(disk_fill_t *fill, int complete);
+
+#endif /* _DISKCACHE_H */
@@ -0,0 +1,433 @@
+/*
+ * dns.c - Asynchronous host name resolver with a TTL cache
+ *
+ * Every name that has been looked up has an entry in a hash table
+ * keyed by the lower-cased name.  An entry is either pending, while a
+ * resolver thread works on it, or done, holding the answer (possibly
+ * an empty one) until it expires.  Lookups that find a pending entry
+ * add themselves to its list of waiters instead of starting a second
+ * lookup; the resolver thread hands its answer to all of them at once.
+ * The buckets are protected by striped mutexes, none of which is held
+ * while a name is actually being resolved.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "dns.h"
+#include "stats.h"
+
+#define DNS_BUCKETS     256   /* Hash buckets for names */
+#define DNS_STRIPES     16    /* Mutexes guarding the buckets */
+#define DNS_HOSTS_TTL   3600  /* Seconds a hosts file answer is cached */
+
+enum { DNS_PENDING, DNS_DONE };
+
+/* Someone waiting for a pending lookup */
+typedef struct dns_waiter {
+    struct dns_waiter *next;
+    dns_callback_t callback;
+    void *arg;
+} dns_waiter_t;
+
+/* What is known about one name */
+typedef struct dns_entry {
+    struct dns_entry *next;       /* Next entry in the same bucket */
+    struct dns_entry *next_job;   /* Next entry in the resolver queue */
+    char *host;                   /* Lower-cased name */
+    unsigned int hash;            /* Hash of host */
+    int state;                    /* DNS_PENDING or DNS_DONE */
+    time_t expires;               /* When a done entry goes stale */
+    dns_addrs_t addrs;            /* The answer, once done */
+    dns_waiter_t *waiters;        /* Lookups waiting while pending */
+} dns_entry_t;
+
+/* One name from the hosts file */
+typedef struct hosts_entry {
+    struct hosts_entry *next;
+    char *host;
+    dns_addrs_t addrs;
+} hosts_entry_t;
+
+/* Where dns_lookup waits for an answer */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+    dns_addrs_t *out;
+} dns_wait_t;
+
+static dns_entry_t *dns_buckets[DNS_BUCKETS];
+static pthread_mutex_t dns_locks[DNS_STRIPES];
+
+/* Entries waiting for a resolver thread, oldest first */
+static dns_entry_t *queue_head;
+static dns_entry_t *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static dns_resolver_t resolver;
+static hosts_entry_t *hosts;
+
+static void *resolver_thread(void *vargp);
+static int resolve_getaddrinfo(const char *host, dns_addrs_t *out);
+static int resolve_hosts(const char *host, dns_addrs_t *out);
+static void load_hosts(const char *filename);
+static int add_address(dns_addrs_t *out, const char *text);
+static void lookup_done(void *arg, const dns_addrs_t *result);
+static unsigned int hash_name(const char *name);
+
+/*
+ * dns_init - Pick the resolver and start the resolver threads.
+ */
+void dns_init(int nthreads, const char *hosts_file)
+{
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < DNS_STRIPES; i++)
+        pthread_mutex_init(&dns_locks[i], NULL);
+    if (resolver == NULL)
+        resolver = resolve_getaddrinfo;
+    if (hosts_file != NULL) {
+        load_hosts(hosts_file);
+        resolver = resolve_hosts;
+    }
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+}
+
+/*
+ * dns_set_resolver - Install a different resolver function.
+ */
+void dns_set_resolver(dns_resolver_t fn)
+{
+    resolver = fn;
+}
+
+/*
+ * dns_lookup_async - Answer from the cache, join a lookup in progress,
+ * or queue a new one.
+ */
+int dns_lookup_async(const char *host, dns_addrs_t *out,
+  dns_callback_t callback, void *arg)
+{
+    char name[MAXLINE];
+    dns_entry_t **link;
+    dns_entry_t *entry = NULL;
+    dns_entry_t *stale;
+    dns_waiter_t *waiter;
+    pthread_mutex_t *lock;
+    unsigned int hash;
+    time_t now;
+    int i;
+
+    /* Numeric addresses need no lookup */
+    out->naddrs = 0;
+    out->ttl = 0;
+    if (add_address(out, host) == 0)
+        return 0;
+    stats_add(STAT_DNS_LOOKUPS, 1);
+
+    for (i = 0; host[i] != '\0'  &&  i < sizeof(name) - 1; i++)
+        name[i] = tolower((unsigned char)host[i]);
+    name[i] = '\0';
+    hash = hash_name(name);
+    lock = &dns_locks[hash % DNS_STRIPES];
+    now = time(NULL);
+
+    pthread_mutex_lock(lock);
+    link = &dns_buckets[hash % DNS_BUCKETS];
+    while (*link != NULL) {
+        if ((*link)->hash == hash  &&  strcmp((*link)->host, name) == 0) {
+            entry = *link;
+            link = &entry->next;
+        } else if ((*link)->state == DNS_DONE  &&  (*link)->expires <= now) {
+            /* Drop other stale entries in passing */
+            stale = *link;
+            *link = stale->next;
+            Free(stale->host);
+            Free(stale);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+
+    if (entry != NULL  &&  entry->state == DNS_DONE  &&  entry->expires > now) {
+        *out = entry->addrs;
+        pthread_mutex_unlock(lock);
+        return out->naddrs > 0 ? 0 : -1;
+    }
+
+    waiter = Malloc(sizeof(dns_waiter_t));
+    waiter->callback = callback;
+    waiter->arg = arg;
+    if (entry != NULL  &&  entry->state == DNS_PENDING) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        pthread_mutex_unlock(lock);
+        return 1;
+    }
+
+    if (entry == NULL) {
+        entry = Malloc(sizeof(dns_entry_t));
+        entry->host = Malloc(strlen(name) + 1);
+        strcpy(entry->host, name);
+        entry->hash = hash;
+        entry->next = dns_buckets[hash % DNS_BUCKETS];
+        dns_buckets[hash % DNS_BUCKETS] = entry;
+    }
+    entry->state = DNS_PENDING;
+    waiter->next = NULL;
+    entry->waiters = waiter;
+    pthread_mutex_unlock(lock);
+
+    pthread_mutex_lock(&queue_lock);
+    entry->next_job = NULL;
+    if (queue_tail != NULL)
+        queue_tail->next_job = entry;
+    else
+        queue_head = entry;
+    queue_tail = entry;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 1;
+}
+
+/*
+ * dns_lookup - Blocking lookup, built on dns_lookup_async.
+ */
+int dns_lookup(const char *host, dns_addrs_t *out)
+{
+    dns_wait_t wait;
+    int rc;
+
+    pthread_mutex_init(&wait.lock, NULL);
+    pthread_cond_init(&wait.done_cond, NULL);
+    wait.done = 0;
+    wait.out = out;
+
+    if ((rc = dns_lookup_async(host, out, lookup_done, &wait)) == 1) {
+        pthread_mutex_lock(&wait.lock);
+        while (!wait.done)
+            pthread_cond_wait(&wait.done_cond, &wait.lock);
+        pthread_mutex_unlock(&wait.lock);
+        rc = out->naddrs > 0 ? 0 : -1;
+    }
+    pthread_cond_destroy(&wait.done_cond);
+    pthread_mutex_destroy(&wait.lock);
+    return rc;
+}
+
+/*
+ * dns_set_port - Store a port in an IPv4 or IPv6 address.
+ */
+void dns_set_port(struct sockaddr_storage *addr, int port)
+{
+    if (addr->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+/*
+ * resolver_thread - Resolve queued names and hand the answers to
+ * everyone waiting for them.
+ */
+static void *resolver_thread(void *vargp)
+{
+    dns_entry_t *entry;
+    dns_waiter_t *waiter;
+    dns_waiter_t *next;
+    dns_addrs_t addrs;
+    pthread_mutex_t *lock;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        entry = queue_head;
+        if ((queue_head = entry->next_job) == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        /* A pending entry is never freed, so its name stays valid */
+        memset(&addrs, 0, sizeof(addrs));
+        addrs.ttl = DNS_TTL;
+        stats_add(STAT_DNS_QUERIES, 1);
+        if (resolver(entry->host, &addrs) < 0  ||  addrs.naddrs == 0) {
+            addrs.naddrs = 0;
+            addrs.ttl = DNS_NEG_TTL;
+        }
+
+        lock = &dns_locks[entry->hash % DNS_STRIPES];
+        pthread_mutex_lock(lock);
+        entry->addrs = addrs;
+        entry->expires = time(NULL) + addrs.ttl;
+        entry->state = DNS_DONE;
+        waiter = entry->waiters;
+        entry->waiters = NULL;
+        pthread_mutex_unlock(lock);
+
+        for (; waiter != NULL; waiter = next) {
+            next = waiter->next;
+            waiter->callback(waiter->arg, &addrs);
+            Free(waiter);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * resolve_getaddrinfo - The default resolver.  getaddrinfo already
+ * orders the addresses by preference (RFC 6724), so they are kept in
+ * its order.
+ */
+static int resolve_getaddrinfo(const char *host, dns_addrs_t *out)
+{
+    struct addrinfo hints;
+    struct addrinfo *list;
+    struct addrinfo *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if (getaddrinfo(host, NULL, &hints, &list) != 0)
+        return -1;
+
+    for (ai = list; ai != NULL  &&  out->naddrs < DNS_MAX_ADDRS;
+         ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        memcpy(&out->addrs[out->naddrs], ai->ai_addr, ai->ai_addrlen);
+        out->addrlens[out->naddrs++] = ai->ai_addrlen;
+    }
+    freeaddrinfo(list);
+    return out->naddrs > 0 ? 0 : -1;
+}
+
+/*
+ * resolve_hosts - Resolver that only knows the names in the hosts file.
+ */
+static int resolve_hosts(const char *host, dns_addrs_t *out)
+{
+    hosts_entry_t *h;
+
+    for (h = hosts; h != NULL; h = h->next) {
+        if (strcasecmp(h->host, host) == 0) {
+            *out = h->addrs;
+            out->ttl = DNS_HOSTS_TTL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * load_hosts - Read a file of "address name [alias ...]" lines, as in
+ * /etc/hosts.  A name listed on several lines gets all their addresses.
+ */
+static void load_hosts(const char *filename)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    char *save;
+    char *addr;
+    char *name;
+    char *p;
+    hosts_entry_t *h;
+
+    fp = Fopen((char *)filename, "r");
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        if ((addr = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            for (h = hosts; h != NULL; h = h->next) {
+                if (strcasecmp(h->host, name) == 0)
+                    break;
+            }
+            if (h == NULL) {
+                h = Calloc(1, sizeof(hosts_entry_t));
+                h->host = Malloc(strlen(name) + 1);
+                strcpy(h->host, name);
+                h->next = hosts;
+                hosts = h;
+            }
+            if (add_address(&h->addrs, addr) < 0)
+                fprintf(stderr, "%s: ignoring address %s\n", filename, addr);
+        }
+    }
+    Fclose(fp);
+}
+
+/*
+ * add_address - Append a numeric IPv4 or IPv6 address to a list.
+ * Returns -1 if "text" isn't one, or the list is full.
+ */
+static int add_address(dns_addrs_t *out, const char *text)
+{
+    struct sockaddr_storage *ss;
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    char buf[INET6_ADDRSTRLEN];
+    size_t len;
+
+    if (out->naddrs == DNS_MAX_ADDRS)
+        return -1;
+    ss = &out->addrs[out->naddrs];
+    memset(ss, 0, sizeof(*ss));
+
+    /* Accept IPv6 literals in URL brackets as well */
+    len = strlen(text);
+    if (text[0] == '[' && len > 2 && len - 2 < sizeof(buf)
+      &&  text[len - 1] == ']') {
+        memcpy(buf, text + 1, len - 2);
+        buf[len - 2] = '\0';
+        text = buf;
+    }
+
+    sin = (struct sockaddr_in *)ss;
+    sin6 = (struct sockaddr_in6 *)ss;
+    if (inet_pton(AF_INET, text, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        out->addrlens[out->naddrs++] = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, text, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        out->addrlens[out->naddrs++] = sizeof(*sin6);
+    } else {
+        return -1;
+    }
+    out->ttl = DNS_HOSTS_TTL;
+    return 0;
+}
+
+/*
+ * lookup_done - Callback that wakes up a blocked dns_lookup.
+ */
+static void lookup_done(void *arg, const dns_addrs_t *result)
+{
+    dns_wait_t *wait = arg;
+
+    pthread_mutex_lock(&wait->lock);
+    *wait->out = *result;
+    wait->done = 1;
+    pthread_cond_signal(&wait->done_cond);
+    pthread_mutex_unlock(&wait->lock);
+}
+
+/*
+ * hash_name - FNV-1a hash of a name.
+ */
+static unsigned int hash_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
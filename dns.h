@@ -0,0 +1,72 @@
+#ifndef _DNS_H
+#define _DNS_H
+
+#include <sys/socket.h>
+
+/*
+ * Asynchronous host name resolver with a shared answer cache.
+ *
+ * Lookups are carried out by a small pool of resolver threads, never
+ * by the threads handling requests.  Answers are cached for their time
+ * to live, failures are cached (for a shorter time) as well, and
+ * concurrent lookups of a name that is already being resolved simply
+ * wait for that one lookup to finish.  Both IPv4 and IPv6 addresses
+ * are returned, in the order they should be tried.
+ *
+ * By default names are resolved with getaddrinfo.  For testing without
+ * a network the resolver can be pointed at a hosts file, in which case
+ * only the names listed there resolve, or replaced outright with
+ * dns_set_resolver.
+ */
+
+#define DNS_THREADS    4    /* Resolver threads */
+#define DNS_TTL        60   /* Seconds a successful answer is cached */
+#define DNS_NEG_TTL    5    /* Seconds a failed lookup is cached */
+#define DNS_MAX_ADDRS  8    /* Addresses kept per name */
+
+/* The addresses a name resolves to; naddrs is 0 if it doesn't */
+typedef struct {
+    int naddrs;
+    int ttl;                /* Seconds the answer may be cached */
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t addrlens[DNS_MAX_ADDRS];
+} dns_addrs_t;
+
+/*
+ * A resolver fills in "out" for "host" and returns 0, or returns -1 if
+ * the name doesn't resolve.  It may set out->ttl; otherwise DNS_TTL
+ * applies.  Ports in the returned addresses are ignored.
+ */
+typedef int (*dns_resolver_t)(const char *host, dns_addrs_t *out);
+
+/* Called by a resolver thread when an asynchronous lookup finishes */
+typedef void (*dns_callback_t)(void *arg, const dns_addrs_t *result);
+
+/*
+ * Start "nthreads" resolver threads.  If "hosts_file" is not NULL,
+ * names are looked up only in that file (in /etc/hosts format).
+ */
+extern void dns_init(int nthreads, const char *hosts_file);
+
+/* Replace the resolver; must be called before any lookups */
+extern void dns_set_resolver(dns_resolver_t resolver);
+
+/*
+ * Start looking up "host".  If the answer is already known, it is
+ * copied into "out" and 0 is returned, or -1 if the name is known not
+ * to resolve.  Otherwise 1 is returned, and "callback" will be called
+ * with "arg" and the answer from a resolver thread once it is known.
+ */
+extern int dns_lookup_async(const char *host, dns_addrs_t *out,
+  dns_callback_t callback, void *arg);
+
+/*
+ * Look up "host", waiting for the answer if necessary.  Returns 0 with
+ * the addresses in "out", or -1 if the name doesn't resolve.
+ */
+extern int dns_lookup(const char *host, dns_addrs_t *out);
+
+/* Set the port of an address returned by a lookup */
+extern void dns_set_port(struct sockaddr_storage *addr, int port);
+
+#endif /* _DNS_H */
@@ -0,0 +1,1651 @@
+/*
+ * event.c - Event-driven proxy workers
+ *
+ * Instead of dedicating a thread (and its stack) to every client, the
+ * event mode runs a fixed number of worker threads, each pinned to a
+ * CPU and each running its own epoll loop over non-blocking sockets.
+ * A worker owns every client and origin socket it accepts or opens,
+ * so none of the per-connection state needs locking.
+ *
+ * Each connection goes through the same steps as process_request,
+ * but as a state machine that is advanced whenever one of its
+ * sockets becomes ready:
+ *
+ *   ST_READ_REQUEST  accumulate the client's request headers
+ *   ST_RESOLVE       wait for the origin's name to be looked up
+ *   ST_CONNECT       wait for a non-blocking connect to the origin
+ *   ST_FORWARD       write the rewritten request to the origin
+ *   ST_BODY          copy the request body, if any, to the origin
+ *   ST_RELAY         copy the origin's response back to the client
+ *
+ * A connection gets CLIENT_IDLE_TIMEOUT seconds in ST_READ_REQUEST to
+ * send a whole request header, and is closed if it takes longer, be it
+ * idle between requests or stalled in the middle of one.  Since the
+ * timeout is the same for all, each worker keeps its waiting
+ * connections in a list in the order they started waiting, which is
+ * also the order of their deadlines, and sleeps in epoll_wait no
+ * longer than until the first of them.
+ *
+ * Requests go to the origin as HTTP/1.1, and the response is framed as
+ * it is relayed (see httpparse.h), so neither connection has to end
+ * with it.  Afterwards the origin connection joins the worker's idle
+ * list, for its next request to the same origin from any client, and
+ * the client connection goes back to ST_READ_REQUEST; its next request
+ * may well be waiting already, sent right behind the last.
+ *
+ * A request whose response is already in the shared cache skips
+ * straight from ST_READ_REQUEST to ST_SERVE, which writes the cached
+ * copy to the client without touching the origin.  Only a complete
+ * copy is served, never one another request is still filling, so a
+ * response reaches other clients only once the cache has judged it
+ * fit for anyone, whatever the request it answered (see cache.h).  A
+ * request for the proxy's statistics goes to ST_REPLY instead, which
+ * writes out the response the proxy made for it.  CONNECT goes from
+ * ST_CONNECT to ST_TUNNEL, which relays both ways until both sides are
+ * done (see tunnel.h).
+ *
+ * Name lookups are handed to the resolver threads in dns.c.  When a
+ * lookup a connection is waiting for completes, the resolver thread
+ * queues the connection on its worker's resolved list and wakes the
+ * worker through an eventfd, so the connection is only ever touched
+ * by its own worker.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "event.h"
+#include "cache.h"
+#include "dns.h"
+#include "rewrite.h"
+#include "httpparse.h"
+#include "arena.h"
+#include "stats.h"
+#include "tunnel.h"
+#include "upstream.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#define MAXEVENTS   256    /* Most events handled per epoll_wait */
+#define MAXREQUEST  65536  /* Largest request header we will buffer */
+#define RELAYBUDGET 16     /* Buffers relayed per wakeup, for fairness */
+#define MAXREQUESTS 100    /* Requests served per client connection */
+#define MAXIDLE     64     /* Idle origin connections kept per worker */
+
+/* How requests are rewritten for the origin; see prepare_request */
+static const rewrite_rule_t keepalive_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+    { RW_STRIP, "Expect" },
+};
+static const rewrite_rule_t close_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+    { RW_STRIP, "Expect" },
+    { RW_ADD, "Connection: close" },
+};
+static rewriter_t *keepalive_rewriter;
+static rewriter_t *close_rewriter;
+
+/* How response headers are rewritten for the client; see take_header */
+static const rewrite_rule_t response_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+};
+static const rewrite_rule_t response_close_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+    { RW_ADD, "Connection: close" },
+};
+static rewriter_t *response_rewriter;
+static rewriter_t *response_close_rewriter;
+
+typedef enum {
+    ST_READ_REQUEST,
+    ST_RESOLVE,
+    ST_CONNECT,
+    ST_FORWARD,
+    ST_BODY,
+    ST_RELAY,
+    ST_SERVE,
+    ST_REPLY,
+    ST_TUNNEL,
+    ST_CLOSED
+} conn_state_t;
+
+/* Where relay_response has got to in the response */
+enum {
+    RESP_HEADER,        /* Accumulating the header in the relay buffer */
+    RESP_BODY,          /* Relaying the body */
+    RESP_DONE           /* Relaying what is left of the relay buffer */
+};
+
+typedef struct conn conn_t;
+typedef struct worker worker_t;
+typedef struct idle idle_t;
+
+/*
+ * A descriptor registered with epoll.  The epoll data pointer refers
+ * to one of these, so an event leads straight back to its connection.
+ */
+typedef struct {
+    int fd;
+    unsigned int events;   /* Events currently registered, 0 if none */
+    conn_t *conn;          /* Owning connection; NULL if none */
+    idle_t *idle;          /* Idle origin connection it is, or NULL */
+} handle_t;
+
+/* Everything a worker knows about one client connection */
+struct conn {
+    conn_state_t state;
+    worker_t *worker;               /* Worker that owns the connection */
+    arena_t *arena;                 /* Where its memory comes from */
+    handle_t client;                /* Socket talking to the client */
+    handle_t origin;                /* Socket talking to the end server */
+    struct sockaddr_in clientaddr;  /* Client IP address, for the log */
+    char *in;                       /* Bytes from the client not yet used up */
+    int in_len;                     /* Bytes at in */
+    int in_size;                    /* Bytes allocated for in */
+    int nrequests;                  /* Requests read so far */
+    conn_t *next;                   /* Link on the worker's dead or resolved list */
+    time_t deadline;                /* When ST_READ_REQUEST gives up, or 0 */
+    conn_t *wait_prev;              /* Links on the worker's waiting list */
+    conn_t *wait_next;
+
+    /*
+     * Everything from here on is about the current request, and is
+     * cleared for the next; see next_request
+     */
+    char *request;                  /* Request rewritten for the origin */
+    int request_len;                /* Bytes at request */
+    int request_sent;               /* Bytes already sent to the origin */
+    int in_used;                    /* Bytes of in taken by the request */
+    http_request_t req;             /* The request, as parsed so far */
+    char *url;                      /* URL from the request line */
+    char *key;                      /* Cache key, or NULL if uncacheable */
+    int cache_flags;                /* CACHE_REQ_* for storing the response */
+    char *hostname;                 /* Origin host */
+    int port;                       /* Origin port */
+    char *origin_key;               /* "host:port", naming idle connections */
+    int persist;                    /* Can the client send another request? */
+    int head;                       /* Is the request a HEAD? */
+    int retryable;                  /* Could it be sent again if unanswered? */
+    int reused;                     /* Is the origin connection an idle one? */
+    int reusable;                   /* Can it be idle again afterwards? */
+    dns_addrs_t addrs;              /* Origin addresses */
+    int addr_next;                  /* Next address to try connecting to */
+    cache_reader_t hit;             /* Cached response being served */
+    long hit_head;                  /* Offset of the blank line ending its header */
+    long hit_sent;                  /* Bytes of it sent */
+    char *hit_buf;                  /* Part of it not yet sent */
+    int hit_len;                    /* Bytes at hit_buf */
+    char *object;                   /* Copy of the response for the cache */
+    int object_len;                 /* Bytes at object */
+    int object_size;                /* Bytes allocated for object */
+    http_response_t resp;           /* The response header, as parsed so far */
+    int resp_state;                 /* RESP_ state */
+    http_body_t resp_body;          /* Where the response body ends */
+    const char *ahead;              /* Bytes to send the client before buf */
+    int ahead_len;                  /* Bytes at ahead */
+    int closing_sent;               /* Has "Connection: close" gone ahead? */
+    int response_len;               /* Response bytes relayed so far */
+    char *reply;                    /* Response made by the proxy itself */
+    int reply_len;                  /* Bytes of it not yet sent */
+    long start;                     /* When the request header was complete */
+    long connect_start;             /* When the origin connect began */
+    int answered;                   /* Has the first response byte gone out? */
+    int done;                       /* Has the whole response gone out? */
+    int has_body;                   /* Does the request have a body? */
+    int expect;                     /* Does the client await "100 Continue"? */
+    http_body_t body;               /* Where the request body ends */
+    char *body_buf;                 /* Body received with the header, not yet sent */
+    int body_len;                   /* Bytes at body_buf */
+    int tunnelling;                 /* Is this a CONNECT? */
+    tunnel_t *tunnel;               /* Its tunnel, once the origin is connected */
+    int buf_head;                   /* Next byte of buf to send */
+    int buf_tail;                   /* End of valid data in buf */
+    char buf[MAXBUF];               /* Response relay buffer */
+};
+
+/* A connection to an origin, kept for the worker's next request to it */
+struct idle {
+    handle_t h;         /* Watched, so that the origin closing it is noticed */
+    char *key;          /* "host:port" */
+    time_t since;       /* When it went idle */
+    idle_t *next;
+};
+
+/* Per-thread state of one event worker */
+struct worker {
+    int id;             /* Small integer used to identify the worker */
+    int cpu;            /* CPU the worker is pinned to */
+    pthread_t tid;
+    int epfd;           /* This worker's epoll instance */
+    handle_t listener;  /* Listening socket, shared unless SO_REUSEPORT */
+    int shared;         /* Do other workers accept from it too? */
+    conn_t *dead;       /* Connections closed during this batch */
+    handle_t notify;    /* eventfd signalled when lookups complete */
+    pthread_mutex_t resolved_lock;
+    conn_t *resolved;   /* Connections whose lookup completed; see dns_resolved */
+    idle_t *idle;       /* Idle origin connections, most recent first */
+    int nidle;
+    idle_t *idle_dead;  /* Idle entries taken or dropped during this batch */
+    conn_t *waiting;    /* Connections in ST_READ_REQUEST, by deadline */
+    conn_t *waiting_tail;
+};
+
+static void *event_worker(void *vargp);
+static int listen_nonblocking(int listenfd);
+static void no_delay(int fd);
+static void watch(worker_t *w, handle_t *h, unsigned int events);
+static void accept_clients(worker_t *w);
+static void conn_close(worker_t *w, conn_t *c);
+static void wait_start(worker_t *w, conn_t *c);
+static void wait_stop(worker_t *w, conn_t *c);
+static int expire_waiting(worker_t *w);
+static void read_request(worker_t *w, conn_t *c);
+static int prepare_request(worker_t *w, conn_t *c, int header_len);
+static int start_connect(worker_t *w, conn_t *c);
+static int take_idle(worker_t *w, const char *key);
+static void give_idle(worker_t *w, const char *key, int fd);
+static void drop_idle(worker_t *w, idle_t *idle);
+static void retire_idle(worker_t *w, idle_t *idle);
+static void dns_resolved(void *arg, const dns_addrs_t *result);
+static void take_resolved(worker_t *w);
+static int connect_origin(worker_t *w, conn_t *c);
+static void finish_connect(worker_t *w, conn_t *c);
+static void forward_request(worker_t *w, conn_t *c);
+static void forward_body(worker_t *w, conn_t *c);
+static void start_tunnel(worker_t *w, conn_t *c);
+static void relay_tunnel(worker_t *w, conn_t *c);
+static void relay_response(worker_t *w, conn_t *c);
+static int send_pending(worker_t *w, conn_t *c);
+static int take_header(worker_t *w, conn_t *c);
+static void origin_closed(worker_t *w, conn_t *c);
+static void retry_request(worker_t *w, conn_t *c);
+static void finish_response(worker_t *w, conn_t *c);
+static void next_request(worker_t *w, conn_t *c);
+static void save_for_cache(conn_t *c, const char *buf, int n);
+static int serve_hit(conn_t *c);
+static void serve_cached(worker_t *w, conn_t *c);
+static int make_reply(conn_t *c);
+static void serve_reply(worker_t *w, conn_t *c);
+static void first_byte(conn_t *c);
+static void response_done(conn_t *c, int len);
+
+/*
+ * event_run - Start the event workers and wait for them forever.
+ */
+void event_run(int port, int nworkers, int reuseport)
+{
+    worker_t *workers;
+    int listenfd = -1;
+    int ncpus;
+    int i;
+
+    if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        ncpus = 1;
+    if (nworkers <= 0)
+        nworkers = ncpus;
+    if (!reuseport)
+        listenfd = listen_nonblocking(Open_listenfd(port));
+
+    keepalive_rewriter = rewrite_compile(keepalive_rules,
+      sizeof(keepalive_rules) / sizeof(keepalive_rules[0]));
+    close_rewriter = rewrite_compile(close_rules,
+      sizeof(close_rules) / sizeof(close_rules[0]));
+    response_rewriter = rewrite_compile(response_rules,
+      sizeof(response_rules) / sizeof(response_rules[0]));
+    response_close_rewriter = rewrite_compile(response_close_rules,
+      sizeof(response_close_rules) / sizeof(response_close_rules[0]));
+
+    printf("Starting %d event workers on %d CPUs\n", nworkers, ncpus);
+    workers = Calloc(nworkers, sizeof(worker_t));
+    for (i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        workers[i].cpu = i % ncpus;
+        if (reuseport)
+            workers[i].listener.fd =
+              listen_nonblocking(Open_listenfd_reuseport(port));
+        else
+            workers[i].listener.fd = listenfd;
+        workers[i].shared = !reuseport;
+        pthread_mutex_init(&workers[i].resolved_lock, NULL);
+        Pthread_create(&workers[i].tid, NULL, event_worker, &workers[i]);
+    }
+    for (i = 0; i < nworkers; i++)
+        Pthread_join(workers[i].tid, NULL);
+    exit(0);
+}
+
+/*
+ * event_worker - Thread routine for one event worker.
+ *
+ * Pins itself to its CPU, then waits for socket readiness and pushes
+ * the affected connection's state machine as far as it will go
+ * without blocking.
+ */
+static void *event_worker(void *vargp)
+{
+    worker_t *w = (worker_t *)vargp;
+    struct epoll_event events[MAXEVENTS];
+    struct epoll_event ev;
+    cpu_set_t cpus;
+    handle_t *h;
+    conn_t *c;
+    idle_t *idle;
+    int timeout = -1;
+    int n, i;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        printf("Worker %d: could not pin to CPU %d\n", w->id, w->cpu);
+
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("event_worker: epoll_create1 error");
+
+    /* EPOLLEXCLUSIVE keeps one new client from waking every worker */
+    ev.events = w->shared ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+    ev.data.ptr = &w->listener;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listener.fd, &ev) < 0)
+        unix_error("event_worker: epoll_ctl error");
+
+    if ((w->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        unix_error("event_worker: eventfd error");
+    watch(w, &w->notify, EPOLLIN);
+
+    while (1) {
+        if ((n = epoll_wait(w->epfd, events, MAXEVENTS, timeout)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("event_worker: epoll_wait error");
+        }
+
+        for (i = 0; i < n; i++) {
+            h = (handle_t *)events[i].data.ptr;
+            if (h == &w->notify) {
+                take_resolved(w);
+                continue;
+            }
+            if (h->idle != NULL) {
+                drop_idle(w, h->idle);
+                continue;
+            }
+            if ((c = h->conn) == NULL) {
+                accept_clients(w);
+                continue;
+            }
+            switch (c->state) {
+            case ST_READ_REQUEST:
+                read_request(w, c);
+                break;
+            case ST_RESOLVE:
+                break;
+            case ST_CONNECT:
+                finish_connect(w, c);
+                break;
+            case ST_FORWARD:
+                forward_request(w, c);
+                break;
+            case ST_BODY:
+                forward_body(w, c);
+                break;
+            case ST_RELAY:
+                relay_response(w, c);
+                break;
+            case ST_SERVE:
+                serve_cached(w, c);
+                break;
+            case ST_REPLY:
+                serve_reply(w, c);
+                break;
+            case ST_TUNNEL:
+                relay_tunnel(w, c);
+                break;
+            case ST_CLOSED:
+                break;
+            }
+        }
+
+        timeout = expire_waiting(w);
+
+        /*
+         * Connections closed above may still have had events later in
+         * the same batch, so they are only freed once the batch is done.
+         */
+        while ((c = w->dead) != NULL) {
+            w->dead = c->next;
+            if (c->hit.obj != NULL)
+                cache_close(&c->hit);
+            free(c->object);
+            arena_put(c->arena);    /* Frees c itself */
+        }
+        while ((idle = w->idle_dead) != NULL) {
+            w->idle_dead = idle->next;
+            Free(idle);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * listen_nonblocking - Make a listening socket's accepts non-blocking,
+ * since a worker must never wait on one.
+ */
+static int listen_nonblocking(int listenfd)
+{
+    int flags;
+
+    if ((flags = fcntl(listenfd, F_GETFL)) < 0
+      ||  fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0)
+        unix_error("listen_nonblocking: fcntl error");
+    return listenfd;
+}
+
+/*
+ * no_delay - Turn off Nagle's algorithm on a socket.  Connections that
+ * carry one request after another soon stop having their segments
+ * acknowledged straight away, and the last part of a response, held
+ * back until the part before it is acknowledged, could then wait for
+ * the peer's delayed ACK.  Everything is written a buffer at a time
+ * anyway, so there are no tiny writes for Nagle to gather up.
+ */
+static void no_delay(int fd)
+{
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * watch - Change the set of events epoll reports for a descriptor,
+ * adding or removing the descriptor from the epoll set as needed.
+ */
+static void watch(worker_t *w, handle_t *h, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (h->events == events)
+        return;
+    if (h->events == 0)
+        op = EPOLL_CTL_ADD;
+    else if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(w->epfd, op, h->fd, &ev) < 0)
+        unix_error("watch: epoll_ctl error");
+    h->events = events;
+}
+
+/*
+ * accept_clients - Accept every pending connection on the listener
+ * and start reading its request.
+ */
+static void accept_clients(worker_t *w)
+{
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    arena_t *arena;
+    conn_t *c;
+    int fd;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        fd = accept4(w->listener.fd, (SA *)&clientaddr, &clientlen,
+          SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR  ||  errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN  &&  errno != EWOULDBLOCK)
+                printf("Worker %d: accept failed; error = %s\n",
+                  w->id, strerror(errno));
+            return;
+        }
+
+        no_delay(fd);
+        arena = arena_get();
+        c = arena_alloc(arena, sizeof(conn_t));
+        memset(c, 0, sizeof(conn_t));
+        c->arena = arena;
+        c->state = ST_READ_REQUEST;
+        c->client.fd = fd;
+        c->client.conn = c;
+        c->origin.fd = -1;
+        c->origin.conn = c;
+        c->clientaddr = *((struct sockaddr_in *)&clientaddr);
+        c->in_size = MAXBUF;
+        c->in = arena_alloc(arena, c->in_size);
+        arena_mark(arena);
+        http_request_init(&c->req);
+        watch(w, &c->client, EPOLLIN);
+        wait_start(w, c);
+        stats_add(STAT_CONNECTIONS, 1);
+        stats_add(STAT_ACTIVE, 1);
+    }
+}
+
+/*
+ * conn_close - Close both sockets of a connection and queue it to be
+ * freed at the end of the current batch of events.
+ */
+static void conn_close(worker_t *w, conn_t *c)
+{
+    /* Closing a descriptor also removes it from the epoll set */
+    if (c->origin.fd >= 0)
+        close(c->origin.fd);
+    close(c->client.fd);
+    if (c->tunnel != NULL)
+        tunnel_close(c->tunnel);
+    wait_stop(w, c);
+    if (c->start != 0  &&  !c->done)
+        stats_add(STAT_ERRORS, 1);
+    stats_add(STAT_ACTIVE, -1);
+    c->state = ST_CLOSED;
+    c->next = w->dead;
+    w->dead = c;
+}
+
+/*
+ * wait_start - Give a connection entering ST_READ_REQUEST until
+ * CLIENT_IDLE_TIMEOUT seconds from now to send its request header,
+ * putting it last on the worker's waiting list.
+ */
+static void wait_start(worker_t *w, conn_t *c)
+{
+    c->deadline = time(NULL) + CLIENT_IDLE_TIMEOUT;
+    c->wait_next = NULL;
+    c->wait_prev = w->waiting_tail;
+    if (w->waiting_tail != NULL)
+        w->waiting_tail->wait_next = c;
+    else
+        w->waiting = c;
+    w->waiting_tail = c;
+}
+
+/*
+ * wait_stop - Take a connection off the waiting list, if it is on it.
+ */
+static void wait_stop(worker_t *w, conn_t *c)
+{
+    if (c->deadline == 0)
+        return;
+    if (c->wait_prev != NULL)
+        c->wait_prev->wait_next = c->wait_next;
+    else
+        w->waiting = c->wait_next;
+    if (c->wait_next != NULL)
+        c->wait_next->wait_prev = c->wait_prev;
+    else
+        w->waiting_tail = c->wait_prev;
+    c->deadline = 0;
+}
+
+/*
+ * expire_waiting - Close the connections whose deadline has passed.
+ * Returns how many milliseconds the worker may sleep before the next
+ * one passes, or -1 if no connection is waiting.
+ */
+static int expire_waiting(worker_t *w)
+{
+    time_t now = time(NULL);
+
+    while (w->waiting != NULL  &&  w->waiting->deadline <= now)
+        conn_close(w, w->waiting);
+    if (w->waiting == NULL)
+        return -1;
+    return (w->waiting->deadline - now) * 1000;
+}
+
+/*
+ * read_request - Read request headers from the client until the
+ * terminating blank line arrives, then start connecting to the origin.
+ * Whatever the client sent after the last request is looked at first.
+ */
+static void read_request(worker_t *w, conn_t *c)
+{
+    int rc;
+    int n;
+
+    rc = c->in_len > 0 ? http_parse_request(c->in, c->in_len, &c->req)
+      : HTTP_INCOMPLETE;
+    while (rc == HTTP_INCOMPLETE) {
+        if (c->in_len == c->in_size) {
+            if (c->in_size >= MAXREQUEST) {
+                printf("Worker %d: request header too large\n", w->id);
+                conn_close(w, c);
+                return;
+            }
+            c->in_size *= 2;
+            c->in = arena_realloc(c->arena, c->in, c->in_size / 2, c->in_size);
+            arena_mark(c->arena);
+        }
+
+        n = read(c->client.fd, c->in + c->in_len, c->in_size - c->in_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN  &&  errno != EWOULDBLOCK)
+                conn_close(w, c);
+            return;
+        }
+        if (n == 0) {
+            /* Client went away, or is done with the connection */
+            conn_close(w, c);
+            return;
+        }
+        c->in_len += n;
+
+        /* Only the new bytes are looked at until the header is complete */
+        rc = http_parse_request(c->in, c->in_len, &c->req);
+    }
+
+    wait_stop(w, c);
+    if (rc == HTTP_ERROR) {
+        printf("Worker %d: malformed request\n", w->id);
+        stats_add(STAT_ERRORS, 1);
+        conn_close(w, c);
+        return;
+    }
+    c->start = stats_now();
+    stats_add(STAT_REQUESTS, 1);
+    stats_add(STAT_BYTES_IN, rc);
+
+    /* A request for the proxy itself rather than for an origin */
+    if (c->req.host.len == 0
+      &&  http_span_equals(c->in, c->req.path, STATS_PATH)) {
+        watch(w, &c->client, 0);
+        if (make_reply(c) < 0) {
+            conn_close(w, c);
+            return;
+        }
+        c->state = ST_REPLY;
+        serve_reply(w, c);
+        return;
+    }
+    if (prepare_request(w, c, rc) < 0) {
+        conn_close(w, c);
+        return;
+    }
+    if (c->key != NULL  &&  cache_lookup(c->key, &c->hit) == 0) {
+        if (serve_hit(c) == 0) {
+            watch(w, &c->client, 0);
+            c->state = ST_SERVE;
+            serve_cached(w, c);
+            return;
+        }
+        cache_close(&c->hit);
+    }
+    if (start_connect(w, c) < 0)
+        conn_close(w, c);
+}
+
+/*
+ * prepare_request - Rewrite a complete request for the origin, dropping
+ * the hop-by-hop headers.  An HTTP/1.1 request goes out as it is, to be
+ * answered over a connection that can carry another; an older one goes
+ * out with "Connection: close", as its client may not understand the
+ * framing of an HTTP/1.1 response.  Works out whether the client's
+ * connection can carry another request, fills in the origin's name and
+ * port, and the URL's cache key if it is a GET, and takes note of
+ * whatever came with the header of the request's body.  For CONNECT,
+ * all that is kept is whatever the client sent after the header, to go
+ * ahead of the tunnelled bytes.  Returns -1 if the request can't be
+ * forwarded.
+ */
+static int prepare_request(worker_t *w, conn_t *c, int header_len)
+{
+    http_request_t *req = &c->req;
+    char hostname[MAXLINE];
+    char pathname[MAXLINE];
+    char key[MAXLINE];
+    const http_header_t *expect;
+    rewriter_t *rw;
+    int size, flags;
+
+    if (req->target.len >= MAXLINE
+      ||  http_span_copy(hostname, MAXLINE, c->in, req->host) < 0
+      ||  http_span_copy(pathname, MAXLINE, c->in, req->path) < 0) {
+        printf("Worker %d: request target too long\n", w->id);
+        return -1;
+    }
+    c->url = arena_alloc(c->arena, req->target.len + 1);
+    http_span_copy(c->url, req->target.len + 1, c->in, req->target);
+    if (hostname[0] == '\0') {
+        printf("Worker %d: no host name in %s\n", w->id, c->url);
+        return -1;
+    }
+    c->hostname = arena_alloc(c->arena, strlen(hostname) + 1);
+    strcpy(c->hostname, hostname);
+    c->port = req->port;
+    if (http_span_equals(c->in, req->method, "CONNECT")) {
+        c->tunnelling = 1;
+        c->request = c->in + header_len;
+        c->request_len = c->in_len - header_len;
+        return 0;
+    }
+
+    c->has_body = http_body_init(&c->body, c->in, req);
+    if (c->has_body < 0) {
+        printf("Worker %d: unusable request body framing for %s\n",
+          w->id, c->url);
+        return -1;
+    }
+    c->in_used = header_len;
+    if (c->has_body) {
+        expect = http_find_header(c->in, req, "Expect");
+        c->expect = req->minor_version >= 1  &&  expect != NULL
+          &&  http_span_equals(c->in, expect->value, "100-continue");
+        c->body_buf = c->in + header_len;
+        c->body_len = http_body_scan(&c->body, c->body_buf,
+          c->in_len - header_len);
+        if (c->body_len < 0) {
+            printf("Worker %d: malformed request body for %s\n", w->id, c->url);
+            return -1;
+        }
+        c->in_used += c->body_len;
+    }
+    c->head = http_span_equals(c->in, req->method, "HEAD");
+    c->retryable = !c->has_body  &&  http_idempotent(c->in, req->method);
+    if (http_span_equals(c->in, req->method, "GET")  &&  !c->has_body
+      &&  cache_key(key, MAXLINE, hostname, c->port, pathname) == 0) {
+        c->key = arena_alloc(c->arena, strlen(key) + 1);
+        strcpy(c->key, key);
+        if (http_find_header(c->in, req, "Authorization") != NULL)
+            c->cache_flags = CACHE_REQ_AUTHORIZED;
+    }
+
+    rw = req->minor_version >= 1 ? keepalive_rewriter : close_rewriter;
+    size = rewrite_bound(rw, header_len);
+    c->request = arena_alloc(c->arena, size);
+    c->request_len = rewrite_request(rw, c->in, header_len, c->request,
+      size, &flags);
+    c->reusable = req->minor_version >= 1;
+    c->persist = req->minor_version >= 1  &&  !(flags & RW_CLOSE)
+      &&  ++c->nrequests < MAXREQUESTS;
+
+    size = strlen(hostname) + 8;
+    c->origin_key = arena_alloc(c->arena, size);
+    snprintf(c->origin_key, size, "%s:%d", hostname, c->port);
+    return 0;
+}
+
+/*
+ * start_connect - Take an idle connection to the origin if the worker
+ * has one, and send the request straight away.  Otherwise look up the
+ * origin's name and begin connecting to it; if the answer isn't cached
+ * the connection waits in ST_RESOLVE until take_resolved picks it up.
+ * Returns -1 if no connection attempt could be started.
+ */
+static int start_connect(worker_t *w, conn_t *c)
+{
+    int fd;
+
+    /* The client has nothing more to say until the response is back */
+    watch(w, &c->client, 0);
+    c->worker = w;
+
+    /* Only a request that can be sent twice risks an idle connection */
+    if (!c->tunnelling  &&  c->retryable  &&  !c->reused
+      &&  (fd = take_idle(w, c->origin_key)) >= 0) {
+        stats_add(STAT_UPSTREAM_REUSED, 1);
+        c->origin.fd = fd;
+        c->reused = 1;
+        c->state = ST_FORWARD;
+        forward_request(w, c);
+        return 0;
+    }
+
+    c->state = ST_RESOLVE;
+    switch (dns_lookup_async(c->hostname, &c->addrs, dns_resolved, c)) {
+    case 1:
+        return 0;
+    case -1:
+        printf("Worker %d: could not resolve %s\n", w->id, c->hostname);
+        return -1;
+    }
+    return connect_origin(w, c);
+}
+
+/*
+ * take_idle - Take the most recently used idle connection to the origin
+ * "key", closing on the way any that have been idle too long.  Returns
+ * its socket, or -1 if there is none.
+ */
+static int take_idle(worker_t *w, const char *key)
+{
+    time_t now = time(NULL);
+    idle_t **link = &w->idle;
+    idle_t *idle;
+    int fd;
+
+    while ((idle = *link) != NULL) {
+        if (now - idle->since >= UPSTREAM_IDLE_TIMEOUT) {
+            *link = idle->next;
+            w->nidle--;
+            retire_idle(w, idle);
+            continue;
+        }
+        if (strcmp(idle->key, key) == 0) {
+            *link = idle->next;
+            w->nidle--;
+            watch(w, &idle->h, 0);
+            fd = idle->h.fd;
+            idle->h.fd = -1;
+            retire_idle(w, idle);
+            return fd;
+        }
+        link = &idle->next;
+    }
+    return -1;
+}
+
+/*
+ * give_idle - Keep a connection to the origin "key" for the next
+ * request to it, or close it if the worker already keeps enough.
+ */
+static void give_idle(worker_t *w, const char *key, int fd)
+{
+    idle_t *idle;
+
+    if (w->nidle >= MAXIDLE) {
+        close(fd);
+        return;
+    }
+    idle = Malloc(sizeof(idle_t) + strlen(key) + 1);
+    idle->key = (char *)(idle + 1);
+    strcpy(idle->key, key);
+    idle->h.fd = fd;
+    idle->h.events = 0;
+    idle->h.conn = NULL;
+    idle->h.idle = idle;
+    idle->since = time(NULL);
+    idle->next = w->idle;
+    w->idle = idle;
+    w->nidle++;
+
+    /* An idle origin has nothing to say; anything at all means it's done */
+    watch(w, &idle->h, EPOLLIN | EPOLLRDHUP);
+}
+
+/*
+ * drop_idle - An idle connection became readable, so the origin has
+ * closed it or broken the protocol; either way it is no use.
+ */
+static void drop_idle(worker_t *w, idle_t *idle)
+{
+    idle_t **link;
+
+    if (idle->h.fd < 0)
+        return;             /* Already taken or dropped during this batch */
+    for (link = &w->idle; *link != idle; link = &(*link)->next)
+        ;
+    *link = idle->next;
+    w->nidle--;
+    retire_idle(w, idle);
+}
+
+/*
+ * retire_idle - Close an idle connection taken off the idle list, unless
+ * its socket has been taken for a request, and queue its entry to be
+ * freed at the end of the current batch of events.
+ */
+static void retire_idle(worker_t *w, idle_t *idle)
+{
+    /* Closing a descriptor also removes it from the epoll set */
+    if (idle->h.fd >= 0)
+        close(idle->h.fd);
+    idle->h.fd = -1;
+    idle->next = w->idle_dead;
+    w->idle_dead = idle;
+}
+
+/*
+ * dns_resolved - Lookup callback, run on a resolver thread.  Hands
+ * the connection back to its worker.
+ */
+static void dns_resolved(void *arg, const dns_addrs_t *result)
+{
+    conn_t *c = (conn_t *)arg;
+    worker_t *w = c->worker;
+    uint64_t one = 1;
+
+    c->addrs = *result;
+    pthread_mutex_lock(&w->resolved_lock);
+    c->next = w->resolved;
+    w->resolved = c;
+    pthread_mutex_unlock(&w->resolved_lock);
+    if (write(w->notify.fd, &one, sizeof(one)) < 0  &&  errno != EAGAIN)
+        unix_error("dns_resolved: write error");
+}
+
+/*
+ * take_resolved - Start connecting every connection whose lookup has
+ * completed since the last call.
+ */
+static void take_resolved(worker_t *w)
+{
+    uint64_t count;
+    conn_t *c, *next;
+
+    if (read(w->notify.fd, &count, sizeof(count)) < 0  &&  errno != EAGAIN)
+        unix_error("take_resolved: read error");
+    pthread_mutex_lock(&w->resolved_lock);
+    c = w->resolved;
+    w->resolved = NULL;
+    pthread_mutex_unlock(&w->resolved_lock);
+
+    for (; c != NULL; c = next) {
+        next = c->next;
+        if (c->addrs.naddrs == 0) {
+            printf("Worker %d: could not resolve host for %s\n", w->id, c->url);
+            conn_close(w, c);
+        } else if (connect_origin(w, c) < 0) {
+            conn_close(w, c);
+        }
+    }
+}
+
+/*
+ * connect_origin - Begin a non-blocking connect to the next of the
+ * origin's addresses that accepts one.  Returns -1 once every address
+ * has been tried.
+ */
+static int connect_origin(worker_t *w, conn_t *c)
+{
+    struct sockaddr_storage *addr;
+    socklen_t addrlen;
+    int fd;
+
+    while (c->addr_next < c->addrs.naddrs) {
+        addr = &c->addrs.addrs[c->addr_next];
+        addrlen = c->addrs.addrlens[c->addr_next++];
+        fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            continue;
+        no_delay(fd);
+        dns_set_port(addr, c->port);
+        c->connect_start = stats_now();
+        if (connect(fd, (SA *)addr, addrlen) == 0  ||  errno == EINPROGRESS) {
+            c->origin.fd = fd;
+            c->state = ST_CONNECT;
+            watch(w, &c->origin, EPOLLOUT);
+            return 0;
+        }
+        close(fd);
+    }
+    printf("Worker %d: could not open connection for %s\n", w->id, c->url);
+    return -1;
+}
+
+/*
+ * finish_connect - The origin socket became writable; find out
+ * whether the connect succeeded and, if so, send the request.  If it
+ * failed, the origin's next address is tried.
+ */
+static void finish_connect(worker_t *w, conn_t *c)
+{
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(c->origin.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0  ||  err != 0) {
+        printf("Worker %d: could not connect for %s: %s\n",
+          w->id, c->url, strerror(err != 0 ? err : errno));
+        close(c->origin.fd);
+        c->origin.fd = -1;
+        c->origin.events = 0;
+        if (connect_origin(w, c) < 0)
+            conn_close(w, c);
+        return;
+    }
+    stats_record(STAT_CONNECT, stats_now() - c->connect_start);
+    stats_add(STAT_UPSTREAM_CONNECTS, 1);
+    if (c->tunnelling) {
+        start_tunnel(w, c);
+        return;
+    }
+    c->state = ST_FORWARD;
+    forward_request(w, c);
+}
+
+/*
+ * forward_request - Send as much of the rewritten request to the
+ * origin as it will take, then move on to its body, or start relaying
+ * the response.
+ */
+static void forward_request(worker_t *w, conn_t *c)
+{
+    static const char go_ahead[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    int n;
+
+    while (c->request_sent < c->request_len) {
+        n = send(c->origin.fd, c->request + c->request_sent,
+          c->request_len - c->request_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN  ||  errno == EWOULDBLOCK)
+                watch(w, &c->origin, EPOLLOUT);
+            else if (c->reused  &&  c->retryable)
+                retry_request(w, c);    /* See origin_closed */
+            else
+                conn_close(w, c);
+            return;
+        }
+        c->request_sent += n;
+    }
+
+    if (c->has_body) {
+        if (c->expect  &&  send(c->client.fd, go_ahead, sizeof(go_ahead) - 1,
+          MSG_NOSIGNAL) != sizeof(go_ahead) - 1) {
+            conn_close(w, c);
+            return;
+        }
+        c->state = ST_BODY;
+        forward_body(w, c);
+        return;
+    }
+    c->state = ST_RELAY;
+    watch(w, &c->origin, EPOLLIN);
+}
+
+/*
+ * forward_body - Move request body bytes from the client to the
+ * origin, starting with any that came in with the header.  As with
+ * responses, the relay buffer is drained before the client is read
+ * again, so a slow origin throttles its client.  Bytes after the body
+ * are the start of the client's next request, and are kept for it.
+ */
+static void forward_body(worker_t *w, conn_t *c)
+{
+    int budget;
+    int n, m;
+
+    for (budget = RELAYBUDGET; budget > 0; budget--) {
+        while (c->body_len > 0  ||  c->buf_head < c->buf_tail) {
+            if (c->body_len > 0)
+                n = send(c->origin.fd, c->body_buf, c->body_len, MSG_NOSIGNAL);
+            else
+                n = send(c->origin.fd, c->buf + c->buf_head,
+                  c->buf_tail - c->buf_head, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN  ||  errno == EWOULDBLOCK) {
+                    watch(w, &c->client, 0);
+                    watch(w, &c->origin, EPOLLOUT);
+                } else
+                    conn_close(w, c);
+                return;
+            }
+            stats_add(STAT_BYTES_IN, n);
+            if (c->body_len > 0) {
+                c->body_buf += n;
+                c->body_len -= n;
+            } else
+                c->buf_head += n;
+        }
+        c->buf_head = c->buf_tail = 0;
+        if (http_body_done(&c->body)) {
+            c->state = ST_RELAY;
+            watch(w, &c->client, 0);
+            watch(w, &c->origin, EPOLLIN);
+            return;
+        }
+        watch(w, &c->origin, 0);
+        watch(w, &c->client, EPOLLIN);
+
+        n = read(c->client.fd, c->buf, MAXBUF);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN  &&  errno != EWOULDBLOCK)
+                conn_close(w, c);
+            return;
+        }
+        if (n == 0) {
+            /* Client went away before finishing its body */
+            conn_close(w, c);
+            return;
+        }
+        if ((m = http_body_scan(&c->body, c->buf, n)) < 0) {
+            printf("Worker %d: malformed request body for %s\n", w->id, c->url);
+            conn_close(w, c);
+            return;
+        }
+        if (m < n) {
+            /* Everything in "in" has gone out, so it can start over */
+            memcpy(c->in, c->buf + m, n - m);
+            c->in_len = n - m;
+            c->in_used = 0;
+        }
+        c->buf_tail = m;
+    }
+}
+
+/*
+ * start_tunnel - The origin of a CONNECT is connected; tell the client
+ * and start relaying.
+ */
+static void start_tunnel(worker_t *w, conn_t *c)
+{
+    static const char established[] =
+      "HTTP/1.1 200 Connection established\r\n\r\n";
+    tunnel_t *t = arena_alloc(c->arena, sizeof(tunnel_t));
+
+    if (tunnel_open(t, c->client.fd, c->origin.fd, c->request,
+      c->request_len, established, sizeof(established) - 1) < 0) {
+        printf("Worker %d: could not set up tunnel to %s\n", w->id, c->url);
+        conn_close(w, c);
+        return;
+    }
+    c->tunnel = t;
+    c->state = ST_TUNNEL;
+    first_byte(c);
+    relay_tunnel(w, c);
+}
+
+/*
+ * relay_tunnel - Pump both directions of a tunnel, then watch each
+ * socket for whatever the directions are waiting for.  When both are
+ * done the tunnel is logged like any other response.
+ */
+static void relay_tunnel(worker_t *w, conn_t *c)
+{
+    tunnel_t *t = c->tunnel;
+    unsigned int client_events = 0;
+    unsigned int origin_events = 0;
+    int up = tunnel_pump(&t->up);
+    int down = tunnel_pump(&t->down);
+
+    if (up == TUNNEL_ERROR  ||  down == TUNNEL_ERROR) {
+        conn_close(w, c);
+        return;
+    }
+    if (up == TUNNEL_DONE  &&  down == TUNNEL_DONE) {
+        log_request(&c->clientaddr, c->url, t->down.bytes);
+        stats_add(STAT_BYTES_IN, t->up.bytes);
+        response_done(c, t->down.bytes);
+        conn_close(w, c);
+        return;
+    }
+    if (up == TUNNEL_READ)
+        client_events |= EPOLLIN;
+    else if (up == TUNNEL_WRITE)
+        origin_events |= EPOLLOUT;
+    if (down == TUNNEL_READ)
+        origin_events |= EPOLLIN;
+    else if (down == TUNNEL_WRITE)
+        client_events |= EPOLLOUT;
+    watch(w, &c->client, client_events);
+    watch(w, &c->origin, origin_events);
+}
+
+/*
+ * relay_response - Move the response from the origin to the client.
+ *
+ * Until its header is complete, the response collects at the start of
+ * the relay buffer; then the header goes out rewritten for the client
+ * (see take_header), and the body goes out as it is, with
+ * http_body_scan watching for its end.  The relay buffer is always
+ * drained to the client before more is read from the origin, so a slow
+ * client throttles its origin rather than making us buffer.
+ */
+static void relay_response(worker_t *w, conn_t *c)
+{
+    int budget;
+    int n, m;
+
+    for (budget = RELAYBUDGET; budget > 0; budget--) {
+        if (send_pending(w, c) < 0)
+            return;
+        if (c->resp_state == RESP_DONE) {
+            finish_response(w, c);
+            return;
+        }
+        watch(w, &c->client, 0);
+        watch(w, &c->origin, EPOLLIN);
+
+        n = read(c->origin.fd, c->buf + c->buf_tail, MAXBUF - c->buf_tail);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN  ||  errno == EWOULDBLOCK)
+                return;
+            n = 0;              /* Treat a failed read like a close */
+        }
+        if (n == 0) {
+            origin_closed(w, c);
+            return;
+        }
+        if (c->resp_state == RESP_HEADER) {
+            c->buf_tail += n;
+            if (take_header(w, c) < 0) {
+                conn_close(w, c);
+                return;
+            }
+            continue;
+        }
+
+        if ((m = http_body_scan(&c->resp_body, c->buf, n)) < 0) {
+            printf("Worker %d: malformed response body for %s\n", w->id, c->url);
+            conn_close(w, c);
+            return;
+        }
+        if (m < n)
+            c->reusable = 0;    /* The origin sent more than the response */
+        save_for_cache(c, c->buf, m);
+        c->buf_tail = m;
+        if (http_body_done(&c->resp_body))
+            c->resp_state = RESP_DONE;
+    }
+
+    /* Out of budget; come back when the client can take the rest */
+    watch(w, &c->origin, 0);
+    watch(w, &c->client, EPOLLOUT);
+}
+
+/*
+ * send_pending - Send the client everything waiting for it: bytes
+ * queued ahead, then the relay buffer, unless that holds a header
+ * still being collected.  Both go in one writev, so that a header and
+ * the body after it don't leave as two small segments, the second held
+ * back by Nagle's algorithm until the first is acknowledged.  Returns
+ * 0 once all of it has gone, or -1 if the client must be waited for,
+ * or the connection has been closed.
+ */
+static int send_pending(worker_t *w, conn_t *c)
+{
+    struct iovec iov[2];
+    int niov;
+    ssize_t n;
+
+    while (1) {
+        niov = 0;
+        if (c->ahead_len > 0) {
+            iov[niov].iov_base = (void *)c->ahead;
+            iov[niov++].iov_len = c->ahead_len;
+        }
+        if (c->resp_state != RESP_HEADER  &&  c->buf_head < c->buf_tail) {
+            iov[niov].iov_base = c->buf + c->buf_head;
+            iov[niov++].iov_len = c->buf_tail - c->buf_head;
+        }
+        if (niov == 0)
+            break;
+        n = writev(c->client.fd, iov, niov);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN  ||  errno == EWOULDBLOCK) {
+                watch(w, &c->origin, 0);
+                watch(w, &c->client, EPOLLOUT);
+            } else
+                conn_close(w, c);
+            return -1;
+        }
+        c->response_len += n;
+        if (n >= c->ahead_len) {
+            c->buf_head += n - c->ahead_len;
+            c->ahead_len = 0;
+        } else {
+            c->ahead += n;
+            c->ahead_len -= n;
+        }
+    }
+    if (c->resp_state != RESP_HEADER)
+        c->buf_head = c->buf_tail = 0;
+    return 0;
+}
+
+/*
+ * take_header - Parse the response header collected in the relay
+ * buffer.  Once it is all there, work out how the body is framed and
+ * whether either connection can outlast the response, and queue the
+ * header, rewritten for the client, to go ahead of the body bytes that
+ * came with it.  Interim 1xx responses are queued the same way, and
+ * the header after them parsed in turn.  Returns -1 if the response
+ * can't be relayed.
+ */
+static int take_header(worker_t *w, conn_t *c)
+{
+    rewriter_t *rw;
+    char *out;
+    int hlen, size, flags;
+    int interim;
+    int n;
+
+    while (1) {
+        hlen = http_parse_response(c->buf, c->buf_tail, &c->resp);
+        if (hlen == HTTP_INCOMPLETE) {
+            if (c->buf_tail < MAXBUF)
+                return 0;
+            printf("Worker %d: response header too large for %s\n",
+              w->id, c->url);
+            return -1;
+        }
+        if (hlen == HTTP_ERROR  ||  http_response_body_init(&c->resp_body,
+          c->buf, &c->resp, c->head) < 0) {
+            printf("Worker %d: malformed response for %s\n", w->id, c->url);
+            return -1;
+        }
+        first_byte(c);
+
+        /* A response that ends with the connection ends the client's too */
+        interim = c->resp.status < 200  &&  c->resp.status != 101;
+        if (http_body_until_close(&c->resp_body))
+            c->persist = c->reusable = 0;
+        if (c->resp.minor_version < 1)
+            c->reusable = 0;
+
+        rw = c->persist  ||  interim ? response_rewriter : response_close_rewriter;
+        size = c->ahead_len + rewrite_bound(rw, hlen);
+        out = arena_alloc(c->arena, size);
+        memcpy(out, c->ahead, c->ahead_len);
+        n = rewrite_request(rw, c->buf, hlen, out + c->ahead_len,
+          size - c->ahead_len, &flags);
+        if (flags & RW_CLOSE)
+            c->reusable = 0;
+        if (!interim) {
+            save_for_cache(c, out + c->ahead_len, n);
+            c->ahead = out;
+            c->ahead_len += n;
+            break;
+        }
+        c->ahead = out;
+        c->ahead_len += n;
+        memmove(c->buf, c->buf + hlen, c->buf_tail - hlen);
+        c->buf_tail -= hlen;
+        http_response_init(&c->resp);
+    }
+
+    n = http_body_scan(&c->resp_body, c->buf + hlen, c->buf_tail - hlen);
+    if (n < 0) {
+        printf("Worker %d: malformed response body for %s\n", w->id, c->url);
+        return -1;
+    }
+    if (n < c->buf_tail - hlen)
+        c->reusable = 0;        /* The origin sent more than the response */
+    save_for_cache(c, c->buf + hlen, n);
+    c->buf_head = hlen;
+    c->buf_tail = hlen + n;
+    c->resp_state = http_body_done(&c->resp_body) ? RESP_DONE : RESP_BODY;
+    return 0;
+}
+
+/*
+ * origin_closed - The origin closed its connection, or it failed.  That
+ * is how a response without a length ends.  If the connection was an
+ * idle one and nothing came back on it, the origin most likely closed
+ * it as the request went out, so the request is sent again over a new
+ * one.  Anything else is a truncated response, which the client can
+ * only be told about by closing its connection too.
+ */
+static void origin_closed(worker_t *w, conn_t *c)
+{
+    if (c->resp_state == RESP_BODY  &&  http_body_until_close(&c->resp_body)) {
+        finish_response(w, c);
+        return;
+    }
+    if (c->reused  &&  c->retryable  &&  c->resp_state == RESP_HEADER
+      &&  c->buf_tail == 0  &&  c->response_len == 0) {
+        retry_request(w, c);
+        return;
+    }
+    conn_close(w, c);
+}
+
+/*
+ * retry_request - Send the request again over a new connection to the
+ * origin, instead of the idle one it went out on.
+ */
+static void retry_request(worker_t *w, conn_t *c)
+{
+    close(c->origin.fd);
+    c->origin.fd = -1;
+    c->origin.events = 0;
+    c->request_sent = 0;
+    c->reused = c->retryable = 0;
+    if (start_connect(w, c) < 0)
+        conn_close(w, c);
+}
+
+/*
+ * finish_response - The whole response has gone out: log it just like
+ * process_request does, offer it to the cache, keep the origin
+ * connection for the next request to the origin if it is still usable,
+ * and go on to the client's next request.
+ */
+static void finish_response(worker_t *w, conn_t *c)
+{
+    log_request(&c->clientaddr, c->url, c->response_len);
+    response_done(c, c->response_len);
+    if (c->object != NULL) {
+        cache_insert(c->key, c->object, c->object_len, c->cache_flags);
+        c->object = NULL;
+    }
+    watch(w, &c->origin, 0);
+    if (c->reusable)
+        give_idle(w, c->origin_key, c->origin.fd);
+    else
+        close(c->origin.fd);
+    c->origin.fd = -1;
+    next_request(w, c);
+}
+
+/*
+ * next_request - Clear away the request just answered and start on the
+ * client's next one, or close the connection if it can't carry one.
+ */
+static void next_request(worker_t *w, conn_t *c)
+{
+    if (!c->persist) {
+        conn_close(w, c);
+        return;
+    }
+    c->in_len -= c->in_used;
+    memmove(c->in, c->in + c->in_used, c->in_len);
+    arena_reset(c->arena);
+    memset(&c->request, 0, offsetof(conn_t, buf) - offsetof(conn_t, request));
+    http_request_init(&c->req);
+    c->state = ST_READ_REQUEST;
+    watch(w, &c->client, EPOLLIN);
+    wait_start(w, c);
+    read_request(w, c);
+}
+
+/*
+ * save_for_cache - Append "n" bytes relayed to the client to the copy
+ * of the response kept for the cache, giving up on the copy once the
+ * response is too large to be cached.
+ */
+static void save_for_cache(conn_t *c, const char *buf, int n)
+{
+    if (c->key == NULL)
+        return;
+    if (c->object_len + n > cache_max_object()) {
+        free(c->object);
+        c->object = NULL;
+        c->key[0] = '\0';    /* Don't start another copy */
+        return;
+    }
+    if (c->key[0] == '\0')
+        return;
+
+    if (c->object_len + n > c->object_size) {
+        if (c->object_size == 0)
+            c->object_size = MAXBUF;
+        while (c->object_len + n > c->object_size)
+            c->object_size *= 2;
+        c->object = Realloc(c->object, c->object_size);
+    }
+    memcpy(c->object + c->object_len, buf, n);
+    c->object_len += n;
+}
+
+/*
+ * serve_hit - Get ready to serve a cached response.  Returns -1 if it
+ * can't be served to this client, being chunked and the client older
+ * than HTTP/1.1.
+ */
+static int serve_hit(conn_t *c)
+{
+    int flags;
+
+    if ((c->hit_head = cache_wait_header(&c->hit, &flags)) < 0
+      ||  ((flags & CACHE_HEAD_CHUNKED)  &&  c->req.minor_version < 1))
+        return -1;
+    if (flags & CACHE_HEAD_CLOSE) {
+        c->persist = 0;
+        c->closing_sent = 1;
+    }
+    return 0;
+}
+
+/*
+ * serve_cached - Write a cached response to the client, then log it
+ * and go on to the client's next request.  If there won't be one, the
+ * client is told so just ahead of the blank line ending the header.
+ */
+static void serve_cached(worker_t *w, conn_t *c)
+{
+    static const char closing[] = "Connection: close\r\n";
+    const char *buf;
+    int n;
+
+    first_byte(c);
+
+    /* The object is complete, so cache_read never waits */
+    while (c->ahead_len > 0  ||  c->hit_len > 0
+      ||  (c->hit_len = cache_read(&c->hit, &c->hit_buf)) > 0) {
+        if (c->ahead_len > 0) {
+            buf = c->ahead;
+            n = c->ahead_len;
+        } else {
+            buf = c->hit_buf;
+            n = c->hit_len;
+            if (!c->persist  &&  !c->closing_sent
+              &&  c->hit_sent + n > c->hit_head) {
+                n = c->hit_head - c->hit_sent;
+                if (n == 0) {
+                    c->ahead = closing;
+                    c->ahead_len = sizeof(closing) - 1;
+                    c->closing_sent = 1;
+                    continue;
+                }
+            }
+        }
+        n = send(c->client.fd, buf, n, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN  ||  errno == EWOULDBLOCK)
+                watch(w, &c->client, EPOLLOUT);
+            else
+                conn_close(w, c);
+            return;
+        }
+        if (c->ahead_len > 0) {
+            c->ahead += n;
+            c->ahead_len -= n;
+        } else {
+            c->hit_buf += n;
+            c->hit_len -= n;
+            c->hit_sent += n;
+        }
+        c->response_len += n;
+    }
+
+    log_request(&c->clientaddr, c->url, c->response_len);
+    stats_add(STAT_CACHE_HITS, 1);
+    response_done(c, c->response_len);
+    cache_close(&c->hit);
+    next_request(w, c);
+}
+
+/*
+ * make_reply - Build the response to a request for the proxy's
+ * statistics.  Returns -1 if it could not be made.
+ */
+static int make_reply(conn_t *c)
+{
+    char *body = arena_alloc(c->arena, STATS_MAX_JSON);
+    int body_len;
+
+    if ((body_len = stats_format(body, STATS_MAX_JSON)) < 0)
+        return -1;
+    c->reply = arena_alloc(c->arena, body_len + MAXLINE);
+    c->reply_len = snprintf(c->reply, MAXLINE,
+      "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\n"
+      "Content-Length: %d\r\nCache-Control: no-store\r\n"
+      "Connection: close\r\n\r\n", body_len);
+    memcpy(c->reply + c->reply_len, body, body_len);
+    c->reply_len += body_len;
+    return 0;
+}
+
+/*
+ * serve_reply - Write the response the proxy made to the client, then
+ * close the connection.
+ */
+static void serve_reply(worker_t *w, conn_t *c)
+{
+    int n;
+
+    first_byte(c);
+    while (c->reply_len > 0) {
+        n = send(c->client.fd, c->reply, c->reply_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN  ||  errno == EWOULDBLOCK)
+                watch(w, &c->client, EPOLLOUT);
+            else
+                conn_close(w, c);
+            return;
+        }
+        c->reply += n;
+        c->reply_len -= n;
+        c->response_len += n;
+    }
+    response_done(c, c->response_len);
+    conn_close(w, c);
+}
+
+/*
+ * first_byte - Time the first byte of the response, unless that has
+ * been done already.
+ */
+static void first_byte(conn_t *c)
+{
+    if (!c->answered) {
+        c->answered = 1;
+        stats_record(STAT_TTFB, stats_now() - c->start);
+    }
+}
+
+/*
+ * response_done - Count a response of "len" bytes that went out in
+ * full, and time it.
+ */
+static void response_done(conn_t *c, int len)
+{
+    c->done = 1;
+    stats_add(STAT_BYTES_OUT, len);
+    stats_record(STAT_TOTAL, stats_now() - c->start);
+}
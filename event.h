@@ -0,0 +1,20 @@
+#ifndef _EVENT_H
+#define _EVENT_H
+
+/*
+ * Event-driven proxy mode.
+ *
+ * event_run starts "nworkers" worker threads, pins worker i to CPU
+ * (i mod number-of-CPUs), and has each of them run a non-blocking
+ * epoll loop that accepts clients on "port" and carries every request
+ * through to completion without ever blocking.  If nworkers is zero
+ * or negative, one worker per online CPU is started.  The workers
+ * share one listening socket, unless "reuseport" is set, in which case
+ * each has its own SO_REUSEPORT socket and the kernel picks which
+ * worker gets a new connection.
+ *
+ * event_run never returns.
+ */
+extern void event_run(int port, int nworkers, int reuseport);
+
+#endif /* _EVENT_H */
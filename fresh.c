@@ -0,0 +1,317 @@
+/*
+ * fresh.c - Freshness lifetimes, validators and conditional requests
+ *
+ * See fresh.h for the interface.  Headers are parsed with
+ * http_parse_response and their fields looked up by name; HTTP dates
+ * are read in all three formats a recipient has to accept, and a date
+ * that can't be read counts as none, except in Expires, where it means
+ * the response has already expired.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "fresh.h"
+#include "httpparse.h"
+
+/* Fields a 304 brings up to date in the stored header */
+static const char *updated_fields[] = {
+    "Date", "Expires", "Cache-Control", "ETag", "Last-Modified", "Age"
+};
+#define NUPDATED (sizeof(updated_fields) / sizeof(updated_fields[0]))
+
+/* Fields the 304s we send ourselves carry over from the stored header */
+static const char *not_modified_fields[] = {
+    "Date", "Expires", "Cache-Control", "ETag", "Last-Modified", "Vary",
+    "Content-Location"
+};
+
+static int parse(const char *head, int len, http_response_t *resp);
+static time_t field_date(const char *head, const http_response_t *resp,
+  const char *name);
+static time_t parse_date(const char *s, int len);
+static long directive(const char *buf, http_span_t value, const char *name);
+static int etag_listed(const char *list, const char *etag, int etag_len);
+static int put(char **p, char *end, const char *buf, int n);
+static int put_field(char **p, char *end, const char *buf,
+  const http_header_t *h);
+
+/*
+ * fresh_expires - Work out the lifetime, and take off the age the
+ * response arrived with.
+ */
+time_t fresh_expires(const char *head, int len, time_t now)
+{
+    http_response_t resp;
+    const http_header_t *h;
+    time_t date, expires, modified;
+    long lifetime = -1;
+    long age = 0;
+
+    if (parse(head, len, &resp) < 0)
+        return now;
+    if ((date = field_date(head, &resp, "Date")) < 0  ||  date > now)
+        date = now;
+    if ((h = http_find_response_header(head, &resp, "Age")) != NULL)
+        age = strtol(head + h->value.off, NULL, 10);
+    if (age < now - date)
+        age = now - date;
+
+    if ((h = http_find_response_header(head, &resp, "Cache-Control")) != NULL) {
+        if (directive(head, h->value, "no-cache") >= 0)
+            return now;
+        if ((lifetime = directive(head, h->value, "s-maxage")) < 0)
+            lifetime = directive(head, h->value, "max-age");
+    }
+    if (lifetime < 0
+      &&  http_find_response_header(head, &resp, "Expires") != NULL) {
+        expires = field_date(head, &resp, "Expires");
+        lifetime = expires > date ? expires - date : 0;
+    }
+    if (lifetime < 0
+      &&  (modified = field_date(head, &resp, "Last-Modified")) >= 0
+      &&  modified <= date) {
+        lifetime = (date - modified) / 10;
+        if (lifetime > FRESH_HEURISTIC_MAX)
+            lifetime = FRESH_HEURISTIC_MAX;
+    }
+    if (lifetime < 0)
+        lifetime = FRESH_DEFAULT;
+    return now + lifetime - age;
+}
+
+/*
+ * fresh_conditions - Send both validators when there are both; the
+ * origin picks the one it understands.
+ */
+int fresh_conditions(const char *head, int len, char *dst, int size)
+{
+    http_response_t resp;
+    const http_header_t *h;
+    char *p = dst;
+    char *end = dst + size;
+
+    if (parse(head, len, &resp) < 0)
+        return 0;
+    if ((h = http_find_response_header(head, &resp, "ETag")) != NULL
+      &&  (put(&p, end, "If-None-Match: ", 15) < 0
+        ||  put(&p, end, head + h->value.off, h->value.len) < 0
+        ||  put(&p, end, "\r\n", 2) < 0))
+        return -1;
+    if ((h = http_find_response_header(head, &resp, "Last-Modified")) != NULL
+      &&  (put(&p, end, "If-Modified-Since: ", 19) < 0
+        ||  put(&p, end, head + h->value.off, h->value.len) < 0
+        ||  put(&p, end, "\r\n", 2) < 0))
+        return -1;
+    return p - dst;
+}
+
+/*
+ * fresh_update - Copy the stored header without the fields the 304
+ * updates, then add the 304's.  A stored Age is dropped even if the
+ * 304 has none, since it no longer says anything.
+ */
+int fresh_update(const char *head, int len, const char *update,
+  int update_len, char *dst, int size)
+{
+    http_response_t resp, upd;
+    const http_header_t *h;
+    const char *eol;
+    char *p = dst;
+    char *end = dst + size;
+    int i, j;
+
+    if (parse(head, len, &resp) < 0  ||  parse(update, update_len, &upd) < 0)
+        return -1;
+    eol = memchr(head, '\n', len);
+    if (put(&p, end, head, eol + 1 - head) < 0)
+        return -1;
+    for (i = 0; i < resp.nheaders; i++) {
+        h = &resp.headers[i];
+        for (j = 0; j < NUPDATED; j++)
+            if (http_span_equals(head, h->name, updated_fields[j]))
+                break;
+        if (j < NUPDATED  &&  (http_span_equals(head, h->name, "Age")
+          ||  http_find_response_header(update, &upd, updated_fields[j]) != NULL))
+            continue;
+        if (put_field(&p, end, head, h) < 0)
+            return -1;
+    }
+    for (j = 0; j < NUPDATED; j++)
+        if ((h = http_find_response_header(update, &upd,
+          updated_fields[j])) != NULL  &&  put_field(&p, end, update, h) < 0)
+            return -1;
+    if (put(&p, end, "\r\n", 2) < 0)
+        return -1;
+    return p - dst;
+}
+
+/*
+ * fresh_not_modified - If-None-Match decides if it is there; a
+ * response without a Last-Modified time can't satisfy
+ * If-Modified-Since.
+ */
+int fresh_not_modified(const char *head, int len,
+  const char *if_none_match, const char *if_modified_since)
+{
+    http_response_t resp;
+    const http_header_t *h;
+    time_t since, modified;
+
+    if (parse(head, len, &resp) < 0)
+        return 0;
+    if (if_none_match != NULL) {
+        if ((h = http_find_response_header(head, &resp, "ETag")) == NULL)
+            return 0;
+        return etag_listed(if_none_match, head + h->value.off, h->value.len);
+    }
+    if (if_modified_since == NULL
+      ||  (since = parse_date(if_modified_since,
+        strlen(if_modified_since))) < 0
+      ||  (modified = field_date(head, &resp, "Last-Modified")) < 0)
+        return 0;
+    return modified <= since;
+}
+
+/*
+ * fresh_304 - A bodyless answer, so no Content-Length or anything else
+ * about the body.
+ */
+int fresh_304(const char *head, int len, char *dst, int size)
+{
+    http_response_t resp;
+    const http_header_t *h;
+    char *p = dst;
+    char *end = dst + size;
+    int i;
+
+    if (parse(head, len, &resp) < 0
+      ||  put(&p, end, "HTTP/1.1 304 Not Modified\r\n", 27) < 0)
+        return -1;
+    for (i = 0; i < sizeof(not_modified_fields) / sizeof(not_modified_fields[0]);
+         i++) {
+        if ((h = http_find_response_header(head, &resp,
+          not_modified_fields[i])) != NULL  &&  put_field(&p, end, head, h) < 0)
+            return -1;
+    }
+    if (put(&p, end, "\r\n", 2) < 0)
+        return -1;
+    return p - dst;
+}
+
+/*
+ * parse - Parse a whole response header.  Returns -1 if it is not one.
+ */
+static int parse(const char *head, int len, http_response_t *resp)
+{
+    http_response_init(resp);
+    return http_parse_response(head, len, resp) == len ? 0 : -1;
+}
+
+/*
+ * field_date - The date in a field, or -1 if it is missing or can't be
+ * read.
+ */
+static time_t field_date(const char *head, const http_response_t *resp,
+  const char *name)
+{
+    const http_header_t *h = http_find_response_header(head, resp, name);
+
+    return h != NULL ? parse_date(head + h->value.off, h->value.len) : -1;
+}
+
+/*
+ * parse_date - Read an HTTP date: the preferred IMF-fixdate, or the
+ * obsolete RFC 850 and asctime forms.
+ */
+static time_t parse_date(const char *s, int len)
+{
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y"
+    };
+    char buf[64];
+    struct tm tm;
+    char *end;
+    int i;
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        if ((end = strptime(buf, formats[i], &tm)) != NULL  &&  *end == '\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+/*
+ * directive - Find a Cache-Control directive.  Returns its number of
+ * seconds, 0 if it has none, or -1 if it isn't there.
+ */
+static long directive(const char *buf, http_span_t value, const char *name)
+{
+    int at;
+
+    if ((at = http_list_find(buf, value, name)) < 0)
+        return -1;
+    return at < value.off + value.len  &&  buf[at] == '='
+      ? strtol(buf + at + 1, NULL, 10) : 0;
+}
+
+/*
+ * etag_listed - Is an entity tag in an If-None-Match list?  The weak
+ * comparison ignores "W/", so a tag we weakened still matches.
+ */
+static int etag_listed(const char *list, const char *etag, int etag_len)
+{
+    const char *p = list;
+    const char *q;
+
+    if (etag_len > 2  &&  strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+        etag_len -= 2;
+    }
+    while (*p != '\0') {
+        while (*p == ' '  ||  *p == '\t'  ||  *p == ',')
+            p++;
+        if (*p == '*')
+            return 1;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+        if (*p != '"'  ||  (q = strchr(p + 1, '"')) == NULL)
+            return 0;
+        if (q + 1 - p == etag_len  &&  strncmp(p, etag, etag_len) == 0)
+            return 1;
+        p = q + 1;
+    }
+    return 0;
+}
+
+/*
+ * put - Append "n" bytes at *p, if they fit before "end".
+ */
+static int put(char **p, char *end, const char *buf, int n)
+{
+    if (end - *p < n)
+        return -1;
+    memcpy(*p, buf, n);
+    *p += n;
+    return 0;
+}
+
+/*
+ * put_field - Append a header field from "buf" as a line of its own.
+ */
+static int put_field(char **p, char *end, const char *buf,
+  const http_header_t *h)
+{
+    if (put(p, end, buf + h->name.off, h->name.len) < 0
+      ||  put(p, end, ": ", 2) < 0
+      ||  put(p, end, buf + h->value.off, h->value.len) < 0
+      ||  put(p, end, "\r\n", 2) < 0)
+        return -1;
+    return 0;
+}
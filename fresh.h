@@ -0,0 +1,67 @@
+#ifndef _FRESH_H
+#define _FRESH_H
+
+#include <time.h>
+
+/*
+ * Freshness and validation of stored responses.
+ *
+ * A stored response is fresh for the lifetime its origin gave it: the
+ * "s-maxage" or "max-age" of its Cache-Control, or else its Expires
+ * less its Date.  One that gives none but has a Last-Modified time is
+ * guessed to stay fresh for a tenth of the time it had gone unmodified
+ * when it was sent, up to FRESH_HEURISTIC_MAX; one with nothing at all
+ * to go on gets FRESH_DEFAULT.  "no-cache" makes it stale from the
+ * start.  Whatever age the response already had when it arrived, from
+ * its Age header or its Date, counts against the lifetime.
+ *
+ * A stale response is not simply thrown away.  If it has a validator,
+ * an ETag or a Last-Modified time, the origin can be asked with
+ * If-None-Match and If-Modified-Since whether it still holds; a 304
+ * makes it fresh again, with its header brought up to date from the
+ * 304's.  The same validators let a client's own conditional request
+ * be answered with a 304 without asking the origin at all.
+ *
+ * Every function here takes a whole header, up to and including the
+ * blank line that ends it.
+ */
+
+#define FRESH_HEURISTIC_MAX  86400  /* Longest lifetime guessed from Last-Modified */
+#define FRESH_DEFAULT        60     /* Lifetime of a response that says nothing */
+
+/* When a response received at "now" stops being fresh */
+extern time_t fresh_expires(const char *head, int len, time_t now);
+
+/*
+ * Write the header lines that ask the origin whether the stored
+ * response with this header still holds.  Returns their length, 0 if
+ * it has no validator to ask with, or -1 if they don't fit in "size"
+ * bytes.
+ */
+extern int fresh_conditions(const char *head, int len, char *dst, int size);
+
+/*
+ * Bring a stored header up to date from the header of the 304 that
+ * revalidated it: the 304's Date, Expires, Cache-Control, ETag,
+ * Last-Modified and Age replace the stored ones.  Returns the new
+ * header's length, or -1 if it doesn't fit in "size" bytes.
+ */
+extern int fresh_update(const char *head, int len, const char *update,
+  int update_len, char *dst, int size);
+
+/*
+ * Has the stored response not changed, by a client's If-None-Match
+ * (compared weakly) or, failing that, its If-Modified-Since?  Either
+ * value may be NULL.
+ */
+extern int fresh_not_modified(const char *head, int len,
+  const char *if_none_match, const char *if_modified_since);
+
+/*
+ * Write the 304 telling such a client so, carrying the stored header's
+ * validators and caching fields.  Returns its length, or -1 if it
+ * doesn't fit in "size" bytes.
+ */
+extern int fresh_304(const char *head, int len, char *dst, int size);
+
+#endif /* _FRESH_H */
@@ -0,0 +1,727 @@
+/*
+ * httpparse.c - Incremental, copy-free HTTP header parser
+ *
+ * See httpparse.h for the interface.  Parsing happens in two steps.
+ * Until the header is complete, each call searches only the bytes it
+ * hasn't seen yet for a line feed followed by an empty line.  Once one
+ * turns up, a single pass over the header splits it into the request
+ * or status line and header fields; requests and responses differ only
+ * in that first line.  Both steps rely on find2 to skip quickly to the
+ * next interesting byte.
+ */
+
+#include "csapp.h"
+#include "httpparse.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char *find2(const char *p, const char *end, char a, char b);
+static int header_end(const char *buf, int len, int *scanned);
+static int parse_fields(const char *buf, const char *p, const char *end,
+  http_header_t *headers, int *nheaders);
+static int parse_request_line(const char *buf, const char *end,
+  http_request_t *req);
+static int parse_status_line(const char *buf, const char *end,
+  http_response_t *resp);
+static int find_framing(const char *buf, const http_header_t *headers,
+  int nheaders, const http_header_t **te, int *ntes,
+  const http_header_t **cl);
+static int last_chunked(const char *buf, const http_header_t *te);
+static int parse_length(const char *buf, const http_header_t *cl, long *len);
+static int parse_target(const char *buf, http_request_t *req);
+static int parse_authority(const char *buf, const char *p, const char *end,
+  http_request_t *req);
+static int is_tchar(unsigned char c);
+static int hex_value(unsigned char c);
+
+/* What the next byte of a body is; see http_body_scan */
+enum {
+    BODY_DONE,          /* Nothing; the body has ended */
+    BODY_LENGTH,        /* Content-Length bytes */
+    CHUNK_SIZE,         /* Chunk size, in hex */
+    CHUNK_EXT,          /* Rest of the chunk size line */
+    CHUNK_DATA,         /* Chunk data */
+    CHUNK_CR,           /* Line end after chunk data */
+    CHUNK_LF,
+    TRAILER_START,      /* Start of a trailer line, or of the final blank line */
+    TRAILER_LINE,       /* Rest of a trailer line */
+    TRAILER_LF,         /* Line feed of the final blank line */
+    BODY_CLOSE          /* Anything; the body ends when the connection does */
+};
+
+/*
+ * http_request_init - Reset a request before parsing starts.
+ */
+void http_request_init(http_request_t *req)
+{
+    memset(req, 0, sizeof(*req));
+    req->port = 80;
+}
+
+/*
+ * http_parse_request - Find the end of the header, then parse it.
+ */
+int http_parse_request(const char *buf, int len, http_request_t *req)
+{
+    int hlen;
+    int off;
+
+    if ((hlen = header_end(buf, len, &req->scanned)) < 0)
+        return hlen;
+    if ((off = parse_request_line(buf, buf + hlen, req)) < 0
+      ||  parse_fields(buf, buf + off, buf + hlen, req->headers,
+            &req->nheaders) < 0)
+        return HTTP_ERROR;
+    return hlen;
+}
+
+/*
+ * http_response_init - Reset a response before parsing starts.
+ */
+void http_response_init(http_response_t *resp)
+{
+    memset(resp, 0, sizeof(*resp));
+}
+
+/*
+ * http_parse_response - Find the end of the header, then parse it.
+ */
+int http_parse_response(const char *buf, int len, http_response_t *resp)
+{
+    int hlen;
+    int off;
+
+    if ((hlen = header_end(buf, len, &resp->scanned)) < 0)
+        return hlen;
+    if ((off = parse_status_line(buf, buf + hlen, resp)) < 0
+      ||  parse_fields(buf, buf + off, buf + hlen, resp->headers,
+            &resp->nheaders) < 0)
+        return HTTP_ERROR;
+    return hlen;
+}
+
+/*
+ * http_find_header - Look a header up by name.
+ */
+const http_header_t *http_find_header(const char *buf,
+  const http_request_t *req, const char *name)
+{
+    int i;
+
+    for (i = 0; i < req->nheaders; i++) {
+        if (http_span_equals(buf, req->headers[i].name, name))
+            return &req->headers[i];
+    }
+    return NULL;
+}
+
+/*
+ * http_find_response_header - Look a response header up by name.
+ */
+const http_header_t *http_find_response_header(const char *buf,
+  const http_response_t *resp, const char *name)
+{
+    int i;
+
+    for (i = 0; i < resp->nheaders; i++) {
+        if (http_span_equals(buf, resp->headers[i].name, name))
+            return &resp->headers[i];
+    }
+    return NULL;
+}
+
+/*
+ * http_idempotent - Can a request with this method safely be sent
+ * again if the first attempt got no answer?
+ */
+int http_idempotent(const char *buf, http_span_t method)
+{
+    static const char *methods[] = {
+        "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"
+    };
+    int i;
+
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+        if (http_span_equals(buf, method, methods[i]))
+            return 1;
+    return 0;
+}
+
+/*
+ * http_span_equals - Case-insensitive comparison of a span and a string.
+ */
+int http_span_equals(const char *buf, http_span_t span, const char *s)
+{
+    return strlen(s) == span.len  &&  strncasecmp(buf + span.off, s, span.len) == 0;
+}
+
+/*
+ * http_span_copy - Make a null-terminated copy of a span.
+ */
+int http_span_copy(char *dst, int size, const char *buf, http_span_t span)
+{
+    if (span.len >= size)
+        return -1;
+    memcpy(dst, buf + span.off, span.len);
+    dst[span.len] = '\0';
+    return 0;
+}
+
+/*
+ * http_list_find - Step over the list an element at a time, passing
+ * over quoted strings whole, so that a name is only ever matched at
+ * the start of an element and never inside another's name or
+ * argument.
+ */
+int http_list_find(const char *buf, http_span_t value, const char *name)
+{
+    const char *p = buf + value.off;
+    const char *end = p + value.len;
+    int n = strlen(name);
+    int quoted;
+
+    while (p < end) {
+        while (p < end  &&  (*p == ' '  ||  *p == '\t'  ||  *p == ','))
+            p++;
+        if (end - p >= n  &&  strncasecmp(p, name, n) == 0
+          &&  (p + n == end  ||  p[n] == '='  ||  p[n] == ';'  ||  p[n] == ','
+            ||  p[n] == ' '  ||  p[n] == '\t'))
+            return p + n - buf;
+        for (quoted = 0; p < end  &&  (quoted  ||  *p != ','); p++) {
+            if (*p == '"')
+                quoted = !quoted;
+            else if (*p == '\\'  &&  quoted  &&  p + 1 < end)
+                p++;
+        }
+    }
+    return -1;
+}
+
+/*
+ * http_body_init - Look at the framing headers.  Every one of them is
+ * checked, not just the first, since a repeated header could also be
+ * read two ways.
+ */
+int http_body_init(http_body_t *body, const char *buf,
+  const http_request_t *req)
+{
+    const http_header_t *te;
+    const http_header_t *cl;
+    int ntes;
+
+    memset(body, 0, sizeof(*body));
+    if (find_framing(buf, req->headers, req->nheaders, &te, &ntes, &cl) < 0)
+        return HTTP_ERROR;
+    if (te != NULL) {
+        if (cl != NULL  ||  ntes > 1
+          ||  !http_span_equals(buf, te->value, "chunked"))
+            return HTTP_ERROR;
+        body->state = CHUNK_SIZE;
+        return 1;
+    }
+    if (cl == NULL)
+        return 0;
+    if (parse_length(buf, cl, &body->left) < 0)
+        return HTTP_ERROR;
+    body->state = body->left > 0 ? BODY_LENGTH : BODY_DONE;
+    return body->left > 0;
+}
+
+/*
+ * http_response_body_init - Work out a response's framing the way RFC
+ * 9112 section 6.3 does: no body for HEAD, 1xx, 204 and 304; then
+ * chunked if that is the last transfer coding, which overrides any
+ * Content-Length; then to the end of the connection for any other
+ * transfer coding; then Content-Length; and otherwise to the end of
+ * the connection.  A 101 switches protocols, so whatever follows it
+ * runs to the end of the connection too.
+ */
+int http_response_body_init(http_body_t *body, const char *buf,
+  const http_response_t *resp, int head)
+{
+    const http_header_t *te;
+    const http_header_t *cl;
+    int ntes;
+
+    memset(body, 0, sizeof(*body));
+    if (resp->status == 101) {
+        body->state = BODY_CLOSE;
+        return 1;
+    }
+    if (head  ||  resp->status < 200  ||  resp->status == 204
+      ||  resp->status == 304)
+        return 0;
+    if (find_framing(buf, resp->headers, resp->nheaders, &te, &ntes, &cl) < 0)
+        return HTTP_ERROR;
+    if (te != NULL) {
+        body->state = last_chunked(buf, te) ? CHUNK_SIZE : BODY_CLOSE;
+        return 1;
+    }
+    if (cl == NULL) {
+        body->state = BODY_CLOSE;
+        return 1;
+    }
+    if (parse_length(buf, cl, &body->left) < 0)
+        return HTTP_ERROR;
+    body->state = body->left > 0 ? BODY_LENGTH : BODY_DONE;
+    return body->left > 0;
+}
+
+/*
+ * http_body_scan - Step through the body's framing.  Data, which is
+ * most of the bytes, is skipped over a run at a time.
+ */
+int http_body_scan(http_body_t *body, const char *buf, int len)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    long n;
+    int d;
+
+    while (p < end  &&  body->state != BODY_DONE) {
+        switch (body->state) {
+        case BODY_LENGTH:
+        case CHUNK_DATA:
+            n = end - p < body->left ? end - p : body->left;
+            p += n;
+            body->left -= n;
+            if (body->left == 0)
+                body->state = body->state == BODY_LENGTH ? BODY_DONE : CHUNK_CR;
+            break;
+        case CHUNK_SIZE:
+            if ((d = hex_value(*p)) < 0) {
+                if (body->digits == 0)
+                    return HTTP_ERROR;
+                body->state = CHUNK_EXT;
+                break;
+            }
+            if (++body->digits > 15)
+                return HTTP_ERROR;
+            body->left = body->left * 16 + d;
+            p++;
+            break;
+        case CHUNK_EXT:
+            /* Chunk extensions mean nothing to us */
+            if (*p++ == '\n') {
+                body->digits = 0;
+                body->state = body->left > 0 ? CHUNK_DATA : TRAILER_START;
+            }
+            break;
+        case CHUNK_CR:
+            if (*p == '\r')
+                p++;
+            body->state = CHUNK_LF;
+            break;
+        case CHUNK_LF:
+            if (*p++ != '\n')
+                return HTTP_ERROR;
+            body->state = CHUNK_SIZE;
+            break;
+        case TRAILER_START:
+            if (*p == '\n')
+                body->state = BODY_DONE;
+            else if (*p == '\r')
+                body->state = TRAILER_LF;
+            else
+                body->state = TRAILER_LINE;
+            p++;
+            break;
+        case TRAILER_LINE:
+            if (*p++ == '\n')
+                body->state = TRAILER_START;
+            break;
+        case TRAILER_LF:
+            if (*p++ != '\n')
+                return HTTP_ERROR;
+            body->state = BODY_DONE;
+            break;
+        case BODY_CLOSE:
+            p = end;
+            break;
+        }
+    }
+    return p - buf;
+}
+
+/*
+ * http_body_done - Check for the end of the body.
+ */
+int http_body_done(const http_body_t *body)
+{
+    return body->state == BODY_DONE;
+}
+
+/*
+ * http_body_until_close - Check for a body framed by the connection.
+ */
+int http_body_until_close(const http_body_t *body)
+{
+    return body->state == BODY_CLOSE;
+}
+
+/*
+ * http_body_data - Content-Length bytes and chunk data are the only
+ * ones whose framing doesn't depend on what they are.
+ */
+long http_body_data(const http_body_t *body)
+{
+    if (body->state == BODY_LENGTH  ||  body->state == CHUNK_DATA)
+        return body->left;
+    return body->state == BODY_CLOSE ? -1 : 0;
+}
+
+/*
+ * http_body_skip - Count data bytes passed on without being scanned.
+ */
+void http_body_skip(http_body_t *body, long n)
+{
+    if (body->state != BODY_LENGTH  &&  body->state != CHUNK_DATA)
+        return;
+    body->left -= n;
+    if (body->left == 0)
+        body->state = body->state == BODY_LENGTH ? BODY_DONE : CHUNK_CR;
+}
+
+/*
+ * find2 - Return the first byte in [p, end) that is "a" or "b", or end
+ * if there is none.
+ */
+static const char *find2(const char *p, const char *end, char a, char b)
+{
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    __m128i v;
+    int mask;
+
+    while (end - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+          _mm_cmpeq_epi8(v, vb)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end  &&  *p != a  &&  *p != b)
+        p++;
+    return p;
+}
+
+/*
+ * header_end - Look for the blank line ending the header, starting
+ * where the previous call left off.  Returns the header's length, or
+ * HTTP_INCOMPLETE.
+ */
+static int header_end(const char *buf, int len, int *scanned)
+{
+    const char *end = buf + len;
+    const char *p = buf + *scanned;
+    const char *q;
+
+    while ((p = find2(p, end, '\n', '\n')) < end) {
+        q = p + 1;
+        if (q < end  &&  *q == '\r')
+            q++;
+        if (q == end)
+            break;          /* Can't tell yet; look at this line feed again */
+        if (*q == '\n'  &&  p > buf) {
+            *scanned = q + 1 - buf;
+            return q + 1 - buf;
+        }
+        p++;
+    }
+    *scanned = p - buf;
+    return HTTP_INCOMPLETE;
+}
+
+/*
+ * parse_fields - Split the header lines from "p" up to the blank line
+ * before "end" into names and values.  Returns -1 if one is malformed
+ * or there are too many.
+ */
+static int parse_fields(const char *buf, const char *p, const char *end,
+  http_header_t *headers, int *nheaders)
+{
+    const char *eol;
+    const char *colon;
+    const char *v;
+    const char *vend;
+    http_header_t *h;
+
+    *nheaders = 0;
+    while (*p != '\n'  &&  !(*p == '\r'  &&  p[1] == '\n')) {
+        eol = find2(p, end, '\n', '\n');
+
+        if (*p == ' '  ||  *p == '\t') {
+            /* Folded onto the previous header; its value grows */
+            if (*nheaders == 0)
+                return -1;
+            h = &headers[*nheaders - 1];
+            vend = eol;
+            while (vend > p  &&  (vend[-1] == '\r'  ||  vend[-1] == ' '
+              ||  vend[-1] == '\t'))
+                vend--;
+            if (vend > p)
+                h->value.len = vend - (buf + h->value.off);
+            p = eol + 1;
+            continue;
+        }
+
+        colon = find2(p, eol, ':', ':');
+        if (colon == eol  ||  colon == p)
+            return -1;
+        for (v = p; v < colon; v++) {
+            if (!is_tchar(*v))
+                return -1;
+        }
+        if (*nheaders == HTTP_MAX_HEADERS)
+            return -1;
+
+        h = &headers[(*nheaders)++];
+        h->name.off = p - buf;
+        h->name.len = colon - p;
+        for (v = colon + 1; v < eol  &&  (*v == ' '  ||  *v == '\t'); v++)
+            ;
+        for (vend = eol; vend > v  &&  (vend[-1] == '\r'  ||  vend[-1] == ' '
+          ||  vend[-1] == '\t'); vend--)
+            ;
+        h->value.off = v - buf;
+        h->value.len = vend - v;
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/*
+ * parse_request_line - Parse "method SP target SP HTTP/1.x CRLF".
+ * Returns the offset of the first header line, or -1.
+ */
+static int parse_request_line(const char *buf, const char *end,
+  http_request_t *req)
+{
+    const char *p = buf;
+    const char *sp;
+    const char *eol;
+
+    /* Tolerate blank lines before the request line */
+    while (p < end  &&  (*p == '\r'  ||  *p == '\n'))
+        p++;
+    eol = find2(p, end, '\n', '\n');
+
+    /* Method */
+    for (sp = p; sp < eol  &&  is_tchar(*sp); sp++)
+        ;
+    if (sp == p  ||  *sp != ' ')
+        return -1;
+    req->method.off = p - buf;
+    req->method.len = sp - p;
+
+    /* Target */
+    p = sp + 1;
+    sp = find2(p, eol, ' ', ' ');
+    if (sp == p  ||  sp == eol)
+        return -1;
+    req->target.off = p - buf;
+    req->target.len = sp - p;
+
+    /* Version */
+    p = sp + 1;
+    if (eol - p < 8  ||  strncmp(p, "HTTP/1.", 7) != 0  ||  !isdigit(p[7]))
+        return -1;
+    req->minor_version = p[7] - '0';
+    p += 8;
+    if (*p == '\r')
+        p++;
+    if (p != eol)
+        return -1;
+
+    if (parse_target(buf, req) < 0)
+        return -1;
+    return eol + 1 - buf;
+}
+
+/*
+ * parse_status_line - Parse "HTTP/1.x SP 3DIGIT SP reason CRLF"; the
+ * reason may be missing altogether.  Returns the offset of the first
+ * header line, or -1.
+ */
+static int parse_status_line(const char *buf, const char *end,
+  http_response_t *resp)
+{
+    const char *p = buf;
+    const char *eol = find2(p, end, '\n', '\n');
+
+    if (eol - p < 12  ||  strncmp(p, "HTTP/1.", 7) != 0  ||  !isdigit(p[7])
+      ||  p[8] != ' '  ||  !isdigit(p[9])  ||  !isdigit(p[10])
+      ||  !isdigit(p[11]))
+        return -1;
+    resp->minor_version = p[7] - '0';
+    resp->status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    p += 12;
+    if (*p != ' '  &&  *p != '\r'  &&  *p != '\n')
+        return -1;
+    return eol + 1 - buf;
+}
+
+/*
+ * parse_target - Split the request target into host, port and path.
+ * Absolute "http://" targets, origin-form paths, CONNECT's host:port
+ * and "*" are understood.
+ */
+static int parse_target(const char *buf, http_request_t *req)
+{
+    const char *p = buf + req->target.off;
+    const char *end = p + req->target.len;
+    const char *slash;
+
+    req->host.off = req->path.off = p - buf;
+    req->host.len = req->path.len = 0;
+    req->port = 80;
+
+    if (http_span_equals(buf, req->method, "CONNECT"))
+        return parse_authority(buf, p, end, req);
+
+    if (end - p >= 7  &&  strncasecmp(p, "http://", 7) == 0) {
+        p += 7;
+        slash = p;
+        while (slash < end  &&  *slash != '/'  &&  *slash != '?'  &&  *slash != '#')
+            slash++;
+        if (parse_authority(buf, p, slash, req) < 0)
+            return -1;
+        p = slash;
+    }
+    if (p < end  &&  *p == '/')
+        p++;
+    req->path.off = p - buf;
+    req->path.len = end - p;
+    return 0;
+}
+
+/*
+ * parse_authority - Parse "host[:port]", where host may be a bracketed
+ * IPv6 literal (which is returned without the brackets).
+ */
+static int parse_authority(const char *buf, const char *p, const char *end,
+  http_request_t *req)
+{
+    const char *colon;
+    const char *q;
+    long port;
+
+    if (p < end  &&  *p == '[') {
+        if ((q = memchr(p, ']', end - p)) == NULL)
+            return -1;
+        req->host.off = p + 1 - buf;
+        req->host.len = q - p - 1;
+        colon = q + 1 < end  &&  q[1] == ':' ? q + 1 : NULL;
+        if (colon == NULL  &&  q + 1 != end)
+            return -1;
+    } else {
+        colon = memchr(p, ':', end - p);
+        req->host.off = p - buf;
+        req->host.len = (colon != NULL ? colon : end) - p;
+    }
+    if (req->host.len == 0)
+        return -1;
+
+    if (colon != NULL) {
+        port = 0;
+        for (q = colon + 1; q < end  &&  isdigit(*q); q++)
+            port = port * 10 + (*q - '0');
+        if (q != end  ||  q == colon + 1  ||  port == 0  ||  port > 65535)
+            return -1;
+        req->port = port;
+    }
+    return 0;
+}
+
+/*
+ * find_framing - Find the Transfer-Encoding and Content-Length headers,
+ * either of which may be missing.  Transfer-Encoding may be split over
+ * several lines, which together list the codings in order; *te is set
+ * to the last line that isn't empty, holding the last coding, and
+ * *ntes to how many such lines there are.  Returns -1 if Content-Length
+ * is repeated.
+ */
+static int find_framing(const char *buf, const http_header_t *headers,
+  int nheaders, const http_header_t **te, int *ntes,
+  const http_header_t **cl)
+{
+    int i;
+
+    *te = *cl = NULL;
+    *ntes = 0;
+    for (i = 0; i < nheaders; i++) {
+        if (http_span_equals(buf, headers[i].name, "Transfer-Encoding")) {
+            if (headers[i].value.len > 0) {
+                *te = &headers[i];
+                (*ntes)++;
+            }
+        } else if (http_span_equals(buf, headers[i].name, "Content-Length")) {
+            if (*cl != NULL)
+                return -1;
+            *cl = &headers[i];
+        }
+    }
+    return 0;
+}
+
+/*
+ * last_chunked - Is chunked the last coding a Transfer-Encoding line
+ * lists?
+ */
+static int last_chunked(const char *buf, const http_header_t *te)
+{
+    const char *start = buf + te->value.off;
+    const char *p = start + te->value.len;
+
+    while (p > start  &&  p[-1] != ',')
+        p--;
+    while (*p == ' '  ||  *p == '\t')
+        p++;
+    return start + te->value.len - p == 7  &&  strncasecmp(p, "chunked", 7) == 0;
+}
+
+/*
+ * parse_length - Read a Content-Length value.  Returns -1 unless it is
+ * all digits, and few enough of them not to overflow.
+ */
+static int parse_length(const char *buf, const http_header_t *cl, long *len)
+{
+    const char *p = buf + cl->value.off;
+    const char *end = p + cl->value.len;
+
+    if (cl->value.len == 0  ||  cl->value.len > 18)
+        return -1;
+    for (*len = 0; p < end; p++) {
+        if (!isdigit(*p))
+            return -1;
+        *len = *len * 10 + (*p - '0');
+    }
+    return 0;
+}
+
+/*
+ * is_tchar - Can this character appear in a method or header name?
+ */
+static int is_tchar(unsigned char c)
+{
+    return isalnum(c)  ||  (c != '\0'  &&  strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/*
+ * hex_value - Return the value of a hex digit, or -1 if it isn't one.
+ */
+static int hex_value(unsigned char c)
+{
+    if (isdigit(c))
+        return c - '0';
+    if (c >= 'a'  &&  c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A'  &&  c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
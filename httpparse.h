@@ -0,0 +1,173 @@
+#ifndef _HTTPPARSE_H
+#define _HTTPPARSE_H
+
+/*
+ * Incremental parser for HTTP/1.x request and response headers.
+ *
+ * The parser works directly on the buffer the message was received
+ * into and copies nothing: the method, the request target and its
+ * parts, and every header name and value are returned as views, an
+ * offset into the buffer and a length.  Offsets rather than pointers
+ * are used so the views stay valid if the buffer is moved or grown.
+ *
+ * Call http_parse_request (or http_parse_response) again each time
+ * more of the message has arrived.  Until the blank line ending the
+ * headers is present it only looks at the new bytes, to find that
+ * line; once it is there the whole header is parsed in one pass.
+ * Line ends and header colons are located sixteen bytes at a time
+ * with SSE2 where it is available.
+ *
+ * Any method is accepted; deciding what to do with it is up to the
+ * caller.
+ *
+ * A body is not parsed, only followed: http_body_init (or
+ * http_response_body_init) works out from the header how the body is
+ * framed, and http_body_scan then tracks the framing through the
+ * body's bytes as they arrive, without copying or decoding them, to
+ * find where it ends.  Chunk size lines, line ends and trailers are
+ * checked on the way, so a malformed body is caught instead of being
+ * forwarded as if it were fine.  Knowing where a response ends, rather
+ * than waiting for the origin to close, is what lets a connection
+ * carry the next request.
+ */
+
+#define HTTP_MAX_HEADERS 100    /* Most header lines in one message */
+
+/* Results of http_parse_request other than a header length */
+#define HTTP_ERROR      -1      /* Not a valid message */
+#define HTTP_INCOMPLETE -2      /* Need more bytes */
+
+/* "len" bytes starting "off" bytes into the message buffer */
+typedef struct {
+    int off;
+    int len;
+} http_span_t;
+
+typedef struct {
+    http_span_t name;
+    http_span_t value;          /* Without surrounding white space */
+} http_header_t;
+
+typedef struct {
+    http_span_t method;
+    http_span_t target;         /* Request target, exactly as sent */
+    http_span_t host;           /* Host from an "http://" or CONNECT target */
+    int port;                   /* Port from the target, else 80 */
+    http_span_t path;           /* Whatever follows the '/' beginning the path */
+    int minor_version;          /* The x in HTTP/1.x */
+    int nheaders;
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int scanned;                /* Bytes already searched for the header's end */
+} http_request_t;
+
+typedef struct {
+    int status;                 /* Three-digit status code */
+    int minor_version;          /* The x in HTTP/1.x */
+    int nheaders;
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int scanned;                /* Bytes already searched for the header's end */
+} http_response_t;
+
+/* Where http_body_scan has got to in a body */
+typedef struct {
+    int state;          /* What the next byte is; 0 once the body has ended */
+    long left;          /* Bytes of Content-Length or of the chunk to come */
+    int digits;         /* Hex digits of the chunk size seen so far */
+} http_body_t;
+
+/* Prepare to parse a new request */
+extern void http_request_init(http_request_t *req);
+
+/*
+ * Parse the request in the first "len" bytes of "buf".  Returns the
+ * length of its header, including the final blank line, once that has
+ * arrived and been parsed; HTTP_INCOMPLETE if more bytes are needed;
+ * or HTTP_ERROR.  Bytes after the header are not looked at.
+ */
+extern int http_parse_request(const char *buf, int len, http_request_t *req);
+
+/* Prepare to parse a new response */
+extern void http_response_init(http_response_t *resp);
+
+/* Parse a response header, as http_parse_request does a request's */
+extern int http_parse_response(const char *buf, int len, http_response_t *resp);
+
+/* Find a header by name, ignoring case; returns NULL if there is none */
+extern const http_header_t *http_find_header(const char *buf,
+  const http_request_t *req, const char *name);
+
+/* The same, for a response */
+extern const http_header_t *http_find_response_header(const char *buf,
+  const http_response_t *resp, const char *name);
+
+/* May a request with this method be sent again if it got no answer? */
+extern int http_idempotent(const char *buf, http_span_t method);
+
+/* Compare a span with a string, ignoring case; returns nonzero if equal */
+extern int http_span_equals(const char *buf, http_span_t span, const char *s);
+
+/*
+ * Copy a span into "dst" as a null-terminated string.  Returns -1 if
+ * it doesn't fit in "size" bytes.
+ */
+extern int http_span_copy(char *dst, int size, const char *buf, http_span_t span);
+
+/*
+ * Find the element "name", ignoring case, in a comma-separated header
+ * value such as Cache-Control's or Connection's.  Returns -1 if it
+ * isn't there, or else the offset in "buf" of what follows the name
+ * within its element: "=" and an argument, ";" and parameters, or
+ * nothing, at the element's end.
+ */
+extern int http_list_find(const char *buf, http_span_t value, const char *name);
+
+/*
+ * Prepare to follow the body of the request parsed from "buf".
+ * Returns 1 if it has one, 0 if not, or HTTP_ERROR if its framing is
+ * unusable: a Transfer-Encoding other than chunked, a bad or repeated
+ * Content-Length, or both headers at once, which could be read two
+ * ways.
+ */
+extern int http_body_init(http_body_t *body, const char *buf,
+  const http_request_t *req);
+
+/*
+ * Prepare to follow the body of the response parsed from "buf", which
+ * answers a HEAD if "head" is set.  Returns 1 if it has one, 0 if not,
+ * or HTTP_ERROR for a bad or repeated Content-Length.  Transfer-Encoding
+ * lines are read as one list, whose last coding decides the framing.
+ * A body without a length or chunked encoding runs until the origin
+ * closes the connection; see http_body_until_close.
+ */
+extern int http_response_body_init(http_body_t *body, const char *buf,
+  const http_response_t *resp, int head);
+
+/*
+ * Follow the body through the next "len" bytes of it at "buf".
+ * Returns how many of them belong to the body, which is fewer than
+ * "len" only if the body ends among them, or HTTP_ERROR.
+ */
+extern int http_body_scan(http_body_t *body, const char *buf, int len);
+
+/* Has the whole body been scanned? */
+extern int http_body_done(const http_body_t *body);
+
+/*
+ * Does the body run until the connection closes?  If so it is never
+ * done; http_body_scan takes every byte given to it.
+ */
+extern int http_body_until_close(const http_body_t *body);
+
+/*
+ * How many of the body's next bytes are data, which http_body_scan
+ * would pass over without looking at them: the rest of the
+ * Content-Length or of the current chunk, -1 for a body running until
+ * close, or 0 if framing comes next.  They can be moved without being
+ * read, e.g. with splice(2), and then counted with http_body_skip.
+ */
+extern long http_body_data(const http_body_t *body);
+
+/* Count "n" bytes, no more than http_body_data says, as passed over */
+extern void http_body_skip(http_body_t *body, long n);
+
+#endif /* _HTTPPARSE_H */
@@ -0,0 +1,769 @@
+/*
+ * loadgen.c - Load generator and latency benchmark for the proxy
+ *
+ * Several client threads send GET requests through the proxy as fast
+ * as it answers them, for a fixed number of requests or a fixed time,
+ * and the results are reported on standard output as one JSON object:
+ * requests and bytes per second, latency percentiles, and CPU time per
+ * request, both the load generator's own and, given its process id,
+ * the proxy's.
+ *
+ * The requests replay a URL mix read from a file.  Each line holding
+ * an "http://" URL contributes one URL; lines in proxy.log's format,
+ * which end in the response size, can be used as they are.  Every URL
+ * is redirected to the origin given with -o, normally stuborigin, with
+ * the original host kept as the first part of the path and the logged
+ * size passed on in the query string, so the stub answers each request
+ * with a body the size the real site sent.  Without a mix file, every
+ * request is for the origin's "/".
+ *
+ * With -s, the mix is replayed on the schedule it was logged on rather
+ * than as fast as possible: each request is sent when as much time has
+ * passed since the start of the run as had passed since the first
+ * logged request, divided by the speedup.  Since the log only records
+ * whole seconds, the requests logged in the same second are spread
+ * evenly over it.  The clients share the schedule, so there have to be
+ * enough of them to keep up; how late requests went out is reported
+ * alongside their latency.  Unless -n or -t says otherwise, the mix is
+ * replayed once.
+ *
+ * A report an earlier run wrote can be given with -b, to have the
+ * changes in throughput and latency since then reported as well, so
+ * that two builds of the proxy are easily compared.
+ *
+ * usage: loadgen [-c connections] [-n requests] [-t seconds] [-k] [-u]
+ *                [-f mix file] [-s speedup] [-o origin host:port]
+ *                [-P proxy pid] [-l label] [-b baseline report]
+ *                <proxy host> <proxy port>
+ *
+ *   -k  keep client connections open between requests (HTTP/1.1)
+ *   -u  make every URL unique, so the proxy's cache never hits
+ */
+
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include "csapp.h"
+
+#define LG_TIMEOUT  10          /* Seconds to wait for the proxy */
+#define LG_MAX_URL  2048        /* Longest URL taken from the mix */
+
+/* One client thread and what it measured */
+typedef struct {
+    pthread_t tid;
+    unsigned long *latency;     /* Microseconds per completed request */
+    long nlatency;
+    long max_latency;           /* Entries allocated in latency */
+    unsigned long *lag;         /* Microseconds each request went out late */
+    long nlag;
+    long max_lag;
+    long errors;
+    long bytes;                 /* Response bytes received, headers included */
+} client_t;
+
+/* One open connection to the proxy */
+typedef struct {
+    int fd;
+    rio_t rio;
+    int used;                   /* Requests already sent on it */
+} conn_t;
+
+static char **urls;             /* The mix, already pointed at the origin */
+static double *when;            /* Seconds from the first to each, if timed */
+static long nurls;
+static double speedup;          /* Keep to the logged timing, this much faster */
+static double span;             /* Seconds one pass over the mix takes */
+static double run_start;       /* When the run began */
+static struct addrinfo *proxy_addr;
+static char origin[256] = "127.0.0.1:8000";
+static long max_requests;       /* 0 for no limit */
+static double max_seconds;      /* 0 for no limit */
+static int keepalive;
+static int unique;
+static long issued;             /* Requests handed out to the clients */
+static double deadline;
+
+static void load_mix(const char *path);
+static void add_url(const char *url, long size, double logged);
+static void schedule(void);
+static void *client(void *vargp);
+static void wait_turn(client_t *c, long seq);
+static int do_request(client_t *c, conn_t *conn, long seq);
+static int read_response(conn_t *conn, long *bytes, int *closing);
+static int read_chunked(conn_t *conn, long *bytes);
+static int discard(conn_t *conn, long n, long *bytes);
+static int open_proxy(conn_t *conn);
+static void close_proxy(conn_t *conn);
+static double now(void);
+static double proxy_cpu(pid_t pid);
+static void append(unsigned long **v, long *n, long *max, unsigned long x);
+static unsigned long *pool(client_t *clients, int nclients, int lag, long *n);
+static int compare_ulong(const void *a, const void *b);
+static unsigned long percentile(unsigned long *sorted, long n, double p);
+static char *read_report(const char *path);
+static double report_value(const char *report, const char *section,
+  const char *name);
+static void compare(const char *baseline, double rps, double mean,
+  unsigned long p50, unsigned long p99);
+
+/*
+ * main - Run the clients and print the report.
+ */
+int main(int argc, char **argv)
+{
+    struct addrinfo hints;
+    struct rusage ru;
+    client_t *clients;
+    unsigned long *all, *lags;
+    const char *mix = NULL;
+    const char *label = "";
+    char *baseline = NULL;
+    pid_t proxy_pid = 0;
+    int nclients = 8;
+    long requests = 0, errors = 0, bytes = 0, nlags, n;
+    double elapsed, cpu_start = 0, cpu_proxy = 0, cpu_self;
+    double sum = 0;
+    int i, opt, rc;
+
+    while ((opt = getopt(argc, argv, "c:n:t:kuf:s:o:P:l:b:")) != -1) {
+        switch (opt) {
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'n':
+            max_requests = atol(optarg);
+            break;
+        case 't':
+            max_seconds = atof(optarg);
+            break;
+        case 'k':
+            keepalive = 1;
+            break;
+        case 'u':
+            unique = 1;
+            break;
+        case 'f':
+            mix = optarg;
+            break;
+        case 's':
+            speedup = atof(optarg);
+            break;
+        case 'o':
+            snprintf(origin, sizeof(origin), "%s", optarg);
+            break;
+        case 'P':
+            proxy_pid = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'b':
+            baseline = read_report(optarg);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 2  ||  nclients < 1  ||  speedup < 0
+      ||  (speedup > 0  &&  mix == NULL)) {
+        fprintf(stderr, "Usage: %s [-c connections] [-n requests] [-t seconds] "
+          "[-k] [-u]\n       [-f mix file] [-s speedup] [-o origin host:port] "
+          "[-P proxy pid]\n       [-l label] [-b baseline report] "
+          "<proxy host> <proxy port>\n", argv[0]);
+        exit(1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(argv[optind], argv[optind + 1], &hints, &proxy_addr)) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(rc));
+        exit(1);
+    }
+    if (mix != NULL)
+        load_mix(mix);
+    if (nurls == 0)
+        add_url("http://", -1, -1);
+    if (speedup > 0)
+        schedule();
+    if (max_requests == 0  &&  max_seconds == 0) {
+        if (speedup > 0)
+            max_requests = nurls;
+        else
+            max_seconds = 10;
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    clients = Calloc(nclients, sizeof(client_t));
+    if (proxy_pid > 0)
+        cpu_start = proxy_cpu(proxy_pid);
+    run_start = now();
+    deadline = max_seconds > 0 ? run_start + max_seconds : 0;
+    for (i = 0; i < nclients; i++)
+        Pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+    for (i = 0; i < nclients; i++)
+        Pthread_join(clients[i].tid, NULL);
+    elapsed = now() - run_start;
+    if (proxy_pid > 0)
+        cpu_proxy = cpu_start < 0 ? -1 : proxy_cpu(proxy_pid) - cpu_start;
+    getrusage(RUSAGE_SELF, &ru);
+    cpu_self = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+      + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+    /* Pool the latencies so the percentiles cover every request */
+    for (i = 0; i < nclients; i++) {
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    all = pool(clients, nclients, 0, &requests);
+    lags = pool(clients, nclients, 1, &nlags);
+    for (n = 0; n < requests; n++)
+        sum += all[n];
+
+    printf("{\n");
+    printf("  \"label\": \"%s\",\n", label);
+    printf("  \"connections\": %d,\n", nclients);
+    printf("  \"keepalive\": %s,\n", keepalive ? "true" : "false");
+    printf("  \"unique_urls\": %s,\n", unique ? "true" : "false");
+    printf("  \"mix_urls\": %ld,\n", nurls);
+    if (speedup > 0)
+        printf("  \"speedup\": %g,\n", speedup);
+    else
+        printf("  \"speedup\": null,\n");
+    printf("  \"duration_s\": %.3f,\n", elapsed);
+    printf("  \"requests\": %ld,\n", requests);
+    printf("  \"errors\": %ld,\n", errors);
+    printf("  \"requests_per_sec\": %.1f,\n", requests / elapsed);
+    printf("  \"bytes\": %ld,\n", bytes);
+    printf("  \"bytes_per_sec\": %.0f,\n", bytes / elapsed);
+    printf("  \"latency_us\": {\"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, "
+      "\"p999\": %lu, \"max\": %lu},\n", requests > 0 ? sum / requests : 0.0,
+      percentile(all, requests, 0.50), percentile(all, requests, 0.99),
+      percentile(all, requests, 0.999), percentile(all, requests, 1.0));
+    if (speedup > 0)
+        printf("  \"lag_us\": {\"p50\": %lu, \"p99\": %lu, \"max\": %lu},\n",
+          percentile(lags, nlags, 0.50), percentile(lags, nlags, 0.99),
+          percentile(lags, nlags, 1.0));
+    else
+        printf("  \"lag_us\": null,\n");
+    printf("  \"cpu_us_per_request\": {\"proxy\": ");
+    if (proxy_pid > 0  &&  cpu_proxy >= 0)
+        printf("%.1f", requests > 0 ? cpu_proxy * 1e6 / requests : 0.0);
+    else
+        printf("null");
+    printf(", \"loadgen\": %.1f}", requests > 0 ? cpu_self * 1e6 / requests : 0.0);
+    if (baseline != NULL)
+        compare(baseline, requests / elapsed, requests > 0 ? sum / requests : 0.0,
+          percentile(all, requests, 0.50), percentile(all, requests, 0.99));
+    printf("\n}\n");
+    exit(errors > 0  &&  requests == 0);
+}
+
+/*
+ * load_mix - Add every URL found in a file to the mix, with the time
+ * it was logged at, if the line starts with one.
+ */
+static void load_mix(const char *path)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    char url[LG_MAX_URL];
+    char *p, *end;
+    struct tm tm;
+    double logged;
+    long size;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        unix_error((char *)path);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strstr(line, "http://")) == NULL)
+            continue;
+        end = p + strcspn(p, " \t\r\n");
+        if (end - p >= sizeof(url))
+            continue;
+        memcpy(url, p, end - p);
+        url[end - p] = '\0';
+
+        /* A number after the URL is the size of the logged response */
+        size = strtol(end, &p, 10);
+        if (p == end  ||  size < 0)
+            size = -1;
+
+        /* The time zone is left off; it is the same all through a log */
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_isdst = -1;
+        logged = strptime(line, "%a %d %b %Y %H:%M:%S", &tm) != NULL
+          ? (double)mktime(&tm) : -1;
+        add_url(url, size, logged);
+    }
+    fclose(fp);
+}
+
+/*
+ * add_url - Add a URL to the mix, rewritten to fetch the same path from
+ * the origin and, if "size" isn't negative, to ask for that many bytes.
+ * "logged" is when it was requested, or negative if that isn't known.
+ */
+static void add_url(const char *url, long size, double logged)
+{
+    static long max_urls;
+    char buf[MAXLINE];
+    const char *rest = url + strlen("http://");
+
+    if (nurls == max_urls) {
+        max_urls = max_urls ? max_urls * 2 : 256;
+        urls = Realloc(urls, max_urls * sizeof(char *));
+        when = Realloc(when, max_urls * sizeof(double));
+    }
+    when[nurls] = logged;
+    snprintf(buf, sizeof(buf), "http://%s/%s", origin, rest);
+    if (size >= 0)
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%csize=%ld",
+          strchr(rest, '?') != NULL ? '&' : '?', size);
+    urls[nurls++] = strdup(buf);
+}
+
+/*
+ * schedule - Turn the logged times into seconds from the first logged
+ * request, spreading those logged in the same second over it.  A URL
+ * logged without a time goes with the one before it.
+ */
+static void schedule(void)
+{
+    double first = -1;
+    double second = 0;
+    long i, j, k;
+
+    for (i = 0; i < nurls; i++) {
+        if (when[i] < 0)
+            when[i] = second;
+        else if (first < 0)
+            first = when[i];
+        second = when[i];
+    }
+    if (first < 0)
+        first = 0;
+    for (i = 0; i < nurls; i = j) {
+        for (j = i; j < nurls  &&  when[j] == when[i]; j++)
+            ;
+        for (k = i; k < j; k++)
+            when[k] = when[k] - first + (double)(k - i) / (j - i);
+    }
+
+    /* A replay that goes round again leaves the last second its due */
+    span = nurls > 0 ? (long)when[nurls - 1] + 1 : 1;
+}
+
+/*
+ * client - Thread routine: keep sending requests until the run is over.
+ */
+static void *client(void *vargp)
+{
+    client_t *c = (client_t *)vargp;
+    conn_t conn;
+    long seq;
+
+    conn.fd = -1;
+    while (1) {
+        seq = __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+        if (max_requests > 0  &&  seq >= max_requests)
+            break;
+        if (speedup > 0)
+            wait_turn(c, seq);
+        if (deadline > 0  &&  now() >= deadline)
+            break;
+        if (do_request(c, &conn, seq) < 0)
+            c->errors++;
+    }
+    close_proxy(&conn);
+    return NULL;
+}
+
+/*
+ * wait_turn - Sleep until a request is due, or note how late it is.
+ * Waits no longer than the run lasts.
+ */
+static void wait_turn(client_t *c, long seq)
+{
+    double due = run_start
+      + ((seq / nurls) * span + when[seq % nurls]) / speedup;
+    double t = now();
+    struct timespec ts;
+
+    if (deadline > 0  &&  due > deadline)
+        due = deadline;
+    if (due > t) {
+        ts.tv_sec = (time_t)(due - t);
+        ts.tv_nsec = (long)((due - t - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0  &&  errno == EINTR)
+            ;
+        t = due;
+    }
+    append(&c->lag, &c->nlag, &c->max_lag, (t - due) * 1e6);
+}
+
+/*
+ * do_request - Send one request and read its response, timing both.
+ * A kept-alive connection that turns out to have been closed by the
+ * proxy is replaced and the request sent again.
+ */
+static int do_request(client_t *c, conn_t *conn, long seq)
+{
+    char request[MAXLINE];
+    const char *url = urls[seq % nurls];
+    double start = now();
+    long bytes = 0;
+    int closing = 0;
+    int len, rc;
+
+    len = snprintf(request, sizeof(request), "GET %s%s", url,
+      !unique ? "" : strchr(url, '?') != NULL ? "&u=" : "?u=");
+    if (unique)
+        len += snprintf(request + len, sizeof(request) - len, "%ld", seq);
+    len += snprintf(request + len, sizeof(request) - len,
+      " HTTP/1.%d\r\nHost: %s\r\n%s\r\n", keepalive, origin,
+      keepalive ? "" : "Connection: close\r\n");
+    if (len >= sizeof(request))
+        return -1;
+
+    while (1) {
+        if (conn->fd < 0  &&  open_proxy(conn) < 0)
+            return -1;
+        if (rio_writen(conn->fd, request, len) == len
+          &&  (rc = read_response(conn, &bytes, &closing)) != 0)
+            break;
+        /* Nothing came back: the proxy may have dropped an idle connection */
+        rc = conn->used == 0 ? -1 : 0;
+        close_proxy(conn);
+        if (rc < 0)
+            return -1;
+        bytes = 0;
+    }
+    conn->used++;
+    if (closing  ||  !keepalive  ||  rc < 0)
+        close_proxy(conn);
+    if (rc < 0)
+        return -1;
+
+    append(&c->latency, &c->nlatency, &c->max_latency, (now() - start) * 1e6);
+    c->bytes += bytes;
+    return 0;
+}
+
+/*
+ * read_response - Read a whole response.  Returns 1 for a complete
+ * "200 OK" response, -1 for anything else, or 0 if the connection was
+ * closed before the status line arrived.
+ */
+static int read_response(conn_t *conn, long *bytes, int *closing)
+{
+    char line[MAXLINE];
+    long content_length = -1;
+    int chunked = 0;
+    int status = 0;
+    int minor = 0;
+    ssize_t n;
+
+    if ((n = rio_readlineb(&conn->rio, line, MAXLINE)) <= 0)
+        return n == 0 ? 0 : -1;
+    *bytes += n;
+    if (sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2)
+        return -1;
+    *closing = minor == 0;
+
+    while (1) {
+        if ((n = rio_readlineb(&conn->rio, line, MAXLINE)) <= 0)
+            return -1;
+        *bytes += n;
+        if (strcmp(line, "\r\n") == 0  ||  strcmp(line, "\n") == 0)
+            break;
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            content_length = atol(line + 15);
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            chunked = strcasestr(line + 18, "chunked") != NULL;
+        else if (strncasecmp(line, "Connection:", 11) == 0) {
+            if (strcasestr(line + 11, "close") != NULL)
+                *closing = 1;
+            else if (strcasestr(line + 11, "keep-alive") != NULL)
+                *closing = 0;
+        }
+    }
+
+    if (chunked) {
+        if (read_chunked(conn, bytes) < 0)
+            return -1;
+    } else if (content_length >= 0) {
+        if (discard(conn, content_length, bytes) < 0)
+            return -1;
+    } else {
+        /* No length: the body runs until the connection closes */
+        *closing = 1;
+        if (discard(conn, -1, bytes) < 0)
+            return -1;
+    }
+    return status == 200 ? 1 : -1;
+}
+
+/*
+ * read_chunked - Read a chunked body, trailers included.
+ */
+static int read_chunked(conn_t *conn, long *bytes)
+{
+    char line[MAXLINE];
+    long size;
+    ssize_t n;
+
+    do {
+        if ((n = rio_readlineb(&conn->rio, line, MAXLINE)) <= 0)
+            return -1;
+        *bytes += n;
+        size = strtol(line, NULL, 16);
+        if (size > 0  &&  discard(conn, size + 2, bytes) < 0)
+            return -1;
+    } while (size > 0);
+
+    do {
+        if ((n = rio_readlineb(&conn->rio, line, MAXLINE)) <= 0)
+            return -1;
+        *bytes += n;
+    } while (strcmp(line, "\r\n") != 0  &&  strcmp(line, "\n") != 0);
+    return 0;
+}
+
+/*
+ * discard - Read and throw away "n" bytes, or everything up to the end
+ * of the connection if "n" is negative.
+ */
+static int discard(conn_t *conn, long n, long *bytes)
+{
+    char buf[MAXBUF];
+    ssize_t got;
+
+    while (n != 0) {
+        got = rio_readnb(&conn->rio, buf, n > 0  &&  n < MAXBUF ? n : MAXBUF);
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            return n < 0 ? 0 : -1;
+        *bytes += got;
+        if (n > 0)
+            n -= got;
+    }
+    return 0;
+}
+
+/*
+ * open_proxy - Connect to the proxy.  Reads time out, so a proxy that
+ * stops answering ends the run rather than hanging it.
+ */
+static int open_proxy(conn_t *conn)
+{
+    struct timeval timeout = { LG_TIMEOUT, 0 };
+    struct addrinfo *ai;
+    int fd;
+
+    for (ai = proxy_addr; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            conn->fd = fd;
+            conn->used = 0;
+            rio_readinitb(&conn->rio, fd);
+            return 0;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+/*
+ * close_proxy - Close the connection to the proxy, if one is open.
+ */
+static void close_proxy(conn_t *conn)
+{
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+}
+
+/*
+ * now - Seconds on the monotonic clock.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * proxy_cpu - User plus system CPU seconds used so far by a process,
+ * from /proc, or -1 if they can't be read.
+ */
+static double proxy_cpu(pid_t pid)
+{
+    char path[64], stat[1024];
+    unsigned long utime, stime;
+    char *p;
+    int fd, n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    stat[n] = '\0';
+
+    /* The command name may contain spaces, so count fields from its end */
+    if ((p = strrchr(stat, ')')) == NULL
+      ||  sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+           &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * append - Add a measurement to a growing array of them.
+ */
+static void append(unsigned long **v, long *n, long *max, unsigned long x)
+{
+    if (*n == *max) {
+        *max = *max ? *max * 2 : 4096;
+        *v = Realloc(*v, *max * sizeof(unsigned long));
+    }
+    (*v)[(*n)++] = x;
+}
+
+/*
+ * pool - Gather every client's latencies, or their lags, into one
+ * sorted array, and set *n to their number.
+ */
+static unsigned long *pool(client_t *clients, int nclients, int lag, long *n)
+{
+    unsigned long *all;
+    long total = 0;
+    int i;
+
+    for (i = 0; i < nclients; i++)
+        total += lag ? clients[i].nlag : clients[i].nlatency;
+    all = Malloc((total > 0 ? total : 1) * sizeof(unsigned long));
+    for (i = 0, *n = 0; i < nclients; i++) {
+        if (lag) {
+            memcpy(all + *n, clients[i].lag, clients[i].nlag * sizeof(unsigned long));
+            *n += clients[i].nlag;
+        } else {
+            memcpy(all + *n, clients[i].latency,
+              clients[i].nlatency * sizeof(unsigned long));
+            *n += clients[i].nlatency;
+        }
+    }
+    qsort(all, *n, sizeof(unsigned long), compare_ulong);
+    return all;
+}
+
+/*
+ * compare_ulong - qsort comparison for latencies.
+ */
+static int compare_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * percentile - The nearest-rank percentile "p" (0 to 1) of n sorted
+ * values, or 0 if there are none.
+ */
+static unsigned long percentile(unsigned long *sorted, long n, double p)
+{
+    long rank;
+
+    if (n == 0)
+        return 0;
+    rank = (long)(p * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+/*
+ * read_report - Read a report written by an earlier run, to compare
+ * with.
+ */
+static char *read_report(const char *path)
+{
+    char *report = Malloc(MAXBUF + 1);
+    int fd, n;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        unix_error((char *)path);
+    n = Rio_readn(fd, report, MAXBUF);
+    Close(fd);
+    report[n] = '\0';
+    return report;
+}
+
+/*
+ * report_value - Find a number in a report: the member "name" of the
+ * object "section", or of the report itself if "section" is NULL.
+ * Returns -1 if it isn't there.
+ */
+static double report_value(const char *report, const char *section,
+  const char *name)
+{
+    char key[64];
+    const char *p = report;
+
+    if (section != NULL) {
+        snprintf(key, sizeof(key), "\"%s\": {", section);
+        if ((p = strstr(p, key)) == NULL)
+            return -1;
+    }
+    snprintf(key, sizeof(key), "\"%s\": ", name);
+    if ((p = strstr(p, key)) == NULL)
+        return -1;
+    return strtod(p + strlen(key), NULL);
+}
+
+/*
+ * compare - Add to the report how this run's throughput and latency
+ * changed from the baseline's, in percent.
+ */
+static void compare(const char *baseline, double rps, double mean,
+  unsigned long p50, unsigned long p99)
+{
+    const char *names[] = { "requests_per_sec", "mean", "p50", "p99" };
+    const char *sections[] = { NULL, "latency_us", "latency_us", "latency_us" };
+    const char *changes[] = { "requests_per_sec", "latency_mean",
+                              "latency_p50", "latency_p99" };
+    double values[] = { rps, mean, p50, p99 };
+    const char *label;
+    double old;
+    int i, n;
+
+    printf(",\n  \"baseline\": {\"label\": ");
+    if ((label = strstr(baseline, "\"label\": \"")) != NULL) {
+        label += strlen("\"label\": \"");
+        n = strcspn(label, "\"");
+        printf("\"%.*s\"", n, label);
+    }
+    else
+        printf("null");
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        old = report_value(baseline, sections[i], names[i]);
+        printf(", \"%s_change_pct\": ", changes[i]);
+        if (old > 0)
+            printf("%.1f", (values[i] - old) * 100 / old);
+        else
+            printf("null");
+    }
+    printf("}");
+}
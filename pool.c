@@ -0,0 +1,165 @@
+/*
+ * pool.c - Worker threads and their bounded multi-producer,
+ * multi-consumer queue
+ *
+ * See pool.h for the interface.  The queue is Vyukov's bounded MPMC
+ * ring: every cell carries a sequence number saying whose turn it is.
+ * A cell at position "pos" is free for the producer that claims "pos"
+ * when its sequence is "pos", and holds an item for the consumer that
+ * claims "pos" when its sequence is "pos + 1"; the consumer then sets
+ * it to "pos + size", freeing the cell for the next lap.  Producers and
+ * consumers claim positions with a compare-and-swap on their own
+ * counter, so they never wait for each other, and the only shared
+ * writes are to the cells themselves.
+ */
+
+#include "csapp.h"
+#include "pool.h"
+
+typedef struct {
+    unsigned long seq;
+    void *item;
+} cell_t;
+
+static cell_t *cells;
+static unsigned long mask;              /* Ring size - 1 */
+static long high_water;
+
+/* Kept on separate cache lines, since producers and consumers differ */
+static unsigned long enqueue_pos __attribute__((aligned(64)));
+static unsigned long dequeue_pos __attribute__((aligned(64)));
+static unsigned long submitted __attribute__((aligned(64)));
+static unsigned long rejected;
+
+static sem_t items;                     /* Items queued but not taken */
+static pool_handler_t handler;
+
+static void *pool_worker(void *vargp);
+static void *dequeue(void);
+
+/*
+ * pool_init - Size the ring and start the workers.
+ */
+void pool_init(int nworkers, int queue_max, pool_handler_t run)
+{
+    unsigned long size = 2;
+    unsigned long i;
+    pthread_t tid;
+    int w;
+
+    if (nworkers < 1  ||  queue_max < 1)
+        app_error("pool_init: need at least one worker and one queue slot");
+    while (size < queue_max)
+        size *= 2;
+    cells = Calloc(size, sizeof(cell_t));
+    for (i = 0; i < size; i++)
+        cells[i].seq = i;
+    mask = size - 1;
+    high_water = queue_max;
+    handler = run;
+    Sem_init(&items, 0, 0);
+
+    for (w = 0; w < nworkers; w++)
+        Pthread_create(&tid, NULL, pool_worker, NULL);
+}
+
+/*
+ * pool_submit - Claim the next free cell, unless the queue is at its
+ * high-water mark, and wake a worker.
+ */
+int pool_submit(void *item)
+{
+    unsigned long pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    cell_t *cell;
+    long dif;
+
+    while (1) {
+        if ((long)(pos - __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED))
+          >= high_water)
+            break;
+        cell = &cells[pos & mask];
+        dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+              __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->item = item;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&submitted, 1, __ATOMIC_RELAXED);
+                V(&items);
+                return 0;
+            }
+            /* Another producer got there first; pos has been reloaded */
+        }
+        else if (dif < 0)
+            break;      /* Full: the consumer of the last lap isn't done */
+        else
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/*
+ * pool_backlog - Return how many items are waiting for a worker.
+ */
+long pool_backlog(void)
+{
+    long depth;
+
+    depth = (long)(__atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED)
+      - __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED));
+    return depth > 0 ? depth : 0;
+}
+
+/*
+ * pool_stats - Read the queue's counts.
+ */
+void pool_stats(pool_stats_t *stats)
+{
+    stats->depth = pool_backlog();
+    stats->submitted = __atomic_load_n(&submitted, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+}
+
+/*
+ * pool_worker - Thread routine: run the handler on queued items.
+ */
+static void *pool_worker(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+        P(&items);
+        handler(dequeue());
+    }
+    return NULL;
+}
+
+/*
+ * dequeue - Take the oldest item.  The caller has taken one count of
+ * "items", so there is one for it, although its producer may still be
+ * filling the cell in.
+ */
+static void *dequeue(void)
+{
+    unsigned long pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    cell_t *cell;
+    void *item;
+    long dif;
+
+    while (1) {
+        cell = &cells[pos & mask];
+        dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, 1,
+              __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                item = cell->item;
+                __atomic_store_n(&cell->seq, pos + mask + 1, __ATOMIC_RELEASE);
+                return item;
+            }
+        }
+        else {
+            /* Not filled in yet, or taken by another worker: look again */
+            pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
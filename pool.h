@@ -0,0 +1,44 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+/*
+ * Fixed pool of worker threads fed by a bounded queue.
+ *
+ * The workers are started up front, and each runs the handler on one
+ * queued item after another.  The queue is a lock-free ring that any
+ * number of threads may add to and take from at once; workers with
+ * nothing to do sleep on a semaphore counting the queued items.  The
+ * queue never grows past its high-water mark: pool_submit refuses
+ * items instead, so the caller can shed load rather than let it pile
+ * up.
+ */
+
+#define POOL_WORKERS  128     /* Default number of workers */
+#define POOL_QUEUE    1024    /* Default high-water mark */
+
+/* Runs in a worker, for each item; its return value is ignored */
+typedef void *(*pool_handler_t)(void *item);
+
+/* What the queue has seen so far */
+typedef struct {
+    long depth;                 /* Items waiting right now */
+    unsigned long submitted;    /* Items accepted */
+    unsigned long rejected;     /* Items refused at the high-water mark */
+} pool_stats_t;
+
+/*
+ * Start "nworkers" threads running "handler", with at most "queue_max"
+ * items waiting for them.
+ */
+extern void pool_init(int nworkers, int queue_max, pool_handler_t handler);
+
+/* Queue an item; returns -1, and counts a rejection, if the queue is full */
+extern int pool_submit(void *item);
+
+/* Items waiting, but not yet taken by a worker */
+extern long pool_backlog(void);
+
+/* Fill in the queue's counts */
+extern void pool_stats(pool_stats_t *stats);
+
+#endif /* _POOL_H */
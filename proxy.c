@@ -10,11 +10,28 @@
  * function that describes what that function does.
  */ 
 
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
-#include "strmanip.h"
-
-/* The name of the proxy's log file */
-#define PROXY_LOG "proxy.log"
+#include "proxy.h"
+#include "event.h"
+#include "cache.h"
+#include "diskcache.h"
+#include "upstream.h"
+#include "dns.h"
+#include "rewrite.h"
+#include "httpparse.h"
+#include "accesslog.h"
+#include "arena.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
+#include "tunnel.h"
+#include "relay.h"
+#include "compress.h"
+#include "fresh.h"
 
 /* Undefine this if you don't want debugging output */
 #define DEBUG
@@ -27,293 +44,1478 @@ typedef struct {
     int myid;    /* Small integer used to identify threads in debug messages */
     int connfd;                    /* Connected file descriptor */ 
     struct sockaddr_in clientaddr; /* Client IP address */
+    arena_t *arena;                /* Where the connection's memory comes from */
 } arglist_t;
 
 /*
  * Place global declarations here.
  */ 
-pthread_mutex_t mutex;
-sem_t semaphore;
-sem_t sem_fml;
+/*
+ * How requests are rewritten for the origin.  Hop-by-hop headers are
+ * about the client's connection, not ours, so they are always dropped.
+ * Expect is answered by us (see body_send), not by the origin.  A
+ * request that gets a connection of its own also says so.
+ */
+static const rewrite_rule_t keepalive_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+    { RW_STRIP, "Expect" },
+};
+static const rewrite_rule_t close_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+    { RW_STRIP, "Expect" },
+    { RW_ADD, "Connection: close" },
+};
+static rewriter_t *keepalive_rewriter;
+static rewriter_t *close_rewriter;
+
+/*
+ * Limits on how long a client connection is kept open
+ */
+#define CLIENT_MAX_REQUESTS 100  /* Requests served per connection */
+#define CLIENT_MAX_HEADER   65536 /* Largest request header we will buffer */
+#define CLIENT_IDLE_SLICE   100  /* Ms between looks at the pool's queue */
+
+/*
+ * Bytes received from a client that haven't been used up yet: the
+ * request being parsed, and any pipelined requests behind it.
+ */
+typedef struct {
+    char *data;
+    int len;    /* Bytes received */
+    int size;   /* Bytes allocated */
+} inbuf_t;
+
 /*
  * Place forward function declarations here.
  */
 void *process_request(void* vargp);
-ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen); 
-int parse_uri(char *uri, char *target_addr, char *path, int  *port);
-void format_log_entry(char *logstring, int stringsize, struct sockaddr_in *sockaddr, char *uri, int size);
+static int handle_request(arglist_t *arglist, inbuf_t *in, int nrequests, int *persist);
+static int read_request(arglist_t *arglist, inbuf_t *in, int nrequests,
+                        http_request_t *req);
+static int wait_for_request(int connfd, inbuf_t *in, int timeout);
+static int send_cached(relay_t *out, cache_reader_t *reader, int keepalive,
+                       int *persist, const char *ifNoneMatch,
+                       const char *ifModifiedSince);
+static int send_disk(relay_t *out, disk_hit_t *hit, int *persist);
+static char *header_value(arena_t *arena, const char *buf,
+                          const http_request_t *req, const char *name);
+static char *cached_head(cache_reader_t *reader, long headLen, arena_t *arena,
+                         int *len, char **rest, int *restLen);
+static char *add_close(arena_t *arena, const char *head, int *len);
+static void reject_connection(int connfd);
+static int send_stats(arglist_t *arglist, relay_t *out, int keepalive,
+                      int *persist);
+static int tunnel_request(arglist_t *arglist, inbuf_t *in, char *url,
+                          char *hostname, int port);
+static void first_byte(void);
+
+static void *acceptor(void *vargp);
+static void accept_clients(int listenfd);
 
 // we wrote these methods below
-int Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen,
-                       char *serv, socklen_t servlen, int flags);
-int open_clientfd_ts(char *hostname, int port);
 int Open_clientfd_ts(char *hostname, int port);
 
 /*
- * Handy macro to compare something with a constant prefix.  For example,
- * prefixcmp(foo, "abc") returns 0 if the first three characters of foo
- * are "abc".
+ * Where process_request sends the response bytes it relays: to the
+ * client, plus the cache object being filled, which other requests
+ * for the same URL follow along (see cache.h).  Once the cache
+ * neither keeps the object nor has readers for it, the rest of the
+ * body is spliced to the client without passing through our buffers.
+ *
+ * Bytes for the client go through its relay (see relay.h), so a slow
+ * client only holds up the origin once the relay's buffer is full.  If
+ * the client goes away while the cache is keeping the response, the
+ * rest of it is still fetched for the requests following along.
+ *
+ * A shared response mustn't depend on whether our own client is
+ * staying connected, so it is fetched as though it were, and
+ * "Connection: close" is added for our client here if need be.
+ *
+ * If the client takes a compressed body, the header is held back until
+ * it is complete, to see whether the body is worth compressing (see
+ * compress.h).  If it is, the client gets the header rewritten for the
+ * compressed body, chunked unless it speaks HTTP/1.0, and the body
+ * goes through a compression stream; the compressed bytes are kept
+ * too, if they fit in the cache, as the response's cached variant.
+ * The cache object being filled, if any, still gets the original.
+ *
+ * When a stale cached copy is being revalidated (see fresh.h), the
+ * origin's answer is only passed on if it isn't a 304.  A 304's header
+ * is kept instead, for the stale copy to be brought up to date with
+ * and sent in its place.
  */
-#define prefixcmp(str, prefix) strncmp(str, prefix, sizeof(prefix) - 1)
+typedef struct {
+    upstream_sink_t up;  /* Must come first; see upstream.h */
+    relay_t *out;        /* Output to the client */
+    int gone;            /* Has the client been given up on? */
+    cache_obj_t *obj;    /* Cache object being filled, or NULL */
+    int shared;          /* Was the response fetched to be shared? */
+    int persist;         /* If so, the fetch's persist flag */
+    int clientPersist;   /* and our client's */
+    int headerState;     /* Status line, header or body next? */
+    int interim;         /* Is this header a 1xx one? */
+    compress_enc_t enc;  /* Coding the client takes, if any */
+    char *head;          /* Header held back meanwhile */
+    int headLen;
+    compress_stream_t *zip; /* Compressing the body, or NULL */
+    int chunked;         /* Is the compressed body sent chunked? */
+    long bodyLen;        /* Bytes in the original body */
+    long bodySeen;       /* Bytes of it compressed so far */
+    long sent;           /* Bytes sent to the client */
+    char *frame;         /* Where a chunk is framed */
+    int frameSize;
+    char *variant;       /* Compressed body for the cache, or NULL */
+    int variantLen;
+    int variantSize;
+    int revalidating;    /* Is a stale copy awaiting the origin's word? */
+    int notModified;     /* Did the origin send a 304 for it? */
+    int cacheFlags;      /* CACHE_REQ_* for storing the variant */
+} sink_t;
+
+/*
+ * When the request a worker is handling was received, and whether its
+ * first response byte has been timed yet
+ */
+static __thread long request_start;
+static __thread int request_answered;
+
+/* What sink_write expects next, for a shared response */
+#define SINK_STATUS 0
+#define SINK_HEADER 1
+#define SINK_BODY   2
+static int interim_status(const char *buf, int n);
+
+static int sink_write(upstream_sink_t *usink, char *buf, int n);
+static int sink_send(sink_t *sink, char *buf, int n);
+static int sink_hold(sink_t *sink, char *buf, int n);
+static int sink_start(sink_t *sink);
+static int sink_compressed(void *arg, const char *buf, int n);
+static void sink_finish(sink_t *sink, const char *variantKey, int *persist);
+
+/*
+ * A request body on its way to the origin (see upstream.h): what the
+ * input buffer already holds of it, then the rest as it arrives, so
+ * the body is never held in full.  Whatever the client sent after the
+ * body is a pipelined request, and is left in the buffer.
+ */
+typedef struct {
+    upstream_body_t up;  /* Must come first; see upstream.h */
+    arglist_t *arglist;
+    inbuf_t *in;
+    http_body_t framing; /* Where the body ends */
+    int expect;          /* Does the client await "100 Continue"? */
+    long len;            /* Bytes sent so far */
+} body_t;
+
+static int body_send(upstream_body_t *ubody, int fd);
+
+/*
+ * A stale cached copy being revalidated: its header, and the body
+ * bytes read from the cache along with it
+ */
+typedef struct {
+    char *head;          /* NULL if not revalidating */
+    int headLen;
+    char *rest;
+    int restLen;
+} stale_t;
+
+static char *revalidate_request(arena_t *arena, cache_reader_t *reader,
+                                stale_t *stale, char *request,
+                                int *request_len);
+static int send_revalidated(relay_t *out, cache_obj_t *obj,
+                            cache_reader_t *reader, stale_t *stale,
+                            char *update, int updateLen, int *persist);
 
 /* 
  * main - Main routine for the proxy program 
+ *
+ * With just a port number, accepted connections are queued for a fixed
+ * pool of -w worker threads running process_request (see pool.h).  At
+ * most -q connections wait in the queue; beyond that, new ones are
+ * turned away at once with a 503.  If a thread count is also given,
+ * the proxy instead runs that many event-driven workers (see event.c);
+ * a count of 0 means one worker per CPU.
+ *
+ * Normally a single listening socket takes every connection.  With -R,
+ * one SO_REUSEPORT socket is opened per CPU, each with its own thread
+ * accepting from it (or one per event worker), and the kernel spreads
+ * new connections among them.
+ *
+ * With -H, origin host names are resolved only from the given file
+ * (in /etc/hosts format) rather than through the system resolver.
+ * -F sets how often, in milliseconds, the access log is written out,
+ * and -d drops log entries rather than wait when the log writer falls
+ * behind.  -C and -O set the cache's total budget and the largest
+ * object it keeps, in bytes.  -D keeps objects too large for that in
+ * slab files in the given directory, -N of them (see diskcache.h).
+ * -T writes every request that takes longer than -t milliseconds to
+ * the given file, broken down into its phases, as Chrome trace events
+ * (see trace.h); only the worker pool's requests are traced.
+ *
+ * Responses are read from the origin as fast as the client takes them,
+ * with up to -b bytes buffered per client in between (see relay.h).
+ * A client that takes nothing for RELAY_TIMEOUT seconds is dropped.
+ *
+ * -Z compresses text responses at the given level (1 to 9) for clients
+ * that take gzip or brotli, if their bodies have at least -M bytes;
+ * compressed copies are cached alongside the originals (see
+ * compress.h).  Only the worker pool compresses.
+ *
+ * Any method is forwarded, with its body streamed to the origin, and
+ * CONNECT opens a tunnel to the origin (see tunnel.h).  In both modes
+ * responses are framed by their length or chunked encoding as they are
+ * relayed, so connections to clients and to origins both carry one
+ * request after another.
  */
 int main(int argc, char **argv)
 {
+    char *hosts_file = NULL;
+    int flush_ms = ALOG_FLUSH_MS;
+    alog_policy_t log_policy = ALOG_BLOCK;
+    size_t max_cache = MAX_CACHE_SIZE;
+    size_t max_object = MAX_OBJECT_SIZE;
+    char *disk_dir = NULL;
+    int disk_slabs = DISK_SLABS;
+    int nworkers = POOL_WORKERS;
+    int queue_max = POOL_QUEUE;
+    int reuseport = 0;
+    char *trace_name = NULL;
+    int trace_slow_ms = TRACE_SLOW_MS;
+    int client_buffer = RELAY_MAX_BUFFER;
+    int zip_level = 0;
+    long zip_min = COMPRESS_MIN_SIZE;
+    int usage = 0;
+    int c;
 
     /* Check arguments */
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
+    while ((c = getopt(argc, argv, "H:F:dC:O:D:N:w:q:RT:t:b:Z:M:")) != -1) {
+        switch (c) {
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 'F':
+            flush_ms = atoi(optarg);
+            break;
+        case 'd':
+            log_policy = ALOG_DROP;
+            break;
+        case 'C':
+            max_cache = strtoul(optarg, NULL, 10);
+            break;
+        case 'O':
+            max_object = strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'N':
+            disk_slabs = atoi(optarg);
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            queue_max = atoi(optarg);
+            break;
+        case 'R':
+            reuseport = 1;
+            break;
+        case 'T':
+            trace_name = optarg;
+            break;
+        case 't':
+            trace_slow_ms = atoi(optarg);
+            break;
+        case 'b':
+            client_buffer = atoi(optarg);
+            break;
+        case 'Z':
+            zip_level = atoi(optarg);
+            break;
+        case 'M':
+            zip_min = atol(optarg);
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+    if (usage || (argc - optind != 1 && argc - optind != 2)) {
+        fprintf(stderr, "Usage: %s [-H hosts file] [-F log flush ms] [-d] "
+          "[-C cache bytes] [-O max object bytes] [-D disk cache dir] "
+          "[-N slabs] [-w workers] [-q queue limit] [-R] "
+          "[-T trace file] [-t slow ms] [-b client buffer bytes] "
+          "[-Z compression level] [-M min compressed bytes] "
+          "<port number> [threads]\n", argv[0]);
         exit(0);
     }
 
-    int listenfd;
-    int connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr; // enough space for any address
-    char client_hostname[MAXLINE];
-    char client_port[MAXLINE];
-    int id = 0;
+    int port = atoi(argv[optind]);
+    int nacceptors;
     pthread_t tid;
+    long i;
+
+    // a client that hangs up is one connection's problem, not a
+    // reason for the whole proxy to die
+    Signal(SIGPIPE, SIG_IGN);
+
+    keepalive_rewriter = rewrite_compile(keepalive_rules,
+      sizeof(keepalive_rules) / sizeof(keepalive_rules[0]));
+    close_rewriter = rewrite_compile(close_rules,
+      sizeof(close_rules) / sizeof(close_rules[0]));
+    cache_init(max_cache, max_object);
+    if (disk_dir != NULL)
+        disk_init(disk_dir, disk_slabs, DISK_SLAB_SIZE);
+    upstream_init(UPSTREAM_MAX_IDLE, UPSTREAM_IDLE_TIMEOUT);
+    dns_init(DNS_THREADS, hosts_file);
+    alog_init(PROXY_LOG, flush_ms, log_policy);
+    stats_init();
+    relay_init(client_buffer, RELAY_TIMEOUT);
+    if (trace_name != NULL)
+        trace_init(trace_name, trace_slow_ms);
+    if (zip_level > 0)
+        compress_init(zip_level, zip_min);
+
+    if (argc - optind == 2)
+        event_run(port, atoi(argv[optind + 1]), reuseport);
+    pool_init(nworkers, queue_max, process_request);
+
+    /* Open the listener sockets; this thread accepts from the last one */
+    if (!reuseport)
+        accept_clients(Open_listenfd(port));    /* Never returns */
+    if ((nacceptors = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nacceptors = 1;
+    printf("Accepting on %d listeners\n", nacceptors);
+    for (i = 1; i < nacceptors; i++)
+        Pthread_create(&tid, NULL, acceptor,
+          (void *)(long)Open_listenfd_reuseport(port));
+    accept_clients(Open_listenfd_reuseport(port));
+    exit(0);
+}
 
-    /* Open listener socket */
-    listenfd = Open_listenfd((int) atoi(argv[1]));
+/*
+ * acceptor - Thread routine: accept connections from one of the
+ * SO_REUSEPORT listeners.
+ */
+static void *acceptor(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    accept_clients((int)(long)vargp);
+    return NULL;
+}
+
+/*
+ * accept_clients - Accept connections forever, queueing each one for
+ * the worker pool.  Nothing here waits on anything but accept: the
+ * client's address is only formatted, numerically, when a request is
+ * logged.
+ */
+static void accept_clients(int listenfd)
+{
+    static int next_id;             /* Shared by every acceptor */
+    struct sockaddr_storage clientaddr; // enough space for any address
+    socklen_t clientlen;
+    arglist_t *arglist;
+    arena_t *arena;
+    int connfd;
 
     while (1) {
         clientlen = sizeof(struct sockaddr_storage);
-
-        // Parse the request
-        connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
-        Getnameinfo((SA*) &clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-        printf("Connected to (%s, %s)\n", client_hostname, client_port);
-        arglist_t* arglist = Malloc(sizeof(arglist_t));
-        arglist->myid = id;
+        if ((connfd = accept4(listenfd, (SA *)&clientaddr, &clientlen,
+          SOCK_CLOEXEC)) < 0) {
+            /* The client may have given up already; keep going */
+            if (errno != EINTR  &&  errno != ECONNABORTED)
+                printf("accept_clients: accept failed; error = %s\n",
+                  strerror(errno));
+            continue;
+        }
+        arena = arena_get();
+        arglist = arena_alloc(arena, sizeof(arglist_t));
+        arglist->arena = arena;
+        arglist->myid = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
         arglist->connfd = connfd;
         arglist->clientaddr = *((struct sockaddr_in*) &clientaddr);
 
-        // Create thread to handle request
-        Sem_init(&semaphore, 0, 1);
-        Sem_init(&sem_fml, 0 ,1 );
-        Pthread_create(&tid, NULL, process_request, (void*) arglist);
-
-        id++;
-
+        // Hand the connection to a worker, unless too many are waiting
+        if (pool_submit(arglist) < 0) {
+            arena_put(arena);
+            reject_connection(connfd);
+        }
     }
-    exit(0);
 }
 
 /*
- * process_request - Thread routine.
+ * process_request - Pool handler.
  * 
- * Each thread reads an HTTP request from a client, forwards it to the
- * end server (always as a simple HTTP/1.0 request), waits for the
- * response, and then forwards it back to the client.
+ * Each call serves one client connection.  It reads an HTTP request
+ * from the client, forwards it to the end server (or answers it from
+ * the cache), and forwards the response back to the client.  As long
+ * as both sides allow it, the connection is then kept open for the
+ * client's next request, which may already be waiting in the input
+ * buffer if the client pipelines its requests.  The connection is
+ * closed after CLIENT_IDLE_TIMEOUT seconds without a new request, or
+ * after CLIENT_MAX_REQUESTS requests.  While other connections are
+ * queued for a worker, the response in hand is the last one, and an
+ * idle connection is closed at once, so that keep-alive clients cannot
+ * hold every worker.
  */ 
 void *process_request(void *vargp) 
 {
     arglist_t arglist;              /* Arg list passed into thread */ 
-    struct sockaddr_in clientaddr;  /* Client socket address */      
     int connfd;                     /* Socket descriptor for talking with client */
-    char *request;                  /* HTTP request from client */
-    int realloc_size;               /* Used to increase size of request buffer if necessary */  
-    int request_len;                /* Total size of HTTP request */
-    int n;                          /* General counting variable */
-    rio_t rio;                      /* Rio buffer for calls to buffered rio_readlineb routine */
-    char buf[MAXLINE];              /* General I/O buffer */
+    inbuf_t in;                     /* Bytes received but not yet handled */
+    int nrequests;                  /* Requests served on this connection */
+    int persist;                    /* Keep the connection open afterwards? */
+    struct timeval timeout = { RELAY_TIMEOUT, 0 };
+    int one = 1;
     
     arglist = *((arglist_t *)vargp); /* Copy the arguments onto the stack */
-    connfd = arglist.connfd;         /* Put connfd and clientaddr in scalars for convenience */  
-    clientaddr = arglist.clientaddr;
-    /* See the man page on pthread_detach for why the following line is handy */
-    Pthread_detach(pthread_self());  /* Detach the thread */
-    Free(vargp);                     /* Free up the arguments */ 
+    connfd = arglist.connfd;         /* Put connfd in a scalar for convenience */  
 
-    /* 
-     * Read the entire HTTP request into the request buffer, one line
-     * at a time.
-     */
-    request = (char *)Malloc(MAXLINE);
-    request[0] = '\0';
-    realloc_size = MAXLINE;
-    request_len = 0;
-    Rio_readinitb(&rio, connfd);
+    // sendfile and splice write to the client directly; don't let a
+    // stuck client hold them forever either
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-    while (1) {
-        // handle errors
-        if ((n = Rio_readlineb_w(&rio, buf, MAXLINE)) <= 0) {
-
-            printf("Thread %d: process_request: client issued a bad request (1).\n",
-              arglist.myid);
-            printf("Thread %d: process_request: partial request was %s\n",
-              arglist.myid, request);
-            close(connfd);
-            free(request);
-            return NULL;
+    // a connection carrying one request after another soon has its
+    // segments acknowledged late, so the end of a response mustn't
+    // wait on Nagle's algorithm for the part before it
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // the input buffer lasts as long as the connection; everything
+    // allocated after the mark is only for the current request
+    in.size = MAXBUF;
+    in.data = arena_alloc(arglist.arena, in.size);
+    in.len = 0;
+    arena_mark(arglist.arena);
+    stats_add(STAT_CONNECTIONS, 1);
+    stats_add(STAT_ACTIVE, 1);
+    for (nrequests = 1; ; nrequests++) {
+        persist = nrequests < CLIENT_MAX_REQUESTS && pool_backlog() == 0;
+        if (handle_request(&arglist, &in, nrequests, &persist) < 0 || !persist)
+            break;
+        arena_reset(arglist.arena);
+        if (!wait_for_request(connfd, &in, CLIENT_IDLE_TIMEOUT))
+            break;
+    }
+
+    stats_add(STAT_ACTIVE, -1);
+    arena_put(arglist.arena);        /* Frees the arguments and buffer */
+    Close(connfd);
+    return NULL;
+}
+
+/*
+ * handle_request - Read one request from the client and send back its
+ * response.
+ *
+ * On entry *persist says whether we are willing to keep the client
+ * connection open after this response; it is cleared if the client or
+ * the response doesn't allow that.  Returns -1 if the request could
+ * not be answered, in which case the connection must be closed.
+ */
+static int handle_request(arglist_t *arglist, inbuf_t *in, int nrequests, int *persist)
+{
+    int connfd = arglist->connfd;   /* Socket descriptor for talking with client */
+    http_request_t req;             /* Where the pieces of the request are */
+    int header_len;                 /* Bytes in the request header */
+    char *request;                  /* Request as it goes to the server */
+    int request_len;                /* Total size of that request */
+    char url[MAXLINE];              /* Request target, for the log */
+    char hostname[MAXLINE];
+    char pathname[MAXLINE];
+    int port;
+    relay_t out;                    /* Response bytes on their way to the client */
+
+    if ((header_len = read_request(arglist, in, nrequests, &req)) < 0)
+        return -1;
+    relay_open(&out, connfd, arglist->arena);
+    trace_mark(TRACE_READ);
+    request_start = stats_now();
+    request_answered = 0;
+    stats_add(STAT_REQUESTS, 1);
+    stats_add(STAT_BYTES_IN, header_len);
+
+    if (http_span_copy(url, MAXLINE, in->data, req.target) < 0
+        || http_span_copy(hostname, MAXLINE, in->data, req.host) < 0
+        || http_span_copy(pathname, MAXLINE, in->data, req.path) < 0) {
+        printf("Thread %d: process_request: request target too long\n",
+          arglist->myid);
+        stats_add(STAT_ERRORS, 1);
+        return -1;
+    }
+    port = req.port;
+
+    // a tunnel takes over the connection for good
+    if (http_span_equals(in->data, req.method, "CONNECT")) {
+        in->len -= header_len;
+        memmove(in->data, in->data + header_len, in->len);
+        *persist = 0;
+        return tunnel_request(arglist, in, url, hostname, port);
+    }
+
+    // find where the body ends, if there is one, before the header is
+    // rewritten over
+    body_t body;
+    int hasBody = http_body_init(&body.framing, in->data, &req);
+    if (hasBody < 0) {
+        printf("Thread %d: process_request: bad request body framing\n",
+          arglist->myid);
+        stats_add(STAT_ERRORS, 1);
+        return -1;
+    }
+    const http_header_t *expect = http_find_header(in->data, &req, "Expect");
+    body.up.send = body_send;
+    body.arglist = arglist;
+    body.in = in;
+    body.expect = hasBody && req.minor_version >= 1 && expect != NULL
+        && http_span_equals(in->data, expect->value, "100-continue");
+    body.len = 0;
+    int isGet = http_span_equals(in->data, req.method, "GET");
+    int isHead = http_span_equals(in->data, req.method, "HEAD");
+    int idempotent = http_idempotent(in->data, req.method);
+
+    // HTTP/1.1 requests go out as they are over a pooled keep-alive
+    // connection; anything older goes over a connection of its own,
+    // and the client connection ends with the response
+    int keepalive = req.minor_version >= 1;
+    if (!keepalive)
+        *persist = 0;
+
+    // strip the hop-by-hop headers; a client that asks us to close
+    // gets its wish
+    rewriter_t *rw = keepalive ? keepalive_rewriter : close_rewriter;
+    int rw_size = rewrite_bound(rw, header_len);
+    int rw_flags;
+    request = arena_alloc(arglist->arena, rw_size);
+    request_len = rewrite_request(rw, in->data, header_len, request, rw_size,
+                                  &rw_flags);
+    if (rw_flags & RW_CLOSE)
+        *persist = 0;
+
+    // a GET may get a compressed response, if the client takes one
+    compress_enc_t enc = COMPRESS_NONE;
+    const http_header_t *accept = http_find_header(in->data, &req,
+                                                   "Accept-Encoding");
+    if (compress_enabled() && isGet && accept != NULL)
+        enc = compress_accepted(in->data, accept->value);
+
+    // and a conditional one may be answered from the cache
+    char *ifNoneMatch = header_value(arglist->arena, in->data, &req,
+                                     "If-None-Match");
+    char *ifModifiedSince = header_value(arglist->arena, in->data, &req,
+                                         "If-Modified-Since");
+    int conditional = ifNoneMatch != NULL || ifModifiedSince != NULL;
+
+    // what the cache must know of the request to judge the response
+    int cacheFlags = http_find_header(in->data, &req, "Authorization") != NULL
+        ? CACHE_REQ_AUTHORIZED : 0;
+
+    // the request has been used up; keep whatever the client sent
+    // after it
+    in->len -= header_len;
+    memmove(in->data, in->data + header_len, in->len);
+
+    // a request for the proxy itself rather than for an origin
+    if (hostname[0] == '\0' && strcmp(pathname, STATS_PATH) == 0)
+        return send_stats(arglist, &out, keepalive, persist);
+
+    // serve the response from the cache if someone has fetched it,
+    // or is fetching it now; otherwise fill the cache as we relay it.
+    // Only plain GETs are cached.  A compressed variant is served
+    // instead of the original if there is one.  A conditional request
+    // is only answered from a complete copy, never filling one, since
+    // what the origin says to it is no answer for anyone else.  Nor
+    // is a fill followed by a request unlike its writer's, or when
+    // either has credentials; such a request fetches on its own.
+    char key[MAXLINE];
+    char variantKey[MAXLINE];
+    int cacheKey = isGet && !hasBody && hostname[0] != '\0'
+        && cache_key(key, MAXLINE, hostname, port, pathname) == 0;
+    int hasVariant = cacheKey && enc != COMPRESS_NONE
+        && compress_variant_key(variantKey, MAXLINE, key, enc) == 0;
+    cache_obj_t *obj = NULL;
+    cache_reader_t reader;
+    disk_hit_t hit;
+    int responseLen = 0;
+    int fromCache = 0;
+    int fromDisk = cacheKey && disk_lookup(key, &hit) == 0;
+    if (fromDisk) {
+        // too large to keep in memory, but kept on disk
+        responseLen = send_disk(&out, &hit, persist);
+        disk_release(&hit);
+    }
+    else if (hasVariant && cache_lookup(variantKey, &reader) == 0) {
+        responseLen = send_cached(&out, &reader, keepalive, persist,
+                                  ifNoneMatch, ifModifiedSince);
+        fromCache = responseLen > 0;
+        cache_close(&reader);
+    }
+    else if (cacheKey && (conditional ? cache_lookup(key, &reader) == 0
+                          : (obj = cache_open(key, cacheFlags, &reader))
+                            == NULL && reader.obj != NULL)) {
+        responseLen = send_cached(&out, &reader, keepalive, persist,
+                                  ifNoneMatch, ifModifiedSince);
+        fromCache = responseLen > 0;
+        cache_close(&reader);
+        // so the next client that takes it gets it compressed
+        if (fromCache && hasVariant)
+            compress_variant(key, enc);
+    }
+
+    // a stale copy is only fetched again if the origin says it has
+    // changed; one without validators is simply replaced
+    stale_t stale = {0};
+    if (obj != NULL && reader.obj != NULL) {
+        request = revalidate_request(arglist->arena, &reader, &stale,
+                                     request, &request_len);
+        if (stale.head == NULL)
+            cache_close(&reader);
+    }
+
+    if (responseLen == 0 && !fromDisk && !out.failed) {
+        // forward request to the server; if nothing came of the copy
+        // we followed, fetch on our own, without sharing
+        sink_t sink;
+        sink.up.write = sink_write;
+        sink.up.len = 0;
+        sink.up.splice_fd = obj != NULL || enc != COMPRESS_NONE ? -1 : connfd;
+        sink.out = &out;
+        sink.gone = 0;
+        sink.obj = obj;
+        sink.shared = obj != NULL;
+        sink.persist = 1;
+        sink.clientPersist = *persist;
+        sink.headerState = SINK_STATUS;
+        sink.enc = enc;
+        sink.head = NULL;
+        sink.headLen = 0;
+        sink.zip = NULL;
+        sink.chunked = keepalive;
+        sink.sent = 0;
+        sink.frame = NULL;
+        sink.frameSize = 0;
+        sink.variant = NULL;
+        sink.variantLen = 0;
+        sink.revalidating = stale.head != NULL;
+        sink.cacheFlags = cacheFlags;
+        sink.notModified = 0;
+        int flags = (keepalive ? UPSTREAM_KEEPALIVE : 0)
+            | (isHead ? UPSTREAM_HEAD : 0) | (idempotent ? 0 : UPSTREAM_NORETRY);
+        if (hostname[0] == '\0'
+            || upstream_fetch(hostname, port, request, request_len,
+                              hasBody ? &body.up : NULL, flags,
+                              sink.shared ? &sink.persist : persist,
+                              &sink.up) < 0)
+            printf("%s\n", "could not open connection to client");
+        if (sink.shared && !sink.persist)
+            *persist = 0;
+        int compressed = sink.zip != NULL;
+        sink_finish(&sink, hasVariant ? variantKey : NULL, persist);
+        responseLen = compressed ? sink.sent : sink.up.len;
+        if (sink.notModified) {
+            responseLen = send_revalidated(&out, sink.obj, &reader, &stale,
+                                           sink.head, sink.headLen, persist);
+            fromCache = responseLen > 0;
+            sink.obj = NULL;
+            stats_add(STAT_REVALIDATED, 1);
+            if (fromCache && hasVariant)
+                compress_variant(key, enc);
         }
+        if (sink.obj != NULL)
+            cache_finish(sink.obj, sink.persist);
+    }
+    if (stale.head != NULL)
+        cache_close(&reader);
 
-        /* Don't pass "Connection:" lines; they cause long hangs */
-        if (prefixcmp(buf, "Connection:") == 0)
-            continue;
+    // the origin is done with; let the client catch up
+    if (relay_flush(&out) < 0) {
+        printf("Thread %d: client stopped taking the response to %s\n",
+          arglist->myid, url);
+        *persist = 0;
+        responseLen = 0;
+    }
 
+    stats_add(STAT_BYTES_IN, body.len);
+    if (responseLen>0) {
+        log_request(&arglist->clientaddr, url, responseLen);
+        if (fromDisk)
+            stats_add(STAT_DISK_HITS, 1);
+        else if (fromCache)
+            stats_add(STAT_CACHE_HITS, 1);
+        stats_add(STAT_BYTES_OUT, responseLen);
+        stats_record(STAT_TOTAL, stats_now() - request_start);
+    }
+    else
+        stats_add(STAT_ERRORS, 1);
+    trace_end(url);
+
+    return responseLen > 0 ? 0 : -1;
+}
+
+/*
+ * read_request - Receive bytes from the client until the buffer holds
+ * a complete request header, and parse it into "req".  Returns the
+ * header's length, or -1 if the client sent a bad request or none.
+ */
+static int read_request(arglist_t *arglist, inbuf_t *in, int nrequests,
+                        http_request_t *req)
+{
+    int rc;
+    int n;
+
+    // the request is timed from its first byte, not from whenever a
+    // kept-alive client was last answered
+    if (in->len > 0)
+        trace_begin();
+    http_request_init(req);
+    while ((rc = http_parse_request(in->data, in->len, req)) == HTTP_INCOMPLETE) {
         /* If not enough room in request buffer, make more room */
-        if (request_len + n + 1 > realloc_size) {
-            /*
-             * In this program the following loop always runs exactly once,
-             * but if you were to use similar code elsewhere it might be
-             * needed, so we'll keep it here for pedagogical purposes.
-             */
-            while (request_len + n + 1 > realloc_size)
-                realloc_size *= 2;
-            request = Realloc(request, realloc_size);
+        if (in->len == in->size) {
+            if (in->size >= CLIENT_MAX_HEADER) {
+                printf("Thread %d: process_request: request header too large\n",
+                  arglist->myid);
+                stats_add(STAT_ERRORS, 1);
+                return -1;
+            }
+            in->data = arena_realloc(arglist->arena, in->data, in->size,
+                                     in->size * 2);
+            in->size *= 2;
+            arena_mark(arglist->arena);
+        }
+
+        n = read(arglist->connfd, in->data + in->len, in->size - in->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            // a client that just hangs up between requests isn't in
+            // error
+            if (in->len > 0 || nrequests == 1) {
+                printf("Thread %d: process_request: client issued a bad request (1).\n",
+                  arglist->myid);
+                stats_add(STAT_ERRORS, 1);
+            }
+            return -1;
+        }
+        if (in->len == 0)
+            trace_begin();
+        in->len += n;
+    }
+    if (rc == HTTP_ERROR) {
+        printf("Thread %d: process_request: client issued a bad request (2).\n",
+          arglist->myid);
+        stats_add(STAT_ERRORS, 1);
+    }
+    return rc;
+}
+
+/*
+ * wait_for_request - Wait up to "timeout" seconds for the client to
+ * start its next request, giving up early if connections are queued
+ * for a worker.  Returns nonzero if there is something to read, either
+ * already buffered (a pipelined request) or on the socket.
+ */
+static int wait_for_request(int connfd, inbuf_t *in, int timeout)
+{
+    struct pollfd pfd;
+    int left = timeout * 1000;      /* Milliseconds */
+    int slice;
+    int rc;
+
+    if (in->len > 0)
+        return 1;
+    pfd.fd = connfd;
+    pfd.events = POLLIN;
+    do {
+        slice = pool_backlog() > 0 ? 0
+          : (left < CLIENT_IDLE_SLICE ? left : CLIENT_IDLE_SLICE);
+        while ((rc = poll(&pfd, 1, slice)) < 0 && errno == EINTR)
+            ;
+        left -= slice;
+    } while (rc == 0 && slice > 0 && left > 0);
+    return rc > 0;
+}
+
+/*
+ * reject_connection - Turn away a connection the workers can't take
+ * on.  The 503 is sent without waiting, and the request is never read,
+ * so the close may reach the client as a reset instead; either way the
+ * acceptor is not held up.
+ */
+static void reject_connection(int connfd)
+{
+    static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\nConnection: close\r\nRetry-After: 1\r\n\r\n";
+
+    /* If this fails, the client still sees the connection close */
+    send(connfd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    Close(connfd);
+}
+
+/*
+ * send_stats - Answer a request for STATS_PATH with the proxy's
+ * current statistics.  Returns 0, or -1 if they could not be sent.
+ */
+static int send_stats(arglist_t *arglist, relay_t *out, int keepalive,
+                      int *persist)
+{
+    char *body = arena_alloc(arglist->arena, STATS_MAX_JSON);
+    char header[MAXLINE];
+    int body_len, header_len;
+
+    if ((body_len = stats_format(body, STATS_MAX_JSON)) < 0) {
+        stats_add(STAT_ERRORS, 1);
+        return -1;
+    }
+    header_len = snprintf(header, sizeof(header),
+      "HTTP/1.%d 200 OK\r\nContent-Type: application/json\r\n"
+      "Content-Length: %d\r\nCache-Control: no-store\r\n%s\r\n",
+      keepalive, body_len, *persist ? "" : "Connection: close\r\n");
+    first_byte();
+    if (relay_write(out, header, header_len) < 0
+        || relay_write(out, body, body_len) < 0 || relay_flush(out) < 0) {
+        stats_add(STAT_ERRORS, 1);
+        return -1;
+    }
+    stats_add(STAT_BYTES_OUT, header_len + body_len);
+    stats_record(STAT_TOTAL, stats_now() - request_start);
+    return 0;
+}
+
+/*
+ * tunnel_request - Answer CONNECT: connect to the origin and relay
+ * bytes both ways until both sides have finished.  Anything the client
+ * sent after the request (often the start of a TLS handshake) goes
+ * ahead of the rest.  The tunnel counts as one request of as many
+ * bytes as came back through it.  Returns 0 if it ran to the end.
+ */
+static int tunnel_request(arglist_t *arglist, inbuf_t *in, char *url,
+                          char *hostname, int port)
+{
+    static const char established[] =
+      "HTTP/1.1 200 Connection established\r\n\r\n";
+    static const char bad_gateway[] = "HTTP/1.1 502 Bad Gateway\r\n"
+      "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    tunnel_t tunnel;
+    int originfd;
+    int rc;
+
+    if ((originfd = open_clientfd_ts(hostname, port)) < 0) {
+        printf("Thread %d: could not open tunnel to %s\n", arglist->myid, url);
+        rio_writen(arglist->connfd, (void *)bad_gateway, sizeof(bad_gateway) - 1);
+        stats_add(STAT_ERRORS, 1);
+        trace_end(url);
+        return -1;
+    }
+    if (tunnel_open(&tunnel, arglist->connfd, originfd, in->data, in->len,
+                    established, sizeof(established) - 1) < 0) {
+        printf("Thread %d: could not set up tunnel to %s\n", arglist->myid, url);
+        Close(originfd);
+        stats_add(STAT_ERRORS, 1);
+        trace_end(url);
+        return -1;
+    }
+    in->len = 0;
+    first_byte();
+    rc = tunnel_run(&tunnel, TUNNEL_IDLE_TIMEOUT);
+    tunnel_close(&tunnel);
+    Close(originfd);
+
+    log_request(&arglist->clientaddr, url, tunnel.down.bytes);
+    stats_add(STAT_BYTES_IN, tunnel.up.bytes);
+    stats_add(STAT_BYTES_OUT, tunnel.down.bytes);
+    stats_record(STAT_TOTAL, stats_now() - request_start);
+    if (rc < 0)
+        stats_add(STAT_ERRORS, 1);
+    trace_end(url);
+    return rc;
+}
+
+/*
+ * body_send - Send a request body to the origin as it arrives from
+ * the client, after telling the client to go ahead if it is waiting
+ * to be told.  Returns -1 if the client went away, the body's framing
+ * was broken, or the origin stopped taking it.
+ */
+static int body_send(upstream_body_t *ubody, int fd)
+{
+    static const char go_ahead[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    body_t *body = (body_t *)ubody;
+    inbuf_t *in = body->in;
+    int connfd = body->arglist->connfd;
+    int n;
+
+    if (body->expect
+        && rio_writen(connfd, (void *)go_ahead, sizeof(go_ahead) - 1) < 0)
+        return -1;
+    while (1) {
+        if ((n = http_body_scan(&body->framing, in->data, in->len)) < 0) {
+            printf("Thread %d: process_request: bad request body\n",
+              body->arglist->myid);
+            return -1;
         }
+        if (n > 0 && rio_writen(fd, in->data, n) != n)
+            return -1;
+        body->len += n;
+        in->len -= n;
+        memmove(in->data, in->data + n, in->len);
+        if (http_body_done(&body->framing))
+            return 0;
 
-        memcpy(request + request_len, buf, n);
-        request_len += n;
+        // everything buffered was body; wait for more
+        while ((n = read(connfd, in->data, in->size)) < 0 && errno == EINTR)
+            ;
+        if (n <= 0)
+            return -1;
+        in->len = n;
+    }
+}
 
-        /* An HTTP request is always terminated by a blank line */
-        if (strcmp(buf, "\r\n") == 0  ||  strcmp(buf, "\n") == 0)
+/*
+ * first_byte - Time the first byte of the response to the request
+ * being handled, unless that has been done already.
+ */
+static void first_byte(void)
+{
+    if (!request_answered) {
+        request_answered = 1;
+        stats_record(STAT_TTFB, stats_now() - request_start);
+        trace_mark(TRACE_WAIT);
+    }
+}
+
+/*
+ * send_cached - Stream a response from the cache to the client,
+ * following the writer if it is still being fetched.  Cached copies
+ * carry no hop-by-hop headers, so if the client connection is about to
+ * be closed, "Connection: close" is added to the header.  A client
+ * that sent "ifNoneMatch" or "ifModifiedSince" (either may be NULL)
+ * and whose copy is still current gets just a 304.  Returns the
+ * number of bytes sent; 0 if the response could not be used, because
+ * it ended without a header or has a chunked body that an HTTP/1.0
+ * client would not understand.  If the client is given up on, "out"
+ * says so.
+ */
+static int send_cached(relay_t *out, cache_reader_t *reader, int keepalive,
+                       int *persist, const char *ifNoneMatch,
+                       const char *ifModifiedSince)
+{
+    char reply[MAXBUF];
+    long headLen;
+    long sent = 0;
+    int flags;
+    int closing;
+    char *head;
+    char *buf;
+    int len;
+    int n;
+
+    if ((headLen = cache_wait_header(reader, &flags)) < 0)
+        return 0;
+    if (!keepalive && (flags & CACHE_HEAD_CHUNKED))
+        return 0;
+    closing = flags & CACHE_HEAD_CLOSE;
+    if (closing)
+        *persist = 0;
+    first_byte();
+    if (ifNoneMatch != NULL || ifModifiedSince != NULL) {
+        // the conditions are checked against the header in one piece
+        if ((head = cached_head(reader, headLen, out->arena, &len,
+                                &buf, &n)) == NULL)
+            return 0;
+        if (fresh_not_modified(head, len, ifNoneMatch, ifModifiedSince)
+            && (sent = fresh_304(head, len, reply, MAXBUF)) > 0) {
+            len = sent;
+            head = !closing && !*persist
+                ? add_close(out->arena, reply, &len) : reply;
+            if (relay_write(out, head, len) < 0)
+                *persist = 0;
+            return len;
+        }
+        if (!closing && !*persist)
+            head = add_close(out->arena, head, &len);
+        sent = len + n;
+        if (relay_write(out, head, len) < 0 || relay_write(out, buf, n) < 0) {
+            *persist = 0;
+            return sent;
+        }
+    }
+    while ((n = cache_read(reader, &buf)) > 0) {
+        if (!closing && !*persist && sent <= headLen && sent + n > headLen) {
+            // tell the client its connection ends with this response
+            if (relay_write(out, buf, headLen - sent) < 0
+                || relay_write(out, "Connection: close\r\n", 19) < 0
+                || relay_write(out, buf + (headLen - sent),
+                               sent + n - headLen) < 0)
+                break;
+        }
+        else if (relay_write(out, buf, n) < 0)
             break;
+        sent += n;
     }
+    if (n != 0)
+        *persist = 0;
+    return sent;
+}
 
-    /* 
-     * Make sure that this is indeed a GET request
-     */
-    if (prefixcmp(request, "GET ") != 0) {
-        printf("process_request: Received non-GET request\n");
-        close(connfd);
-        free(request);
+/*
+ * header_value - Copy the value of a request header field into the
+ * arena, as a string.  Returns NULL if the request has no such field.
+ */
+static char *header_value(arena_t *arena, const char *buf,
+                          const http_request_t *req, const char *name)
+{
+    const http_header_t *h = http_find_header(buf, req, name);
+    char *value;
+
+    if (h == NULL)
         return NULL;
+    value = arena_alloc(arena, h->value.len + 1);
+    memcpy(value, buf + h->value.off, h->value.len);
+    value[h->value.len] = '\0';
+    return value;
+}
+
+/*
+ * cached_head - Read the header of a cached response, whose blank line
+ * starts at "headLen", into the arena in one piece.  Returns it, with
+ * its length in *len, and what was read of the body along with it in
+ * *rest and *restLen; or NULL if the response ended first.
+ */
+static char *cached_head(cache_reader_t *reader, long headLen, arena_t *arena,
+                         int *len, char **rest, int *restLen)
+{
+    char *head = arena_alloc(arena, headLen + 2);
+    long want = headLen + 1;
+    long got = 0;
+    char *buf;
+    int n, i;
+
+    while ((n = cache_read(reader, &buf)) > 0) {
+        for (i = 0; i < n && got < want; i++) {
+            head[got++] = buf[i];
+            // a CRLF blank line is a byte longer
+            if (got == headLen + 1 && head[headLen] == '\r')
+                want++;
+        }
+        if (got == want) {
+            *len = got;
+            *rest = buf + i;
+            *restLen = n - i;
+            return head;
+        }
     }
-     
-     /* begin our code */
-     // find len of first line
-     int count = 0;
-     while(request[count] != '\n') {
-         count++;
-     }
-     //extract first line
-     char* firstLine = (char*)Malloc(count);
-     memcpy(firstLine, &request[0], count-1);
-     firstLine[count] = '\0';
-
-     //Change to proper protocol
-     P(&sem_fml);
-     char* httpRequest = substitute_re(request, request_len, " HTTP\\/1\\.1", " HTTP/1.0", 0, 0, NULL, NULL);
-     V(&sem_fml);
-
-
-
-     // extract data from first line
-     char* get = Malloc(3);
-     char* url = Malloc(MAXLINE);
-     char* protocol = Malloc(8);
-     sscanf(firstLine, "%s %s %s", get, url, protocol);
-
-
-     // parse info from uri
-     char* hostname = (char *)Malloc(MAXLINE);
-     char* pathname = (char *)Malloc(MAXLINE);
-     int* port = (int *)Malloc(sizeof(int*));;
-     if (parse_uri(url, hostname, pathname, port) != 0) {
-         printf("Warning: parse_uri failed; error = %s\n", strerror(errno));
-     };
-
-     
-     
-     // forward request to the server
-     int clientfd;
-     if((clientfd = Open_clientfd_ts(hostname, *port)) < 0) {
-        printf("%s\n", "could not open connection to client");
-        return NULL;
-     }
+    return NULL;
+}
 
-     // initialize buffer
-     Rio_readinitb(&rio, clientfd);
+/*
+ * add_close - Copy a header with "Connection: close" added before its
+ * blank line, for a client whose connection ends with this response.
+ * Updates *len.
+ */
+static char *add_close(arena_t *arena, const char *head, int *len)
+{
+    int blank = *len >= 2 && head[*len - 2] == '\r' ? 2 : 1;
+    int at = *len - blank;
+    char *buf = arena_alloc(arena, *len + 19);
+
+    memcpy(buf, head, at);
+    memcpy(buf + at, "Connection: close\r\n", 19);
+    memcpy(buf + at + 19, head + at, blank);
+    *len += 19;
+    return buf;
+}
+
+/*
+ * revalidate_request - Read the header of the stale copy "reader" is
+ * on, and add its validators to the request for the origin.  If it has
+ * any, "stale" is filled in and the new request returned; otherwise
+ * stale->head stays NULL and the request is returned as it was.
+ */
+static char *revalidate_request(arena_t *arena, cache_reader_t *reader,
+                                stale_t *stale, char *request,
+                                int *request_len)
+{
+    char lines[MAXBUF];
+    char *head, *rest;
+    char *buf;
+    long headLen;
+    int flags, len, restLen, n;
+    int blank, at;
 
-     // write response to buffer
-     Rio_writen(clientfd, httpRequest, strlen(request));
-     ssize_t readData;
-     int responseLen = 0;
-     while ((readData = Rio_readnb(&rio, buf, MAXLINE)) > 0) {
-        responseLen += readData;
-        Rio_writen(connfd, buf, readData);
-     }
+    if ((headLen = cache_wait_header(reader, &flags)) < 0
+        || (head = cached_head(reader, headLen, arena, &len,
+                               &rest, &restLen)) == NULL
+        || (n = fresh_conditions(head, len, lines, MAXBUF)) <= 0)
+        return request;
 
-     if (responseLen>0) {
-         /* Create log entry */
-         char * log_entry = Malloc(MAXLINE);
-         format_log_entry(log_entry, MAXLINE, &clientaddr, url, responseLen);
+    blank = *request_len >= 2 && request[*request_len - 2] == '\r' ? 2 : 1;
+    at = *request_len - blank;
+    buf = arena_alloc(arena, *request_len + n);
+    memcpy(buf, request, at);
+    memcpy(buf + at, lines, n);
+    memcpy(buf + at + n, request + at, blank);
+    *request_len += n;
+    stale->head = head;
+    stale->headLen = len;
+    stale->rest = rest;
+    stale->restLen = restLen;
+    return buf;
+}
+
+/*
+ * send_revalidated - The origin says the stale copy "reader" is on
+ * still holds: fill "obj" with it, its header brought up to date from
+ * the 304's ("update"), and send it to the client.  A header that
+ * can't be updated is kept as it was.  Returns the number of bytes
+ * sent, or 0 if the client was given up on.
+ */
+static int send_revalidated(relay_t *out, cache_obj_t *obj,
+                            cache_reader_t *reader, stale_t *stale,
+                            char *update, int updateLen, int *persist)
+{
+    int size = stale->headLen + updateLen;
+    char *head = arena_alloc(out->arena, size);
+    int gone = 0;
+    long sent;
+    char *buf;
+    int len, n;
 
-          /* Logfile is a shared resource, must be protected with a mutex */
-         pthread_mutex_lock(&mutex);
-         FILE* file = Fopen("proxy.log", "a");
-         fprintf(file, "%s\n", log_entry); //buffered
-         Free(log_entry);
-         Fclose(file);
-         pthread_mutex_unlock(&mutex);
+    if ((len = fresh_update(stale->head, stale->headLen, update, updateLen,
+                            head, size)) < 0) {
+        head = stale->head;
+        len = stale->headLen;
+    }
+    cache_append(obj, head, len);
+    if (!cache_header(obj, len - (head[len - 2] == '\r' ? 2 : 1), 0)) {
+        cache_finish(obj, 1);
+        obj = NULL;
+    }
+    sent = len;
+    if (!*persist)
+        head = add_close(out->arena, head, &len);
+    if (relay_write(out, head, len) < 0)
+        gone = 1;
 
+    // the rest of the body is the stale copy's, untouched
+    buf = stale->rest;
+    n = stale->restLen;
+    if (n == 0)
+        n = cache_read(reader, &buf);
+    while (n > 0) {
+        if (obj != NULL)
+            cache_append(obj, buf, n);
+        if (!gone && relay_write(out, buf, n) < 0)
+            gone = 1;
+        sent += n;
+        n = cache_read(reader, &buf);
+    }
+    if (obj != NULL)
+        cache_finish(obj, n == 0);
+    if (gone || n != 0)
+        *persist = 0;
+    return gone ? 0 : sent;
+}
 
-     }
-   
-     // cleanup
-     // Free(firstLine);
-     Free(get);
-     Free(url);
-     Free(hostname);
-     Free(pathname);
-     Free(port);
-     Free(request);
+/*
+ * send_disk - Send a response kept in the disk tier straight from its
+ * slab file to the client, adding "Connection: close" to the header
+ * if the client connection is about to be closed.  Returns the number
+ * of bytes sent.
+ */
+static int send_disk(relay_t *out, disk_hit_t *hit, int *persist)
+{
+    off_t off = hit->off;
+    off_t end = hit->off + hit->size;
+    off_t split = *persist ? end : hit->off + hit->head_len;
+    ssize_t n;
 
-     Close(connfd);
-     Close(clientfd);
-     pthread_exit(0);
-     return NULL;
+    first_byte();
+    while (off < end) {
+        if (off == split) {
+            if (relay_write(out, "Connection: close\r\n", 19) < 0
+                || relay_flush(out) < 0) {
+                *persist = 0;
+                break;
+            }
+            split = end;
+        }
+        n = sendfile(out->fd, hit->fd, &off, split - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            *persist = 0;
+            break;
+        }
+    }
+    return off - hit->off;
 }
 
+/*
+ * interim_status - Is this status line an interim 1xx one, which the
+ * final response follows?  A 101 is final: what follows it is the
+ * upgraded connection.
+ */
+static int interim_status(const char *buf, int n)
+{
+    return n > 11 && strncmp(buf, "HTTP/1.", 7) == 0 && buf[8] == ' '
+        && buf[9] == '1' && strncmp(buf + 9, "101", 3) != 0;
+}
 
 /*
- * Rio_readlineb_w - A wrapper for rio_readlineb (csapp.c) that
- * prints a warning when a read fails instead of terminating 
- * the process.
+ * sink_write - Pass one piece of a response on to the client and
+ * append it to the cache object being filled.  Once the header is
+ * complete and the cache has neither kept the object nor anyone
+ * following it, let the rest of the body be spliced.  Returns -1 to
+ * abandon the response once neither the client nor the cache wants
+ * any more of it.
  */
-ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen) 
+static int sink_write(upstream_sink_t *usink, char *buf, int n)
 {
-    ssize_t rc;
+    sink_t *sink = (sink_t *)usink;
+    long len = usink->len;   /* Bytes before this piece */
+    int blank = (n == 2 && buf[0] == '\r' && buf[1] == '\n')
+        || (n == 1 && buf[0] == '\n');
 
-    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0) {
-        printf("Warning: rio_readlineb failed; error = %s\n", strerror(errno));
+    first_byte();
+    if (sink->revalidating && sink->headerState == SINK_STATUS
+        && !interim_status(buf, n)) {
+        // the origin's verdict on the stale copy
+        sink->revalidating = 0;
+        sink->notModified = n > 11 && strncmp(buf + 8, " 304", 4) == 0;
+    }
+    if (sink->notModified) {
+        // keep the 304's header, which is all there is of it; one too
+        // long to keep just doesn't update the stale copy's
+        if (sink->head == NULL)
+            sink->head = arena_alloc(sink->out->arena, MAXBUF);
+        if (sink->headLen + n <= MAXBUF) {
+            memcpy(sink->head + sink->headLen, buf, n);
+            sink->headLen += n;
+        }
         return 0;
     }
-    return rc;
+    if (sink->obj != NULL)
+        cache_append(sink->obj, buf, n);
+
+    // upstream hands over a shared or held header a line at a time;
+    // at its end, say where it is and tell our client if we're closing
+    if (sink->zip != NULL) {
+        sink->bodySeen += n;
+        if (compress_write(sink->zip, buf, n) < 0)
+            sink->gone = 1;
+    }
+    else if ((!sink->shared && sink->enc == COMPRESS_NONE)
+             || sink->headerState == SINK_BODY)
+        sink_send(sink, buf, n);
+    else if (sink->headerState == SINK_STATUS) {
+        sink->interim = interim_status(buf, n);
+        sink->headerState = SINK_HEADER;
+        sink_hold(sink, buf, n);
+    }
+    else if (!blank)
+        sink_hold(sink, buf, n);
+    else if (sink->interim) {
+        sink->headerState = SINK_STATUS;
+        sink_hold(sink, buf, n);
+        sink_send(sink, sink->head, sink->headLen);
+        sink->headLen = 0;
+    }
+    else {
+        if (sink->shared && sink->persist && !sink->clientPersist)
+            sink_hold(sink, "Connection: close\r\n", 19);
+        if (sink->obj != NULL
+            && !cache_header(sink->obj, len, !sink->persist)) {
+            cache_finish(sink->obj, sink->persist);
+            sink->obj = NULL;
+            if (sink->enc == COMPRESS_NONE)
+                usink->splice_fd = sink->out->fd;
+        }
+        sink->headerState = SINK_BODY;
+        sink_hold(sink, buf, n);
+        sink_start(sink);
+    }
+    return sink->gone && sink->obj == NULL ? -1 : 0;
+}
+
+/*
+ * sink_send - Send bytes on to the client, unless it is gone.  Once
+ * bytes are being spliced past the relay, it must be empty after each
+ * write, so nothing it holds is overtaken.
+ */
+static int sink_send(sink_t *sink, char *buf, int n)
+{
+    if (!sink->gone
+        && (relay_write(sink->out, buf, n) < 0
+            || (sink->up.splice_fd >= 0 && relay_flush(sink->out) < 0)))
+        sink->gone = 1;
+    sink->sent += n;
+    return sink->gone ? -1 : 0;
 }
 
-// A thread-safe version of open_clientfd in which we protect
-// calls to gethostbyname with semaphores
+/*
+ * sink_hold - Hold back a header line while the body might yet be
+ * compressed; otherwise just send it.  A header too long to hold is
+ * sent as it is, and the body with it.
+ */
+static int sink_hold(sink_t *sink, char *buf, int n)
+{
+    if (sink->enc == COMPRESS_NONE)
+        return sink_send(sink, buf, n);
+    if (sink->head == NULL)
+        sink->head = arena_alloc(sink->out->arena, MAXBUF);
+    if (sink->headLen + n > MAXBUF) {
+        sink->enc = COMPRESS_NONE;
+        sink_send(sink, sink->head, sink->headLen);
+        return sink_send(sink, buf, n);
+    }
+    memcpy(sink->head + sink->headLen, buf, n);
+    sink->headLen += n;
+    return 0;
+}
+
+/*
+ * sink_start - At the end of a held header, start compressing the body
+ * if it's worth it and a stream is to be had, and send the header the
+ * client is to get.
+ */
+static int sink_start(sink_t *sink)
+{
+    char *head;
+    int len;
+
+    if (sink->enc == COMPRESS_NONE)
+        return sink->gone ? -1 : 0;
+    head = arena_alloc(sink->out->arena, MAXBUF);
+    len = compress_header(sink->head, sink->headLen, sink->enc,
+                          sink->chunked ? COMPRESS_CHUNKED : COMPRESS_CLOSE,
+                          head, MAXBUF, &sink->bodyLen);
+    if (len >= 0
+        && (sink->zip = compress_open(sink->enc, sink_compressed, sink)) != NULL) {
+        stats_add(STAT_COMPRESSED, 1);
+        if (sink->bodyLen <= cache_max_object())
+            sink->variant = Malloc(sink->variantSize = sink->bodyLen);
+        return sink_send(sink, head, len);
+    }
+    sink->enc = COMPRESS_NONE;
+    if (sink->obj == NULL)
+        sink->up.splice_fd = sink->out->fd;
+    return sink_send(sink, sink->head, sink->headLen);
+}
+
+/*
+ * sink_compressed - Send on a piece of the compressed body, as a chunk
+ * if need be, and keep it for the cache.
+ */
+static int sink_compressed(void *arg, const char *buf, int n)
+{
+    sink_t *sink = arg;
+    int len;
+
+    if (sink->variant != NULL && sink->variantLen + n <= sink->variantSize) {
+        memcpy(sink->variant + sink->variantLen, buf, n);
+        sink->variantLen += n;
+    }
+    else if (sink->variant != NULL) {
+        // no smaller than the original; not worth keeping
+        Free(sink->variant);
+        sink->variant = NULL;
+    }
+    if (!sink->chunked)
+        return sink_send(sink, (char *)buf, n);
+
+    // frame the chunk in one piece, so it goes out in one send
+    if (sink->frameSize < n + 16) {
+        sink->frameSize = n + 16;
+        sink->frame = Realloc(sink->frame, sink->frameSize);
+    }
+    len = sprintf(sink->frame, "%x\r\n", n);
+    memcpy(sink->frame + len, buf, n);
+    memcpy(sink->frame + len + n, "\r\n", 2);
+    return sink_send(sink, sink->frame, len + n + 2);
+}
+
+/*
+ * sink_finish - Once upstream is done, finish the compressed body.  It
+ * is only complete if all of the original went into it; if not, the
+ * client connection has to close.  A complete one is cached under
+ * "variantKey", unless that is NULL.  A header still held back never
+ * ended, and is passed on as it is.
+ */
+static void sink_finish(sink_t *sink, const char *variantKey, int *persist)
+{
+    char *head;
+    char *data;
+    int complete;
+    int len;
+
+    if (sink->zip == NULL) {
+        if (sink->enc != COMPRESS_NONE && sink->headerState != SINK_BODY
+            && !sink->notModified)
+            sink_send(sink, sink->head, sink->headLen);
+        return;
+    }
+    complete = compress_close(sink->zip) == 0
+        && sink->bodySeen == sink->bodyLen;
+    sink->zip = NULL;
+    if (!complete)
+        *persist = 0;
+    else if (sink->chunked)
+        sink_send(sink, "0\r\n\r\n", 5);
+
+    if (complete && variantKey != NULL && sink->variant != NULL) {
+        head = arena_alloc(sink->out->arena, MAXBUF);
+        len = compress_header(sink->head, sink->headLen, sink->enc,
+                              sink->variantLen, head, MAXBUF, &sink->bodyLen);
+        if (len >= 0) {
+            data = Malloc(len + sink->variantLen);
+            memcpy(data, head, len);
+            memcpy(data + len, sink->variant, sink->variantLen);
+            cache_insert(variantKey, data, len + sink->variantLen,
+                         sink->cacheFlags | CACHE_REQ_ENCODING);
+        }
+    }
+    Free(sink->variant);
+    Free(sink->frame);
+}
+
+// A thread-safe version of open_clientfd.  The name is looked up by
+// the resolver in dns.c, which caches answers and shares one lookup
+// among threads asking for the same host; each of its IPv4 or IPv6
+// addresses is then tried in turn.
 int open_clientfd_ts(char *hostname, int port) 
 {
     int clientfd;
-    struct hostent *hp;
-    struct sockaddr_in serveraddr;
-
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        return -1; /* check errno for cause of error */
+    dns_addrs_t addrs;
+    long start;
+    int rc;
+    int i;
 
-    /* Fill in the server's IP address and port */
-    P(&semaphore);
-    if ((hp = gethostbyname(hostname)) == NULL)
-        return -2; /* check h_errno for cause of error */
-    V(&semaphore);
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    bcopy((char *)hp->h_addr_list[0], 
-          (char *)&serveraddr.sin_addr.s_addr, hp->h_length);
-    serveraddr.sin_port = htons(port);
+    rc = dns_lookup(hostname, &addrs);
+    trace_mark(TRACE_DNS);
+    if (rc < 0)
+        return -2;
 
     /* Establish a connection with the server */
-    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
-        return -1;
-    return clientfd;
+    for (i = 0; i < addrs.naddrs; i++) {
+        clientfd = socket(addrs.addrs[i].ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (clientfd < 0)
+            continue;
+        dns_set_port(&addrs.addrs[i], port);
+        start = stats_now();
+        if (connect(clientfd, (SA *) &addrs.addrs[i], addrs.addrlens[i]) == 0) {
+            stats_record(STAT_CONNECT, stats_now() - start);
+            stats_add(STAT_UPSTREAM_CONNECTS, 1);
+            trace_mark(TRACE_CONNECT);
+            return clientfd;
+        }
+        close(clientfd);
+    }
+    return -1; /* check errno for cause of error */
 }
 
 
@@ -334,69 +1536,56 @@ int Open_clientfd_ts(char *hostname, int port)
 }
 
 /*
- * Getnameinfo- A wrapper for getnameinfo <sys/socket.h> that
- * prints a warning when the name fetch fails instead of terminating 
- * the process.
+ * open_listenfd_reuseport - Like open_listenfd, but lets any number of
+ * sockets listen on the same port, the kernel spreading incoming
+ * connections among them.  Returns -1 and sets errno on error.
  */
-int Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen,
-                       char *serv, socklen_t servlen, int flags) {
-    ssize_t result;
+int open_listenfd_reuseport(int port)
+{
+    int listenfd, optval = 1;
+    struct sockaddr_in serveraddr;
 
-    if ((result = getnameinfo(sa, salen, host, hostlen, serv, servlen, flags)) < 0) {
-        printf("Warning: getnameinfo; error = %s\n", strerror(errno));
-        return 0;
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *)&optval, sizeof(int)) < 0
+      ||  setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                     (const void *)&optval, sizeof(int)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0
+      ||  listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
     }
+    return listenfd;
+}
 
-    return result;
+int Open_listenfd_reuseport(int port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+        unix_error("Open_listenfd_reuseport error");
+    return rc;
 }
 
 /*
- * parse_uri - URI parser
- * 
- * Given a URI from an HTTP proxy GET request (i.e., a URL), extract
- * the host name, path name, and port.  The memory for hostname and
- * pathname must already be allocated and should be at least MAXLINE
- * bytes. Return -1 if there are any problems.
+ * log_request - Append one entry for a completed response to the
+ * proxy's log file.
  */
-int parse_uri(char *uri, char *hostname, char *pathname, int *port)
+void log_request(struct sockaddr_in *clientaddr, char *uri, int size)
 {
-    char *hostbegin;
-    char *hostend;
-    char *pathbegin;
-    int len;
+    char log_entry[MAXLINE];
 
-    if (strncasecmp(uri, "http://", 7) != 0) {
-        hostname[0] = '\0';
-        return -1;
-    }
-       
-    /* Extract the host name */
-    hostbegin = uri + 7;
-    hostend = strpbrk(hostbegin, " :/\r\n");
-    if (hostend != 0)
-        len = hostend - hostbegin;
-    else
-        len = strlen(hostbegin);
-    hostend = hostbegin + len;
-    strncpy(hostname, hostbegin, len);
-    hostname[len] = '\0';
-    
-    /* Extract the port number */
-    *port = 80; /* default */
-    if (*hostend == ':')   
-        *port = atoi(hostend + 1);
-    
-    /* Extract the path */
-    pathbegin = strchr(hostbegin, '/');
-    if (pathbegin == NULL) {
-        pathname[0] = '\0';
-    }
-    else {
-        pathbegin++;    
-        strcpy(pathname, pathbegin);
-    }
-
-    return 0;
+    format_log_entry(log_entry, MAXLINE, clientaddr, uri, size);
+    alog_write(log_entry, strlen(log_entry));
 }
 
 /*
@@ -409,14 +1598,11 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port)
 void format_log_entry(char *logstring, int stringsize,
                       struct sockaddr_in *sockaddr, char *uri, int size)
 {
-    time_t now;
-    char time_str[MAXLINE];
     unsigned long host;
     unsigned char a, b, c, d;
 
-    /* Get a formatted time string */
-    now = time(NULL);
-    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime(&now));
+    /* Get a formatted time string; see accesslog.c */
+    const char *time_str = alog_timestamp();
 
     /* 
      * Convert the IP address in network byte order to dotted decimal
@@ -0,0 +1,30 @@
+#ifndef _PROXY_H
+#define _PROXY_H
+
+#include "csapp.h"
+
+/*
+ * Declarations shared between the thread-per-connection code in
+ * proxy.c and the other request-processing modules.
+ */
+
+/* The name of the proxy's log file */
+#define PROXY_LOG "proxy.log"
+
+/* Seconds a client connection may take to send its next request */
+#define CLIENT_IDLE_TIMEOUT 15
+
+/*
+ * Handy macro to compare something with a constant prefix.  For example,
+ * prefixcmp(foo, "abc") returns 0 if the first three characters of foo
+ * are "abc".
+ */
+#define prefixcmp(str, prefix) strncmp(str, prefix, sizeof(prefix) - 1)
+
+int open_clientfd_ts(char *hostname, int port);
+int open_listenfd_reuseport(int port);
+int Open_listenfd_reuseport(int port);
+void format_log_entry(char *logstring, int stringsize, struct sockaddr_in *sockaddr, char *uri, int size);
+void log_request(struct sockaddr_in *clientaddr, char *uri, int size);
+
+#endif /* _PROXY_H */
@@ -0,0 +1,157 @@
+/*
+ * relay.c - Bounded, non-blocking output to a client
+ *
+ * See relay.h for the interface.  Bytes are always offered to the
+ * socket first, with MSG_DONTWAIT, and only what it refuses is copied
+ * into the buffer; once anything is buffered, new bytes go behind it
+ * so that nothing is reordered.  A full buffer is drained completely
+ * before more is accepted, which keeps it a single run of bytes with
+ * no wrapping.
+ */
+
+#include <poll.h>
+#include "csapp.h"
+#include "relay.h"
+
+static int max_buffer = RELAY_MAX_BUFFER;
+static int timeout_ms = RELAY_TIMEOUT * 1000;
+
+static int drain(relay_t *r, int wait);
+static int wait_writable(relay_t *r);
+static int give_up(relay_t *r);
+
+/*
+ * relay_init - Set the limits shared by every client.
+ */
+void relay_init(int max, int timeout)
+{
+    max_buffer = max > 0 ? max : 0;
+    timeout_ms = timeout * 1000;
+}
+
+/*
+ * relay_open - Start with nothing buffered; the buffer itself is only
+ * allocated when it is first needed.
+ */
+void relay_open(relay_t *r, int fd, arena_t *arena)
+{
+    r->fd = fd;
+    r->arena = arena;
+    r->buf = NULL;
+    r->head = r->tail = 0;
+    r->failed = 0;
+}
+
+/*
+ * relay_write - Send what the socket takes now, and buffer the rest,
+ * draining the buffer whenever it fills up.
+ */
+int relay_write(relay_t *r, const char *buf, int n)
+{
+    ssize_t m;
+    int room;
+
+    if (r->failed)
+        return -1;
+    while (n > 0) {
+        if (r->head == r->tail) {
+            m = send(r->fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (m >= 0) {
+                buf += m;
+                n -= m;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN  &&  errno != EWOULDBLOCK)
+                return give_up(r);
+            if (max_buffer == 0) {
+                /* No buffering at all; just wait */
+                if (wait_writable(r) < 0)
+                    return -1;
+                continue;
+            }
+        }
+
+        if (r->buf == NULL)
+            r->buf = arena_alloc(r->arena, max_buffer);
+        if ((room = max_buffer - r->tail) == 0) {
+            if (drain(r, 1) < 0)
+                return -1;
+            continue;
+        }
+        if (room > n)
+            room = n;
+        memcpy(r->buf + r->tail, buf, room);
+        r->tail += room;
+        buf += room;
+        n -= room;
+    }
+    return drain(r, 0);
+}
+
+/*
+ * relay_flush - Drain the buffer, waiting for the client as needed.
+ */
+int relay_flush(relay_t *r)
+{
+    if (r->failed)
+        return -1;
+    return drain(r, 1);
+}
+
+/*
+ * drain - Send buffered bytes until the buffer is empty or, unless
+ * "wait" is set, the socket would block.  Returns -1 if the client is
+ * given up on.
+ */
+static int drain(relay_t *r, int wait)
+{
+    ssize_t m;
+
+    while (r->head < r->tail) {
+        m = send(r->fd, r->buf + r->head, r->tail - r->head,
+          MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (m >= 0) {
+            r->head += m;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN  &&  errno != EWOULDBLOCK)
+            return give_up(r);
+        if (!wait)
+            return 0;
+        if (wait_writable(r) < 0)
+            return -1;
+    }
+    r->head = r->tail = 0;
+    return 0;
+}
+
+/*
+ * wait_writable - Wait for the client's socket to take more bytes.
+ * Returns -1, giving up on the client, if it doesn't within the
+ * timeout.
+ */
+static int wait_writable(relay_t *r)
+{
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = r->fd;
+    pfd.events = POLLOUT;
+    while ((rc = poll(&pfd, 1, timeout_ms)) < 0  &&  errno == EINTR)
+        ;
+    return rc > 0 ? 0 : give_up(r);
+}
+
+/*
+ * give_up - Stop sending to a client that is gone or stuck.
+ */
+static int give_up(relay_t *r)
+{
+    r->failed = 1;
+    r->head = r->tail = 0;
+    return -1;
+}
@@ -0,0 +1,57 @@
+#ifndef _RELAY_H
+#define _RELAY_H
+
+#include "arena.h"
+
+/*
+ * Bounded, non-blocking output to a client.
+ *
+ * relay_write hands bytes to the client's socket without waiting, and
+ * keeps whatever the socket won't take yet in a buffer of its own, up
+ * to a fixed size.  Only when that buffer is full does it wait for the
+ * client, so a client slower than its origin holds back the origin,
+ * instead of making us buffer without limit; but a response that fits
+ * in the buffer can be read off the origin at the origin's pace, and
+ * the origin connection freed, before the client has taken it all.
+ * relay_flush then waits for the client to catch up.
+ *
+ * The buffer comes from the connection's arena the first time the
+ * client falls behind, so clients that keep up cost nothing.  A client
+ * that takes nothing for the timeout, or whose connection fails, is
+ * given up on: the call returns -1 and every later one does too,
+ * leaving the connection to be closed.  Nothing here raises SIGPIPE.
+ */
+
+#define RELAY_MAX_BUFFER  (256 * 1024)  /* Default bytes buffered per client */
+#define RELAY_TIMEOUT     30            /* Seconds a client may take nothing */
+
+typedef struct {
+    int fd;
+    arena_t *arena;
+    char *buf;      /* Bytes not yet taken by the client, or NULL */
+    int head;       /* First of them */
+    int tail;       /* End of them */
+    int failed;     /* Has the client been given up on? */
+} relay_t;
+
+/* Set the buffer size for every client, and how long a client may stall */
+extern void relay_init(int max_buffer, int timeout);
+
+/* Start output to the client on socket "fd", buffering in "arena" */
+extern void relay_open(relay_t *r, int fd, arena_t *arena);
+
+/*
+ * Send "n" bytes at "buf" after everything written before, waiting
+ * only if they don't fit in the buffer.  Returns 0, or -1 if the
+ * client has been given up on.
+ */
+extern int relay_write(relay_t *r, const char *buf, int n);
+
+/*
+ * Wait until the client has taken everything written so far, as
+ * before writing to its socket other than through relay_write.
+ * Returns 0, or -1 if the client has been given up on.
+ */
+extern int relay_flush(relay_t *r);
+
+#endif /* _RELAY_H */
@@ -0,0 +1,201 @@
+/*
+ * rewrite.c - Single-pass request header rewriting
+ *
+ * See rewrite.h for the interface.  A compiled rewriter keeps the
+ * names of stripped headers in lower case, with a table of their first
+ * letters so that most headers are passed after a single lookup, and
+ * the headers to add already joined into one CRLF-terminated block.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "rewrite.h"
+#include "httpparse.h"
+
+#define RW_MAX_STRIP 32   /* Most headers one rewriter can strip */
+#define RW_MAX_NAME  64   /* Longest header name it can strip */
+#define RW_MAX_ADD   1024 /* Most bytes of headers it can add */
+
+struct rewriter {
+    char version[RW_MAX_NAME];     /* New protocol version, or "" */
+    int version_len;
+    int nstrip;
+    struct {
+        char name[RW_MAX_NAME];    /* Lower case, without the colon */
+        int len;
+    } strip[RW_MAX_STRIP];
+    unsigned char first[256];      /* Nonzero for each stripped name's first letter */
+    char add[RW_MAX_ADD];          /* Header lines to add, each ending in CRLF */
+    int add_len;
+};
+
+static int stripped(const rewriter_t *rw, const char *line, int len,
+  int *connection);
+static int has_token(const char *s, int len, const char *token);
+
+/*
+ * rewrite_compile - Turn a list of rules into a rewriter.
+ */
+rewriter_t *rewrite_compile(const rewrite_rule_t *rules, int nrules)
+{
+    rewriter_t *rw = Calloc(1, sizeof(rewriter_t));
+    int len;
+    int i, j;
+
+    for (i = 0; i < nrules; i++) {
+        len = strlen(rules[i].text);
+        switch (rules[i].kind) {
+        case RW_VERSION:
+            if (len == 0  ||  len >= RW_MAX_NAME)
+                app_error("rewrite_compile: bad version");
+            strcpy(rw->version, rules[i].text);
+            rw->version_len = len;
+            break;
+        case RW_STRIP:
+            if (len == 0  ||  len >= RW_MAX_NAME  ||  rw->nstrip == RW_MAX_STRIP)
+                app_error("rewrite_compile: too many or too long header names");
+            for (j = 0; j < len; j++)
+                rw->strip[rw->nstrip].name[j] = tolower((unsigned char)rules[i].text[j]);
+            rw->strip[rw->nstrip].len = len;
+            rw->first[(unsigned char)rw->strip[rw->nstrip].name[0]] = 1;
+            rw->first[toupper((unsigned char)rw->strip[rw->nstrip].name[0])] = 1;
+            rw->nstrip++;
+            break;
+        case RW_ADD:
+            if (rw->add_len + len + 2 > RW_MAX_ADD)
+                app_error("rewrite_compile: too many added headers");
+            memcpy(rw->add + rw->add_len, rules[i].text, len);
+            memcpy(rw->add + rw->add_len + len, "\r\n", 2);
+            rw->add_len += len + 2;
+            break;
+        }
+    }
+    return rw;
+}
+
+/*
+ * rewrite_bound - Upper bound on the size of a rewritten request.
+ */
+int rewrite_bound(const rewriter_t *rw, int len)
+{
+    return len + rw->version_len + rw->add_len;
+}
+
+/*
+ * rewrite_request - Apply a rewriter's rules to one request header.
+ */
+int rewrite_request(const rewriter_t *rw, const char *in, int in_len,
+  char *out, int out_size, int *flags)
+{
+    const char *end = in + in_len;
+    const char *line;
+    const char *eol;
+    const char *sp;
+    const char *ver;
+    char *o = out;
+    char *oend = out + out_size;
+    int skipping = 0;
+    int connection = 0;
+    int len;
+
+#define EMIT(p, n) do {                         \
+        if (oend - o < (n))                     \
+            return -1;                          \
+        memcpy(o, (p), (n));                    \
+        o += (n);                               \
+    } while (0)
+
+    *flags = 0;
+    for (line = in; line < end; line = eol) {
+        eol = memchr(line, '\n', end - line);
+        eol = eol != NULL ? eol + 1 : end;
+        len = eol - line;
+
+        if (line == in) {
+            /* The request line: "method target version" */
+            ver = line + len;
+            while (ver > line  &&  (ver[-1] == '\n'  ||  ver[-1] == '\r'))
+                ver--;
+            sp = memrchr(line, ' ', ver - line);
+            if (rw->version_len > 0  &&  sp != NULL
+              &&  ver - sp > 5  &&  strncmp(sp + 1, "HTTP/", 5) == 0) {
+                EMIT(line, sp + 1 - line);
+                EMIT(rw->version, rw->version_len);
+                EMIT(ver, eol - ver);
+                continue;
+            }
+        } else if (line[0] == '\n'  ||  (line[0] == '\r'  &&  len == 2)) {
+            /* The blank line; new headers go just before it */
+            EMIT(rw->add, rw->add_len);
+            EMIT(line, end - line);
+            break;
+        } else if (line[0] == ' '  ||  line[0] == '\t') {
+            /* Continuation of the previous header */
+            if (skipping) {
+                if (connection  &&  has_token(line, len, "close"))
+                    *flags |= RW_CLOSE;
+                continue;
+            }
+        } else if ((skipping = stripped(rw, line, len, &connection))) {
+            if (connection  &&  has_token(line, len, "close"))
+                *flags |= RW_CLOSE;
+            continue;
+        }
+        EMIT(line, len);
+    }
+    return o - out;
+
+#undef EMIT
+}
+
+/*
+ * stripped - Decide whether a header line is to be dropped, and set
+ * *connection if it is a Connection or Proxy-Connection header.
+ */
+static int stripped(const rewriter_t *rw, const char *line, int len,
+  int *connection)
+{
+    const char *colon;
+    int n, i, j;
+
+    *connection = 0;
+    if (!rw->first[(unsigned char)line[0]])
+        return 0;
+    if ((colon = memchr(line, ':', len)) == NULL)
+        return 0;
+    n = colon - line;
+    for (i = 0; i < rw->nstrip; i++) {
+        if (rw->strip[i].len != n)
+            continue;
+        for (j = 0; j < n; j++) {
+            if (tolower((unsigned char)line[j]) != rw->strip[i].name[j])
+                break;
+        }
+        if (j < n)
+            continue;
+        *connection = (n == 10  &&  strncasecmp(line, "Connection", 10) == 0)
+          ||  (n == 16  &&  strncasecmp(line, "Proxy-Connection", 16) == 0);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * has_token - Does the value on a header line, or on a continuation
+ * of one, list "token"?  The "len" bytes at "line" include its line
+ * end.
+ */
+static int has_token(const char *line, int len, const char *token)
+{
+    const char *colon;
+    http_span_t value;
+
+    value.off = 0;
+    if (line[0] != ' '  &&  line[0] != '\t'
+      &&  (colon = memchr(line, ':', len)) != NULL)
+        value.off = colon + 1 - line;
+    while (len > value.off  &&  isspace((unsigned char)line[len - 1]))
+        len--;
+    value.len = len - value.off;
+    return http_list_find(line, value, token) >= 0;
+}
@@ -0,0 +1,51 @@
+#ifndef _REWRITE_H
+#define _REWRITE_H
+
+/*
+ * Rewriting of request headers before they are forwarded.
+ *
+ * A rewriter is compiled once, at startup, from a list of rules, and
+ * is never modified afterwards, so any number of threads can use it
+ * at the same time without locking.  rewrite_request applies every
+ * rule in a single pass over the request line and headers, writing
+ * the result into a buffer supplied by the caller; it allocates no
+ * memory itself.  A rewriter without RW_VERSION leaves the first line
+ * alone, so it can rewrite a response header just as well.
+ */
+
+typedef enum {
+    RW_VERSION,   /* Set the request line's protocol version to "text" */
+    RW_STRIP,     /* Drop every header named "text", in any case */
+    RW_ADD        /* Add the header line "text" (without line ending) */
+} rewrite_kind_t;
+
+typedef struct {
+    rewrite_kind_t kind;
+    const char *text;
+} rewrite_rule_t;
+
+/* Flags reported by rewrite_request */
+#define RW_CLOSE 1   /* A stripped Connection or Proxy-Connection said "close" */
+
+typedef struct rewriter rewriter_t;
+
+/*
+ * Compile "nrules" rules into a rewriter.  Added headers appear in the
+ * order given, just before the blank line ending the headers.  Bad
+ * rules are reported and terminate the program.
+ */
+extern rewriter_t *rewrite_compile(const rewrite_rule_t *rules, int nrules);
+
+/* The most bytes rewriting a request of "len" bytes can produce */
+extern int rewrite_bound(const rewriter_t *rw, int len);
+
+/*
+ * Rewrite the request in "in" (of length "in_len", up to and including
+ * the blank line that ends its headers) into "out", which must not
+ * overlap it.  Stores RW_ flags in *flags.  Returns the length of the
+ * rewritten request, or -1 if it doesn't fit in "out_size" bytes.
+ */
+extern int rewrite_request(const rewriter_t *rw, const char *in, int in_len,
+  char *out, int out_size, int *flags);
+
+#endif /* _REWRITE_H */
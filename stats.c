@@ -0,0 +1,251 @@
+/*
+ * stats.c - Per-thread counters and latency histograms
+ *
+ * See stats.h for the interface.  A thread's block is allocated and
+ * linked onto a global list the first time the thread counts
+ * something, and is found again through a thread-local pointer.  The
+ * threads that count are long-lived (pool workers, acceptors, event
+ * workers, resolver threads), so blocks are never unlinked.
+ *
+ * Counters are only ever written by their own thread, with relaxed
+ * atomic stores, and read by stats_format with relaxed atomic loads;
+ * a total may be a moment out of date, but is never torn.
+ *
+ * Histogram buckets: values below 2 * STATS_SUB_BUCKETS each have a
+ * bucket of their own.  Above that, a value whose highest set bit is
+ * bit "msb" is shifted right by msb - log2(STATS_SUB_BUCKETS), leaving
+ * STATS_SUB_BUCKETS possible tops, one bucket each.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "pool.h"
+#include "arena.h"
+
+#define SUB_BITS  4     /* log2(STATS_SUB_BUCKETS) */
+#define NBUCKETS  (2 * STATS_SUB_BUCKETS \
+                   + (STATS_MAX_BITS - SUB_BITS - 1) * STATS_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[NBUCKETS];
+} hist_t;
+
+typedef struct block {
+    unsigned long counters[STAT_NCOUNTERS];
+    hist_t hists[STAT_NHISTS];
+    struct block *next;
+} __attribute__((aligned(64))) block_t;
+
+static block_t *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread block_t *mine;
+static long started;
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+    "connections", "active", "requests", "bytes_in", "bytes_out",
+    "cache_hits", "disk_hits", "compressed", "revalidated", "cache_rejects",
+    "upstream_connects", "upstream_reused", "dns_lookups", "dns_queries",
+    "errors"
+};
+static const char *hist_names[STAT_NHISTS] = {
+    "total", "connect", "ttfb"
+};
+
+static block_t *my_block(void);
+static int bucket_of(unsigned long v);
+static unsigned long bucket_top(int b);
+static int format_hist(char *buf, int size, const char *name, hist_t *h,
+                       int last);
+
+/* Relaxed read and write of a counter only its own thread changes */
+#define BUMP(p, n) __atomic_store_n((p), *(p) + (n), __ATOMIC_RELAXED)
+#define READ(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/*
+ * stats_init - Note when the proxy started.
+ */
+void stats_init(void)
+{
+    started = stats_now();
+}
+
+/*
+ * stats_add - Add to one of this thread's counters.
+ */
+void stats_add(stat_counter_t counter, long n)
+{
+    block_t *b = mine != NULL ? mine : my_block();
+
+    BUMP(&b->counters[counter], (unsigned long)n);
+}
+
+/*
+ * stats_record - Add one latency to one of this thread's histograms.
+ */
+void stats_record(stat_hist_t hist, long usec)
+{
+    block_t *b = mine != NULL ? mine : my_block();
+    hist_t *h = &b->hists[hist];
+    unsigned long v = usec > 0 ? usec : 0;
+
+    BUMP(&h->buckets[bucket_of(v)], 1);
+    BUMP(&h->count, 1);
+    BUMP(&h->sum, v);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_now - Read the monotonic clock in microseconds.
+ */
+long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * stats_format - Add up every thread's block, and write the totals,
+ * the worker pool's queue and the arenas' counts as JSON.
+ */
+int stats_format(char *buf, int size)
+{
+    unsigned long counters[STAT_NCOUNTERS];
+    static hist_t hists[STAT_NHISTS];   /* Too large for a stack */
+    static pthread_mutex_t hists_lock = PTHREAD_MUTEX_INITIALIZER;
+    pool_stats_t pool;
+    arena_stats_t arena;
+    block_t *b;
+    int len, n, i, j;
+
+    memset(counters, 0, sizeof(counters));
+    pthread_mutex_lock(&hists_lock);
+    memset(hists, 0, sizeof(hists));
+    pthread_mutex_lock(&blocks_lock);
+    for (b = blocks; b != NULL; b = b->next) {
+        for (i = 0; i < STAT_NCOUNTERS; i++)
+            counters[i] += READ(&b->counters[i]);
+        for (i = 0; i < STAT_NHISTS; i++) {
+            hists[i].count += READ(&b->hists[i].count);
+            hists[i].sum += READ(&b->hists[i].sum);
+            if (READ(&b->hists[i].max) > hists[i].max)
+                hists[i].max = READ(&b->hists[i].max);
+            for (j = 0; j < NBUCKETS; j++)
+                hists[i].buckets[j] += READ(&b->hists[i].buckets[j]);
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+    pool_stats(&pool);
+    arena_stats(&arena);
+
+    len = snprintf(buf, size, "{\n  \"uptime_s\": %ld,\n",
+      (stats_now() - started) / 1000000);
+    for (i = 0; i < STAT_NCOUNTERS && len < size; i++)
+        len += snprintf(buf + len, size - len, "  \"%s\": %ld,\n",
+          counter_names[i], (long)counters[i]);
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+          "  \"queue\": {\"depth\": %ld, \"submitted\": %lu, \"rejected\": %lu},\n"
+          "  \"arena\": {\"requests\": %lu, \"allocs\": %lu, \"heap_calls\": %lu},\n"
+          "  \"latency_us\": {\n",
+          pool.depth, pool.submitted, pool.rejected,
+          arena.requests, arena.allocs, arena.heap_calls);
+    for (i = 0; i < STAT_NHISTS && len < size; i++) {
+        if ((n = format_hist(buf + len, size - len, hist_names[i], &hists[i],
+          i == STAT_NHISTS - 1)) < 0)
+            len = size;
+        else
+            len += n;
+    }
+    pthread_mutex_unlock(&hists_lock);
+    if (len < size)
+        len += snprintf(buf + len, size - len, "  }\n}\n");
+    return len < size ? len : -1;
+}
+
+/*
+ * my_block - Allocate this thread's block and add it to the list.
+ */
+static block_t *my_block(void)
+{
+    block_t *b = NULL;
+
+    if (posix_memalign((void **)&b, 64, sizeof(block_t)) != 0)
+        unix_error("my_block: posix_memalign error");
+    memset(b, 0, sizeof(block_t));
+    pthread_mutex_lock(&blocks_lock);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&blocks_lock);
+    mine = b;
+    return b;
+}
+
+/*
+ * bucket_of - Find the bucket a value falls in.
+ */
+static int bucket_of(unsigned long v)
+{
+    int shift;
+
+    if (v < 2 * STATS_SUB_BUCKETS)
+        return v;
+    shift = 63 - __builtin_clzl(v) - SUB_BITS;
+    if (shift > STATS_MAX_BITS - SUB_BITS - 1)
+        return NBUCKETS - 1;
+    return 2 * STATS_SUB_BUCKETS + (shift - 1) * STATS_SUB_BUCKETS
+      + (int)(v >> shift) - STATS_SUB_BUCKETS;
+}
+
+/*
+ * bucket_top - Return the largest value that falls in a bucket.
+ */
+static unsigned long bucket_top(int b)
+{
+    int shift;
+    unsigned long top;
+
+    if (b < 2 * STATS_SUB_BUCKETS)
+        return b;
+    b -= 2 * STATS_SUB_BUCKETS;
+    shift = b / STATS_SUB_BUCKETS + 1;
+    top = b % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+/*
+ * format_hist - Write one histogram's count, mean, percentiles and
+ * maximum as a JSON member.  A percentile is reported as the top of
+ * the bucket it falls in, but never above the maximum.  Returns the
+ * length written, or -1 if it didn't fit.
+ */
+static int format_hist(char *buf, int size, const char *name, hist_t *h,
+                       int last)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *labels[] = { "p50", "p90", "p99", "p999" };
+    unsigned long seen = 0;
+    unsigned long rank;
+    unsigned long v;
+    int len, b, q;
+
+    len = snprintf(buf, size, "    \"%s\": {\"count\": %lu, \"mean\": %lu",
+      name, h->count, h->count > 0 ? h->sum / h->count : 0);
+    for (b = 0, q = 0; q < 4 && len < size; q++) {
+        rank = (unsigned long)(quantiles[q] * h->count + 0.999999);
+        while (b < NBUCKETS - 1 && seen + h->buckets[b] < rank)
+            seen += h->buckets[b++];
+        v = h->count > 0 ? bucket_top(b) : 0;
+        len += snprintf(buf + len, size - len, ", \"%s\": %lu",
+          labels[q], v < h->max ? v : h->max);
+    }
+    if (len < size)
+        len += snprintf(buf + len, size - len, ", \"max\": %lu}%s\n",
+          h->max, last ? "" : ",");
+    return len < size ? len : -1;
+}
@@ -0,0 +1,74 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Live counters and latency histograms.
+ *
+ * Every thread that counts something gets a block of counters of its
+ * own, on cache lines of its own, the first time it does so, and only
+ * ever writes to that block; nothing is shared between threads while
+ * requests are handled.  stats_format adds up all the threads' blocks
+ * when the statistics are read.
+ *
+ * Latencies, in microseconds, go into log-linear histograms in the
+ * style of HdrHistogram: values are bucketed by their highest set bit,
+ * and each power of two is split into STATS_SUB_BUCKETS equal parts,
+ * so every value is known to within 1 / STATS_SUB_BUCKETS of itself.
+ *
+ * The statistics are served as JSON to a request for STATS_PATH made
+ * to the proxy itself, e.g. "curl http://localhost:port/__proxy/stats".
+ */
+
+#define STATS_PATH "__proxy/stats"  /* Request path, less its leading '/' */
+#define STATS_MAX_JSON 8192          /* Room stats_format needs */
+
+#define STATS_SUB_BUCKETS 16         /* Buckets per power of two */
+#define STATS_MAX_BITS    40         /* Larger values share the last bucket */
+
+/* Counters */
+typedef enum {
+    STAT_CONNECTIONS,       /* Client connections accepted */
+    STAT_ACTIVE,            /* Client connections open now */
+    STAT_REQUESTS,          /* Requests received */
+    STAT_BYTES_IN,          /* Request header bytes received */
+    STAT_BYTES_OUT,         /* Response bytes sent */
+    STAT_CACHE_HITS,        /* Responses served from memory */
+    STAT_DISK_HITS,         /* Responses served from the disk tier */
+    STAT_COMPRESSED,        /* Responses compressed on their way out */
+    STAT_REVALIDATED,       /* Stale responses the origin said still hold */
+    STAT_CACHE_REJECTS,     /* Responses the admission filter kept out */
+    STAT_UPSTREAM_CONNECTS, /* New connections to origins */
+    STAT_UPSTREAM_REUSED,   /* Pooled origin connections reused */
+    STAT_DNS_LOOKUPS,       /* Host names looked up */
+    STAT_DNS_QUERIES,       /* Lookups the resolver had to carry out */
+    STAT_ERRORS,            /* Requests that got no response */
+    STAT_NCOUNTERS
+} stat_counter_t;
+
+/* Latency histograms */
+typedef enum {
+    STAT_TOTAL,             /* Request header received to response sent */
+    STAT_CONNECT,           /* TCP connect to an origin */
+    STAT_TTFB,              /* Request header received to first byte sent */
+    STAT_NHISTS
+} stat_hist_t;
+
+/* Start the clock the uptime is measured from */
+extern void stats_init(void);
+
+/* Add "n" (which may be negative) to one of this thread's counters */
+extern void stats_add(stat_counter_t counter, long n);
+
+/* Record one latency, in microseconds, in this thread's histogram */
+extern void stats_record(stat_hist_t hist, long usec);
+
+/* Monotonic clock, in microseconds, for timing what is recorded */
+extern long stats_now(void);
+
+/*
+ * Write the current totals, as JSON, into "buf" of "size" bytes.
+ * Returns the length written, or -1 if "buf" is too small.
+ */
+extern int stats_format(char *buf, int size);
+
+#endif /* _STATS_H */
@@ -0,0 +1,193 @@
+/*
+ * stuborigin.c - Stand-in origin server for benchmarking the proxy
+ *
+ * Answers every request with a body of filler bytes, so the proxy can
+ * be measured on one machine without a real web server or the network
+ * getting in the way.  How big the response is and how long to wait
+ * before sending it are set on the command line, and can be overridden
+ * for each request in its query string:
+ *
+ *     GET /any/path?size=4096&delay=20 HTTP/1.1
+ *
+ * Connections to HTTP/1.1 clients stay open for further requests
+ * unless the client sends "Connection: close", the query string
+ * contains "close", or the server was started with -c.  Each
+ * connection is served by a thread of its own.
+ *
+ * usage: stuborigin [-s bytes] [-d delay ms] [-c] <port number>
+ */
+
+#define _GNU_SOURCE
+#include <netinet/tcp.h>
+#include "csapp.h"
+
+#define STUB_SIZE   1024        /* Default body size */
+#define STUB_FILL   65536       /* Bytes of filler written at a time */
+
+static long default_size = STUB_SIZE;
+static long default_delay;
+static int always_close;
+static char filler[STUB_FILL];
+
+static void *serve(void *vargp);
+static int serve_request(int connfd, rio_t *rio);
+static int query_param(const char *query, const char *name, long *value);
+
+/*
+ * main - Parse the options and accept connections forever.
+ */
+int main(int argc, char **argv)
+{
+    int listenfd, *connfdp;
+    pthread_t tid;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:d:c")) != -1) {
+        switch (opt) {
+        case 's':
+            default_size = atol(optarg);
+            break;
+        case 'd':
+            default_delay = atol(optarg);
+            break;
+        case 'c':
+            always_close = 1;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-s bytes] [-d delay ms] [-c] <port number>\n",
+          argv[0]);
+        exit(1);
+    }
+
+    memset(filler, 'x', sizeof(filler));
+    Signal(SIGPIPE, SIG_IGN);
+    listenfd = Open_listenfd(atoi(argv[optind]));
+    while (1) {
+        connfdp = Malloc(sizeof(int));
+        *connfdp = Accept(listenfd, NULL, NULL);
+        Pthread_create(&tid, NULL, serve, connfdp);
+    }
+}
+
+/*
+ * serve - Thread routine: answer requests on one connection until
+ * either side closes it.
+ */
+static void *serve(void *vargp)
+{
+    int connfd = *(int *)vargp;
+    int one = 1;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    /* The header and body go out in separate writes; don't let Nagle
+       hold the body back waiting for the header to be acknowledged */
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_readinitb(&rio, connfd);
+    while (serve_request(connfd, &rio))
+        ;
+    Close(connfd);
+    return NULL;
+}
+
+/*
+ * serve_request - Read one request and send its response.  Returns
+ * nonzero if the connection can be used for another request.
+ */
+static int serve_request(int connfd, rio_t *rio)
+{
+    char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char header[MAXLINE];
+    char *query;
+    long size = default_size;
+    long delay = default_delay;
+    long body_len = 0;
+    long n;
+    int keepalive;
+    int len;
+
+    if (rio_readlineb(rio, line, MAXLINE) <= 0)
+        return 0;
+    if (sscanf(line, "%s %s %s", method, uri, version) != 3)
+        return 0;
+    keepalive = !always_close  &&  strcmp(version, "HTTP/1.1") == 0;
+
+    /* Headers: only the body length and "Connection: close" matter */
+    while (1) {
+        if (rio_readlineb(rio, line, MAXLINE) <= 0)
+            return 0;
+        if (strcmp(line, "\r\n") == 0  ||  strcmp(line, "\n") == 0)
+            break;
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            body_len = atol(line + 15);
+        else if (strncasecmp(line, "Connection:", 11) == 0
+          &&  strcasestr(line + 11, "close") != NULL)
+            keepalive = 0;
+    }
+
+    /* Throw away a request body, if there is one */
+    while (body_len > 0) {
+        n = body_len < MAXLINE ? body_len : MAXLINE;
+        if ((n = rio_readnb(rio, line, n)) <= 0)
+            return 0;
+        body_len -= n;
+    }
+
+    if ((query = strchr(uri, '?')) != NULL) {
+        query++;
+        query_param(query, "size", &size);
+        query_param(query, "delay", &delay);
+        if (query_param(query, "close", NULL))
+            keepalive = 0;
+    }
+    if (delay > 0)
+        usleep(delay * 1000);
+
+    len = snprintf(header, sizeof(header),
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "Content-Length: %ld\r\n"
+      "%s"
+      "\r\n", size, keepalive ? "" : "Connection: close\r\n");
+    if (rio_writen(connfd, header, len) < 0)
+        return 0;
+    if (strcmp(method, "HEAD") == 0)
+        return keepalive;
+    while (size > 0) {
+        n = size < STUB_FILL ? size : STUB_FILL;
+        if (rio_writen(connfd, filler, n) < 0)
+            return 0;
+        size -= n;
+    }
+    return keepalive;
+}
+
+/*
+ * query_param - Look for "name" or "name=value" among the '&'-separated
+ * parameters of a query string.  Stores the value, if there is one and
+ * "value" isn't NULL, and returns nonzero if the parameter was found.
+ */
+static int query_param(const char *query, const char *name, long *value)
+{
+    int n = strlen(name);
+    const char *p = query;
+
+    while (*p != '\0') {
+        if (strncmp(p, name, n) == 0  &&  (p[n] == '\0'  ||  p[n] == '&'
+          ||  p[n] == '=')) {
+            if (p[n] == '='  &&  value != NULL)
+                *value = atol(p + n + 1);
+            return 1;
+        }
+        if ((p = strchr(p, '&')) == NULL)
+            break;
+        p++;
+    }
+    return 0;
+}
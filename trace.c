@@ -0,0 +1,158 @@
+/*
+ * trace.c - Per-request phase timestamps, with slow requests written
+ * out as Chrome trace events
+ *
+ * See trace.h for the interface.  Timestamps come from the monotonic
+ * clock, which is read through the vDSO without entering the kernel.
+ * The trace file is a JSON array that is never closed, which the
+ * trace viewers accept, so events can simply be appended to it as
+ * slow requests finish.  Only those writes take a lock.
+ */
+
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "trace.h"
+
+typedef struct {
+    trace_phase_t phase;
+    long ns;                    /* When the phase ended */
+} trace_mark_t;
+
+typedef struct {
+    long start;                 /* When the request began, in ns */
+    int nmarks;
+    int active;                 /* Begun and not yet ended? */
+    trace_mark_t marks[TRACE_MARKS];
+    char url[TRACE_URL];
+} trace_rec_t;
+
+static int enabled;
+static long slow_ns;
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread trace_rec_t *ring;      /* This thread's records */
+static __thread int ring_next;          /* Record of the current request */
+static __thread int thread_id;          /* Kernel thread id, for the viewer */
+
+static const char *phase_names[TRACE_NPHASES] = {
+    "read", "dns", "connect", "send", "wait", "relay"
+};
+
+static long now_ns(void);
+static void write_record(trace_rec_t *rec);
+
+/*
+ * trace_init - Open the trace file and turn tracing on.
+ */
+void trace_init(const char *filename, int slow_ms)
+{
+    if ((trace_file = fopen(filename, "w")) == NULL)
+        unix_error("trace_init: fopen error");
+    fputs("[\n", trace_file);
+    fflush(trace_file);
+    slow_ns = slow_ms * 1000000L;
+    enabled = 1;
+}
+
+/*
+ * trace_begin - Take the next record from this thread's ring.
+ */
+void trace_begin(void)
+{
+    trace_rec_t *rec;
+
+    if (!enabled)
+        return;
+    if (ring == NULL) {
+        ring = Calloc(TRACE_RING, sizeof(trace_rec_t));
+        thread_id = syscall(SYS_gettid);
+    }
+    ring_next = (ring_next + 1) % TRACE_RING;
+    rec = &ring[ring_next];
+    rec->start = now_ns();
+    rec->nmarks = 0;
+    rec->active = 1;
+}
+
+/*
+ * trace_mark - Note the end of a phase.  Phases past TRACE_MARKS (a
+ * request retried over and over) are folded into the last one.
+ */
+void trace_mark(trace_phase_t phase)
+{
+    trace_rec_t *rec;
+
+    if (!enabled  ||  ring == NULL  ||  !(rec = &ring[ring_next])->active)
+        return;
+    if (rec->nmarks == TRACE_MARKS)
+        rec->nmarks--;
+    rec->marks[rec->nmarks].phase = phase;
+    rec->marks[rec->nmarks++].ns = now_ns();
+}
+
+/*
+ * trace_end - End the request's relay phase, and write the request out
+ * if it took too long.
+ */
+void trace_end(const char *url)
+{
+    trace_rec_t *rec;
+
+    if (!enabled  ||  ring == NULL  ||  !(rec = &ring[ring_next])->active)
+        return;
+    trace_mark(TRACE_RELAY);
+    rec->active = 0;
+    if (rec->marks[rec->nmarks - 1].ns - rec->start < slow_ns)
+        return;
+    strncpy(rec->url, url, TRACE_URL - 1);
+    rec->url[TRACE_URL - 1] = '\0';
+    write_record(rec);
+}
+
+/*
+ * now_ns - Read the monotonic clock in nanoseconds.
+ */
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * write_record - Append a request's events to the trace file: one
+ * spanning the whole request, with its URL, and one for each phase,
+ * which the viewer nests under it.  Times are in microseconds.
+ */
+static void write_record(trace_rec_t *rec)
+{
+    char url[2 * TRACE_URL];
+    long from = rec->start;
+    long end = rec->marks[rec->nmarks - 1].ns;
+    int i, j;
+
+    /* Escape the URL for a JSON string */
+    for (i = j = 0; rec->url[i] != '\0'  &&  j < sizeof(url) - 2; i++) {
+        if (rec->url[i] == '"'  ||  rec->url[i] == '\\')
+            url[j++] = '\\';
+        if ((unsigned char)rec->url[i] >= ' ')
+            url[j++] = rec->url[i];
+    }
+    url[j] = '\0';
+
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_file, "{\"name\": \"request\", \"ph\": \"X\", \"pid\": %d, "
+      "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"url\": \"%s\"}},\n",
+      (int)getpid(), thread_id, from / 1000.0, (end - from) / 1000.0, url);
+    for (i = 0; i < rec->nmarks; i++) {
+        fprintf(trace_file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, "
+          "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+          phase_names[rec->marks[i].phase], (int)getpid(), thread_id,
+          from / 1000.0, (rec->marks[i].ns - from) / 1000.0);
+        from = rec->marks[i].ns;
+    }
+    fflush(trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,51 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Per-request phase tracing.
+ *
+ * While a request is handled, the time at which each phase of it ends
+ * is noted in a record taken from a ring kept by the handling thread,
+ * so tracing allocates nothing and takes no locks.  When the request is
+ * done, a record whose total time is above the slow threshold is
+ * written to the trace file in Chrome's trace-event format (a JSON
+ * array of complete events, one for the request and one per phase,
+ * loadable in chrome://tracing or Perfetto); all others are simply
+ * overwritten later.
+ *
+ * Tracing is off until trace_init is called; until then every call
+ * below returns at once.
+ */
+
+#define TRACE_SLOW_MS  100   /* Default slow threshold */
+#define TRACE_RING     64    /* Records kept per thread */
+#define TRACE_MARKS    16    /* Phases noted per request */
+#define TRACE_URL      256   /* Bytes of URL kept per request */
+
+/* Phases, named by what the proxy was doing until they ended */
+typedef enum {
+    TRACE_READ,         /* Receiving the request header */
+    TRACE_DNS,          /* Looking up the origin's name */
+    TRACE_CONNECT,      /* Connecting to the origin */
+    TRACE_SEND,         /* Sending the request to the origin */
+    TRACE_WAIT,         /* Waiting for the first byte of the response */
+    TRACE_RELAY,        /* Sending the response on to the client */
+    TRACE_NPHASES
+} trace_phase_t;
+
+/* Open "filename" for slow requests taking over "slow_ms" milliseconds */
+extern void trace_init(const char *filename, int slow_ms);
+
+/* Start timing a new request on this thread */
+extern void trace_begin(void);
+
+/* Note that this thread's request has finished a phase */
+extern void trace_mark(trace_phase_t phase);
+
+/*
+ * Finish this thread's request, whose URL was "url", ending its last
+ * phase; write it out if it was slow.
+ */
+extern void trace_end(const char *url);
+
+#endif /* _TRACE_H */
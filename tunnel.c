@@ -0,0 +1,180 @@
+/*
+ * tunnel.c - Zero-copy, non-blocking relay for CONNECT tunnels
+ *
+ * See tunnel.h for the interface.  A direction alternates between
+ * filling its pipe from "from" and draining it to "to"; it only reads
+ * more once the pipe is empty, so a slow receiver holds back its
+ * sender instead of making us buffer.  A pump moves at most
+ * TUNNEL_BUDGET bytes before returning, so that one busy direction
+ * can't starve the other, or the other connections of an event
+ * worker; the loops driving it are level-triggered, so it is called
+ * again straight away.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include "csapp.h"
+#include "tunnel.h"
+
+#define TUNNEL_CHUNK   65536        /* Most bytes asked of one splice */
+#define TUNNEL_BUDGET  (1 << 20)    /* Most bytes moved by one pump */
+
+static int dir_open(tunnel_dir_t *d, int from, int to, const char *buf,
+                    int len);
+static int set_nonblocking(int fd);
+
+/*
+ * tunnel_open - Make the pipes, preload them, and make the sockets
+ * non-blocking.
+ */
+int tunnel_open(tunnel_t *t, int client_fd, int origin_fd,
+  const char *up, int up_len, const char *down, int down_len)
+{
+    t->down.pipe[0] = t->down.pipe[1] = -1;
+    if (dir_open(&t->up, client_fd, origin_fd, up, up_len) < 0
+      ||  dir_open(&t->down, origin_fd, client_fd, down, down_len) < 0
+      ||  set_nonblocking(client_fd) < 0  ||  set_nonblocking(origin_fd) < 0) {
+        tunnel_close(t);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * tunnel_pump - Drain the pipe to "to", then refill it from "from",
+ * until one of them would block, "from" has finished and the pipe is
+ * empty, or the budget is used up.
+ */
+int tunnel_pump(tunnel_dir_t *d)
+{
+    long moved = 0;
+    ssize_t n;
+
+    if (d->state == TUNNEL_DONE  ||  d->state == TUNNEL_ERROR)
+        return d->state;
+    while (moved < TUNNEL_BUDGET) {
+        if (d->queued > 0) {
+            n = splice(d->pipe[0], NULL, d->to, NULL, d->queued,
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0  &&  errno == EINTR)
+                continue;
+            if (n < 0)
+                return d->state = (errno == EAGAIN ? TUNNEL_WRITE : TUNNEL_ERROR);
+            d->queued -= n;
+            d->bytes += n;
+            moved += n;
+            continue;
+        }
+        if (d->eof) {
+            /* Pass the end of the stream on */
+            shutdown(d->to, SHUT_WR);
+            return d->state = TUNNEL_DONE;
+        }
+        n = splice(d->from, NULL, d->pipe[1], NULL, TUNNEL_CHUNK,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0  &&  errno == EINTR)
+            continue;
+        if (n < 0)
+            return d->state = (errno == EAGAIN ? TUNNEL_READ : TUNNEL_ERROR);
+        if (n == 0)
+            d->eof = 1;
+        d->queued += n;
+    }
+    /* Out of budget; say what would have been next */
+    return d->state = d->queued > 0 ? TUNNEL_WRITE : TUNNEL_READ;
+}
+
+/*
+ * tunnel_run - Pump both directions, polling the sockets for whatever
+ * the directions are waiting for, until both are done.
+ */
+int tunnel_run(tunnel_t *t, int idle_timeout)
+{
+    tunnel_dir_t *dirs[2] = { &t->up, &t->down };
+    struct pollfd pfds[2];
+    int i, rc;
+
+    pfds[0].fd = t->up.from;
+    pfds[1].fd = t->down.from;
+    while (1) {
+        pfds[0].events = pfds[1].events = 0;
+        for (i = 0; i < 2; i++) {
+            switch (tunnel_pump(dirs[i])) {
+            case TUNNEL_ERROR:
+                return -1;
+            case TUNNEL_READ:
+                pfds[i].events |= POLLIN;       /* dirs[i]->from */
+                break;
+            case TUNNEL_WRITE:
+                pfds[1 - i].events |= POLLOUT;  /* dirs[i]->to */
+                break;
+            }
+        }
+        if (t->up.state == TUNNEL_DONE  &&  t->down.state == TUNNEL_DONE)
+            return 0;
+        while ((rc = poll(pfds, 2, idle_timeout * 1000)) < 0  &&  errno == EINTR)
+            ;
+        if (rc <= 0)
+            return -1;
+    }
+}
+
+/*
+ * tunnel_close - Close the pipes of both directions.
+ */
+void tunnel_close(tunnel_t *t)
+{
+    tunnel_dir_t *d;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        d = i == 0 ? &t->up : &t->down;
+        if (d->pipe[0] >= 0) {
+            close(d->pipe[0]);
+            close(d->pipe[1]);
+            d->pipe[0] = d->pipe[1] = -1;
+        }
+    }
+}
+
+/*
+ * dir_open - Set up one direction, with "len" bytes of "buf" already
+ * queued in its pipe.
+ */
+static int dir_open(tunnel_dir_t *d, int from, int to, const char *buf,
+                    int len)
+{
+    int n;
+
+    memset(d, 0, sizeof(tunnel_dir_t));
+    d->from = from;
+    d->to = to;
+    d->state = TUNNEL_READ;
+    if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        d->pipe[0] = d->pipe[1] = -1;
+        return -1;
+    }
+    while (len > 0) {
+        if ((n = write(d->pipe[1], buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        d->queued += n;
+    }
+    return 0;
+}
+
+/*
+ * set_nonblocking - Make a socket's reads and writes non-blocking.
+ */
+static int set_nonblocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
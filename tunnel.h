@@ -0,0 +1,64 @@
+#ifndef _TUNNEL_H
+#define _TUNNEL_H
+
+/*
+ * CONNECT tunnels: bytes relayed both ways between a client and an
+ * origin, unexamined, until both sides have finished.
+ *
+ * Each direction moves bytes from one socket to the other through a
+ * pipe of its own with splice(2), so they are never copied into user
+ * space.  tunnel_pump never blocks; it moves what it can and says what
+ * it is waiting for, so a tunnel can be driven by whatever loop owns
+ * the sockets: tunnel_run for a pool worker, which polls both sockets
+ * itself, or an event worker's epoll loop.  When one side finishes
+ * sending, the other side's sending half is shut down, and the tunnel
+ * carries on in the other direction until it finishes too.
+ */
+
+#define TUNNEL_IDLE_TIMEOUT 300     /* Seconds a tunnel may sit idle */
+
+/* What tunnel_pump is waiting for */
+#define TUNNEL_READ   0     /* "from" to become readable */
+#define TUNNEL_WRITE  1     /* "to" to become writable */
+#define TUNNEL_DONE   2     /* Nothing; this direction has finished */
+#define TUNNEL_ERROR  3     /* Nothing; the tunnel has failed */
+
+/* One direction of a tunnel */
+typedef struct {
+    int from, to;           /* Sockets */
+    int pipe[2];
+    long queued;            /* Bytes in the pipe, not yet sent on */
+    long bytes;             /* Bytes relayed so far */
+    int eof;                /* Has "from" finished sending? */
+    int state;              /* What the last tunnel_pump returned */
+} tunnel_dir_t;
+
+typedef struct {
+    tunnel_dir_t up;        /* Client to origin */
+    tunnel_dir_t down;      /* Origin to client */
+} tunnel_t;
+
+/*
+ * Set up a tunnel between two sockets, making both non-blocking.  The
+ * "up_len" bytes at "up" are sent to the origin before anything the
+ * client sends from now on, and the "down_len" bytes at "down" to the
+ * client before anything from the origin.  Returns -1 if the pipes
+ * couldn't be made, or the bytes didn't fit in them.
+ */
+extern int tunnel_open(tunnel_t *t, int client_fd, int origin_fd,
+  const char *up, int up_len, const char *down, int down_len);
+
+/* Move what can be moved one way without blocking; returns a TUNNEL_ state */
+extern int tunnel_pump(tunnel_dir_t *d);
+
+/*
+ * Run a tunnel to the end from the calling thread, waiting in poll(2)
+ * for either socket.  Gives up after "idle_timeout" seconds without
+ * traffic.  Returns 0 if both directions finished, else -1.
+ */
+extern int tunnel_run(tunnel_t *t, int idle_timeout);
+
+/* Free a tunnel's pipes; the sockets are left to the caller */
+extern void tunnel_close(tunnel_t *t);
+
+#endif /* _TUNNEL_H */
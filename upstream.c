@@ -0,0 +1,630 @@
+/*
+ * upstream.c - Origin server connections and the keep-alive pool
+ *
+ * Idle connections live in a hash table keyed by "host:port".  The
+ * table's buckets are protected by a small set of striped mutexes, so
+ * requests to different hosts rarely contend, and every lock is held
+ * only long enough to push or pop a list entry.
+ *
+ * Body bytes are spliced through a pipe that each thread creates the
+ * first time it needs one and that is closed when the thread exits.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "proxy.h"
+#include "upstream.h"
+#include "httpparse.h"
+#include "rewrite.h"
+#include "stats.h"
+#include "trace.h"
+
+#define POOL_BUCKETS 256   /* Hash buckets for hosts */
+#define POOL_STRIPES 16    /* Mutexes guarding the buckets */
+#define SPLICE_PIPE_SIZE (1 << 20)  /* Pipe capacity to ask for */
+#define SPLICE_UNSUPPORTED (-2)     /* splice_body can't be used here */
+
+/* One connection to an origin server */
+typedef struct upstream {
+    struct upstream *next;  /* Next idle connection to the same host */
+    int fd;
+    int reused;             /* Nonzero if this came from the pool */
+    time_t idle_since;      /* When it was last returned to the pool */
+    rio_t rio;              /* Buffered reader for responses */
+} upstream_t;
+
+/* A thread's pipe for splicing */
+typedef struct {
+    int fds[2];             /* Read and write ends, or -1 */
+    int size;               /* Capacity of the pipe */
+} splice_pipe_t;
+
+/* The idle connections to one host and port */
+typedef struct host_pool {
+    struct host_pool *next; /* Next host in the same bucket */
+    char *key;              /* "host:port" */
+    upstream_t *idle;       /* Idle connections, most recent first */
+    int nidle;
+} host_pool_t;
+
+static host_pool_t *pool_buckets[POOL_BUCKETS];
+static pthread_mutex_t pool_locks[POOL_STRIPES];
+static int pool_max_idle;
+static int pool_idle_timeout;
+static pthread_key_t pipe_key;
+
+/* How response headers are rewritten for the client; see relay_framed */
+static const rewrite_rule_t response_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+};
+static const rewrite_rule_t response_close_rules[] = {
+    { RW_STRIP, "Connection" },
+    { RW_STRIP, "Proxy-Connection" },
+    { RW_STRIP, "Keep-Alive" },
+    { RW_ADD, "Connection: close" },
+};
+static rewriter_t *response_rewriter;
+static rewriter_t *response_close_rewriter;
+
+static upstream_t *upstream_open(char *hostname, int port);
+static void upstream_close(upstream_t *up);
+static upstream_t *pool_take(char *key);
+static void pool_give(char *key, upstream_t *up);
+static upstream_t *pool_expire(host_pool_t *hp, time_t now);
+static void *pool_reaper(void *vargp);
+static int alive(int fd);
+static int relay_framed(upstream_t *up, upstream_sink_t *sink, int head,
+  int *reusable, int *persist);
+static int send_request(upstream_t *up, char *request, int request_len,
+  upstream_body_t *body);
+static int read_header(upstream_t *up, char *buf, int size,
+  http_response_t *resp);
+static int relay_body(upstream_t *up, http_body_t *body, upstream_sink_t *sink);
+static ssize_t read_some(upstream_t *up, char *buf, size_t n);
+static int emit_lines(upstream_sink_t *sink, char *buf, int n);
+static int emit(upstream_sink_t *sink, char *buf, int n);
+static ssize_t splice_body(int from, int to, long length);
+static splice_pipe_t *splice_pipe(void);
+static void splice_pipe_free(void *vargp);
+static unsigned int hash_key(const char *key);
+
+/*
+ * upstream_init - Configure the pool and start the reaper thread.
+ */
+void upstream_init(int max_idle, int idle_timeout)
+{
+    pthread_t tid;
+    int i;
+
+    pool_max_idle = max_idle;
+    pool_idle_timeout = idle_timeout;
+    for (i = 0; i < POOL_STRIPES; i++)
+        pthread_mutex_init(&pool_locks[i], NULL);
+    if ((i = pthread_key_create(&pipe_key, splice_pipe_free)) != 0)
+        posix_error(i, "upstream_init: pthread_key_create error");
+    response_rewriter = rewrite_compile(response_rules,
+      sizeof(response_rules) / sizeof(response_rules[0]));
+    response_close_rewriter = rewrite_compile(response_close_rules,
+      sizeof(response_close_rules) / sizeof(response_close_rules[0]));
+    if (pool_max_idle > 0)
+        Pthread_create(&tid, NULL, pool_reaper, NULL);
+}
+
+/*
+ * upstream_fetch - Forward one request to an origin server and relay
+ * its response.
+ */
+int upstream_fetch(char *hostname, int port, char *request, int request_len,
+  upstream_body_t *body, int flags, int *persist, upstream_sink_t *sink)
+{
+    char key[MAXLINE];
+    int keepalive = (flags & UPSTREAM_KEEPALIVE)  &&  pool_max_idle > 0;
+    int head = flags & UPSTREAM_HEAD;
+    int retry = body == NULL  &&  !(flags & UPSTREAM_NORETRY);
+    upstream_t *up;
+    int reusable;
+    int rc;
+
+    if (snprintf(key, sizeof(key), "%s:%d", hostname, port) >= sizeof(key))
+        keepalive = 0;
+
+    if (!keepalive) {
+        if ((up = upstream_open(hostname, port)) == NULL)
+            return -1;
+        rc = -1;
+        if (send_request(up, request, request_len, body) == 0)
+            rc = relay_framed(up, sink, head, &reusable, persist);
+        upstream_close(up);
+        return rc;
+    }
+
+    while (1) {
+        if ((!retry  ||  (up = pool_take(key)) == NULL)
+          &&  (up = upstream_open(hostname, port)) == NULL)
+            return -1;
+
+        rc = -1;
+        if (send_request(up, request, request_len, body) == 0)
+            rc = relay_framed(up, sink, head, &reusable, persist);
+        if (rc == 0) {
+            if (reusable)
+                pool_give(key, up);
+            else
+                upstream_close(up);
+            return 0;
+        }
+
+        /*
+         * Nothing came back.  A pooled connection may simply have been
+         * closed by the origin while idle, so try again on a new one.
+         */
+        rc = up->reused;
+        upstream_close(up);
+        if (!rc)
+            return -1;
+    }
+}
+
+/*
+ * send_request - Send a request header and its body, if it has one.
+ * Returns -1 if either couldn't be sent.
+ */
+static int send_request(upstream_t *up, char *request, int request_len,
+  upstream_body_t *body)
+{
+    if (rio_writen(up->fd, request, request_len) != request_len)
+        return -1;
+    if (body != NULL  &&  body->send(body, up->fd) < 0)
+        return -1;
+    trace_mark(TRACE_SEND);
+    return 0;
+}
+
+/*
+ * upstream_open - Open a new connection to an origin server.
+ */
+static upstream_t *upstream_open(char *hostname, int port)
+{
+    upstream_t *up;
+    int fd;
+
+    if ((fd = open_clientfd_ts(hostname, port)) < 0)
+        return NULL;
+    up = Malloc(sizeof(upstream_t));
+    up->next = NULL;
+    up->fd = fd;
+    up->reused = 0;
+    Rio_readinitb(&up->rio, fd);
+    return up;
+}
+
+/*
+ * upstream_close - Close an origin connection for good.
+ */
+static void upstream_close(upstream_t *up)
+{
+    close(up->fd);
+    Free(up);
+}
+
+/*
+ * pool_take - Pop the most recently used live idle connection for a
+ * host, or return NULL if there is none.
+ */
+static upstream_t *pool_take(char *key)
+{
+    unsigned int b = hash_key(key) % POOL_BUCKETS;
+    pthread_mutex_t *lock = &pool_locks[b % POOL_STRIPES];
+    upstream_t *stale = NULL;
+    upstream_t *up = NULL;
+    upstream_t *next;
+    host_pool_t *hp;
+
+    pthread_mutex_lock(lock);
+    for (hp = pool_buckets[b]; hp != NULL; hp = hp->next) {
+        if (strcmp(hp->key, key) == 0)
+            break;
+    }
+    if (hp != NULL) {
+        stale = pool_expire(hp, time(NULL));
+        if ((up = hp->idle) != NULL) {
+            hp->idle = up->next;
+            hp->nidle--;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    for (; stale != NULL; stale = next) {
+        next = stale->next;
+        upstream_close(stale);
+    }
+    if (up != NULL  &&  !alive(up->fd)) {
+        upstream_close(up);
+        return NULL;
+    }
+    if (up != NULL) {
+        up->next = NULL;
+        up->reused = 1;
+        stats_add(STAT_UPSTREAM_REUSED, 1);
+    }
+    return up;
+}
+
+/*
+ * pool_give - Return a connection whose last response ended cleanly
+ * to its host's idle list, or close it if the list is full.
+ */
+static void pool_give(char *key, upstream_t *up)
+{
+    unsigned int b = hash_key(key) % POOL_BUCKETS;
+    pthread_mutex_t *lock = &pool_locks[b % POOL_STRIPES];
+    host_pool_t *hp;
+
+    pthread_mutex_lock(lock);
+    for (hp = pool_buckets[b]; hp != NULL; hp = hp->next) {
+        if (strcmp(hp->key, key) == 0)
+            break;
+    }
+    if (hp == NULL) {
+        hp = Calloc(1, sizeof(host_pool_t));
+        hp->key = Malloc(strlen(key) + 1);
+        strcpy(hp->key, key);
+        hp->next = pool_buckets[b];
+        pool_buckets[b] = hp;
+    }
+    if (hp->nidle < pool_max_idle) {
+        up->idle_since = time(NULL);
+        up->next = hp->idle;
+        hp->idle = up;
+        hp->nidle++;
+        up = NULL;
+    }
+    pthread_mutex_unlock(lock);
+
+    if (up != NULL)
+        upstream_close(up);
+}
+
+/*
+ * pool_expire - Unlink a host's connections that have been idle too
+ * long and return them as a list for the caller to close once it has
+ * dropped the lock.  Since the list is ordered most recent first, the
+ * expired connections are all at its tail.
+ */
+static upstream_t *pool_expire(host_pool_t *hp, time_t now)
+{
+    upstream_t **link;
+    upstream_t *up;
+    upstream_t *expired;
+
+    for (link = &hp->idle; *link != NULL; link = &(*link)->next) {
+        if (now - (*link)->idle_since >= pool_idle_timeout)
+            break;
+    }
+    expired = *link;
+    *link = NULL;
+    for (up = expired; up != NULL; up = up->next)
+        hp->nidle--;
+    return expired;
+}
+
+/*
+ * pool_reaper - Thread routine that periodically closes idle
+ * connections to hosts nobody has asked for in a while.
+ */
+static void *pool_reaper(void *vargp)
+{
+    upstream_t *stale;
+    upstream_t *next;
+    host_pool_t *hp;
+    int b;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        sleep(pool_idle_timeout > 1 ? pool_idle_timeout / 2 : 1);
+        for (b = 0; b < POOL_BUCKETS; b++) {
+            pthread_mutex_lock(&pool_locks[b % POOL_STRIPES]);
+            stale = NULL;
+            for (hp = pool_buckets[b]; hp != NULL; hp = hp->next) {
+                upstream_t *tail = pool_expire(hp, time(NULL));
+                while (tail != NULL) {
+                    next = tail->next;
+                    tail->next = stale;
+                    stale = tail;
+                    tail = next;
+                }
+            }
+            pthread_mutex_unlock(&pool_locks[b % POOL_STRIPES]);
+
+            for (; stale != NULL; stale = next) {
+                next = stale->next;
+                upstream_close(stale);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * alive - Check, without blocking, that an idle connection has
+ * neither been closed by the origin nor received unexpected data.
+ */
+static int alive(int fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+      &&  (errno == EAGAIN  ||  errno == EWOULDBLOCK);
+}
+
+/*
+ * relay_framed - Relay one response, framed as the parser in
+ * httpparse.c frames it, the same as in event mode.
+ *
+ * Hop-by-hop headers are dropped.  A body that runs until the origin
+ * closes the connection (which includes whatever follows a 101) clears
+ * *persist, because the client must see a close too.  If *persist ends
+ * up clear, "Connection: close" is added for the client.  Interim 1xx
+ * responses are relayed and followed by the final one.  *reusable is
+ * set if the connection can carry another request.  If the sink gives
+ * up, the response is cut short like a truncated one.  Returns -1 if
+ * no usable response header was received, else 0.
+ */
+static int relay_framed(upstream_t *up, upstream_sink_t *sink, int head,
+  int *reusable, int *persist)
+{
+    http_response_t resp;
+    http_body_t body;
+    rewriter_t *rw;
+    char buf[MAXBUF];
+    char out[MAXBUF + MAXLINE];
+    int hlen, n, flags;
+    int interim, closing;
+    int rc;
+
+    *reusable = 0;
+    do {
+        if ((hlen = read_header(up, buf, sizeof(buf), &resp)) <= 0
+          ||  http_response_body_init(&body, buf, &resp, head) < 0) {
+            /* Nothing we can frame; an interim response already went */
+            if (sink->len == 0)
+                return -1;
+            goto truncated;
+        }
+        interim = resp.status < 200  &&  resp.status != 101;
+        closing = resp.minor_version < 1;
+        if (http_body_until_close(&body))
+            *persist = 0;
+        rw = *persist  ||  interim ? response_rewriter : response_close_rewriter;
+        if ((n = rewrite_request(rw, buf, hlen, out, sizeof(out), &flags)) < 0
+          ||  emit_lines(sink, out, n) < 0)
+            goto truncated;
+        if (flags & RW_CLOSE)
+            closing = 1;
+    } while (interim);
+
+    if ((rc = relay_body(up, &body, sink)) < 0)
+        goto truncated;
+
+    /* Anything already buffered beyond the response means trouble */
+    *reusable = !closing  &&  rc == 0  &&  http_body_done(&body)
+      &&  up->rio.rio_cnt == 0;
+    return 0;
+
+truncated:
+    /*
+     * The client can only learn that the response is cut short by a
+     * close, and the connection is left somewhere mid-response
+     */
+    *reusable = 0;
+    *persist = 0;
+    return 0;
+}
+
+/*
+ * read_header - Read a response header into "buf" a line at a time,
+ * so that none of the body is taken from rio, until the parser finds
+ * its end.  Returns its length, 0 if the connection closed before any
+ * of it arrived, or HTTP_ERROR if it was cut short, malformed or
+ * larger than "size".
+ */
+static int read_header(upstream_t *up, char *buf, int size,
+  http_response_t *resp)
+{
+    int len = 0;
+    int n, rc;
+
+    http_response_init(resp);
+    do {
+        if ((n = rio_readlineb(&up->rio, buf + len, size - len)) <= 0)
+            return len == 0 ? 0 : HTTP_ERROR;
+        len += n;
+        rc = http_parse_response(buf, len, resp);
+    } while (rc == HTTP_INCOMPLETE  &&  len < size - 1);
+    return rc == HTTP_INCOMPLETE ? HTTP_ERROR : rc;
+}
+
+/*
+ * relay_body - Relay a response body until "body" says it has ended,
+ * or until the origin closes the connection if that is what ends it.
+ * Data runs are spliced when the sink allows it and rio holds none of
+ * them; everything else is copied, and scanned for its framing.
+ * Returns -1 if the body was cut short, malformed, or couldn't be
+ * delivered, 1 if the origin sent more than the response, which is
+ * dropped, and otherwise 0.
+ */
+static int relay_body(upstream_t *up, http_body_t *body, upstream_sink_t *sink)
+{
+    char buf[MAXBUF];
+    long data;
+    ssize_t n;
+    int m;
+
+    while (!http_body_done(body)) {
+        data = http_body_data(body);
+        n = SPLICE_UNSUPPORTED;
+        if (data != 0  &&  sink->splice_fd >= 0  &&  up->rio.rio_cnt == 0) {
+            if ((n = splice_body(up->fd, sink->splice_fd, data)) > 0) {
+                sink->len += n;
+                http_body_skip(body, n);
+            }
+        }
+        if (n == SPLICE_UNSUPPORTED) {
+            n = read_some(up, buf, data > 0  &&  data < MAXBUF ? data : MAXBUF);
+            if (n > 0) {
+                if ((m = http_body_scan(body, buf, n)) < 0
+                  ||  emit(sink, buf, m) < 0)
+                    return -1;
+                if (m < n)
+                    return 1;
+            }
+        }
+        if (n <= 0)
+            return n == 0  &&  http_body_until_close(body) ? 0 : -1;
+    }
+    return 0;
+}
+
+/*
+ * read_some - Read up to "n" bytes of whatever the origin has sent:
+ * what rio has buffered first, then from the socket.  Returns the
+ * number read, 0 at end of file, or -1 on error.
+ */
+static ssize_t read_some(upstream_t *up, char *buf, size_t n)
+{
+    ssize_t rc;
+
+    if (up->rio.rio_cnt > 0) {
+        rc = up->rio.rio_cnt < n ? up->rio.rio_cnt : n;
+        memcpy(buf, up->rio.rio_bufptr, rc);
+        up->rio.rio_bufptr += rc;
+        up->rio.rio_cnt -= rc;
+        return rc;
+    }
+    while ((rc = read(up->fd, buf, n)) < 0  &&  errno == EINTR)
+        ;
+    return rc;
+}
+
+/*
+ * emit_lines - Hand a header to the sink a line at a time, which is
+ * how sinks expect to get it.  Returns -1 if the sink gave up.
+ */
+static int emit_lines(upstream_sink_t *sink, char *buf, int n)
+{
+    char *end = buf + n;
+    char *line;
+    char *eol;
+
+    for (line = buf; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end - 1;
+        if (emit(sink, line, eol + 1 - line) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * emit - Copy one piece of a response to the sink.  Returns -1 if the
+ * sink gave up.
+ */
+static int emit(upstream_sink_t *sink, char *buf, int n)
+{
+    if (sink->write(sink, buf, n) < 0)
+        return -1;
+    sink->len += n;
+    return 0;
+}
+
+/*
+ * splice_body - Move up to "length" bytes (any amount if negative)
+ * from socket "from" to descriptor "to" through the thread's pipe.
+ * Returns the number of bytes moved, 0 at end of file, -1 on error,
+ * or SPLICE_UNSUPPORTED if splicing isn't possible between these
+ * descriptors and the caller should copy instead.
+ */
+static ssize_t splice_body(int from, int to, long length)
+{
+    splice_pipe_t *p;
+    size_t want;
+    ssize_t n, m;
+    ssize_t done;
+
+    if ((p = splice_pipe()) == NULL)
+        return SPLICE_UNSUPPORTED;
+    want = (length < 0  ||  length > p->size) ? p->size : length;
+    while ((n = splice(from, NULL, p->fds[1], NULL, want, SPLICE_F_MOVE)) < 0) {
+        if (errno == EINVAL  ||  errno == ENOSYS)
+            return SPLICE_UNSUPPORTED;
+        if (errno != EINTR)
+            return -1;
+    }
+
+    for (done = 0; done < n; done += m) {
+        m = splice(p->fds[0], NULL, to, NULL, n - done, SPLICE_F_MOVE);
+        if (m < 0  &&  errno == EINTR) {
+            m = 0;
+            continue;
+        }
+        if (m <= 0) {
+            /* Whatever is left in the pipe is of no use to anyone */
+            splice_pipe_free(p);
+            pthread_setspecific(pipe_key, NULL);
+            return -1;
+        }
+    }
+    return n;
+}
+
+/*
+ * splice_pipe - Return the calling thread's pipe, creating it on
+ * first use, or NULL if no pipe can be had.
+ */
+static splice_pipe_t *splice_pipe(void)
+{
+    splice_pipe_t *p;
+
+    if ((p = pthread_getspecific(pipe_key)) != NULL)
+        return p;
+    p = Malloc(sizeof(splice_pipe_t));
+    if (pipe2(p->fds, O_CLOEXEC) < 0) {
+        Free(p);
+        return NULL;
+    }
+    /* A bigger pipe means fewer trips through the loop */
+    fcntl(p->fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if ((p->size = fcntl(p->fds[1], F_GETPIPE_SZ)) <= 0)
+        p->size = 65536;
+    pthread_setspecific(pipe_key, p);
+    return p;
+}
+
+/*
+ * splice_pipe_free - Close a thread's pipe; also the key destructor
+ * that runs when the thread exits.
+ */
+static void splice_pipe_free(void *vargp)
+{
+    splice_pipe_t *p = (splice_pipe_t *)vargp;
+
+    close(p->fds[0]);
+    close(p->fds[1]);
+    Free(p);
+}
+
+/*
+ * hash_key - FNV-1a hash of a pool key.
+ */
+static unsigned int hash_key(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*key != '\0') {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,90 @@
+#ifndef _UPSTREAM_H
+#define _UPSTREAM_H
+
+#include "csapp.h"
+
+/*
+ * Connections to origin servers, with a pool of idle persistent
+ * (HTTP/1.1 keep-alive) connections per host and port.
+ *
+ * upstream_fetch sends one request and relays its response through a
+ * caller-supplied function.  The response is framed by its
+ * Content-Length or chunked encoding, as httpparse.h frames them, so
+ * for a keep-alive fetch its end is found without waiting for the
+ * origin to close the connection, and the connection goes back to the
+ * pool for the next request to the same host.  Idle connections are
+ * closed after a timeout, and at most a fixed number are kept per
+ * host.
+ *
+ * Response bodies the caller doesn't need to look at can be moved
+ * from the origin's socket to the client's with splice(2), through a
+ * pipe kept by each thread, so they are never copied into user space.
+ */
+
+/* Default pool limits */
+#define UPSTREAM_MAX_IDLE      8   /* Idle connections kept per host */
+#define UPSTREAM_IDLE_TIMEOUT  30  /* Seconds an idle connection is kept */
+
+/*
+ * Where a relayed response goes.  Every piece that passes through the
+ * proxy's memory is handed to "write", in order.  While "splice_fd" is
+ * not -1, body bytes are instead spliced straight to that descriptor;
+ * the caller may set it at any point, e.g. from "write" once it no
+ * longer wants a copy of the response.  "len" counts the bytes
+ * delivered either way.  If "write" returns -1, or a splice fails, the
+ * rest of the response is abandoned and its connection closed.
+ */
+typedef struct upstream_sink {
+    int (*write)(struct upstream_sink *sink, char *buf, int n);
+    int splice_fd;
+    long len;
+} upstream_sink_t;
+
+/*
+ * Where a request body comes from.  "send" is called once the header
+ * has gone out, and must send the whole body to "fd", returning -1 if
+ * it couldn't.
+ */
+typedef struct upstream_body {
+    int (*send)(struct upstream_body *body, int fd);
+} upstream_body_t;
+
+/* Flags for upstream_fetch */
+#define UPSTREAM_KEEPALIVE 1    /* HTTP/1.1 request, may use the pool */
+#define UPSTREAM_HEAD      2    /* Response to HEAD, which has no body */
+#define UPSTREAM_NORETRY   4    /* Not to be sent twice; see below */
+
+/*
+ * Set the pool limits and start the thread that closes expired idle
+ * connections.  A "max_idle" of zero disables pooling altogether.
+ */
+extern void upstream_init(int max_idle, int idle_timeout);
+
+/*
+ * Send "request" (of length "request_len") to "hostname":"port",
+ * followed by the body from "body" if it isn't NULL, and deliver the
+ * response to "sink".
+ *
+ * With UPSTREAM_KEEPALIVE in "flags", the request must be an HTTP/1.1
+ * request without hop-by-hop headers.  The connection is taken from
+ * the pool when possible, and pooled again if the response leaves it
+ * reusable.  A pooled connection the origin has already closed is
+ * retried once on a fresh connection.  A request with a body, or with
+ * UPSTREAM_NORETRY, can't be sent a second time, so it always gets a
+ * fresh connection, though that may be pooled afterwards.  Without
+ * UPSTREAM_KEEPALIVE a fresh connection is used and closed after the
+ * response.
+ *
+ * Either way the response's own hop-by-hop headers are dropped.  On
+ * entry *persist says whether the client connection is to stay open
+ * after this response; it is cleared if the response's end can only be
+ * signalled by closing the connection, and whenever it ends up clear
+ * the response tells the client "Connection: close".
+ *
+ * Returns -1 if no part of a response could be obtained, else 0.
+ */
+extern int upstream_fetch(char *hostname, int port, char *request,
+  int request_len, upstream_body_t *body, int flags, int *persist,
+  upstream_sink_t *sink);
+
+#endif /* _UPSTREAM_H */